@@ -0,0 +1,112 @@
+/*
+ * <AdapterLog.h: leveled, structured log records kept in memory>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef ADAPTER_LOG_H
+#define ADAPTER_LOG_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <syslog.h>
+
+typedef enum
+{
+	ADAPTER_LOG_ERROR = 0,
+	ADAPTER_LOG_WARNING,
+	ADAPTER_LOG_INFO,
+	ADAPTER_LOG_DEBUG,
+	ADAPTER_LOG_LEVEL_COUNT
+} AdapterLogLevel;
+
+/**
+ * Levels above this are compiled out (e.g. -DADAPTER_LOG_MAX_LEVEL=2 for no debug records at all)
+ */
+#ifndef ADAPTER_LOG_MAX_LEVEL
+#define ADAPTER_LOG_MAX_LEVEL ADAPTER_LOG_DEBUG
+#endif
+
+#define ADAPTER_LOG_MAX_FIELDS 6
+
+/**
+ * The current level. Only read it through ADAPTER_LOG_ENABLED.
+ */
+extern volatile gint adapterLogLevel;
+
+#define ADAPTER_LOG_ENABLED(level) ((level) <= ADAPTER_LOG_MAX_LEVEL && G_UNLIKELY((gint) (level) <= adapterLogLevel))
+
+/**
+ * Adds a record to the ring if level is enabled. event must be a string literal; the arguments after value are up to
+ * ADAPTER_LOG_MAX_FIELDS pairs of a key (a string literal) and a string value (copied, NULL allowed). When the level is
+ * off none of the arguments are evaluated.
+ *
+ * ADAPTER_LOG(ADAPTER_LOG_DEBUG, "presence", availability, "buddy", buddy->name, "group", groupName);
+ */
+#define ADAPTER_LOG(level, event, value, ...) \
+	do \
+	{ \
+		if (ADAPTER_LOG_ENABLED(level)) \
+		{ \
+			adapterLogWrite(level, event, value, ##__VA_ARGS__, NULL); \
+		} \
+	} while (0)
+
+/**
+ * The level a syslog priority is logged at
+ */
+#define ADAPTER_LOG_LEVEL_FROM_PRIORITY(priority) \
+	((priority) <= LOG_ERR ? ADAPTER_LOG_ERROR : (priority) == LOG_WARNING ? ADAPTER_LOG_WARNING : \
+	(priority) == LOG_DEBUG ? ADAPTER_LOG_DEBUG : ADAPTER_LOG_INFO)
+
+/**
+ * Use ADAPTER_LOG. Safe from any thread: writers claim a slot with an atomic increment and never wait for each other or
+ * for a dump.
+ */
+void adapterLogWrite(AdapterLogLevel level, const char *event, gint64 value, ...);
+
+void adapterLogSetLevel(AdapterLogLevel level);
+
+AdapterLogLevel adapterLogGetLevel(void);
+
+/**
+ * "error", "warning", "info" or "debug"
+ */
+const char* adapterLogLevelName(AdapterLogLevel level);
+
+/**
+ * The level with that name, or -1
+ */
+int adapterLogLevelFromName(const char *name);
+
+typedef struct _AdapterLogRecord
+{
+	guint seq;
+	gint64 timeMs;
+	AdapterLogLevel level;
+	const char *event;
+	gint64 value;
+	guint fieldCount;
+	const char *keys[ADAPTER_LOG_MAX_FIELDS];
+	/* point into the record */
+	const char *values[ADAPTER_LOG_MAX_FIELDS];
+} AdapterLogRecord;
+
+typedef void (*AdapterLogFunction)(const AdapterLogRecord *record, gpointer data);
+
+/**
+ * The records still in the ring, oldest first, at most the last limit of them (0 for all). Records being written
+ * while the ring is read are skipped.
+ */
+void adapterLogForEach(guint limit, AdapterLogFunction function, gpointer data);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * <AdapterProbes.h: USDT probes on the adapter's hot paths>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Built in when the toolchain has sys/sdt.h (the Makefiles then define HAVE_SYS_SDT_H), otherwise every probe is empty.
+ * Each probe has a semaphore that the tracer raises while it's attached, and a probe's arguments are only evaluated
+ * while it is, so an unattached probe costs a load and a branch. All probes are in the libpurpleadapter provider:
+ *
+ *   method__entry(method, payloadSize)          a bus method is called
+ *   method__exit(method, latencyUs)             and returned
+ *   presence__changed(accountKey, buddy, held)  libpurple reported a presence change; held if it's queued for later
+ *   message__incoming(accountKey, from, length) an incoming IM
+ *   io__dispatch(source, fd, condition)         a socket woke us up; source is the account key or the input function
+ *   login__phase(accountKey, phase, atMs)       a login reached a phase (see LoginTrace.h)
+ *   login__done(accountKey, outcome, totalMs)   and finished
+ *   subscription__reply(key, payloadSize)       a reply to all subscribers of key
+ *
+ * e.g. bpftrace -e 'usdt:./LibpurpleAdapter:libpurpleadapter:method__exit { @[str(arg0)] = hist(arg1); }'
+ */
+
+#ifndef ADAPTER_PROBES_H
+#define ADAPTER_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ADAPTER_PROBE_LIST(PROBE) \
+	PROBE(method__entry) \
+	PROBE(method__exit) \
+	PROBE(presence__changed) \
+	PROBE(message__incoming) \
+	PROBE(io__dispatch) \
+	PROBE(login__phase) \
+	PROBE(login__done) \
+	PROBE(subscription__reply)
+
+#define ADAPTER_PROBE_SEMAPHORE(name) libpurpleadapter_##name##_semaphore
+
+#define ADAPTER_PROBE_DECLARE_SEMAPHORE(name) extern volatile unsigned short ADAPTER_PROBE_SEMAPHORE(name);
+ADAPTER_PROBE_LIST(ADAPTER_PROBE_DECLARE_SEMAPHORE)
+
+/**
+ * True while a tracer is attached to the probe. For arguments that cost something to get, e.g. an account key.
+ */
+#define ADAPTER_PROBE_ENABLED(name) __builtin_expect(ADAPTER_PROBE_SEMAPHORE(name) != 0, 0)
+
+#define ADAPTER_PROBE2(name, a, b) \
+	do \
+	{ \
+		if (ADAPTER_PROBE_ENABLED(name)) \
+		{ \
+			DTRACE_PROBE2(libpurpleadapter, name, a, b); \
+		} \
+	} while (0)
+
+#define ADAPTER_PROBE3(name, a, b, c) \
+	do \
+	{ \
+		if (ADAPTER_PROBE_ENABLED(name)) \
+		{ \
+			DTRACE_PROBE3(libpurpleadapter, name, a, b, c); \
+		} \
+	} while (0)
+
+#else
+
+#define ADAPTER_PROBE_ENABLED(name) 0
+#define ADAPTER_PROBE2(name, a, b) do { } while (0)
+#define ADAPTER_PROBE3(name, a, b, c) do { } while (0)
+
+#endif
+
+#endif
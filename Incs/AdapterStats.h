@@ -0,0 +1,81 @@
+/*
+ * <AdapterStats.h: counters behind the getStats method>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef ADAPTER_STATS_H
+#define ADAPTER_STATS_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	/* presence changes libpurple told us about */
+	STATS_PRESENCE_IN = 0,
+	/* presence updates sent to the subscribers */
+	STATS_PRESENCE_OUT,
+	STATS_MESSAGES_IN,
+	STATS_MESSAGES_OUT,
+	STATS_COUNTER_COUNT
+} AdapterCounter;
+
+typedef struct _MethodStats
+{
+	const char *method;
+	guint calls;
+	/* replies with "returnValue":false */
+	guint errors;
+	/* over the most recent calls */
+	guint p50Us;
+	guint p90Us;
+	guint p99Us;
+	guint maxUs;
+} MethodStats;
+
+typedef struct _MethodCounters MethodCounters;
+
+void adapterStatsCount(AdapterCounter counter);
+
+guint adapterStatsGetCounter(AdapterCounter counter);
+
+/**
+ * "presenceIn", "presenceOut", "messagesIn" or "messagesOut"
+ */
+const char* adapterStatsCounterName(AdapterCounter counter);
+
+/**
+ * The bus method's counters, created (with no calls) the first time. Main loop only.
+ */
+MethodCounters* adapterStatsGetMethodCounters(const char *method);
+
+/**
+ * A call of the bus method whose counters these are, and how long its handler took
+ */
+void adapterStatsMethodCalled(MethodCounters *methodStats, guint latencyUs);
+
+/**
+ * A reply to a call of the method (during the call or later) was an error
+ */
+void adapterStatsMethodFailed(const char *method);
+
+typedef void (*MethodStatsFunction)(const MethodStats *stats, gpointer data);
+
+void adapterStatsForEachMethod(MethodStatsFunction function, gpointer data);
+
+/**
+ * Resident set size of the process, 0 if it can't be read
+ */
+guint64 adapterStatsGetRssBytes(void);
+
+#endif
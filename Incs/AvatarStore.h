@@ -0,0 +1,92 @@
+/*
+ * <AvatarStore.h: size-bounded store of buddy icons, one file per distinct image>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef AVATAR_STORE_H
+#define AVATAR_STORE_H
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include "AvatarThumbnailer.h"
+
+/**
+ * Called when the buddy's avatar changed without libpurple knowing, i.e. when its thumbnails were written
+ */
+typedef void (*AvatarUpdatedFunction)(PurpleBuddy *buddy);
+
+/**
+ * Loads the index of directory (or, the first time, adopts the files that are already there), takes over writing
+ * buddy icons from libpurple and starts the thumbnailer (at most thumbnailQueueDepth images wait for it). Call after
+ * the buddy list was loaded.
+ */
+bool avatarStoreInit(const char *directory, guint64 budgetBytes, guint thumbnailQueueDepth,
+		AvatarUpdatedFunction updated);
+
+/**
+ * Stops the thumbnailer and writes the index if it changed
+ */
+void avatarStoreShutdown(void);
+
+/**
+ * With lazy avatars, icons of the account's buddies are only written to the store when they are fetched
+ */
+void avatarStoreSetLazy(PurpleAccount *account, bool lazy);
+
+/**
+ * Stores the buddy's current icon (unless an identical image is already stored, or the account has lazy avatars) and
+ * points the buddy at it. Called for buddy-icon-changed.
+ */
+void avatarStoreUpdateBuddy(PurpleBuddy *buddy);
+
+/**
+ * Drops the buddy's reference to its icon
+ */
+void avatarStoreRemoveBuddy(PurpleBuddy *buddy);
+
+/**
+ * Full path of the buddy's icon, or NULL if it has none. The string belongs to the store and stays the same until the
+ * buddy's icon changes, so it can be used without copying it on every presence update.
+ */
+const char* avatarStoreGetBuddyPath(PurpleBuddy *buddy);
+
+/**
+ * Full path of a thumbnail of the buddy's icon, or NULL if there is none (yet). Owned by the store like the path.
+ */
+const char* avatarStoreGetBuddyThumbnail(PurpleBuddy *buddy, AvatarThumbnail thumbnail);
+
+/**
+ * Content hash of the buddy's icon, or NULL if it has none. Known for icons that were not fetched yet, too.
+ */
+const char* avatarStoreGetBuddyHash(PurpleBuddy *buddy);
+
+/**
+ * Writes the buddy's icon to the store if it wasn't yet (lazy avatars) and returns its full path, or NULL if the buddy
+ * has no icon or it could not be written
+ */
+const char* avatarStoreFetchBuddy(PurpleBuddy *buddy);
+
+/**
+ * Total size of the stored images in bytes
+ */
+guint64 avatarStoreSize(void);
+
+/**
+ * Number of stored images
+ */
+guint avatarStoreCount(void);
+
+#endif
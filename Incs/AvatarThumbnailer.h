@@ -0,0 +1,62 @@
+/*
+ * <AvatarThumbnailer.h: scales buddy icons down to thumbnails on a worker thread>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef AVATAR_THUMBNAILER_H
+#define AVATAR_THUMBNAILER_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	AVATAR_THUMBNAIL_SMALL = 0,
+	AVATAR_THUMBNAIL_LARGE,
+	AVATAR_THUMBNAIL_COUNT
+} AvatarThumbnail;
+
+/**
+ * Called on the main loop when the thumbnails of filename were written (bytes is their total size) or could not be
+ * written (bytes is 0, and none of them is left on disk). decoded is FALSE if the image itself couldn't be decoded,
+ * which trying again won't change.
+ */
+typedef void (*ThumbnailsDoneFunction)(const char *filename, guint64 bytes, bool decoded);
+
+/**
+ * Starts the worker thread. At most maxQueued images wait for it; more are refused.
+ */
+bool avatarThumbnailerStart(guint maxQueued, ThumbnailsDoneFunction done);
+
+/**
+ * Drops the images that are still waiting and waits for the worker thread to exit
+ */
+void avatarThumbnailerStop(void);
+
+/**
+ * Queues the image at path (named filename in its directory) for thumbnailing. Returns FALSE if the queue is full or
+ * the worker isn't running.
+ */
+bool avatarThumbnailerQueue(const char *path, const char *filename);
+
+/**
+ * Width and height (the image is scaled to fit, keeping its aspect ratio) of the thumbnail
+ */
+guint avatarThumbnailSize(AvatarThumbnail thumbnail);
+
+/**
+ * Where the thumbnail of the image at path goes: next to it, e.g. "0123...cdef-32.png" for "0123...cdef.jpg"
+ */
+char* avatarThumbnailPath(const char *path, AvatarThumbnail thumbnail);
+
+#endif
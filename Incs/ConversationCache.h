@@ -0,0 +1,54 @@
+/*
+ * <ConversationCache.h: bounded LRU index of the IM conversations we keep open>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef CONVERSATION_CACHE_H
+#define CONVERSATION_CACHE_H
+
+#include "purple.h"
+
+/**
+ * Must be called after purple_core_init. defaultLimit is the number of IM conversations we keep per account unless
+ * conversationCacheSetLimit says otherwise. Conversations that haven't been used for idleSeconds are destroyed
+ * (0 keeps them until they're evicted by the limit).
+ */
+void conversationCacheInit(guint defaultLimit, guint idleSeconds);
+
+/**
+ * Changes the number of IM conversations we keep for this account. Extra conversations are destroyed right away.
+ */
+void conversationCacheSetLimit(PurpleAccount *account, guint limit);
+
+/**
+ * Returns the IM conversation with usernameTo, creating it if needed, and marks it as the most recently used one.
+ * The least recently used conversation of the account is destroyed if we're over the limit.
+ */
+PurpleConversation* conversationCacheGet(PurpleAccount *account, const char *usernameTo);
+
+/**
+ * Marks an IM conversation as just used (e.g. a message came in on it) so that it isn't destroyed as idle
+ */
+void conversationCacheTouch(PurpleConversation *conversation);
+
+/**
+ * Destroys all the conversations we keep for this account (e.g. when it signs off)
+ */
+void conversationCacheRemoveAccount(PurpleAccount *account);
+
+/**
+ * Number of conversations currently indexed over all accounts
+ */
+guint conversationCacheSize(void);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * <DisplayHysteresis.h: decides when a display change is worth telling the IM servers about>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef DISPLAY_HYSTERESIS_H
+#define DISPLAY_HYSTERESIS_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef struct _DisplayHysteresisStats
+{
+	/* times the accounts were set idle or active */
+	guint toggles;
+	/* display on periods that ended before the accounts were set active */
+	guint suppressedWakes;
+	/* how long the display has to stay on right now before the accounts are set active */
+	guint leaveDelayMs;
+	/* median of the display on periods we remember */
+	guint typicalWakeMs;
+} DisplayHysteresisStats;
+
+/**
+ * Called to set all accounts idle (display off) or active
+ */
+typedef void (*DisplayIdleFunction)(bool idle);
+
+/**
+ * initialDelayMs is used until a few display on periods were seen; the accounts never wait longer than maxDelayMs to
+ * leave idle. setUndelayedIdle (may be NULL) is called on every display change, for the accounts where waiting
+ * saves no server traffic.
+ */
+void displayHysteresisInit(guint initialDelayMs, guint maxDelayMs, DisplayIdleFunction setIdle,
+		DisplayIdleFunction setUndelayedIdle);
+
+/**
+ * The display went on or off. Going off sets the accounts idle right away (unless they still are); going on sets them
+ * active only once the display stayed on for longer than the wakes that are typical for this user.
+ */
+void displayHysteresisDisplayChanged(bool on);
+
+/**
+ * Sets the accounts idle or active regardless of the display, e.g. when a client asks for it. Not a display change:
+ * nothing is recorded about how long the display stays on.
+ */
+void displayHysteresisSetIdle(bool idle);
+
+void displayHysteresisGetStats(DisplayHysteresisStats *stats);
+
+#endif
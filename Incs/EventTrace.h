@@ -0,0 +1,89 @@
+/*
+ * <EventTrace.h: records buddy list signals and incoming IMs to a file that Tools/replay plays back>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	EVENT_TRACE_STATUS = 1,
+	EVENT_TRACE_SIGNED_ON,
+	EVENT_TRACE_SIGNED_OFF,
+	EVENT_TRACE_ICON,
+	EVENT_TRACE_IM
+} EventTraceType;
+
+/*
+ * One recorded event. Which fields are set depends on the type:
+ *   status:          statusId, text (the status message, if there is one)
+ *   signed on / off: nothing else
+ *   icon:            icon and iconLength (NULL if the icon was removed), text (the checksum, if there is one)
+ *   IM:              text (the message), flags
+ * The strings and the icon belong to the reader and stay valid until it's closed.
+ */
+typedef struct _EventTraceRecord
+{
+	EventTraceType type;
+	/* since the recording started */
+	guint64 timeUs;
+	const char *protocolId;
+	const char *account;
+	/* the buddy, or the sender of an IM */
+	const char *buddy;
+	const char *statusId;
+	const char *text;
+	const guchar *icon;
+	gsize iconLength;
+	guint flags;
+} EventTraceRecord;
+
+/**
+ * Starts recording to path and stops by itself at the first record that doesn't fit in maxBytes (that record isn't
+ * written, so the file never grows past them). Must be called after libpurple is initialized. Whatever is at path is
+ * removed and a new file only the owner can read is created in its place. Returns FALSE if the file can't be created
+ * or a recording is already going on.
+ */
+bool eventTraceStart(const char *path, gsize maxBytes);
+
+/**
+ * Stops recording (if it was) and flushes the file
+ */
+void eventTraceStop(void);
+
+bool eventTraceIsRecording(void);
+
+/**
+ * Events and bytes written by the current (or the last) recording
+ */
+void eventTraceGetCounts(guint *events, gsize *bytes);
+
+typedef struct _EventTraceReader EventTraceReader;
+
+/**
+ * NULL if the file can't be read or isn't a trace
+ */
+EventTraceReader* eventTraceOpen(const char *path);
+
+/**
+ * The next record. Returns FALSE at the end of the trace (or where it's cut short).
+ */
+bool eventTraceRead(EventTraceReader *reader, EventTraceRecord *record);
+
+void eventTraceClose(EventTraceReader *reader);
+
+#endif
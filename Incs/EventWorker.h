@@ -0,0 +1,173 @@
+/*
+ * <EventWorker.h: hands serialization and logging to a worker thread, and its bus replies back to the main loop>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef EVENT_WORKER_H
+#define EVENT_WORKER_H
+
+#include <glib.h>
+#include <lunaservice.h>
+
+#include "AdapterLog.h"
+
+typedef enum
+{
+	EVENT_PRESENCE = 0,
+	EVENT_INCOMING_MESSAGE,
+	EVENT_DELIVERY_STATUS,
+	EVENT_ADD_INCOMING_BATCH,
+	EVENT_REMOVE_INCOMING_BATCH,
+	EVENT_SYSLOG,
+	EVENT_SUBSCRIPTION_REPLY
+} EventType;
+
+/*
+ * Field slots of an EVENT_PRESENCE record. displayName, avatarHash and the thumbnails are optional; if they are not set
+ * they're left out of the payload.
+ */
+enum
+{
+	PRESENCE_SERVICE_NAME = 0,
+	PRESENCE_USERNAME,
+	PRESENCE_BUDDY_USERNAME,
+	PRESENCE_DISPLAY_NAME,
+	PRESENCE_AVATAR_LOCATION,
+	PRESENCE_CUSTOM_MESSAGE,
+	PRESENCE_AVAILABILITY,
+	PRESENCE_GROUP_NAME,
+	PRESENCE_AVATAR_HASH,
+	PRESENCE_AVATAR_THUMBNAIL_SMALL,
+	PRESENCE_AVATAR_THUMBNAIL_LARGE,
+	PRESENCE_FIELD_COUNT
+};
+
+/*
+ * Field slots of an EVENT_INCOMING_MESSAGE record. accountKey picks the filtered/batched subscribers the message goes
+ * to; seq is the message's sequence number, which only goes up within seqEpoch.
+ */
+enum
+{
+	MESSAGE_SERVICE_NAME = 0,
+	MESSAGE_USERNAME,
+	MESSAGE_USERNAME_FROM,
+	MESSAGE_TEXT,
+	MESSAGE_ACCOUNT_KEY,
+	MESSAGE_SEQ,
+	MESSAGE_SEQ_EPOCH,
+	MESSAGE_FIELD_COUNT
+};
+
+/*
+ * Field slots of an EVENT_DELIVERY_STATUS record. The message was delivered if errorCode is not set.
+ */
+enum
+{
+	DELIVERY_SERVICE_NAME = 0,
+	DELIVERY_USERNAME,
+	DELIVERY_USERNAME_TO,
+	DELIVERY_CLIENT_ID,
+	DELIVERY_MESSAGE_ID,
+	DELIVERY_ERROR_CODE,
+	DELIVERY_ERROR_TEXT,
+	DELIVERY_FIELD_COUNT
+};
+
+/*
+ * Field slots of an EVENT_ADD_INCOMING_BATCH record. accountKey is not set for batches of all accounts.
+ */
+enum
+{
+	BATCH_SUBSCRIPTION_KEY = 0,
+	BATCH_ACCOUNT_KEY,
+	BATCH_FIELD_COUNT
+};
+
+/*
+ * Field slots of an EVENT_SYSLOG record
+ */
+enum
+{
+	SYSLOG_TEXT = 0,
+	SYSLOG_FIELD_COUNT
+};
+
+/*
+ * Field slots of an EVENT_SUBSCRIPTION_REPLY record
+ */
+enum
+{
+	REPLY_KEY = 0,
+	REPLY_PAYLOAD,
+	REPLY_FIELD_COUNT
+};
+
+/**
+ * Starts the worker thread. Until it is started (or if it could not be started) events are processed synchronously
+ * on the calling thread. The replies the worker builds are sent on serviceHandle from the default main context, so
+ * call this from the main loop thread.
+ */
+bool eventWorkerStart(LSHandle *serviceHandle);
+
+/**
+ * Asks the worker thread to drain the queue, sends what it replied and waits for it to exit
+ */
+void eventWorkerStop(void);
+
+/**
+ * Copies fieldCount strings (NULL entries are allowed and mean "not set") into a single record and queues it for the
+ * worker thread. origin should be a string literal (usually __FUNCTION__) and is used for logging. Never waits: if the
+ * worker is a full queue behind, the record waits on the main loop's side, where a presence update replaces the one
+ * still waiting for the same buddy.
+ * Must only be called from the main loop thread.
+ */
+void eventWorkerPost(EventType type, const char *origin, const char **fields, int fieldCount);
+
+/**
+ * Sends payload to the subscribers of key after the events posted before it, e.g. a full buddy list that must not be
+ * overtaken by older presence updates still in the queue
+ */
+void eventWorkerReply(const char *key, const char *payload);
+
+/**
+ * From now on incoming messages (of accountKey only, or of all accounts if accountKey is NULL) are also collected for
+ * subscriptionKey and sent to it as one {"messages":[...]} reply at most maxDelayMs after the first one arrived.
+ * Call it once per subscriber: if the batch already exists it only gets one more.
+ */
+void eventWorkerAddIncomingBatch(const char *subscriptionKey, const char *accountKey, guint maxDelayMs);
+
+/**
+ * One subscriber of the batch is gone (its subscription was cancelled). The batch, and the messages it still holds,
+ * go with the last one.
+ */
+void eventWorkerRemoveIncomingBatch(const char *subscriptionKey);
+
+/**
+ * syslog() replacement for the main loop: the message is formatted here but written by the worker thread. It's also
+ * kept in the log ring. Nothing is formatted (or evaluated) if the priority's level is off.
+ */
+#define eventWorkerSyslog(priority, ...) \
+	do \
+	{ \
+		if (ADAPTER_LOG_ENABLED(ADAPTER_LOG_LEVEL_FROM_PRIORITY(priority))) \
+		{ \
+			eventWorkerSyslogText(priority, __VA_ARGS__); \
+		} \
+	} while (0)
+
+/**
+ * Use eventWorkerSyslog
+ */
+void eventWorkerSyslogText(int priority, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * <LibpurpleAdapter.h: the adapter's entry point, and what the tools drive it through>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * main is in Src/AdapterMain.c, so that the load test, the soak test, the bench and the replay tool (Tools/) can link
+ * Src/LibpurpleAdapter.o as the service is built from it and bring their own main. Everything below adapterMain is
+ * for them; the service itself doesn't call it from outside.
+ */
+
+#ifndef LIBPURPLE_ADAPTER_H
+#define LIBPURPLE_ADAPTER_H
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Size of the incoming message spool file
+ */
+#define INCOMING_MESSAGE_SPOOL_SIZE (256 * 1024)
+
+/**
+ * Registers the service on the bus and runs the main loop until it quits
+ */
+int adapterMain(int argc, char *argv[]);
+
+typedef void (*AdapterAccountFunction)(PurpleAccount *account);
+
+/**
+ * Keeps the incoming message spool and the avatars somewhere else than the device's data directory. Call before
+ * adapterMain (or initializeLibpurple); the strings must stay valid.
+ */
+void adapterSetDataPaths(const char *spoolPath, const char *avatarPath);
+
+/**
+ * function is called for every account that logs in, just before it connects (the load test points the account at
+ * its loopback server). NULL, the default, leaves accounts alone.
+ */
+void adapterSetConfigureAccountFunction(AdapterAccountFunction function);
+
+/**
+ * TRUE if the account (getAccountKey) has finished logging in, or is logging in
+ */
+bool adapterIsAccountOnline(const char *accountKey);
+bool adapterIsAccountPending(const char *accountKey);
+
+/**
+ * Sets up libpurple as the first login does
+ */
+void initializeLibpurple(void);
+
+/*
+ * libpurple's callbacks, called directly by tools that play events into the adapter without a server
+ */
+void buddy_signed_on_off_cb(PurpleBuddy *buddy, gpointer data);
+void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status, PurpleStatus *new_status,
+		gpointer unused);
+void incoming_message_cb(PurpleConversation *conv, const char *who, const char *alias, const char *message,
+		PurpleMessageFlags flags, time_t mtime);
+
+/*
+ * Per-event helpers and the buddy list reply, measured by Tools/bench/AdapterBench.c. The strings they return are
+ * malloc'd, unless an argument was NULL.
+ */
+char* getAccountKey(const char *username, const char *serviceName);
+char* getAccountKeyFromPurpleAccount(PurpleAccount *account);
+char* getJavaFriendlyUsername(const char *username, const char *serviceName);
+char* getPrplFriendlyUsername(const char *serviceName, const char *username);
+char* stripResourceFromGtalkUsername(const char *username);
+char* getServiceNameFromPrplProtocolId(char *prplProtocolId);
+void respondWithFullBuddyList(PurpleAccount *account, char *serviceName, char *myJavaFriendlyUsername);
+
+#endif
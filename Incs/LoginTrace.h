@@ -0,0 +1,96 @@
+/*
+ * <LoginTrace.h: where the time goes while an account logs in>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef LOGIN_TRACE_H
+#define LOGIN_TRACE_H
+
+#include <glib.h>
+
+#define LOGIN_TRACE_MAX_PHASES 16
+
+typedef struct _LoginTracePhase
+{
+	/* interned */
+	const char *name;
+	/* since the login call */
+	guint atMs;
+} LoginTracePhase;
+
+typedef struct _LoginTrace
+{
+	char *accountKey;
+	char *serviceName;
+	gint64 startUs;
+	/* "connected", "failed", "timeout", "cancelled" or "abandoned" */
+	const char *outcome;
+	/* from libpurple if the login failed, otherwise NULL */
+	char *error;
+	guint totalMs;
+	guint phaseCount;
+	LoginTracePhase phases[LOGIN_TRACE_MAX_PHASES];
+} LoginTrace;
+
+typedef struct _LoginPhaseStats
+{
+	/* the phase, or "total" for the whole of the successful logins */
+	const char *name;
+	guint count;
+	/* time spent in the phase, from its mark to the next one or the end of the login, over the most recent logins */
+	guint p50Ms;
+	guint p90Ms;
+	guint p99Ms;
+	guint maxMs;
+} LoginPhaseStats;
+
+/**
+ * Keeps the last historySize finished traces
+ */
+void loginTraceInit(guint historySize);
+
+/**
+ * The login method was called for the account. A trace still open for it is finished as "abandoned".
+ */
+void loginTraceStart(const char *accountKey, const char *serviceName);
+
+/**
+ * The account's login got to phase (copied). Phases are whatever the caller names them: the adapter uses its own steps
+ * and the connection progress texts of the prpl, e.g. for jabber "Connecting" (resolving and connecting to the server),
+ * "Initializing Stream", "Initializing SSL/TLS" and "Authenticating". Does nothing if no login is being traced for
+ * the account.
+ */
+void loginTraceMark(const char *accountKey, const char *phase);
+
+/**
+ * Closes the account's trace, if it has one open, and adds it to its service's histograms. Only "connected" logins
+ * count towards the "total".
+ */
+void loginTraceFinish(const char *accountKey, const char *outcome, const char *error);
+
+typedef void (*LoginTraceFunction)(const LoginTrace *trace, gpointer data);
+
+/**
+ * Finished traces, oldest first
+ */
+void loginTraceForEach(LoginTraceFunction function, gpointer data);
+
+typedef void (*LoginServiceFunction)(const char *serviceName, guint connected, guint failed,
+		const LoginPhaseStats *phases, guint phaseCount, gpointer data);
+
+/**
+ * Per service: how many logins succeeded and failed, and the phase histograms in the order the phases were first seen
+ */
+void loginTraceForEachService(LoginServiceFunction function, gpointer data);
+
+#endif
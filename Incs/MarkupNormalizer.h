@@ -0,0 +1,57 @@
+/*
+ * <MarkupNormalizer.h: turns the HTML that prpls hand us into plain text>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef MARKUP_NORMALIZER_H
+#define MARKUP_NORMALIZER_H
+
+#include <glib.h>
+
+typedef enum
+{
+	SPAN_BOLD = 0,
+	SPAN_ITALIC,
+	SPAN_UNDERLINE,
+	SPAN_LINK
+} FormattingSpanType;
+
+/*
+ * A run of formatted plain text. start and end are byte offsets into the output; href points into the input markup
+ * (it is not NUL terminated) and is only set for links.
+ */
+typedef struct _FormattingSpan
+{
+	FormattingSpanType type;
+	gsize start;
+	gsize end;
+	const char *href;
+	gsize hrefLength;
+} FormattingSpan;
+
+/**
+ * Strips the tags from markup (length bytes) and decodes its entities into out, which must have room for length + 1
+ * bytes (the plain text is never longer than the markup). <br> becomes a newline. Returns the length of the plain text.
+ *
+ * If spans is not NULL, up to maxSpans bold, italic, underline and link spans are stored in it and their number in
+ * spanCount. Nothing is allocated.
+ */
+gsize markupNormalize(const char *markup, gsize length, char *out, FormattingSpan *spans, guint maxSpans,
+		guint *spanCount);
+
+/**
+ * Name of a span type as it appears in payloads ("bold", "italic", "underline", "link")
+ */
+const char* markupSpanTypeName(FormattingSpanType type);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * <MessageSpool.h: memory-mapped ring of the most recent incoming messages>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef MESSAGE_SPOOL_H
+#define MESSAGE_SPOOL_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+/**
+ * Maps the spool file (creating it if needed) and recovers the records that survived the last run. If this fails the
+ * spool is disabled and the other calls do nothing.
+ */
+bool messageSpoolOpen(const char *path, guint32 size);
+
+void messageSpoolClose(void);
+
+/**
+ * Sequence number of the newest record in the spool (0 if it was never written to)
+ */
+guint messageSpoolLastSeq(void);
+
+/**
+ * Changes whenever the sequence numbers start over (a new or unrecoverable spool), so that whoever kept a seq can tell
+ * it's from before. Positive and below 2^31; 0 if the spool isn't open.
+ */
+guint messageSpoolEpoch(void);
+
+/**
+ * Appends a record for the account with key (may be NULL), overwriting the oldest ones if the ring is full. Safe to
+ * call from any thread.
+ */
+void messageSpoolAppend(guint seq, const char *key, const char *payload, gsize length);
+
+/**
+ * Appends the payloads of the records newer than sinceSeq to out, comma separated and oldest first: those of the
+ * account with key, or all of them if key is NULL. Returns the number of records. Safe to call from any thread.
+ */
+guint messageSpoolCollectSince(guint sinceSeq, const char *key, GString *out);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * <OutboundQueue.h: holds outgoing messages while their account is still signing on>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef OUTBOUND_QUEUE_H
+#define OUTBOUND_QUEUE_H
+
+#include "purple.h"
+
+/**
+ * Sends one (still escaped) message. Returns FALSE if it could not be handed to the prpl.
+ */
+typedef bool (*OutboundSendFunction)(PurpleAccount *account, const char *usernameTo, const char *messageText);
+
+void outboundQueueInit(guint maxMessagesPerAccount, OutboundSendFunction sendFunction);
+
+/**
+ * Queues a message for an account that is not online yet (or is online but was rate limited; call outboundQueueFlush
+ * afterwards). Returns the id that its delivery status will carry, or 0
+ * if the account's queue is full.
+ */
+guint outboundQueueAdd(const char *accountKey, const char *serviceName, const char *username, const char *usernameTo,
+		const char *messageText, const char *clientId);
+
+/**
+ * Sends everything queued for this account, in order and as fast as the rate limiter allows, and reports each message
+ * as delivered (or not). Messages the rate limiter holds back are sent later from a timer.
+ */
+void outboundQueueFlush(const char *accountKey, PurpleAccount *account);
+
+/**
+ * Drops everything queued for this account and reports each message as failed
+ */
+void outboundQueueFail(const char *accountKey, const char *errorCode, const char *errorText);
+
+/**
+ * Number of messages currently queued for the account
+ */
+guint outboundQueueAccountLength(const char *accountKey);
+
+/**
+ * Number of messages currently queued over all accounts
+ */
+guint outboundQueueLength(void);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * <PresenceStrategy.h: what each account does with presence updates while the display is off>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef PRESENCE_STRATEGY_H
+#define PRESENCE_STRATEGY_H
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef struct _PresenceStrategyStats
+{
+	/* presence updates the local strategy held back */
+	guint held;
+	/* presence updates sent when the accounts left idle; the others were superseded by a later update */
+	guint released;
+} PresenceStrategyStats;
+
+/**
+ * Called for a buddy whose presence updates were held back, once its account isn't idle anymore
+ */
+typedef void (*PresenceReleasedFunction)(PurpleBuddy *buddy);
+
+/**
+ * Starts watching the server features of XMPP accounts. Call after libpurple was initialized.
+ */
+void presenceStrategyInit(PresenceReleasedFunction released);
+
+/**
+ * Picks the strategy for an account that just signed on. It starts out not idle.
+ */
+void presenceStrategyAddAccount(const char *accountKey, PurpleAccount *account);
+
+/**
+ * Forgets an account that went offline (held updates are dropped)
+ */
+void presenceStrategyRemoveAccount(const char *accountKey);
+
+/**
+ * Display off (idle) or on, for all accounts in one pass
+ */
+void presenceStrategySetIdle(bool idle);
+
+/**
+ * Like presenceStrategySetIdle, for the accounts on the local strategy only: their server sends every update anyway,
+ * so there's no traffic to save by keeping them idle a little longer.
+ */
+void presenceStrategySetLocalIdle(bool idle);
+
+void presenceStrategySetAccountIdle(const char *accountKey, bool idle);
+
+/**
+ * Returns TRUE if the buddy's presence update should not be sent now. The adapter-local strategy holds back updates
+ * while its account is idle and releases the latest presence of each buddy when it isn't anymore.
+ */
+bool presenceStrategyHoldUpdate(PurpleBuddy *buddy);
+
+/**
+ * "google:queue", "csi" or "local", NULL if the account isn't known
+ */
+const char* presenceStrategyGetName(const char *accountKey);
+
+bool presenceStrategyIsIdle(const char *accountKey);
+
+void presenceStrategyGetStats(PresenceStrategyStats *stats);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * <PurpleDebugLog.h: keeps libpurple's debug output in memory instead of printing it>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef PURPLE_DEBUG_LOG_H
+#define PURPLE_DEBUG_LOG_H
+
+#include "purple.h"
+
+#include <glib.h>
+
+/**
+ * A filter level above PURPLE_DEBUG_FATAL: nothing is kept
+ */
+#define PURPLE_DEBUG_LOG_OFF (PURPLE_DEBUG_FATAL + 1)
+
+typedef struct _PurpleDebugLogStats
+{
+	guint kept;
+	/* lines libpurple didn't format because the filter said no */
+	guint filtered;
+	/* lines pushed out of the ring by newer ones */
+	guint evicted;
+	guint64 bytes;
+} PurpleDebugLogStats;
+
+/**
+ * Keeps up to budgetBytes of lines, keeping lines of level or higher in any category
+ */
+void purpleDebugLogInit(guint64 budgetBytes, PurpleDebugLevel level);
+
+/**
+ * For purple_debug_set_ui_ops. With these libpurple asks before it formats a line; leave purple_debug_set_enabled off or
+ * it prints everything to stdout as well.
+ */
+PurpleDebugUiOps* purpleDebugLogGetUiOps(void);
+
+/**
+ * Keep lines of level or higher of the given categories only (categories is NULL terminated; NULL or empty means all)
+ */
+void purpleDebugLogSetFilter(PurpleDebugLevel level, const char **categories);
+
+PurpleDebugLevel purpleDebugLogGetLevel(void);
+
+typedef void (*PurpleDebugCategoryFunction)(const char *category, gpointer data);
+
+/**
+ * The categories of the filter, none if all categories are kept
+ */
+void purpleDebugLogForEachCategory(PurpleDebugCategoryFunction function, gpointer data);
+
+typedef void (*PurpleDebugLineFunction)(gint64 timeMs, PurpleDebugLevel level, const char *category, const char *text,
+		gpointer data);
+
+/**
+ * The last limit lines (0 for all), oldest first
+ */
+void purpleDebugLogForEach(guint limit, PurpleDebugLineFunction function, gpointer data);
+
+void purpleDebugLogGetStats(PurpleDebugLogStats *stats);
+
+/**
+ * "misc", "info", "warning", "error", "fatal" or "off"
+ */
+const char* purpleDebugLevelName(PurpleDebugLevel level);
+
+/**
+ * The level with that name, or -1
+ */
+int purpleDebugLevelFromName(const char *name);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * <RateLimiter.h: paces what we send to the IM servers per account>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	RATE_CLASS_MESSAGE = 0,
+	RATE_CLASS_STATUS,
+	RATE_CLASS_COUNT
+} RateLimitClass;
+
+typedef struct _RateLimitStats
+{
+	/* operations that went through the limiter */
+	guint operations;
+	/* operations that had to wait for a token */
+	guint delayed;
+	guint64 totalDelayMs;
+	guint maxDelayMs;
+	/* operations waiting right now */
+	guint waiting;
+} RateLimitStats;
+
+/**
+ * Called once a token was taken for the operation
+ */
+typedef void (*RateLimitedFunction)(const char *accountKey, gpointer data);
+
+void rateLimiterInit(void);
+
+/**
+ * Takes a token from the account's bucket for this class if one is available and nothing is waiting for it.
+ * serviceName picks the bucket size and refill rate when the bucket is created.
+ */
+bool rateLimiterTryAcquire(const char *accountKey, const char *serviceName, RateLimitClass rateClass);
+
+/**
+ * Calls function (on the main loop) as soon as a token is available. Operations of the same account and class run in
+ * the order they were passed in. destroyData is called on data if the operation is cancelled.
+ */
+void rateLimiterWait(const char *accountKey, const char *serviceName, RateLimitClass rateClass,
+		RateLimitedFunction function, gpointer data, GDestroyNotify destroyData);
+
+/**
+ * Drops the operations waiting for the account (the buckets stay: the server remembers how busy we were)
+ */
+void rateLimiterCancel(const char *accountKey);
+
+void rateLimiterGetStats(RateLimitClass rateClass, RateLimitStats *stats);
+
+/**
+ * "message" or "status"
+ */
+const char* rateLimiterClassName(RateLimitClass rateClass);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * <WakeupStats.h: counts what wakes the main loop up, with the display on and off>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef WAKEUP_STATS_H
+#define WAKEUP_STATS_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	/* a connection's socket; the source is the account if we know it, otherwise the input function */
+	WAKEUP_IO = 0,
+	/* a libpurple timer; the source is its callback */
+	WAKEUP_TIMER,
+	/* a bus method call or a reply to one of our calls */
+	WAKEUP_BUS,
+	WAKEUP_TYPE_COUNT
+} WakeupType;
+
+typedef struct _WakeupSource WakeupSource;
+
+/**
+ * Returns the source for identity (an account, a function or a method name), creating it the first time. name is
+ * copied; if it's NULL the name of the symbol at identity is used. Sources are never freed, so look them up when the
+ * watch or timer is added and keep the pointer.
+ */
+WakeupSource* wakeupStatsGetSource(WakeupType type, gconstpointer identity, const char *name);
+
+/**
+ * One wakeup by source, counted for the current display state. Main loop only.
+ */
+void wakeupStatsCount(WakeupSource *source);
+
+/**
+ * The source's name (an account key, a function or a method)
+ */
+const char* wakeupStatsGetName(const WakeupSource *source);
+
+void wakeupStatsSetDisplayOn(bool on);
+
+typedef void (*WakeupSourceFunction)(WakeupType type, const char *name, guint displayOn, guint displayOff,
+		gpointer data);
+
+void wakeupStatsForEach(WakeupSourceFunction function, gpointer data);
+
+/**
+ * Wakeups with the display on and off, and how long the display has been off in total
+ */
+void wakeupStatsGetTotals(guint *displayOn, guint *displayOff, guint64 *displayOffMs);
+
+/**
+ * "io", "timer" or "bus"
+ */
+const char* wakeupTypeName(WakeupType type);
+
+#endif
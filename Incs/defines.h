@@ -1,5 +1,7 @@
 #include <syslog.h>
 
+#include "WakeupStats.h"
+
 #define CUSTOM_USER_DIRECTORY  "/dev/null"
 #define CUSTOM_PLUGIN_PATH     ""
 #define PLUGIN_SAVE_PREF       "/purple/nullclient/plugins/saved"
@@ -10,11 +12,23 @@ typedef struct _IOClosure
 	guint result;
 	gpointer data;
 	PurpleInputFunction function; 
+	WakeupSource *wakeupSource;
 } IOClosure;
 
+typedef struct _TimeoutClosure
+{
+	GSourceFunc function;
+	gpointer data;
+	WakeupSource *wakeupSource;
+} TimeoutClosure;
+
 static void destroyNotify(gpointer dataToFree);
 static gboolean adapterInvokeIO(GIOChannel *source, GIOCondition condition, gpointer data);
 static guint adapterIOAdd(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data);
+static guint adapterTimeoutAdd(guint interval, GSourceFunc function, gpointer data);
+static guint adapterTimeoutAddSeconds(guint interval, GSourceFunc function, gpointer data);
+static char* getAccountKeyFromPurpleAccount(PurpleAccount *account);
+static void connect_progress_cb(PurpleConnection *gc, const char *text, size_t step, size_t step_count);
 static void adapterUIInit(void);
 static GHashTable* getClientInfo(void);
 static void incoming_message_cb(PurpleConversation *conv, const char *who, const char *alias, const char *message,
@@ -24,7 +38,10 @@ static PurpleCoreUiOps adapterCoreUIOps =
 { NULL, NULL, adapterUIInit, NULL, getClientInfo, NULL, NULL, NULL };
 
 static PurpleEventLoopUiOps adapterEventLoopUIOps =
-{ g_timeout_add, g_source_remove, adapterIOAdd, g_source_remove, NULL, g_timeout_add_seconds, NULL, NULL, NULL };
+{ adapterTimeoutAdd, g_source_remove, adapterIOAdd, g_source_remove, NULL, adapterTimeoutAddSeconds, NULL, NULL, NULL };
+
+static PurpleConnectionUiOps adapterConnectionUIOps =
+{ connect_progress_cb, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
 
 static PurpleConversationUiOps adapterConversationUIOps  =
 { NULL, NULL, NULL, NULL, incoming_message_cb, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
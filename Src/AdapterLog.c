@@ -0,0 +1,178 @@
+/*
+ * <AdapterLog.c: a lock-free ring of binary log records>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Records are never formatted when they are written: the strings are copied into the record as they are and the keys
+ * and the event are kept as pointers to their literals. Turning them into text is left to whoever dumps the ring.
+ * A writer takes the next sequence number with an atomic increment, clears the slot's seq, fills the slot and then
+ * publishes seq + 1. A reader copies a slot and keeps the copy only if seq was the one it expected before and after.
+ * Sequence numbers are unsigned and wrap; the record that gets G_MAXUINT publishes 0 and is never read.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "AdapterLog.h"
+
+/* a power of two */
+#define LOG_RING_SIZE 512
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_TEXT_SIZE 192
+
+typedef struct _RingRecord
+{
+	/* 0 while the record is being written, its sequence number + 1 once it's complete */
+	volatile guint seq;
+	AdapterLogLevel level;
+	gint64 timeMs;
+	const char *event;
+	gint64 value;
+	guint fieldCount;
+	const char *keys[ADAPTER_LOG_MAX_FIELDS];
+	guint8 valueOffsets[ADAPTER_LOG_MAX_FIELDS];
+	/* the values, one after the other, each truncated to what's left */
+	char text[LOG_TEXT_SIZE];
+} RingRecord;
+
+volatile gint adapterLogLevel = ADAPTER_LOG_INFO;
+
+static RingRecord ring[LOG_RING_SIZE];
+
+/**
+ * The sequence number the next record gets
+ */
+static volatile guint nextSeq = 0;
+
+static const char *levelNames[ADAPTER_LOG_LEVEL_COUNT] = { "error", "warning", "info", "debug" };
+
+static guint claimSeq(void)
+{
+#if GLIB_CHECK_VERSION(2, 30, 0)
+	return g_atomic_int_add((volatile gint *) &nextSeq, 1);
+#else
+	return g_atomic_int_exchange_and_add((volatile gint *) &nextSeq, 1);
+#endif
+}
+
+void adapterLogWrite(AdapterLogLevel level, const char *event, gint64 value, ...)
+{
+	va_list args;
+	struct timespec now;
+	guint seq = claimSeq();
+	RingRecord *record = &ring[seq & LOG_RING_MASK];
+	guint used = 0;
+	const char *key;
+
+	g_atomic_int_set((volatile gint *) &record->seq, 0);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->level = level;
+	record->timeMs = (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	record->event = event;
+	record->value = value;
+	record->fieldCount = 0;
+
+	va_start(args, value);
+	while ((key = va_arg(args, const char *)) != NULL && record->fieldCount < ADAPTER_LOG_MAX_FIELDS)
+	{
+		const char *fieldValue = va_arg(args, const char *);
+		gsize length = fieldValue != NULL ? strlen(fieldValue) : 0;
+
+		if (used == LOG_TEXT_SIZE)
+		{
+			break;
+		}
+		length = MIN(length, LOG_TEXT_SIZE - used - 1);
+		memcpy(record->text + used, fieldValue, length);
+		record->text[used + length] = '\0';
+		record->keys[record->fieldCount] = key;
+		record->valueOffsets[record->fieldCount] = used;
+		record->fieldCount++;
+		used += length + 1;
+	}
+	va_end(args);
+
+	g_atomic_int_set((volatile gint *) &record->seq, seq + 1);
+}
+
+void adapterLogSetLevel(AdapterLogLevel level)
+{
+	g_atomic_int_set(&adapterLogLevel, level);
+}
+
+AdapterLogLevel adapterLogGetLevel(void)
+{
+	return g_atomic_int_get(&adapterLogLevel);
+}
+
+const char* adapterLogLevelName(AdapterLogLevel level)
+{
+	return levelNames[level];
+}
+
+int adapterLogLevelFromName(const char *name)
+{
+	int level;
+	for (level = 0; level < ADAPTER_LOG_LEVEL_COUNT; level++)
+	{
+		if (strcmp(levelNames[level], name) == 0)
+		{
+			return level;
+		}
+	}
+	return -1;
+}
+
+void adapterLogForEach(guint limit, AdapterLogFunction function, gpointer data)
+{
+	RingRecord copy;
+	AdapterLogRecord record;
+	guint i;
+	guint end = g_atomic_int_get((volatile gint *) &nextSeq);
+	guint count = (limit > 0 && limit < LOG_RING_SIZE) ? limit : LOG_RING_SIZE;
+
+	/*
+	 * end - count wraps below 0 until the ring has been filled once; slots that were never written have seq 0, which
+	 * is no record's seq + 1
+	 */
+	for (; count > 0; count--)
+	{
+		guint seq = end - count;
+		RingRecord *slot = &ring[seq & LOG_RING_MASK];
+		guint published = g_atomic_int_get((volatile gint *) &slot->seq);
+		if (published == 0 || published != seq + 1)
+		{
+			continue;
+		}
+		memcpy(&copy, slot, sizeof(copy));
+		if ((guint) g_atomic_int_get((volatile gint *) &slot->seq) != published)
+		{
+			/* overwritten while we copied it */
+			continue;
+		}
+
+		record.seq = seq;
+		record.timeMs = copy.timeMs;
+		record.level = copy.level;
+		record.event = copy.event;
+		record.value = copy.value;
+		record.fieldCount = copy.fieldCount;
+		for (i = 0; i < copy.fieldCount; i++)
+		{
+			record.keys[i] = copy.keys[i];
+			record.values[i] = copy.text + copy.valueOffsets[i];
+		}
+		function(&record, data);
+	}
+}
@@ -0,0 +1,21 @@
+/*
+ * <AdapterMain.c: the LibpurpleAdapter service's main>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "LibpurpleAdapter.h"
+
+int main(int argc, char *argv[])
+{
+	return adapterMain(argc, argv);
+}
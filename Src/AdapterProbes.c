@@ -0,0 +1,26 @@
+/*
+ * <AdapterProbes.c: the semaphores of the USDT probes>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The tracer finds them in the .probes section and raises them while it is attached.
+ */
+
+#include "AdapterProbes.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+#define ADAPTER_PROBE_DEFINE_SEMAPHORE(name) \
+	volatile unsigned short ADAPTER_PROBE_SEMAPHORE(name) __attribute__((unused, section(".probes")));
+ADAPTER_PROBE_LIST(ADAPTER_PROBE_DEFINE_SEMAPHORE)
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * <AdapterStats.c: counters behind the getStats method>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * All of this is only touched by the main loop. Latency percentiles are taken over the last LATENCY_SAMPLES calls of
+ * a method, so they follow what the adapter does now rather than averaging over its whole life.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "AdapterStats.h"
+
+#define LATENCY_SAMPLES 128
+
+struct _MethodCounters
+{
+	char *method;
+	guint calls;
+	guint errors;
+	guint maxUs;
+	/* ring of the most recent latencies; calls tells how much of it is used and where the next one goes */
+	guint latencies[LATENCY_SAMPLES];
+};
+
+static guint counters[STATS_COUNTER_COUNT];
+
+/**
+ * key: method name (owned by the value), value: MethodCounters
+ */
+static GHashTable *methodCounters = NULL;
+
+MethodCounters* adapterStatsGetMethodCounters(const char *method)
+{
+	if (methodCounters == NULL)
+	{
+		methodCounters = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	MethodCounters *methodStats = g_hash_table_lookup(methodCounters, method);
+	if (methodStats == NULL)
+	{
+		methodStats = g_new0(MethodCounters, 1);
+		methodStats->method = g_strdup(method);
+		g_hash_table_insert(methodCounters, methodStats->method, methodStats);
+	}
+	return methodStats;
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+	guint latencyA = *(const guint *) a;
+	guint latencyB = *(const guint *) b;
+	return latencyA < latencyB ? -1 : latencyA > latencyB;
+}
+
+void adapterStatsCount(AdapterCounter counter)
+{
+	counters[counter]++;
+}
+
+guint adapterStatsGetCounter(AdapterCounter counter)
+{
+	return counters[counter];
+}
+
+const char* adapterStatsCounterName(AdapterCounter counter)
+{
+	static const char *names[STATS_COUNTER_COUNT] = { "presenceIn", "presenceOut", "messagesIn", "messagesOut" };
+	return names[counter];
+}
+
+void adapterStatsMethodCalled(MethodCounters *methodStats, guint latencyUs)
+{
+	methodStats->latencies[methodStats->calls % LATENCY_SAMPLES] = latencyUs;
+	methodStats->calls++;
+	methodStats->maxUs = MAX(methodStats->maxUs, latencyUs);
+}
+
+void adapterStatsMethodFailed(const char *method)
+{
+	adapterStatsGetMethodCounters(method)->errors++;
+}
+
+void adapterStatsForEachMethod(MethodStatsFunction function, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	guint sorted[LATENCY_SAMPLES];
+
+	if (methodCounters == NULL)
+	{
+		return;
+	}
+	g_hash_table_iter_init(&iter, methodCounters);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		MethodCounters *methodStats = value;
+		guint samples = MIN(methodStats->calls, LATENCY_SAMPLES);
+		MethodStats stats = { methodStats->method, methodStats->calls, methodStats->errors, 0, 0, 0, methodStats->maxUs };
+
+		if (samples > 0)
+		{
+			memcpy(sorted, methodStats->latencies, samples * sizeof(guint));
+			qsort(sorted, samples, sizeof(guint), compareLatencies);
+			stats.p50Us = sorted[(samples - 1) * 50 / 100];
+			stats.p90Us = sorted[(samples - 1) * 90 / 100];
+			stats.p99Us = sorted[(samples - 1) * 99 / 100];
+		}
+		function(&stats, data);
+	}
+}
+
+guint64 adapterStatsGetRssBytes(void)
+{
+	unsigned long size, resident;
+	guint64 rss = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm == NULL)
+	{
+		return 0;
+	}
+	if (fscanf(statm, "%lu %lu", &size, &resident) == 2)
+	{
+		rss = (guint64) resident * sysconf(_SC_PAGESIZE);
+	}
+	fclose(statm);
+	return rss;
+}
@@ -0,0 +1,677 @@
+/*
+ * <AvatarStore.c: size-bounded store of buddy icons, one file per distinct image>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * libpurple's icon cache never gives anything back: every icon we ever received stays in /var/luna/data/im-avatars.
+ * We write the icons ourselves instead. A file is named after the hash of its contents (the same name libpurple would
+ * use, so it still finds the icons when it loads the buddy list), so an image that several buddies of any number of
+ * accounts use is stored once. Buddies reference the images; images that no buddy references are kept, least recently
+ * referenced first out, until the store goes over its budget.
+ *
+ * What's in the store (name, size, last reference) is kept in an index file so that we never have to scan the
+ * directory at startup. The index is written a while after it changed, to keep flash writes down.
+ *
+ * Accounts can ask for lazy avatars: then an icon that isn't stored yet is only remembered by its hash (libpurple keeps
+ * the image in memory while the buddy uses it) and written when a client fetches it.
+ *
+ * Images that buddies reference get thumbnails (written by the thumbnailer's worker thread, next to the image). They
+ * count against the budget and go with the image.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "AvatarStore.h"
+#include "AvatarThumbnailer.h"
+
+#define INDEX_FILENAME "avatar-index"
+#define INDEX_HEADER "avatar-index 1\n"
+#define INDEX_WRITE_DELAY_SECONDS 30
+
+typedef struct _AvatarEntry
+{
+	/* content hash and extension, e.g. "0123...cdef.png" */
+	char *filename;
+	/* just the content hash */
+	char *hash;
+	char *path;
+	guint64 size;
+	/* buddies pointing at this image */
+	guint references;
+	/* seconds since the epoch */
+	gint64 lastReferenced;
+	/* link in unreferencedEntries; NULL while references > 0 */
+	GList *unreferencedLink;
+	/* NULL until the thumbnails were written */
+	char *thumbnailPaths[AVATAR_THUMBNAIL_COUNT];
+	guint64 thumbnailBytes;
+	/* waiting for the thumbnailer */
+	bool thumbnailsQueued;
+} AvatarEntry;
+
+static char *storeDirectory = NULL;
+static guint64 storeBudget = 0;
+static guint64 storeSize = 0;
+
+/**
+ * key: filename (owned by the value), value: AvatarEntry
+ */
+static GHashTable *avatarEntries = NULL;
+
+/**
+ * AvatarEntries without references, least recently referenced first. These are the ones we evict.
+ */
+static GQueue unreferencedEntries = G_QUEUE_INIT;
+
+/**
+ * key: PurpleBuddy, value: the AvatarEntry it references
+ */
+static GHashTable *buddyAvatars = NULL;
+
+/**
+ * key: PurpleBuddy of a lazy account, value: content hash of its icon, which isn't stored yet
+ */
+static GHashTable *pendingAvatars = NULL;
+
+/**
+ * PurpleAccounts with lazy avatars
+ */
+static GHashTable *lazyAccounts = NULL;
+
+/**
+ * Content hashes of the images the thumbnailer couldn't decode. They aren't queued again, even if they're evicted and
+ * come back.
+ */
+static GHashTable *undecodableImages = NULL;
+
+static guint indexWriteTimer = 0;
+static AvatarUpdatedFunction avatarUpdated = NULL;
+
+static void freeAvatarEntry(gpointer data)
+{
+	AvatarEntry *entry = data;
+	int i;
+	for (i = 0; i < AVATAR_THUMBNAIL_COUNT; i++)
+	{
+		g_free(entry->thumbnailPaths[i]);
+	}
+	g_free(entry->filename);
+	g_free(entry->hash);
+	g_free(entry->path);
+	g_free(entry);
+}
+
+/*
+ * "0123...cdef.png" -> "0123...cdef"
+ */
+static char* getImageHash(const char *filename)
+{
+	return g_strndup(filename, strcspn(filename, "."));
+}
+
+static AvatarEntry* addEntry(const char *filename, guint64 size, gint64 lastReferenced)
+{
+	AvatarEntry *entry = g_new0(AvatarEntry, 1);
+	entry->filename = g_strdup(filename);
+	entry->hash = getImageHash(filename);
+	entry->path = g_build_filename(storeDirectory, filename, NULL);
+	entry->size = size;
+	entry->lastReferenced = lastReferenced;
+	g_hash_table_insert(avatarEntries, entry->filename, entry);
+	storeSize += size;
+	return entry;
+}
+
+static void setThumbnails(AvatarEntry *entry, guint64 bytes)
+{
+	int i;
+	for (i = 0; i < AVATAR_THUMBNAIL_COUNT; i++)
+	{
+		entry->thumbnailPaths[i] = avatarThumbnailPath(entry->path, i);
+	}
+	entry->thumbnailBytes = bytes;
+	storeSize += bytes;
+}
+
+static void unlinkThumbnails(const char *path)
+{
+	int i;
+	for (i = 0; i < AVATAR_THUMBNAIL_COUNT; i++)
+	{
+		char *thumbnailPath = avatarThumbnailPath(path, i);
+		g_unlink(thumbnailPath);
+		g_free(thumbnailPath);
+	}
+}
+
+static gint compareLastReferenced(gconstpointer a, gconstpointer b)
+{
+	const AvatarEntry *entryA = a;
+	const AvatarEntry *entryB = b;
+	return entryA->lastReferenced < entryB->lastReferenced ? -1 : entryA->lastReferenced > entryB->lastReferenced;
+}
+
+static gboolean writeIndex(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	indexWriteTimer = 0;
+
+	GString *index = g_string_new(INDEX_HEADER);
+	g_hash_table_iter_init(&iter, avatarEntries);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		AvatarEntry *entry = value;
+		g_string_append_printf(index, "%s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GUINT64_FORMAT "\n",
+				entry->filename, entry->size, entry->lastReferenced, entry->thumbnailBytes);
+	}
+
+	char *indexPath = g_build_filename(storeDirectory, INDEX_FILENAME, NULL);
+	if (!g_file_set_contents(indexPath, index->str, index->len, NULL))
+	{
+		syslog(LOG_INFO, "Could not write the avatar index %s", indexPath);
+	}
+	g_free(indexPath);
+	g_string_free(index, TRUE);
+	return FALSE;
+}
+
+static void scheduleIndexWrite(void)
+{
+	if (indexWriteTimer == 0)
+	{
+		indexWriteTimer = purple_timeout_add_seconds(INDEX_WRITE_DELAY_SECONDS, writeIndex, NULL);
+	}
+}
+
+static void evictEntries(void)
+{
+	AvatarEntry *entry;
+	while (storeSize > storeBudget && (entry = g_queue_pop_head(&unreferencedEntries)) != NULL)
+	{
+		g_unlink(entry->path);
+		if (entry->thumbnailPaths[0] != NULL)
+		{
+			unlinkThumbnails(entry->path);
+		}
+		storeSize -= entry->size + entry->thumbnailBytes;
+		g_hash_table_remove(avatarEntries, entry->filename);
+		scheduleIndexWrite();
+	}
+}
+
+static void referenceEntry(AvatarEntry *entry)
+{
+	if (entry->references++ == 0)
+	{
+		g_queue_delete_link(&unreferencedEntries, entry->unreferencedLink);
+		entry->unreferencedLink = NULL;
+	}
+	/*
+	 * If the thumbnailer's queue is full this is tried again when the next buddy is pointed at the image
+	 */
+	if (entry->thumbnailPaths[0] == NULL && !entry->thumbnailsQueued
+			&& g_hash_table_lookup(undecodableImages, entry->hash) == NULL)
+	{
+		entry->thumbnailsQueued = avatarThumbnailerQueue(entry->path, entry->filename);
+	}
+	entry->lastReferenced = time(NULL);
+	scheduleIndexWrite();
+}
+
+static void releaseEntry(AvatarEntry *entry)
+{
+	entry->lastReferenced = time(NULL);
+	if (--entry->references == 0)
+	{
+		g_queue_push_tail(&unreferencedEntries, entry);
+		entry->unreferencedLink = unreferencedEntries.tail;
+	}
+	scheduleIndexWrite();
+}
+
+/*
+ * Adds entries (unreferenced, least recently referenced first) for a list of new AvatarEntries and frees the list
+ */
+static void addUnreferencedEntries(GList *entries)
+{
+	GList *iterator;
+	entries = g_list_sort(entries, compareLastReferenced);
+	for (iterator = entries; iterator != NULL; iterator = g_list_next(iterator))
+	{
+		g_queue_push_tail(&unreferencedEntries, iterator->data);
+		((AvatarEntry *) iterator->data)->unreferencedLink = unreferencedEntries.tail;
+	}
+	g_list_free(entries);
+}
+
+static bool loadIndex(void)
+{
+	char *indexPath = g_build_filename(storeDirectory, INDEX_FILENAME, NULL);
+	char *contents = NULL;
+	gboolean loaded = g_file_get_contents(indexPath, &contents, NULL, NULL);
+	g_free(indexPath);
+	if (!loaded)
+	{
+		return FALSE;
+	}
+	if (!g_str_has_prefix(contents, INDEX_HEADER))
+	{
+		g_free(contents);
+		return FALSE;
+	}
+
+	GList *entries = NULL;
+	char **lines = g_strsplit(contents + strlen(INDEX_HEADER), "\n", -1);
+	char **line;
+	for (line = lines; *line != NULL; line++)
+	{
+		char filename[128];
+		guint64 size;
+		gint64 lastReferenced;
+		/* not in indexes written before there were thumbnails */
+		guint64 thumbnailBytes = 0;
+		if (sscanf(*line, "%127s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GUINT64_FORMAT, filename, &size,
+				&lastReferenced, &thumbnailBytes) >= 3 && g_hash_table_lookup(avatarEntries, filename) == NULL)
+		{
+			AvatarEntry *entry = addEntry(filename, size, lastReferenced);
+			if (thumbnailBytes > 0)
+			{
+				setThumbnails(entry, thumbnailBytes);
+			}
+			entries = g_list_prepend(entries, entry);
+		}
+	}
+	addUnreferencedEntries(entries);
+
+	g_strfreev(lines);
+	g_free(contents);
+	return TRUE;
+}
+
+/*
+ * Image names are purple_util_get_image_filename's: the SHA-1 of the image in hex and an extension. Thumbnails are
+ * "<SHA-1>-<size>.png", or that with ".tmp" while they're being written.
+ */
+static gboolean isThumbnailFilename(const char *filename)
+{
+	if (strspn(filename, "0123456789abcdef") != 40 || filename[40] != '-')
+	{
+		return FALSE;
+	}
+	const char *size = filename + 41;
+	gsize sizeLength = strspn(size, "0123456789");
+	return sizeLength > 0 && (strcmp(size + sizeLength, ".png") == 0 || strcmp(size + sizeLength, ".png.tmp") == 0);
+}
+
+/*
+ * Without an index (first start with the store) we take over whatever libpurple left in the directory
+ */
+static void adoptDirectory(void)
+{
+	GDir *directory = g_dir_open(storeDirectory, 0, NULL);
+	const char *filename;
+	GList *entries = NULL;
+	struct stat fileStat;
+
+	if (directory == NULL)
+	{
+		return;
+	}
+	while ((filename = g_dir_read_name(directory)) != NULL)
+	{
+		char *path = g_build_filename(storeDirectory, filename, NULL);
+		if (strcmp(filename, INDEX_FILENAME) == 0)
+		{
+			/* ours, even if it didn't load */
+		}
+		else if (isThumbnailFilename(filename))
+		{
+			/* thumbnails get rebuilt */
+			g_unlink(path);
+		}
+		else if (g_stat(path, &fileStat) == 0 && S_ISREG(fileStat.st_mode))
+		{
+			entries = g_list_prepend(entries, addEntry(filename, fileStat.st_size, fileStat.st_mtime));
+		}
+		g_free(path);
+	}
+	g_dir_close(directory);
+	addUnreferencedEntries(entries);
+	syslog(LOG_INFO, "Adopted %u avatars", g_hash_table_size(avatarEntries));
+	scheduleIndexWrite();
+}
+
+/*
+ * Points the buddy at entry (NULL for no icon)
+ */
+static void setBuddyEntry(PurpleBuddy *buddy, AvatarEntry *entry)
+{
+	AvatarEntry *oldEntry = g_hash_table_lookup(buddyAvatars, buddy);
+	if (oldEntry == entry)
+	{
+		return;
+	}
+	if (entry != NULL)
+	{
+		referenceEntry(entry);
+		g_hash_table_insert(buddyAvatars, buddy, entry);
+	}
+	else
+	{
+		g_hash_table_remove(buddyAvatars, buddy);
+	}
+	if (oldEntry != NULL)
+	{
+		releaseEntry(oldEntry);
+	}
+}
+
+/*
+ * Returns the entry of the image, writing it to the store first if needed. If lazy, an image that isn't stored isn't
+ * written either: NULL is returned and pendingHash set to the image's hash.
+ */
+static AvatarEntry* storeImage(gconstpointer data, size_t length, bool lazy, char **pendingHash)
+{
+	char *filename = purple_util_get_image_filename(data, length);
+	AvatarEntry *entry = g_hash_table_lookup(avatarEntries, filename);
+
+	if (entry == NULL || !g_file_test(entry->path, G_FILE_TEST_EXISTS))
+	{
+		if (lazy)
+		{
+			*pendingHash = getImageHash(filename);
+			g_free(filename);
+			return NULL;
+		}
+
+		char *path = g_build_filename(storeDirectory, filename, NULL);
+		gboolean written = purple_util_write_data_to_file_absolute(path, data, length);
+		g_free(path);
+		if (!written)
+		{
+			g_free(filename);
+			return NULL;
+		}
+		if (entry == NULL)
+		{
+			entry = addEntry(filename, length, time(NULL));
+			g_queue_push_tail(&unreferencedEntries, entry);
+			entry->unreferencedLink = unreferencedEntries.tail;
+		}
+		scheduleIndexWrite();
+	}
+	g_free(filename);
+	return entry;
+}
+
+/*
+ * The buddies of the saved buddy list reference the icons they had when we last ran
+ */
+static void referenceBuddyListIcons(void)
+{
+	PurpleBlistNode *node;
+	for (node = purple_blist_get_root(); node != NULL; node = purple_blist_node_next(node, TRUE))
+	{
+		if (!PURPLE_BLIST_NODE_IS_BUDDY(node))
+		{
+			continue;
+		}
+		const char *filename = purple_blist_node_get_string(node, "buddy_icon");
+		AvatarEntry *entry = filename ? g_hash_table_lookup(avatarEntries, filename) : NULL;
+		if (entry != NULL)
+		{
+			setBuddyEntry((PurpleBuddy *) node, entry);
+		}
+	}
+}
+
+/*
+ * The thumbnailer is done with an image (on the main loop)
+ */
+static void thumbnailsDone(const char *filename, guint64 bytes, bool decoded)
+{
+	AvatarEntry *entry = g_hash_table_lookup(avatarEntries, filename);
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (entry == NULL)
+	{
+		/* evicted in the meantime */
+		char *path = g_build_filename(storeDirectory, filename, NULL);
+		unlinkThumbnails(path);
+		g_free(path);
+		return;
+	}
+	entry->thumbnailsQueued = FALSE;
+	if (!decoded)
+	{
+		g_hash_table_insert(undecodableImages, g_strdup(entry->hash), GINT_TO_POINTER(TRUE));
+	}
+	if (bytes == 0 || entry->thumbnailPaths[0] != NULL)
+	{
+		return;
+	}
+	setThumbnails(entry, bytes);
+	scheduleIndexWrite();
+
+	/*
+	 * The buddies' presence has to go out again, now with the thumbnails
+	 */
+	if (avatarUpdated != NULL)
+	{
+		g_hash_table_iter_init(&iter, buddyAvatars);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			if (value == entry)
+			{
+				avatarUpdated(key);
+			}
+		}
+	}
+	evictEntries();
+}
+
+bool avatarStoreInit(const char *directory, guint64 budgetBytes, guint thumbnailQueueDepth,
+		AvatarUpdatedFunction updated)
+{
+	if (avatarEntries != NULL)
+	{
+		return TRUE;
+	}
+
+	storeDirectory = g_strdup(directory);
+	storeBudget = budgetBytes;
+	avatarUpdated = updated;
+	avatarEntries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, freeAvatarEntry);
+	buddyAvatars = g_hash_table_new(g_direct_hash, g_direct_equal);
+	pendingAvatars = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	lazyAccounts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	undecodableImages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (g_mkdir_with_parents(storeDirectory, 0700) != 0)
+	{
+		syslog(LOG_INFO, "Could not create the avatar directory %s", storeDirectory);
+	}
+
+	/*
+	 * libpurple still tells us where the icon of a buddy is (the names match) but doesn't write icons anymore
+	 */
+	purple_buddy_icons_set_cache_dir(storeDirectory);
+	purple_buddy_icons_set_caching(FALSE);
+
+	avatarThumbnailerStart(thumbnailQueueDepth, thumbnailsDone);
+	if (!loadIndex())
+	{
+		adoptDirectory();
+	}
+	referenceBuddyListIcons();
+	evictEntries();
+
+	syslog(LOG_INFO, "Avatar store has %u images, %" G_GUINT64_FORMAT " bytes", g_hash_table_size(avatarEntries),
+			storeSize);
+	return TRUE;
+}
+
+void avatarStoreShutdown(void)
+{
+	avatarThumbnailerStop();
+	if (indexWriteTimer != 0)
+	{
+		purple_timeout_remove(indexWriteTimer);
+		writeIndex(NULL);
+	}
+}
+
+void avatarStoreSetLazy(PurpleAccount *account, bool lazy)
+{
+	g_return_if_fail(lazyAccounts != NULL);
+
+	if (lazy)
+	{
+		g_hash_table_insert(lazyAccounts, account, account);
+	}
+	else
+	{
+		g_hash_table_remove(lazyAccounts, account);
+	}
+}
+
+/*
+ * Stores (or, if lazy, remembers the hash of) the buddy's current icon and points the buddy at it
+ */
+static void storeBuddyIcon(PurpleBuddy *buddy, bool lazy)
+{
+	PurpleBlistNode *node = (PurpleBlistNode *) buddy;
+	PurpleBuddyIcon *icon = purple_buddy_get_icon(buddy);
+	AvatarEntry *entry = NULL;
+	char *pendingHash = NULL;
+	size_t length = 0;
+
+	if (icon != NULL)
+	{
+		gconstpointer data = purple_buddy_icon_get_data(icon, &length);
+		if (data != NULL && length > 0)
+		{
+			entry = storeImage(data, length, lazy, &pendingHash);
+		}
+	}
+	setBuddyEntry(buddy, entry);
+	if (pendingHash != NULL)
+	{
+		g_hash_table_insert(pendingAvatars, buddy, pendingHash);
+	}
+	else
+	{
+		g_hash_table_remove(pendingAvatars, buddy);
+	}
+
+	/*
+	 * libpurple only remembers these when it caches icons itself. Without them it would ask the server for every icon
+	 * again at the next sign on. A lazy icon has no file yet, but its checksum still saves the download.
+	 */
+	if (entry != NULL)
+	{
+		purple_blist_node_set_string(node, "buddy_icon", entry->filename);
+	}
+	else
+	{
+		purple_blist_node_remove_setting(node, "buddy_icon");
+	}
+	if (icon != NULL && purple_buddy_icon_get_checksum(icon) != NULL && (entry != NULL || pendingHash != NULL))
+	{
+		purple_blist_node_set_string(node, "icon_checksum", purple_buddy_icon_get_checksum(icon));
+	}
+	else if (entry == NULL && pendingHash == NULL)
+	{
+		purple_blist_node_remove_setting(node, "icon_checksum");
+	}
+
+	evictEntries();
+}
+
+void avatarStoreUpdateBuddy(PurpleBuddy *buddy)
+{
+	g_return_if_fail(avatarEntries != NULL);
+
+	storeBuddyIcon(buddy, g_hash_table_lookup(lazyAccounts, purple_buddy_get_account(buddy)) != NULL);
+}
+
+void avatarStoreRemoveBuddy(PurpleBuddy *buddy)
+{
+	g_return_if_fail(avatarEntries != NULL);
+
+	g_hash_table_remove(pendingAvatars, buddy);
+	setBuddyEntry(buddy, NULL);
+	evictEntries();
+}
+
+const char* avatarStoreFetchBuddy(PurpleBuddy *buddy)
+{
+	g_return_val_if_fail(avatarEntries != NULL, NULL);
+
+	if (g_hash_table_lookup(pendingAvatars, buddy) != NULL)
+	{
+		storeBuddyIcon(buddy, FALSE);
+	}
+	else if (avatarStoreGetBuddyPath(buddy) == NULL && purple_buddy_get_icon(buddy) == NULL)
+	{
+		/*
+		 * A lazy icon from an earlier run: we kept its checksum but not its data. Forget the checksum so that the
+		 * server sends the icon again at the next sign on.
+		 */
+		purple_blist_node_remove_setting((PurpleBlistNode *) buddy, "icon_checksum");
+	}
+	return avatarStoreGetBuddyPath(buddy);
+}
+
+const char* avatarStoreGetBuddyPath(PurpleBuddy *buddy)
+{
+	AvatarEntry *entry = buddyAvatars ? g_hash_table_lookup(buddyAvatars, buddy) : NULL;
+	return entry ? entry->path : NULL;
+}
+
+const char* avatarStoreGetBuddyThumbnail(PurpleBuddy *buddy, AvatarThumbnail thumbnail)
+{
+	AvatarEntry *entry = buddyAvatars ? g_hash_table_lookup(buddyAvatars, buddy) : NULL;
+	return entry ? entry->thumbnailPaths[thumbnail] : NULL;
+}
+
+const char* avatarStoreGetBuddyHash(PurpleBuddy *buddy)
+{
+	AvatarEntry *entry = buddyAvatars ? g_hash_table_lookup(buddyAvatars, buddy) : NULL;
+	if (entry != NULL)
+	{
+		return entry->hash;
+	}
+	return pendingAvatars ? g_hash_table_lookup(pendingAvatars, buddy) : NULL;
+}
+
+guint64 avatarStoreSize(void)
+{
+	return storeSize;
+}
+
+guint avatarStoreCount(void)
+{
+	return avatarEntries ? g_hash_table_size(avatarEntries) : 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * <AvatarThumbnailer.c: scales buddy icons down to thumbnails on a worker thread>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The clients show buddy icons at a couple of small sizes and used to decode and scale the full image each time. The
+ * avatar store hands every new image to this worker, which decodes it once and writes a PNG per thumbnail size next to
+ * it. Decoding can take tens of milliseconds for a large JPEG, so it stays off the main loop; the queue is bounded so
+ * that a sign on with hundreds of new icons can't pile up work (or memory) without limit.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include "AvatarThumbnailer.h"
+
+static const guint thumbnailSizes[AVATAR_THUMBNAIL_COUNT] = { 32, 64 };
+
+typedef struct _ThumbnailJob
+{
+	char *path;
+	char *filename;
+	/* total size of the thumbnails written; 0 if they could not be */
+	guint64 bytes;
+	bool decoded;
+} ThumbnailJob;
+
+static pthread_t workerThread;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueChanged = PTHREAD_COND_INITIALIZER;
+/* ThumbnailJobs, oldest first. Guarded by queueLock, as is running. */
+static GQueue jobs = G_QUEUE_INIT;
+static guint queueDepth = 0;
+static bool running = FALSE;
+static ThumbnailsDoneFunction doneFunction = NULL;
+
+static void freeJob(ThumbnailJob *job)
+{
+	g_free(job->path);
+	g_free(job->filename);
+	g_free(job);
+}
+
+guint avatarThumbnailSize(AvatarThumbnail thumbnail)
+{
+	return thumbnailSizes[thumbnail];
+}
+
+char* avatarThumbnailPath(const char *path, AvatarThumbnail thumbnail)
+{
+	const char *extension = strrchr(path, '.');
+	const char *separator = strrchr(path, G_DIR_SEPARATOR);
+	gsize stemLength = extension != NULL && extension > separator ? (gsize) (extension - path) : strlen(path);
+	return g_strdup_printf("%.*s-%u.png", (int) stemLength, path, thumbnailSizes[thumbnail]);
+}
+
+/*
+ * Writes the PNG to a temporary file first so that a client never sees half a thumbnail. Returns the file's size, 0 on
+ * failure.
+ */
+static guint64 saveThumbnail(GdkPixbuf *thumbnail, const char *thumbnailPath)
+{
+	char *temporaryPath = g_strconcat(thumbnailPath, ".tmp", NULL);
+	GError *error = NULL;
+	struct stat fileStat;
+	guint64 bytes = 0;
+
+	if (!gdk_pixbuf_save(thumbnail, temporaryPath, "png", &error, NULL))
+	{
+		syslog(LOG_INFO, "Could not write the thumbnail %s: %s", thumbnailPath, error->message);
+		g_error_free(error);
+	}
+	else if (g_rename(temporaryPath, thumbnailPath) != 0 || g_stat(thumbnailPath, &fileStat) != 0)
+	{
+		syslog(LOG_INFO, "Could not write the thumbnail %s", thumbnailPath);
+	}
+	else
+	{
+		bytes = fileStat.st_size;
+	}
+	g_unlink(temporaryPath);
+	g_free(temporaryPath);
+	return bytes;
+}
+
+static void makeThumbnails(ThumbnailJob *job)
+{
+	GError *error = NULL;
+	GdkPixbuf *image = gdk_pixbuf_new_from_file(job->path, &error);
+	int i;
+
+	if (image == NULL)
+	{
+		syslog(LOG_INFO, "Could not decode the avatar %s: %s", job->path, error->message);
+		g_error_free(error);
+		return;
+	}
+	job->decoded = TRUE;
+
+	int width = gdk_pixbuf_get_width(image);
+	int height = gdk_pixbuf_get_height(image);
+	for (i = 0; i < AVATAR_THUMBNAIL_COUNT; i++)
+	{
+		/*
+		 * Fit into the square, keeping the aspect ratio. Small images aren't scaled up.
+		 */
+		double scale = MIN(1.0, (double) thumbnailSizes[i] / MAX(width, height));
+		GdkPixbuf *thumbnail = gdk_pixbuf_scale_simple(image, MAX(1, (int) (width * scale + 0.5)),
+				MAX(1, (int) (height * scale + 0.5)), GDK_INTERP_BILINEAR);
+		char *thumbnailPath = avatarThumbnailPath(job->path, i);
+		guint64 bytes = thumbnail ? saveThumbnail(thumbnail, thumbnailPath) : 0;
+		g_free(thumbnailPath);
+		if (thumbnail)
+		{
+			g_object_unref(thumbnail);
+		}
+		if (bytes == 0)
+		{
+			/*
+			 * All the sizes or none: the store only knows about an image's thumbnails once they're all there
+			 */
+			while (--i >= 0)
+			{
+				thumbnailPath = avatarThumbnailPath(job->path, i);
+				g_unlink(thumbnailPath);
+				g_free(thumbnailPath);
+			}
+			job->bytes = 0;
+			break;
+		}
+		job->bytes += bytes;
+	}
+	g_object_unref(image);
+}
+
+/*
+ * On the main loop
+ */
+static gboolean reportJob(gpointer data)
+{
+	ThumbnailJob *job = data;
+	doneFunction(job->filename, job->bytes, job->decoded);
+	freeJob(job);
+	return FALSE;
+}
+
+static void* thumbnailerMain(void *unused)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&queueLock);
+		while (running && g_queue_is_empty(&jobs))
+		{
+			pthread_cond_wait(&queueChanged, &queueLock);
+		}
+		if (!running)
+		{
+			pthread_mutex_unlock(&queueLock);
+			break;
+		}
+		ThumbnailJob *job = g_queue_pop_head(&jobs);
+		pthread_mutex_unlock(&queueLock);
+
+		makeThumbnails(job);
+		g_idle_add(reportJob, job);
+	}
+	return NULL;
+}
+
+bool avatarThumbnailerStart(guint maxQueued, ThumbnailsDoneFunction done)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+	g_type_init();
+#endif
+	queueDepth = maxQueued;
+	doneFunction = done;
+	running = TRUE;
+	if (pthread_create(&workerThread, NULL, thumbnailerMain, NULL) != 0)
+	{
+		syslog(LOG_INFO, "pthread_create failed. There will be no avatar thumbnails");
+		running = FALSE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void avatarThumbnailerStop(void)
+{
+	ThumbnailJob *job;
+
+	pthread_mutex_lock(&queueLock);
+	if (!running)
+	{
+		pthread_mutex_unlock(&queueLock);
+		return;
+	}
+	running = FALSE;
+	while ((job = g_queue_pop_head(&jobs)) != NULL)
+	{
+		freeJob(job);
+	}
+	pthread_cond_signal(&queueChanged);
+	pthread_mutex_unlock(&queueLock);
+
+	pthread_join(workerThread, NULL);
+}
+
+bool avatarThumbnailerQueue(const char *path, const char *filename)
+{
+	bool queued = FALSE;
+
+	pthread_mutex_lock(&queueLock);
+	if (running && g_queue_get_length(&jobs) < queueDepth)
+	{
+		ThumbnailJob *job = g_new0(ThumbnailJob, 1);
+		job->path = g_strdup(path);
+		job->filename = g_strdup(filename);
+		g_queue_push_tail(&jobs, job);
+		pthread_cond_signal(&queueChanged);
+		queued = TRUE;
+	}
+	pthread_mutex_unlock(&queueLock);
+	return queued;
+}
@@ -0,0 +1,302 @@
+/*
+ * <ConversationCache.c: bounded LRU index of the IM conversations we keep open>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * libpurple never destroys an IM conversation on its own, and purple_conversation_new walks the list of all
+ * conversations every time it's called. We index the IM conversations of each account by normalized buddy name
+ * (hash table + LRU queue) so that sending is an O(1) lookup, and destroy the least recently used ones once an
+ * account has more than its limit. Conversations created by libpurple for incoming messages are indexed too.
+ * Conversations nobody has used for the idle time are destroyed by a timer that only runs while some are indexed.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <time.h>
+
+#include "ConversationCache.h"
+
+typedef struct _CachedConversation
+{
+	char *name;
+	PurpleConversation *conversation;
+	/* monotonic seconds */
+	gint64 lastUsed;
+} CachedConversation;
+
+typedef struct _AccountConversations
+{
+	/* key: normalized buddy name, value: link in lru */
+	GHashTable *byName;
+	/* most recently used conversation at the head */
+	GQueue lru;
+	guint limit;
+} AccountConversations;
+
+/**
+ * key: PurpleAccount, value: AccountConversations
+ */
+static GHashTable *conversationsByAccount = NULL;
+static guint defaultConversationLimit = 1;
+static guint indexedConversations = 0;
+static guint idleSeconds = 0;
+static guint sweepTimer = 0;
+
+static gint64 nowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static AccountConversations* getAccountConversations(PurpleAccount *account, gboolean create)
+{
+	AccountConversations *accountConversations = g_hash_table_lookup(conversationsByAccount, account);
+	if (accountConversations == NULL && create)
+	{
+		accountConversations = g_new0(AccountConversations, 1);
+		accountConversations->byName = g_hash_table_new(g_str_hash, g_str_equal);
+		g_queue_init(&accountConversations->lru);
+		accountConversations->limit = defaultConversationLimit;
+		g_hash_table_insert(conversationsByAccount, account, accountConversations);
+	}
+	return accountConversations;
+}
+
+/*
+ * Removes the conversation from the index without destroying it
+ */
+static PurpleConversation* forgetConversation(AccountConversations *accountConversations, GList *link)
+{
+	CachedConversation *cachedConversation = link->data;
+	PurpleConversation *conversation = cachedConversation->conversation;
+
+	g_hash_table_remove(accountConversations->byName, cachedConversation->name);
+	g_queue_delete_link(&accountConversations->lru, link);
+	g_free(cachedConversation->name);
+	g_free(cachedConversation);
+	indexedConversations--;
+
+	return conversation;
+}
+
+static void touchConversation(AccountConversations *accountConversations, GList *link)
+{
+	((CachedConversation *) link->data)->lastUsed = nowSeconds();
+	if (link != accountConversations->lru.head)
+	{
+		g_queue_unlink(&accountConversations->lru, link);
+		g_queue_push_head_link(&accountConversations->lru, link);
+	}
+}
+
+static void evictConversations(AccountConversations *accountConversations, guint limit)
+{
+	while (accountConversations->lru.length > limit)
+	{
+		/*
+		 * Take it out of the index first so that deleting_conversation_cb doesn't find it
+		 */
+		PurpleConversation *conversation = forgetConversation(accountConversations,
+				g_queue_peek_tail_link(&accountConversations->lru));
+		purple_conversation_destroy(conversation);
+	}
+}
+
+static void evictIdleConversations(gpointer account, gpointer value, gpointer cutoff)
+{
+	AccountConversations *accountConversations = value;
+	GList *link;
+
+	/*
+	 * The LRU queue is in order of use, so the idle ones are at the tail
+	 */
+	while ((link = g_queue_peek_tail_link(&accountConversations->lru)) != NULL
+			&& ((CachedConversation *) link->data)->lastUsed <= *(gint64 *) cutoff)
+	{
+		purple_conversation_destroy(forgetConversation(accountConversations, link));
+	}
+}
+
+static gboolean sweepIdleConversations(gpointer data)
+{
+	gint64 cutoff = nowSeconds() - idleSeconds;
+
+	g_hash_table_foreach(conversationsByAccount, evictIdleConversations, &cutoff);
+	if (indexedConversations == 0)
+	{
+		sweepTimer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void indexConversation(AccountConversations *accountConversations, const char *normalizedName,
+		PurpleConversation *conversation)
+{
+	CachedConversation *cachedConversation = g_new0(CachedConversation, 1);
+	cachedConversation->name = g_strdup(normalizedName);
+	cachedConversation->conversation = conversation;
+	cachedConversation->lastUsed = nowSeconds();
+
+	g_queue_push_head(&accountConversations->lru, cachedConversation);
+	g_hash_table_insert(accountConversations->byName, cachedConversation->name, accountConversations->lru.head);
+	indexedConversations++;
+
+	/*
+	 * An idle conversation goes between idleSeconds and 1.5 idleSeconds after it was last used
+	 */
+	if (sweepTimer == 0 && idleSeconds > 0)
+	{
+		sweepTimer = purple_timeout_add_seconds(MAX(idleSeconds / 2, 1), sweepIdleConversations, NULL);
+	}
+}
+
+static void conversation_created_cb(PurpleConversation *conversation, gpointer unused)
+{
+	if (purple_conversation_get_type(conversation) != PURPLE_CONV_TYPE_IM)
+	{
+		return;
+	}
+
+	PurpleAccount *account = purple_conversation_get_account(conversation);
+	AccountConversations *accountConversations = getAccountConversations(account, TRUE);
+	const char *normalizedName = purple_normalize(account, purple_conversation_get_name(conversation));
+
+	GList *link = g_hash_table_lookup(accountConversations->byName, normalizedName);
+	if (link != NULL)
+	{
+		touchConversation(accountConversations, link);
+	}
+	else
+	{
+		indexConversation(accountConversations, normalizedName, conversation);
+		evictConversations(accountConversations, accountConversations->limit);
+	}
+}
+
+static void deleting_conversation_cb(PurpleConversation *conversation, gpointer unused)
+{
+	if (purple_conversation_get_type(conversation) != PURPLE_CONV_TYPE_IM)
+	{
+		return;
+	}
+
+	PurpleAccount *account = purple_conversation_get_account(conversation);
+	AccountConversations *accountConversations = getAccountConversations(account, FALSE);
+	if (accountConversations == NULL)
+	{
+		return;
+	}
+
+	const char *normalizedName = purple_normalize(account, purple_conversation_get_name(conversation));
+	GList *link = g_hash_table_lookup(accountConversations->byName, normalizedName);
+	if (link != NULL && ((CachedConversation *) link->data)->conversation == conversation)
+	{
+		forgetConversation(accountConversations, link);
+	}
+}
+
+void conversationCacheInit(guint defaultLimit, guint idleTimeout)
+{
+	static int handle;
+
+	defaultConversationLimit = MAX(defaultLimit, 1);
+	idleSeconds = idleTimeout;
+	if (conversationsByAccount != NULL)
+	{
+		return;
+	}
+	conversationsByAccount = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	purple_signal_connect(purple_conversations_get_handle(), "conversation-created", &handle,
+			PURPLE_CALLBACK(conversation_created_cb), NULL);
+	purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation", &handle,
+			PURPLE_CALLBACK(deleting_conversation_cb), NULL);
+}
+
+void conversationCacheSetLimit(PurpleAccount *account, guint limit)
+{
+	AccountConversations *accountConversations = getAccountConversations(account, TRUE);
+	accountConversations->limit = MAX(limit, 1);
+	evictConversations(accountConversations, accountConversations->limit);
+}
+
+PurpleConversation* conversationCacheGet(PurpleAccount *account, const char *usernameTo)
+{
+	AccountConversations *accountConversations = getAccountConversations(account, TRUE);
+
+	GList *link = g_hash_table_lookup(accountConversations->byName, purple_normalize(account, usernameTo));
+	if (link != NULL)
+	{
+		touchConversation(accountConversations, link);
+		return ((CachedConversation *) link->data)->conversation;
+	}
+
+	/*
+	 * Not indexed yet: let libpurple create it (conversation_created_cb indexes it)
+	 */
+	PurpleConversation *conversation = purple_conversation_new(PURPLE_CONV_TYPE_IM, account, usernameTo);
+	if (conversation == NULL)
+	{
+		return NULL;
+	}
+
+	const char *normalizedName = purple_normalize(account, purple_conversation_get_name(conversation));
+	link = g_hash_table_lookup(accountConversations->byName, normalizedName);
+	if (link == NULL)
+	{
+		/*
+		 * purple_conversation_new handed us a conversation that existed before we started indexing
+		 */
+		indexConversation(accountConversations, normalizedName, conversation);
+		evictConversations(accountConversations, accountConversations->limit);
+	}
+	return conversation;
+}
+
+void conversationCacheTouch(PurpleConversation *conversation)
+{
+	PurpleAccount *account = purple_conversation_get_account(conversation);
+	AccountConversations *accountConversations = getAccountConversations(account, FALSE);
+	if (accountConversations == NULL)
+	{
+		return;
+	}
+
+	GList *link = g_hash_table_lookup(accountConversations->byName,
+			purple_normalize(account, purple_conversation_get_name(conversation)));
+	if (link != NULL && ((CachedConversation *) link->data)->conversation == conversation)
+	{
+		touchConversation(accountConversations, link);
+	}
+}
+
+void conversationCacheRemoveAccount(PurpleAccount *account)
+{
+	AccountConversations *accountConversations = getAccountConversations(account, FALSE);
+	if (accountConversations == NULL)
+	{
+		return;
+	}
+
+	evictConversations(accountConversations, 0);
+	g_hash_table_remove(conversationsByAccount, account);
+	g_hash_table_destroy(accountConversations->byName);
+	g_free(accountConversations);
+}
+
+guint conversationCacheSize(void)
+{
+	return indexedConversations;
+}
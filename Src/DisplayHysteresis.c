@@ -0,0 +1,182 @@
+/*
+ * <DisplayHysteresis.c: decides when a display change is worth telling the IM servers about>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Every time the accounts leave idle the servers flush everything they held back, and every time they enter it again
+ * it's another round trip. Turning the display on to look at the clock shouldn't cost that. We remember how long the
+ * display stayed on the last few times and only leave idle once it has been on longer than three out of four of those
+ * wakes. If most wakes are long anyway (the user is reading and typing), waiting would only delay presence, so we
+ * leave idle after a short minimum delay. Accounts whose updates are only held back by us cost nothing to wake, so
+ * they follow the display right away.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "DisplayHysteresis.h"
+
+/**
+ * Display on periods we remember
+ */
+#define WAKE_HISTORY_SIZE 16
+/**
+ * Wakes we have to see before we trust the history
+ */
+#define MIN_WAKES_SEEN 4
+#define MIN_LEAVE_DELAY_MS 3000
+
+static DisplayIdleFunction setAccountsIdle = NULL;
+static DisplayIdleFunction setUndelayedAccountsIdle = NULL;
+/* wakes longer than this are not "brief": we never wait longer */
+static guint maxLeaveDelayMs = 0;
+static guint wakeHistory[WAKE_HISTORY_SIZE];
+static guint wakesSeen = 0;
+static guint leaveDelayMs = 0;
+static guint typicalWakeMs = 0;
+/* when the display went on; 0 while it is off */
+static gint64 displayOnAt = 0;
+static bool accountsIdle = FALSE;
+static guint leaveTimer = 0;
+static guint toggles = 0;
+static guint suppressedWakes = 0;
+
+static gint64 nowMilliseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int compareDurations(const void *a, const void *b)
+{
+	guint durationA = *(const guint *) a;
+	guint durationB = *(const guint *) b;
+	return durationA < durationB ? -1 : durationA > durationB;
+}
+
+static void recordWake(guint durationMs)
+{
+	guint sorted[WAKE_HISTORY_SIZE];
+	guint count;
+
+	wakeHistory[wakesSeen++ % WAKE_HISTORY_SIZE] = durationMs;
+	count = MIN(wakesSeen, WAKE_HISTORY_SIZE);
+	if (count < MIN_WAKES_SEEN)
+	{
+		return;
+	}
+
+	memcpy(sorted, wakeHistory, count * sizeof(guint));
+	qsort(sorted, count, sizeof(guint), compareDurations);
+	typicalWakeMs = sorted[count / 2];
+
+	guint upperQuartile = sorted[(count * 3) / 4];
+	if (upperQuartile > maxLeaveDelayMs)
+	{
+		leaveDelayMs = MIN_LEAVE_DELAY_MS;
+	}
+	else
+	{
+		/* a little past the wake, so that the display going off right at the end doesn't race the timer */
+		leaveDelayMs = MIN(maxLeaveDelayMs, MAX(MIN_LEAVE_DELAY_MS, upperQuartile + upperQuartile / 8));
+	}
+}
+
+static void setIdle(bool idle)
+{
+	if (accountsIdle != idle)
+	{
+		accountsIdle = idle;
+		toggles++;
+		setAccountsIdle(idle);
+	}
+}
+
+static gboolean leaveIdle(gpointer data)
+{
+	leaveTimer = 0;
+	setIdle(FALSE);
+	return FALSE;
+}
+
+void displayHysteresisInit(guint initialDelayMs, guint maxDelayMs, DisplayIdleFunction setIdleFunction,
+		DisplayIdleFunction setUndelayedIdleFunction)
+{
+	setAccountsIdle = setIdleFunction;
+	setUndelayedAccountsIdle = setUndelayedIdleFunction;
+	maxLeaveDelayMs = MAX(maxDelayMs, MIN_LEAVE_DELAY_MS);
+	leaveDelayMs = MIN(initialDelayMs, maxLeaveDelayMs);
+}
+
+void displayHysteresisDisplayChanged(bool on)
+{
+	gint64 now = nowMilliseconds();
+
+	g_return_if_fail(setAccountsIdle != NULL);
+
+	if (setUndelayedAccountsIdle != NULL)
+	{
+		setUndelayedAccountsIdle(!on);
+	}
+	if (on)
+	{
+		displayOnAt = now;
+		if (leaveTimer == 0 && accountsIdle)
+		{
+			leaveTimer = purple_timeout_add(leaveDelayMs, leaveIdle, NULL);
+		}
+		return;
+	}
+
+	if (displayOnAt != 0)
+	{
+		recordWake(MIN(now - displayOnAt, (gint64) G_MAXUINT));
+		displayOnAt = 0;
+	}
+	if (leaveTimer != 0)
+	{
+		/*
+		 * A brief wake: the accounts never left idle, so there's nothing to flush and nothing to send
+		 */
+		purple_timeout_remove(leaveTimer);
+		leaveTimer = 0;
+		suppressedWakes++;
+		return;
+	}
+	setIdle(TRUE);
+}
+
+void displayHysteresisSetIdle(bool idle)
+{
+	g_return_if_fail(setAccountsIdle != NULL);
+
+	if (leaveTimer != 0)
+	{
+		purple_timeout_remove(leaveTimer);
+		leaveTimer = 0;
+	}
+	setIdle(idle);
+}
+
+void displayHysteresisGetStats(DisplayHysteresisStats *stats)
+{
+	stats->toggles = toggles;
+	stats->suppressedWakes = suppressedWakes;
+	stats->leaveDelayMs = leaveDelayMs;
+	stats->typicalWakeMs = typicalWakeMs;
+}
@@ -0,0 +1,558 @@
+/*
+ * <EventTrace.c: records buddy list signals and incoming IMs to a file that Tools/replay plays back>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The recorder has signal handlers of its own, so what's recorded is what libpurple emitted, whatever the adapter did
+ * with it. The file is the magic followed by records:
+ *
+ *   type (1 byte), microseconds since the previous record (varint), protocol id, account, buddy (strings), then
+ *   status:  status id, status message (strings)
+ *   icon:    checksum (string), image (blob)
+ *   IM:      message (string), flags (varint)
+ *
+ * Varints are 7 bits per byte, low bits first. A string is a varint: 0 for none, 1 if the string follows (its length
+ * as a varint, then its bytes) or n to repeat the (n - 2)th string of the trace; names and status ids are written once.
+ * Blobs work the same way, and an icon is written again only if its checksum changed.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "EventTrace.h"
+
+#define TRACE_MAGIC "IMTRACE1"
+#define TRACE_MAGIC_LENGTH 8
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+#define REF_NONE 0
+#define REF_INLINE 1
+#define REF_FIRST_ID 2
+
+struct _EventTraceReader
+{
+	GMappedFile *file;
+	const guchar *next;
+	const guchar *end;
+	guint64 timeUs;
+	/* of char*, owned */
+	GPtrArray *strings;
+	/* of const guchar* into the file, each preceded by its length in blobLengths */
+	GPtrArray *blobs;
+	GArray *blobLengths;
+};
+
+static FILE *traceFile = NULL;
+static gsize traceMaxBytes = 0;
+static gint64 lastRecordUs = 0;
+static guint traceEvents = 0;
+/* set by the first record that would take the trace past maxBytes, which isn't written; stopSource then stops it */
+static bool traceFull = FALSE;
+static guint stopSource = 0;
+static gsize traceBytes = 0;
+
+/**
+ * key: string (owned), value: its id + REF_FIRST_ID
+ */
+static GHashTable *writtenStrings = NULL;
+
+/**
+ * key: icon checksum (owned), value: blob id + REF_FIRST_ID
+ */
+static GHashTable *writtenIcons = NULL;
+static guint nextBlobId = 0;
+
+/* the signal handlers' handle */
+static int traceHandle;
+
+static gint64 nowMicroseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void writeBytes(const void *bytes, gsize length)
+{
+	fwrite(bytes, 1, length, traceFile);
+	traceBytes += length;
+}
+
+static void writeVarint(guint64 value)
+{
+	guchar bytes[10];
+	gsize length = 0;
+
+	do
+	{
+		bytes[length] = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+		{
+			bytes[length] |= 0x80;
+		}
+		length++;
+	} while (value != 0);
+	writeBytes(bytes, length);
+}
+
+static gsize getVarintSize(guint64 value)
+{
+	gsize size = 1;
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+/*
+ * What writeString would write. A string that's repeated within the record is counted in full each time, so this
+ * can only err on the large side
+ */
+static gsize getStringSize(const char *string)
+{
+	if (string == NULL)
+	{
+		return getVarintSize(REF_NONE);
+	}
+	guint ref = GPOINTER_TO_UINT(g_hash_table_lookup(writtenStrings, string));
+	if (ref != 0)
+	{
+		return getVarintSize(ref);
+	}
+	gsize length = strlen(string);
+	return getVarintSize(REF_INLINE) + getVarintSize(length) + length;
+}
+
+static gsize getIconSize(const char *checksum, gconstpointer data, gsize length)
+{
+	guint ref = checksum != NULL ? GPOINTER_TO_UINT(g_hash_table_lookup(writtenIcons, checksum)) : 0;
+
+	if (data == NULL)
+	{
+		return getVarintSize(REF_NONE);
+	}
+	if (ref != 0)
+	{
+		return getVarintSize(ref);
+	}
+	return getVarintSize(REF_INLINE) + getVarintSize(length) + length;
+}
+
+static void writeString(const char *string)
+{
+	if (string == NULL)
+	{
+		writeVarint(REF_NONE);
+		return;
+	}
+	guint ref = GPOINTER_TO_UINT(g_hash_table_lookup(writtenStrings, string));
+	if (ref != 0)
+	{
+		writeVarint(ref);
+		return;
+	}
+	gsize length = strlen(string);
+	writeVarint(REF_INLINE);
+	writeVarint(length);
+	writeBytes(string, length);
+	g_hash_table_insert(writtenStrings, g_strdup(string), GUINT_TO_POINTER(g_hash_table_size(writtenStrings) + REF_FIRST_ID));
+}
+
+static void writeIcon(const char *checksum, gconstpointer data, gsize length)
+{
+	guint ref = checksum != NULL ? GPOINTER_TO_UINT(g_hash_table_lookup(writtenIcons, checksum)) : 0;
+
+	if (data == NULL)
+	{
+		writeVarint(REF_NONE);
+		return;
+	}
+	if (ref != 0)
+	{
+		writeVarint(ref);
+		return;
+	}
+	writeVarint(REF_INLINE);
+	writeVarint(length);
+	writeBytes(data, length);
+	if (checksum != NULL)
+	{
+		g_hash_table_insert(writtenIcons, g_strdup(checksum), GUINT_TO_POINTER(nextBlobId + REF_FIRST_ID));
+	}
+	nextBlobId++;
+}
+
+static gboolean stopWhenFull(gpointer data)
+{
+	stopSource = 0;
+	eventTraceStop();
+	return FALSE;
+}
+
+/*
+ * Writes what all records start with, if the whole record (bodySize being the rest of it) fits in maxBytes. If it
+ * doesn't, nothing more is written and the recording is stopped from the main loop: the handlers can't be
+ * disconnected while a signal is being emitted
+ */
+static bool writeRecordStart(EventTraceType type, PurpleAccount *account, const char *buddy, gsize bodySize)
+{
+	gint64 now = nowMicroseconds();
+	guchar typeByte = type;
+	const char *protocolId = purple_account_get_protocol_id(account);
+	const char *username = purple_account_get_username(account);
+
+	if (traceFull)
+	{
+		return FALSE;
+	}
+	gsize size = sizeof(typeByte) + getVarintSize(now - lastRecordUs) + getStringSize(protocolId)
+			+ getStringSize(username) + getStringSize(buddy) + bodySize;
+	if (size > traceMaxBytes - MIN(traceBytes, traceMaxBytes))
+	{
+		traceFull = TRUE;
+		stopSource = purple_timeout_add(0, stopWhenFull, NULL);
+		return FALSE;
+	}
+
+	writeBytes(&typeByte, 1);
+	writeVarint(now - lastRecordUs);
+	lastRecordUs = now;
+	writeString(protocolId);
+	writeString(username);
+	writeString(buddy);
+	traceEvents++;
+	return TRUE;
+}
+
+static void buddyStatusChanged(PurpleBuddy *buddy, PurpleStatus *oldStatus, PurpleStatus *newStatus, gpointer data)
+{
+	const char *statusId = purple_status_get_id(newStatus);
+	const char *statusMessage = purple_status_get_attr_string(newStatus, "message");
+
+	if (!writeRecordStart(EVENT_TRACE_STATUS, purple_buddy_get_account(buddy), purple_buddy_get_name(buddy),
+			getStringSize(statusId) + getStringSize(statusMessage)))
+	{
+		return;
+	}
+	writeString(statusId);
+	writeString(statusMessage);
+}
+
+static void buddySignedOnOff(PurpleBuddy *buddy, gpointer data)
+{
+	writeRecordStart(GPOINTER_TO_INT(data) ? EVENT_TRACE_SIGNED_ON : EVENT_TRACE_SIGNED_OFF,
+			purple_buddy_get_account(buddy), purple_buddy_get_name(buddy), 0);
+}
+
+static void buddyIconChanged(PurpleBuddy *buddy, gpointer data)
+{
+	PurpleBuddyIcon *icon = purple_buddy_get_icon(buddy);
+	gconstpointer iconData = NULL;
+	size_t length = 0;
+	const char *checksum = NULL;
+
+	if (traceFull)
+	{
+		return;
+	}
+	if (icon != NULL)
+	{
+		iconData = purple_buddy_icon_get_data(icon, &length);
+		checksum = purple_buddy_icon_get_checksum(icon);
+	}
+	if (!writeRecordStart(EVENT_TRACE_ICON, purple_buddy_get_account(buddy), purple_buddy_get_name(buddy),
+			getStringSize(checksum) + getIconSize(checksum, iconData, length)))
+	{
+		return;
+	}
+	writeString(checksum);
+	writeIcon(checksum, iconData, length);
+}
+
+static void receivedIm(PurpleAccount *account, char *sender, char *message, PurpleConversation *conv,
+		PurpleMessageFlags flags, gpointer data)
+{
+	if (!writeRecordStart(EVENT_TRACE_IM, account, sender, getStringSize(message) + getVarintSize(flags)))
+	{
+		return;
+	}
+	writeString(message);
+	writeVarint(flags);
+}
+
+bool eventTraceStart(const char *path, gsize maxBytes)
+{
+	if (traceFile != NULL)
+	{
+		return FALSE;
+	}
+	/*
+	 * The trace has IM bodies in it: only we get to read it, and a file (or a link) that's in the way is removed
+	 * rather than written through
+	 */
+	unlink(path);
+	int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd < 0)
+	{
+		return FALSE;
+	}
+	traceFile = fdopen(fd, "wb");
+	if (traceFile == NULL)
+	{
+		close(fd);
+		return FALSE;
+	}
+	setvbuf(traceFile, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+	writtenStrings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	writtenIcons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	nextBlobId = 0;
+	traceMaxBytes = maxBytes;
+	traceEvents = 0;
+	traceBytes = 0;
+	traceFull = FALSE;
+	lastRecordUs = nowMicroseconds();
+	writeBytes(TRACE_MAGIC, TRACE_MAGIC_LENGTH);
+
+	void *blistHandle = purple_blist_get_handle();
+	purple_signal_connect(blistHandle, "buddy-status-changed", &traceHandle, PURPLE_CALLBACK(buddyStatusChanged), NULL);
+	purple_signal_connect(blistHandle, "buddy-signed-on", &traceHandle, PURPLE_CALLBACK(buddySignedOnOff),
+			GINT_TO_POINTER(TRUE));
+	purple_signal_connect(blistHandle, "buddy-signed-off", &traceHandle, PURPLE_CALLBACK(buddySignedOnOff),
+			GINT_TO_POINTER(FALSE));
+	purple_signal_connect(blistHandle, "buddy-icon-changed", &traceHandle, PURPLE_CALLBACK(buddyIconChanged), NULL);
+	purple_signal_connect(purple_conversations_get_handle(), "received-im-msg", &traceHandle,
+			PURPLE_CALLBACK(receivedIm), NULL);
+	return TRUE;
+}
+
+void eventTraceStop(void)
+{
+	if (traceFile == NULL)
+	{
+		return;
+	}
+	if (stopSource != 0)
+	{
+		purple_timeout_remove(stopSource);
+		stopSource = 0;
+	}
+	purple_signals_disconnect_by_handle(&traceHandle);
+	fclose(traceFile);
+	traceFile = NULL;
+	g_hash_table_destroy(writtenStrings);
+	writtenStrings = NULL;
+	g_hash_table_destroy(writtenIcons);
+	writtenIcons = NULL;
+}
+
+bool eventTraceIsRecording(void)
+{
+	return traceFile != NULL;
+}
+
+void eventTraceGetCounts(guint *events, gsize *bytes)
+{
+	*events = traceEvents;
+	*bytes = traceBytes;
+}
+
+static bool readVarint(EventTraceReader *reader, guint64 *value)
+{
+	int shift;
+
+	*value = 0;
+	for (shift = 0; reader->next < reader->end && shift < 64; shift += 7)
+	{
+		guchar byte = *reader->next++;
+		*value |= (guint64) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Points at the length bytes that follow (and moves past them), NULL if the trace is cut short
+ */
+static const guchar* readInline(EventTraceReader *reader, gsize *length)
+{
+	guint64 inlineLength;
+	if (!readVarint(reader, &inlineLength) || inlineLength > (guint64) (reader->end - reader->next))
+	{
+		return NULL;
+	}
+	const guchar *bytes = reader->next;
+	reader->next += inlineLength;
+	*length = inlineLength;
+	return bytes;
+}
+
+static bool readString(EventTraceReader *reader, const char **string)
+{
+	guint64 ref;
+	gsize length;
+
+	if (!readVarint(reader, &ref))
+	{
+		return FALSE;
+	}
+	if (ref == REF_NONE)
+	{
+		*string = NULL;
+	}
+	else if (ref == REF_INLINE)
+	{
+		const guchar *bytes = readInline(reader, &length);
+		if (bytes == NULL)
+		{
+			return FALSE;
+		}
+		*string = g_strndup((const char *) bytes, length);
+		g_ptr_array_add(reader->strings, (gpointer) *string);
+	}
+	else if (ref - REF_FIRST_ID < reader->strings->len)
+	{
+		*string = g_ptr_array_index(reader->strings, ref - REF_FIRST_ID);
+	}
+	else
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool readBlob(EventTraceReader *reader, const guchar **blob, gsize *length)
+{
+	guint64 ref;
+
+	if (!readVarint(reader, &ref))
+	{
+		return FALSE;
+	}
+	if (ref == REF_NONE)
+	{
+		*blob = NULL;
+		*length = 0;
+	}
+	else if (ref == REF_INLINE)
+	{
+		*blob = readInline(reader, length);
+		if (*blob == NULL)
+		{
+			return FALSE;
+		}
+		g_ptr_array_add(reader->blobs, (gpointer) *blob);
+		g_array_append_val(reader->blobLengths, *length);
+	}
+	else if (ref - REF_FIRST_ID < reader->blobs->len)
+	{
+		*blob = g_ptr_array_index(reader->blobs, ref - REF_FIRST_ID);
+		*length = g_array_index(reader->blobLengths, gsize, ref - REF_FIRST_ID);
+	}
+	else
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+EventTraceReader* eventTraceOpen(const char *path)
+{
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+
+	if (file == NULL)
+	{
+		return NULL;
+	}
+	if (g_mapped_file_get_length(file) < TRACE_MAGIC_LENGTH
+			|| memcmp(g_mapped_file_get_contents(file), TRACE_MAGIC, TRACE_MAGIC_LENGTH) != 0)
+	{
+		g_mapped_file_free(file);
+		return NULL;
+	}
+
+	EventTraceReader *reader = g_new0(EventTraceReader, 1);
+	reader->file = file;
+	reader->next = (const guchar *) g_mapped_file_get_contents(file) + TRACE_MAGIC_LENGTH;
+	reader->end = (const guchar *) g_mapped_file_get_contents(file) + g_mapped_file_get_length(file);
+	reader->strings = g_ptr_array_new();
+	reader->blobs = g_ptr_array_new();
+	reader->blobLengths = g_array_new(FALSE, FALSE, sizeof(gsize));
+	return reader;
+}
+
+bool eventTraceRead(EventTraceReader *reader, EventTraceRecord *record)
+{
+	guint64 deltaUs, flags;
+
+	memset(record, 0, sizeof(EventTraceRecord));
+	if (reader->next >= reader->end)
+	{
+		return FALSE;
+	}
+	record->type = *reader->next++;
+	if (!readVarint(reader, &deltaUs) || !readString(reader, &record->protocolId)
+			|| !readString(reader, &record->account) || !readString(reader, &record->buddy))
+	{
+		return FALSE;
+	}
+	reader->timeUs += deltaUs;
+	record->timeUs = reader->timeUs;
+
+	switch (record->type)
+	{
+		case EVENT_TRACE_STATUS:
+			return readString(reader, &record->statusId) && readString(reader, &record->text);
+		case EVENT_TRACE_SIGNED_ON:
+		case EVENT_TRACE_SIGNED_OFF:
+			return TRUE;
+		case EVENT_TRACE_ICON:
+			return readString(reader, &record->text) && readBlob(reader, &record->icon, &record->iconLength);
+		case EVENT_TRACE_IM:
+			if (!readString(reader, &record->text) || !readVarint(reader, &flags))
+			{
+				return FALSE;
+			}
+			record->flags = flags;
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+void eventTraceClose(EventTraceReader *reader)
+{
+	guint i;
+
+	for (i = 0; i < reader->strings->len; i++)
+	{
+		g_free(g_ptr_array_index(reader->strings, i));
+	}
+	g_ptr_array_free(reader->strings, TRUE);
+	g_ptr_array_free(reader->blobs, TRUE);
+	g_array_free(reader->blobLengths, TRUE);
+	g_mapped_file_free(reader->file);
+	g_free(reader);
+}
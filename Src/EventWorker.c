@@ -0,0 +1,949 @@
+/*
+ * <EventWorker.c: hands serialization and logging to a worker thread, and its bus replies back to the main loop>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The main loop only does protocol work and state mutation. Whatever it wants to tell the bus (presence updates,
+ * incoming messages, log lines) is packed into a compact record and pushed into a single-producer/single-consumer
+ * ring. The worker thread pops the records, builds the JSON payloads and logs. lunaservice handles are not thread
+ * safe, so the finished replies go back through a second ring and the main loop sends them, woken by a pipe.
+ */
+
+#include <glib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cjson/json.h>
+#include <lunaservice.h>
+
+#include "AdapterProbes.h"
+#include "AvatarThumbnailer.h"
+#include "EventWorker.h"
+#include "MarkupNormalizer.h"
+#include "MessageSpool.h"
+#include "WakeupStats.h"
+
+/**
+ * Number of slots in the ring. Must be a power of two. One slot is always left empty to tell "full" from "empty".
+ */
+#define EVENT_RING_SIZE 1024
+#define EVENT_RING_MASK (EVENT_RING_SIZE - 1)
+#define EVENT_MAX_FIELDS 12
+
+/**
+ * Incoming messages shorter than this are normalized into a buffer on the stack
+ */
+#define PLAIN_TEXT_BUFFER_SIZE 1024
+#define MAX_FORMATTING_SPANS 32
+
+typedef struct _AdapterEvent
+{
+	EventType type;
+	/* syslog priority for EVENT_SYSLOG, max delay for EVENT_ADD_INCOMING_BATCH */
+	gint value;
+	const char *origin;
+	/* all the string fields of the record packed back to back in one allocation */
+	char *block;
+	guint32 offsets[EVENT_MAX_FIELDS];
+	/* bit n is set if field n is not NULL */
+	guint32 present;
+} AdapterEvent;
+
+static AdapterEvent ring[EVENT_RING_SIZE];
+/* next slot to be written. Only stored by the main loop thread */
+static volatile gint ringHead = 0;
+/* next slot to be read. Only stored by the worker thread */
+static volatile gint ringTail = 0;
+
+/**
+ * Events the main loop couldn't put in the ring because it was full, oldest first (AdapterEvents of their own). The
+ * main loop never waits for the worker: they go into the ring as the worker makes room. A presence update replaces
+ * the one still waiting for the same buddy, so a storm the worker can't keep up with costs one record per buddy. Main
+ * loop only.
+ */
+static GQueue *overflow = NULL;
+/**
+ * key: "serviceName\nusername\nbuddyUsername" (owned), value: the link of the buddy's presence update in overflow
+ */
+static GHashTable *overflowPresence = NULL;
+/* set while overflow holds events, so that the worker wakes the main loop when it has made room */
+static volatile gint overflowWaiting = FALSE;
+
+/**
+ * Replies the worker has built, on their way back to the main loop. Same layout as the event ring, the other way
+ * round: the worker writes, the main loop reads.
+ */
+#define REPLY_RING_SIZE 1024
+#define REPLY_RING_MASK (REPLY_RING_SIZE - 1)
+
+typedef struct _PendingReply
+{
+	char *key;
+	char *payload;
+} PendingReply;
+
+static PendingReply replyRing[REPLY_RING_SIZE];
+/* next slot to be written. Only stored by the worker thread */
+static volatile gint replyHead = 0;
+/* next slot to be read. Only stored by the main loop thread */
+static volatile gint replyTail = 0;
+
+/*
+ * Incoming messages collected for a batching subscriber
+ */
+typedef struct _IncomingBatch
+{
+	char *subscriptionKey;
+	/* NULL if the batch takes messages of all accounts */
+	char *accountKey;
+	gint64 maxDelayMs;
+	GString *messages;
+	guint count;
+	/* when the batch has to go out; only meaningful if count > 0 */
+	gint64 deadline;
+	/* subscriptions on subscriptionKey */
+	guint subscribers;
+} IncomingBatch;
+
+/**
+ * key: subscription key, value: IncomingBatch. Only touched by the thread that processes the events.
+ */
+static GHashTable *incomingBatches = NULL;
+
+static LSHandle *replyHandle = NULL;
+static pthread_t workerThread;
+static sem_t workerWakeup;
+static volatile gint workerRunning = FALSE;
+static volatile gint workerSleeping = FALSE;
+/* cleared while the worker thread runs; it sets it on its way out, once it won't queue any more replies */
+static volatile gint workerExited = TRUE;
+
+/**
+ * The worker writes a byte to wakeupPipe when it queues a reply and mainLoopWoken isn't set yet; the main loop clears
+ * it before it drains the reply ring
+ */
+static int wakeupPipe[2] = { -1, -1 };
+static guint wakeupWatch = 0;
+static volatile gint mainLoopWoken = FALSE;
+static WakeupSource *wakeupSource = NULL;
+
+static const char* getEventField(const AdapterEvent *event, int field)
+{
+	if ((event->present & (1 << field)) == 0)
+	{
+		return NULL;
+	}
+	return event->block + event->offsets[field];
+}
+
+static const char* getEventFieldOrEmpty(const AdapterEvent *event, int field)
+{
+	const char *value = getEventField(event, field);
+	return value ? value : "";
+}
+
+/*
+ * Main loop only
+ */
+static void sendReply(const char *key, const char *payload)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	ADAPTER_PROBE2(subscription__reply, key, strlen(payload));
+	bool retVal = LSSubscriptionReply(replyHandle, key, payload, &lserror);
+	if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+}
+
+static void wakeMainLoop(void)
+{
+	if (g_atomic_int_compare_and_exchange(&mainLoopWoken, FALSE, TRUE))
+	{
+		while (write(wakeupPipe[1], "r", 1) < 0 && errno == EINTR)
+		{
+			/* interrupted by a signal; try again */
+		}
+	}
+}
+
+static bool onWorkerThread(void)
+{
+	return !g_atomic_int_get(&workerExited) && pthread_equal(pthread_self(), workerThread);
+}
+
+/*
+ * On the worker thread the reply is queued for the main loop; when events are processed inline it's sent right away
+ */
+static void replyToSubscribers(const char *key, const char *payload)
+{
+	if (!onWorkerThread())
+	{
+		sendReply(key, payload);
+		return;
+	}
+
+	gint head = replyHead;
+	gint next = (head + 1) & REPLY_RING_MASK;
+	while (g_atomic_int_get(&replyTail) == next)
+	{
+		/*
+		 * The main loop is a full ring of replies behind. The worker can afford to wait; the main loop never waits
+		 * for it.
+		 */
+		wakeMainLoop();
+		g_usleep(1000);
+	}
+	replyRing[head].key = g_strdup(key);
+	replyRing[head].payload = g_strdup(payload);
+	g_atomic_int_set(&replyHead, next);
+	wakeMainLoop();
+}
+
+/*
+ * Sends the replies the worker has queued, in order. Main loop only.
+ */
+static void sendQueuedReplies(void)
+{
+	gint tail = replyTail;
+	while (g_atomic_int_get(&replyHead) != tail)
+	{
+		sendReply(replyRing[tail].key, replyRing[tail].payload);
+		g_free(replyRing[tail].key);
+		g_free(replyRing[tail].payload);
+		tail = (tail + 1) & REPLY_RING_MASK;
+		g_atomic_int_set(&replyTail, tail);
+	}
+}
+
+static void moveOverflowToRing(void);
+
+static gboolean mainLoopWakeup(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	char buffer[64];
+
+	wakeupStatsCount(wakeupSource);
+	while (read(wakeupPipe[0], buffer, sizeof(buffer)) > 0)
+	{
+		/* the bytes only say there's something to do */
+	}
+	/* cleared before draining, so a reply queued from here on writes to the pipe again */
+	g_atomic_int_set(&mainLoopWoken, FALSE);
+	sendQueuedReplies();
+	moveOverflowToRing();
+	return TRUE;
+}
+
+static void processPresenceEvent(const AdapterEvent *event)
+{
+	const char *displayName = getEventField(event, PRESENCE_DISPLAY_NAME);
+	const char *avatarHash = getEventField(event, PRESENCE_AVATAR_HASH);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "serviceName", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_SERVICE_NAME)));
+	json_object_object_add(payload, "username", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_USERNAME)));
+	json_object_object_add(payload, "buddyUsername", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_BUDDY_USERNAME)));
+	if (displayName != NULL)
+	{
+		json_object_object_add(payload, "displayName", json_object_new_string(displayName));
+	}
+	json_object_object_add(payload, "avatarLocation", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_AVATAR_LOCATION)));
+	if (avatarHash != NULL)
+	{
+		json_object_object_add(payload, "avatarHash", json_object_new_string(avatarHash));
+	}
+	if (getEventField(event, PRESENCE_AVATAR_THUMBNAIL_SMALL) != NULL)
+	{
+		/* {"32":"/var/luna/data/im-avatars/0123...cdef-32.png", "64":...} */
+		struct json_object *thumbnails = json_object_new_object();
+		char size[12];
+		sprintf(size, "%u", avatarThumbnailSize(AVATAR_THUMBNAIL_SMALL));
+		json_object_object_add(thumbnails, size, json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_AVATAR_THUMBNAIL_SMALL)));
+		sprintf(size, "%u", avatarThumbnailSize(AVATAR_THUMBNAIL_LARGE));
+		json_object_object_add(thumbnails, size, json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_AVATAR_THUMBNAIL_LARGE)));
+		json_object_object_add(payload, "avatarThumbnails", thumbnails);
+	}
+	json_object_object_add(payload, "customMessage", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_CUSTOM_MESSAGE)));
+	json_object_object_add(payload, "availability", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_AVAILABILITY)));
+	json_object_object_add(payload, "groupName", json_object_new_string(getEventFieldOrEmpty(event, PRESENCE_GROUP_NAME)));
+
+	replyToSubscribers("/getBuddyList", json_object_to_json_string(payload));
+
+	ADAPTER_LOG(ADAPTER_LOG_DEBUG, "presence", 0, "buddy", getEventField(event, PRESENCE_BUDDY_USERNAME),
+			"availability", getEventField(event, PRESENCE_AVAILABILITY),
+			"customMessage", getEventField(event, PRESENCE_CUSTOM_MESSAGE),
+			"avatar", getEventField(event, PRESENCE_AVATAR_LOCATION), "displayName", displayName,
+			"group", getEventField(event, PRESENCE_GROUP_NAME));
+
+	if (!is_error(payload))
+	{
+		json_object_put(payload);
+	}
+}
+
+static gint64 nowMilliseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void flushIncomingBatch(IncomingBatch *batch)
+{
+	if (batch->count == 0)
+	{
+		return;
+	}
+	g_string_prepend(batch->messages, "{\"returnValue\":true, \"messages\":[");
+	g_string_append(batch->messages, "]}");
+	replyToSubscribers(batch->subscriptionKey, batch->messages->str);
+
+	g_string_truncate(batch->messages, 0);
+	batch->count = 0;
+}
+
+/*
+ * Sends the batches that are due (or all of them if flushAll is set). Returns the number of milliseconds until the
+ * next one is due, or -1 if all the batches are empty.
+ */
+static gint64 flushIncomingBatches(gboolean flushAll)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gint64 now = nowMilliseconds();
+	gint64 timeout = -1;
+
+	if (incomingBatches == NULL)
+	{
+		return -1;
+	}
+
+	g_hash_table_iter_init(&iter, incomingBatches);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		IncomingBatch *batch = value;
+		if (batch->count == 0)
+		{
+			continue;
+		}
+		if (flushAll || batch->deadline <= now)
+		{
+			flushIncomingBatch(batch);
+		}
+		else if (timeout < 0 || batch->deadline - now < timeout)
+		{
+			timeout = batch->deadline - now;
+		}
+	}
+	return timeout;
+}
+
+static void processAddIncomingBatchEvent(const AdapterEvent *event)
+{
+	const char *subscriptionKey = getEventFieldOrEmpty(event, BATCH_SUBSCRIPTION_KEY);
+	const char *accountKey = getEventField(event, BATCH_ACCOUNT_KEY);
+
+	if (incomingBatches == NULL)
+	{
+		incomingBatches = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	IncomingBatch *batch = g_hash_table_lookup(incomingBatches, subscriptionKey);
+	if (batch != NULL)
+	{
+		batch->subscribers++;
+		return;
+	}
+
+	batch = g_new0(IncomingBatch, 1);
+	batch->subscriptionKey = g_strdup(subscriptionKey);
+	batch->accountKey = g_strdup(accountKey);
+	batch->maxDelayMs = event->value;
+	batch->messages = g_string_new("");
+	batch->subscribers = 1;
+	g_hash_table_insert(incomingBatches, batch->subscriptionKey, batch);
+}
+
+static void processRemoveIncomingBatchEvent(const AdapterEvent *event)
+{
+	const char *subscriptionKey = getEventFieldOrEmpty(event, BATCH_SUBSCRIPTION_KEY);
+	IncomingBatch *batch = incomingBatches ? g_hash_table_lookup(incomingBatches, subscriptionKey) : NULL;
+
+	if (batch == NULL || --batch->subscribers > 0)
+	{
+		return;
+	}
+	g_hash_table_remove(incomingBatches, subscriptionKey);
+	g_string_free(batch->messages, TRUE);
+	g_free(batch->accountKey);
+	g_free(batch->subscriptionKey);
+	g_free(batch);
+}
+
+static void addToIncomingBatches(const char *accountKey, const char *message)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+
+	if (incomingBatches == NULL)
+	{
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, incomingBatches);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		IncomingBatch *batch = value;
+		if (batch->accountKey != NULL && strcmp(batch->accountKey, accountKey) != 0)
+		{
+			continue;
+		}
+		if (batch->count == 0)
+		{
+			batch->deadline = nowMilliseconds() + batch->maxDelayMs;
+		}
+		else
+		{
+			g_string_append_c(batch->messages, ',');
+		}
+		g_string_append(batch->messages, message);
+		batch->count++;
+	}
+}
+
+/*
+ * Adds the message text without markup ("plainText") and, if there was any, its formatting: [{type, start, end, href}]
+ * with offsets in characters of plainText
+ */
+static void addPlainText(struct json_object *payload, const char *messageText)
+{
+	char plainTextBuffer[PLAIN_TEXT_BUFFER_SIZE];
+	FormattingSpan spans[MAX_FORMATTING_SPANS];
+	guint spanCount = 0;
+	guint i;
+
+	gsize length = strlen(messageText);
+	char *plainText = length < sizeof(plainTextBuffer) ? plainTextBuffer : g_malloc(length + 1);
+	markupNormalize(messageText, length, plainText, spans, MAX_FORMATTING_SPANS, &spanCount);
+	json_object_object_add(payload, "plainText", json_object_new_string(plainText));
+
+	if (spanCount > 0)
+	{
+		struct json_object *formatting = json_object_new_array();
+		for (i = 0; i < spanCount; i++)
+		{
+			struct json_object *span = json_object_new_object();
+			json_object_object_add(span, "type", json_object_new_string(markupSpanTypeName(spans[i].type)));
+			json_object_object_add(span, "start",
+					json_object_new_int(g_utf8_pointer_to_offset(plainText, plainText + spans[i].start)));
+			json_object_object_add(span, "end",
+					json_object_new_int(g_utf8_pointer_to_offset(plainText, plainText + spans[i].end)));
+			if (spans[i].href != NULL)
+			{
+				/* hrefs are escaped too */
+				char *href = g_malloc(spans[i].hrefLength + 1);
+				markupNormalize(spans[i].href, spans[i].hrefLength, href, NULL, 0, NULL);
+				json_object_object_add(span, "href", json_object_new_string(href));
+				g_free(href);
+			}
+			json_object_array_add(formatting, span);
+		}
+		json_object_object_add(payload, "formatting", formatting);
+	}
+
+	if (plainText != plainTextBuffer)
+	{
+		g_free(plainText);
+	}
+}
+
+static void processIncomingMessageEvent(const AdapterEvent *event)
+{
+	const char *accountKey = getEventFieldOrEmpty(event, MESSAGE_ACCOUNT_KEY);
+	guint seq = strtoul(getEventFieldOrEmpty(event, MESSAGE_SEQ), NULL, 10);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "serviceName", json_object_new_string(getEventFieldOrEmpty(event, MESSAGE_SERVICE_NAME)));
+	json_object_object_add(payload, "username", json_object_new_string(getEventFieldOrEmpty(event, MESSAGE_USERNAME)));
+	json_object_object_add(payload, "usernameFrom", json_object_new_string(getEventFieldOrEmpty(event, MESSAGE_USERNAME_FROM)));
+	json_object_object_add(payload, "messageText", json_object_new_string(getEventFieldOrEmpty(event, MESSAGE_TEXT)));
+	json_object_object_add(payload, "seq", json_object_new_int(seq));
+	json_object_object_add(payload, "seqEpoch", json_object_new_int(atoi(getEventFieldOrEmpty(event, MESSAGE_SEQ_EPOCH))));
+	addPlainText(payload, getEventFieldOrEmpty(event, MESSAGE_TEXT));
+	const char *message = json_object_to_json_string(payload);
+
+	/*
+	 * Spooled before it is sent so that a subscriber replaying from its last seq can't miss it (it may see it twice)
+	 */
+	messageSpoolAppend(seq, accountKey, message, strlen(message));
+
+	/*
+	 * Subscribers of all accounts, then subscribers of this account only, then the batching subscribers
+	 */
+	replyToSubscribers("/registerForIncomingMessages", message);
+
+	char *accountSubscriptionKey = g_strconcat("/registerForIncomingMessages/", accountKey, NULL);
+	replyToSubscribers(accountSubscriptionKey, message);
+	g_free(accountSubscriptionKey);
+
+	addToIncomingBatches(accountKey, message);
+
+	if (!is_error(payload))
+	{
+		json_object_put(payload);
+	}
+}
+
+static void processDeliveryStatusEvent(const AdapterEvent *event)
+{
+	const char *clientId = getEventField(event, DELIVERY_CLIENT_ID);
+	const char *errorCode = getEventField(event, DELIVERY_ERROR_CODE);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "serviceName", json_object_new_string(getEventFieldOrEmpty(event, DELIVERY_SERVICE_NAME)));
+	json_object_object_add(payload, "username", json_object_new_string(getEventFieldOrEmpty(event, DELIVERY_USERNAME)));
+	json_object_object_add(payload, "usernameTo", json_object_new_string(getEventFieldOrEmpty(event, DELIVERY_USERNAME_TO)));
+	json_object_object_add(payload, "messageId", json_object_new_int(atoi(getEventFieldOrEmpty(event, DELIVERY_MESSAGE_ID))));
+	if (clientId != NULL)
+	{
+		json_object_object_add(payload, "clientId", json_object_new_string(clientId));
+	}
+	json_object_object_add(payload, "delivered", json_object_new_boolean(errorCode == NULL));
+	if (errorCode != NULL)
+	{
+		json_object_object_add(payload, "errorCode", json_object_new_string(errorCode));
+		json_object_object_add(payload, "errorText", json_object_new_string(getEventFieldOrEmpty(event, DELIVERY_ERROR_TEXT)));
+	}
+
+	replyToSubscribers("/registerForMessageDeliveryStatus", json_object_to_json_string(payload));
+
+	if (!is_error(payload))
+	{
+		json_object_put(payload);
+	}
+}
+
+static void processEvent(const AdapterEvent *event)
+{
+	switch (event->type)
+	{
+	case EVENT_PRESENCE:
+		processPresenceEvent(event);
+		break;
+	case EVENT_INCOMING_MESSAGE:
+		processIncomingMessageEvent(event);
+		break;
+	case EVENT_DELIVERY_STATUS:
+		processDeliveryStatusEvent(event);
+		break;
+	case EVENT_ADD_INCOMING_BATCH:
+		processAddIncomingBatchEvent(event);
+		break;
+	case EVENT_REMOVE_INCOMING_BATCH:
+		processRemoveIncomingBatchEvent(event);
+		break;
+	case EVENT_SYSLOG:
+		syslog(event->value, "%s", getEventFieldOrEmpty(event, SYSLOG_TEXT));
+		break;
+	case EVENT_SUBSCRIPTION_REPLY:
+		replyToSubscribers(getEventFieldOrEmpty(event, REPLY_KEY), getEventFieldOrEmpty(event, REPLY_PAYLOAD));
+		break;
+	}
+}
+
+/*
+ * Blocks the worker until the main loop has published at least one record, we're asked to stop, or timeoutMs have
+ * passed (a negative timeout means no timeout)
+ */
+static void waitForEvents(gint64 timeoutMs)
+{
+	g_atomic_int_set(&workerSleeping, TRUE);
+	if (g_atomic_int_get(&ringHead) == ringTail && g_atomic_int_get(&workerRunning) && timeoutMs != 0)
+	{
+		if (timeoutMs < 0)
+		{
+			while (sem_wait(&workerWakeup) != 0)
+			{
+				/* interrupted by a signal; try again */
+			}
+			return;
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeoutMs / 1000;
+		deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		int result;
+		while ((result = sem_timedwait(&workerWakeup, &deadline)) != 0 && errno == EINTR)
+		{
+			/* interrupted by a signal; try again */
+		}
+		if (result == 0)
+		{
+			return;
+		}
+	}
+
+	/*
+	 * We didn't sleep, or the wait timed out
+	 */
+	if (g_atomic_int_compare_and_exchange(&workerSleeping, TRUE, FALSE))
+	{
+		return;
+	}
+	/*
+	 * The producer cleared the flag first, which means it posted the semaphore. Consume that post so it doesn't turn
+	 * into a spurious wakeup later.
+	 */
+	while (sem_wait(&workerWakeup) != 0)
+	{
+		/* interrupted by a signal; try again */
+	}
+}
+
+static void wakeWorker(void)
+{
+	if (g_atomic_int_compare_and_exchange(&workerSleeping, TRUE, FALSE))
+	{
+		sem_post(&workerWakeup);
+	}
+}
+
+static void* eventWorkerMain(void *unused)
+{
+	for (;;)
+	{
+		gint64 timeout = flushIncomingBatches(FALSE);
+		gint tail = ringTail;
+		if (g_atomic_int_get(&ringHead) == tail)
+		{
+			if (!g_atomic_int_get(&workerRunning))
+			{
+				flushIncomingBatches(TRUE);
+				break;
+			}
+			waitForEvents(timeout);
+			continue;
+		}
+
+		AdapterEvent *event = &ring[tail];
+		processEvent(event);
+		g_free(event->block);
+		event->block = NULL;
+
+		g_atomic_int_set(&ringTail, (tail + 1) & EVENT_RING_MASK);
+		if (g_atomic_int_get(&overflowWaiting))
+		{
+			wakeMainLoop();
+		}
+	}
+	g_atomic_int_set(&workerExited, TRUE);
+	return NULL;
+}
+
+static void closeWakeupPipe(void)
+{
+	if (wakeupWatch != 0)
+	{
+		g_source_remove(wakeupWatch);
+		wakeupWatch = 0;
+	}
+	close(wakeupPipe[0]);
+	close(wakeupPipe[1]);
+	wakeupPipe[0] = wakeupPipe[1] = -1;
+}
+
+bool eventWorkerStart(LSHandle *serviceHandle)
+{
+	replyHandle = serviceHandle;
+
+	if (pipe(wakeupPipe) != 0)
+	{
+		syslog(LOG_INFO, "pipe failed. Events will be processed on the main loop");
+		return FALSE;
+	}
+	fcntl(wakeupPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakeupPipe[1], F_SETFL, O_NONBLOCK);
+	wakeupSource = wakeupStatsGetSource(WAKEUP_IO, mainLoopWakeup, "eventWorkerReplies");
+	GIOChannel *channel = g_io_channel_unix_new(wakeupPipe[0]);
+	wakeupWatch = g_io_add_watch(channel, G_IO_IN, mainLoopWakeup, NULL);
+	g_io_channel_unref(channel);
+
+	if (sem_init(&workerWakeup, 0, 0) != 0)
+	{
+		syslog(LOG_INFO, "sem_init failed. Events will be processed on the main loop");
+		closeWakeupPipe();
+		return FALSE;
+	}
+
+	g_atomic_int_set(&workerExited, FALSE);
+	g_atomic_int_set(&workerRunning, TRUE);
+	if (pthread_create(&workerThread, NULL, eventWorkerMain, NULL) != 0)
+	{
+		syslog(LOG_INFO, "pthread_create failed. Events will be processed on the main loop");
+		g_atomic_int_set(&workerRunning, FALSE);
+		g_atomic_int_set(&workerExited, TRUE);
+		sem_destroy(&workerWakeup);
+		closeWakeupPipe();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void eventWorkerStop(void)
+{
+	if (!g_atomic_int_get(&workerRunning))
+	{
+		return;
+	}
+	/*
+	 * What's still waiting in the overflow goes out first
+	 */
+	while (overflow != NULL && !g_queue_is_empty(overflow))
+	{
+		moveOverflowToRing();
+		sendQueuedReplies();
+		g_usleep(1000);
+	}
+
+	g_atomic_int_set(&workerRunning, FALSE);
+	sem_post(&workerWakeup);
+	/*
+	 * The worker may be waiting for room in the reply ring, and only this thread makes room
+	 */
+	while (!g_atomic_int_get(&workerExited))
+	{
+		sendQueuedReplies();
+		g_usleep(1000);
+	}
+	pthread_join(workerThread, NULL);
+	sem_destroy(&workerWakeup);
+	sendQueuedReplies();
+	closeWakeupPipe();
+}
+
+/*
+ * Returns FALSE if the ring is full. Main loop only.
+ */
+static gboolean pushToRing(const AdapterEvent *event)
+{
+	gint head = ringHead;
+	gint next = (head + 1) & EVENT_RING_MASK;
+	if (g_atomic_int_get(&ringTail) == next)
+	{
+		return FALSE;
+	}
+	ring[head] = *event;
+	g_atomic_int_set(&ringHead, next);
+	wakeWorker();
+	return TRUE;
+}
+
+static char* getPresenceKey(const AdapterEvent *event)
+{
+	return g_strconcat(getEventFieldOrEmpty(event, PRESENCE_SERVICE_NAME), "\n",
+			getEventFieldOrEmpty(event, PRESENCE_USERNAME), "\n", getEventFieldOrEmpty(event, PRESENCE_BUDDY_USERNAME),
+			NULL);
+}
+
+/*
+ * Moves the overflow into the ring, oldest first, until the ring is full again
+ */
+static void moveOverflowToRing(void)
+{
+	while (overflow != NULL && !g_queue_is_empty(overflow))
+	{
+		AdapterEvent *event = g_queue_peek_head(overflow);
+		if (!pushToRing(event))
+		{
+			return;
+		}
+		if (event->type == EVENT_PRESENCE)
+		{
+			char *key = getPresenceKey(event);
+			if (g_hash_table_lookup(overflowPresence, key) == g_queue_peek_head_link(overflow))
+			{
+				g_hash_table_remove(overflowPresence, key);
+			}
+			g_free(key);
+		}
+		g_queue_pop_head(overflow);
+		g_free(event);
+	}
+	g_atomic_int_set(&overflowWaiting, FALSE);
+}
+
+static void addToOverflow(const AdapterEvent *event)
+{
+	if (overflow == NULL)
+	{
+		overflow = g_queue_new();
+		overflowPresence = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+	if (g_queue_is_empty(overflow))
+	{
+		ADAPTER_LOG(ADAPTER_LOG_WARNING, "eventRingFull", EVENT_RING_SIZE);
+	}
+
+	if (event->type == EVENT_PRESENCE)
+	{
+		char *key = getPresenceKey(event);
+		GList *waiting = g_hash_table_lookup(overflowPresence, key);
+		if (waiting != NULL)
+		{
+			/* the update still waiting for this buddy is out of date; this one takes its place */
+			AdapterEvent *waitingEvent = waiting->data;
+			g_free(waitingEvent->block);
+			*waitingEvent = *event;
+			g_free(key);
+			return;
+		}
+		g_queue_push_tail(overflow, g_memdup(event, sizeof(AdapterEvent)));
+		g_hash_table_insert(overflowPresence, key, g_queue_peek_tail_link(overflow));
+	}
+	else
+	{
+		g_queue_push_tail(overflow, g_memdup(event, sizeof(AdapterEvent)));
+		if (event->type == EVENT_SUBSCRIPTION_REPLY)
+		{
+			/* a later update must not be merged into one that goes out before the full buddy list */
+			g_hash_table_remove_all(overflowPresence);
+		}
+	}
+
+	/*
+	 * Set before trying the ring again: either the worker sees it when it makes room, or it made room already
+	 */
+	g_atomic_int_set(&overflowWaiting, TRUE);
+	moveOverflowToRing();
+}
+
+static void postEvent(EventType type, gint value, const char *origin, const char **fields, int fieldCount)
+{
+	AdapterEvent event;
+	gsize lengths[EVENT_MAX_FIELDS];
+	gsize blockSize = 0;
+	int i;
+
+	g_return_if_fail(fieldCount <= EVENT_MAX_FIELDS);
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.value = value;
+	event.origin = origin;
+
+	for (i = 0; i < fieldCount; i++)
+	{
+		lengths[i] = fields[i] ? strlen(fields[i]) + 1 : 0;
+		blockSize += lengths[i];
+	}
+
+	event.block = g_malloc(blockSize ? blockSize : 1);
+	blockSize = 0;
+	for (i = 0; i < fieldCount; i++)
+	{
+		if (fields[i] != NULL)
+		{
+			memcpy(event.block + blockSize, fields[i], lengths[i]);
+			event.offsets[i] = blockSize;
+			event.present |= 1 << i;
+			blockSize += lengths[i];
+		}
+	}
+
+	if (!g_atomic_int_get(&workerRunning))
+	{
+		/*
+		 * Nobody would flush the batches later, so they go out right away
+		 */
+		processEvent(&event);
+		flushIncomingBatches(TRUE);
+		g_free(event.block);
+		return;
+	}
+
+	/*
+	 * If the worker is a full ring behind, the event waits in the overflow rather than the main loop waiting for a
+	 * free slot; behind what's already waiting there, so nothing is reordered
+	 */
+	if (overflow != NULL && !g_queue_is_empty(overflow))
+	{
+		moveOverflowToRing();
+	}
+	if ((overflow == NULL || g_queue_is_empty(overflow)) && pushToRing(&event))
+	{
+		return;
+	}
+	addToOverflow(&event);
+}
+
+void eventWorkerPost(EventType type, const char *origin, const char **fields, int fieldCount)
+{
+	postEvent(type, 0, origin, fields, fieldCount);
+}
+
+void eventWorkerReply(const char *key, const char *payload)
+{
+	const char *fields[REPLY_FIELD_COUNT];
+	fields[REPLY_KEY] = key;
+	fields[REPLY_PAYLOAD] = payload;
+	postEvent(EVENT_SUBSCRIPTION_REPLY, 0, __FUNCTION__, fields, REPLY_FIELD_COUNT);
+}
+
+void eventWorkerAddIncomingBatch(const char *subscriptionKey, const char *accountKey, guint maxDelayMs)
+{
+	const char *fields[BATCH_FIELD_COUNT];
+	fields[BATCH_SUBSCRIPTION_KEY] = subscriptionKey;
+	fields[BATCH_ACCOUNT_KEY] = accountKey;
+	postEvent(EVENT_ADD_INCOMING_BATCH, maxDelayMs, __FUNCTION__, fields, BATCH_FIELD_COUNT);
+}
+
+void eventWorkerRemoveIncomingBatch(const char *subscriptionKey)
+{
+	const char *fields[BATCH_FIELD_COUNT];
+	fields[BATCH_SUBSCRIPTION_KEY] = subscriptionKey;
+	fields[BATCH_ACCOUNT_KEY] = NULL;
+	postEvent(EVENT_REMOVE_INCOMING_BATCH, 0, __FUNCTION__, fields, BATCH_FIELD_COUNT);
+}
+
+void eventWorkerSyslogText(int priority, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	char *text = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	adapterLogWrite(ADAPTER_LOG_LEVEL_FROM_PRIORITY(priority), "syslog", priority, "text", text, NULL);
+
+	const char *fields[SYSLOG_FIELD_COUNT];
+	fields[SYSLOG_TEXT] = text;
+	postEvent(EVENT_SYSLOG, priority, __FUNCTION__, fields, SYSLOG_FIELD_COUNT);
+	g_free(text);
+}
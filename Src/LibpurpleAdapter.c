@@ -33,6 +33,21 @@
 #include <stdlib.h>
 
 #include "defines.h"
+#include "EventWorker.h"
+#include "ConversationCache.h"
+#include "OutboundQueue.h"
+#include "MessageSpool.h"
+#include "RateLimiter.h"
+#include "AvatarStore.h"
+#include "PresenceStrategy.h"
+#include "DisplayHysteresis.h"
+#include "AdapterStats.h"
+#include "LoginTrace.h"
+#include "AdapterLog.h"
+#include "PurpleDebugLog.h"
+#include "AdapterProbes.h"
+#include "EventTrace.h"
+#include "LibpurpleAdapter.h"
 
 #include <cjson/json.h>
 #include <lunaservice.h>
@@ -45,7 +60,8 @@
 #define CONNECT_TIMEOUT_SECONDS 30
 
 /**
- * The number of seconds we wait before disabling the server queue after the screen turns on
+ * The number of seconds we wait before disabling the server queue after the screen turns on (until the display
+ * hysteresis has seen enough display changes to pick its own delay)
  */
 #define DISABLE_QUEUE_TIMEOUT_SECONDS 10
 
@@ -54,6 +70,70 @@
  */
 #define POST_LOGIN_WAIT_SECONDS 10
 
+/**
+ * The number of IM conversations we keep open per account (unless login is passed maxConversations). The least
+ * recently used one is destroyed when we go over.
+ */
+#define MAX_CONVERSATIONS_PER_ACCOUNT 20
+
+/**
+ * IM conversations that haven't sent or received anything for this long are destroyed too
+ */
+#define CONVERSATION_IDLE_SECONDS (30 * 60)
+
+/**
+ * The number of outgoing messages we hold on to for an account that is still signing on
+ */
+#define MAX_QUEUED_MESSAGES_PER_ACCOUNT 50
+
+/**
+ * Bounds for the batchMaxDelayMs parameter of registerForIncomingMessages
+ */
+#define MIN_INCOMING_BATCH_DELAY_MS 10
+#define MAX_INCOMING_BATCH_DELAY_MS 2000
+
+/**
+ * Incoming messages are also kept in this file so that subscribers can catch up on what they missed (sinceSeq). The
+ * tools set their own (adapterSetDataPaths).
+ */
+#ifndef INCOMING_MESSAGE_SPOOL_PATH
+#define INCOMING_MESSAGE_SPOOL_PATH "/var/luna/data/im-incoming-spool"
+#endif
+
+/**
+ * Where buddy icons are stored, and how much space the ones no buddy uses anymore may take up
+ */
+#ifndef AVATAR_DIRECTORY
+#define AVATAR_DIRECTORY "/var/luna/data/im-avatars"
+#endif
+#define AVATAR_STORE_BUDGET_BYTES (2 * 1024 * 1024)
+/**
+ * New icons waiting to be thumbnailed. Icons that don't fit are thumbnailed the next time a buddy uses them.
+ */
+#define AVATAR_THUMBNAIL_QUEUE_DEPTH 16
+
+/**
+ * How often getStats subscribers get the stats
+ */
+#define STATS_PUSH_INTERVAL_SECONDS 60
+
+/**
+ * Finished logins kept for getLoginTraces
+ */
+#define LOGIN_TRACE_HISTORY 32
+
+/**
+ * libpurple debug lines kept for getPurpleDebugLog
+ */
+#define PURPLE_DEBUG_LOG_BUDGET_BYTES (256 * 1024)
+
+/**
+ * Where startEventTrace records to, and the most it records. The trace has IM bodies and icons in it, so callers don't
+ * get to pick the file or make it bigger.
+ */
+#define EVENT_TRACE_PATH "/var/log/im-events.trace"
+#define EVENT_TRACE_MAX_BYTES (64 * 1024 * 1024)
+
 static const char *dbusAddress = "im.libpurple.palm";
 
 static LSHandle *serviceHandle = NULL;
@@ -81,10 +161,74 @@ static bool currentDisplayState = TRUE; // TRUE: display on
  * key: accountKey, value: IP address 
  */
 static GHashTable *ipAddressesBoundTo = NULL;
+/**
+ * Sequence number of the last message we received (over all accounts), and the epoch it counts in: the spool's, or
+ * a new one on every start if there's no spool to carry the seqs over
+ */
+static guint lastIncomingMessageSeq = 0;
+static guint incomingMessageSeqEpoch = 0;
+static char incomingMessageSeqEpochText[12];
+
+/**
+ * The device's unless a tool set its own (adapterSetDataPaths)
+ */
+static const char *incomingMessageSpoolPath = INCOMING_MESSAGE_SPOOL_PATH;
+static const char *avatarDirectory = AVATAR_DIRECTORY;
+
+/**
+ * Called for every account before it connects; see adapterSetConfigureAccountFunction
+ */
+static AdapterAccountFunction configureAccount = NULL;
+
+/*
+ * A status change the rate limiter is holding back
+ */
+typedef struct _PendingStatusChange
+{
+	char *accountKey;
+	/* -1 keeps the current availability */
+	int availability;
+	/* NULL keeps the current custom message */
+	char *customMessage;
+} PendingStatusChange;
+
+/**
+ * key: accountKey (owned by the value), value: PendingStatusChange
+ */
+static GHashTable *pendingStatusChanges = NULL;
+
+/**
+ * libpurple timers that haven't fired (or been removed) yet
+ */
+static guint pendingTimers = 0;
+
+/**
+ * Pushes the stats to getStats subscribers; 0 while nobody is subscribed
+ */
+static guint statsTimer = 0;
+static guint statsSubscribers = 0;
+
+/**
+ * key: PurpleConnection, value: the WakeupSource of its account. Filled when the connection starts signing on, so that
+ * adding a watch is a lookup rather than a walk over the connections and a new account key.
+ */
+static GHashTable *connectionWakeupSources = NULL;
+
+/**
+ * Open SSL connections (set). Their watches carry the PurpleSslConnection, whose connect data is the connection.
+ */
+static GHashTable *sslConnections = NULL;
+
+/**
+ * The SSL plugin's ops, and ours that wrap them to keep track of sslConnections
+ */
+static PurpleSslOps *pluginSslOps = NULL;
+static PurpleSslOps adapterSslOps;
 
 static void adapterUIInit(void)
 {
 	purple_conversations_set_ui_ops(&adapterConversationUIOps);
+	purple_connections_set_ui_ops(&adapterConnectionUIOps);
 }
 
 static void destroyNotify(gpointer dataToFree)
@@ -107,11 +251,53 @@ static gboolean adapterInvokeIO(GIOChannel *ioChannel, GIOCondition ioCondition,
 		purpleCondition = purpleCondition | PURPLE_INPUT_WRITE;
 	}
 
+	wakeupStatsCount(ioClosure->wakeupSource);
+	ADAPTER_PROBE3(io__dispatch, wakeupStatsGetName(ioClosure->wakeupSource), g_io_channel_unix_get_fd(ioChannel),
+			purpleCondition);
 	ioClosure->function(ioClosure->data, g_io_channel_unix_get_fd(ioChannel), purpleCondition);
 
 	return TRUE;
 }
 
+/*
+ * Wakeups of a socket are counted for its account if the watch's data is a connection (as for XMPP and Yahoo) or an
+ * SSL connection opened for one, otherwise for the input function
+ */
+static WakeupSource* getIOWakeupSource(PurpleInputFunction inputFunction, gpointer data)
+{
+	PurpleSslConnection *gsc = g_hash_table_lookup(sslConnections, data);
+	WakeupSource *source = g_hash_table_lookup(connectionWakeupSources, gsc ? gsc->connect_cb_data : data);
+	return source ? source : wakeupStatsGetSource(WAKEUP_IO, inputFunction, NULL);
+}
+
+static void adapterSslConnect(PurpleSslConnection *gsc)
+{
+	g_hash_table_insert(sslConnections, gsc, gsc);
+	pluginSslOps->connectfunc(gsc);
+}
+
+static void adapterSslClose(PurpleSslConnection *gsc)
+{
+	g_hash_table_remove(sslConnections, gsc);
+	pluginSslOps->close(gsc);
+}
+
+/*
+ * Loads the SSL plugin and puts our ops in front of its ops
+ */
+static void wrapSslOps(void)
+{
+	if (!purple_ssl_is_supported())
+	{
+		return;
+	}
+	pluginSslOps = purple_ssl_get_ops();
+	adapterSslOps = *pluginSslOps;
+	adapterSslOps.connectfunc = adapterSslConnect;
+	adapterSslOps.close = adapterSslClose;
+	purple_ssl_set_ops(&adapterSslOps);
+}
+
 static guint adapterIOAdd(gint fd, PurpleInputCondition purpleCondition, PurpleInputFunction inputFunction, gpointer data)
 {
 	GIOChannel *ioChannel;
@@ -120,6 +306,7 @@ static guint adapterIOAdd(gint fd, PurpleInputCondition purpleCondition, PurpleI
 
 	ioClosure->data = data;
 	ioClosure->function = inputFunction;
+	ioClosure->wakeupSource = getIOWakeupSource(inputFunction, data);
 
 	if (PURPLE_INPUT_READ & purpleCondition)
 	{
@@ -138,6 +325,95 @@ static guint adapterIOAdd(gint fd, PurpleInputCondition purpleCondition, PurpleI
 	g_io_channel_unref(ioChannel);
 	return ioClosure->result;
 }
+
+static gboolean adapterInvokeTimeout(gpointer data)
+{
+	TimeoutClosure *timeoutClosure = data;
+	wakeupStatsCount(timeoutClosure->wakeupSource);
+	return timeoutClosure->function(timeoutClosure->data);
+}
+
+static void freeTimeoutClosure(gpointer data)
+{
+	pendingTimers--;
+	g_free(data);
+}
+
+static TimeoutClosure* newTimeoutClosure(GSourceFunc function, gpointer data)
+{
+	TimeoutClosure *timeoutClosure = g_new0(TimeoutClosure, 1);
+	pendingTimers++;
+	timeoutClosure->function = function;
+	timeoutClosure->data = data;
+	timeoutClosure->wakeupSource = wakeupStatsGetSource(WAKEUP_TIMER, function, NULL);
+	return timeoutClosure;
+}
+
+static guint adapterTimeoutAdd(guint interval, GSourceFunc function, gpointer data)
+{
+	return g_timeout_add_full(G_PRIORITY_DEFAULT, interval, adapterInvokeTimeout, newTimeoutClosure(function, data),
+			freeTimeoutClosure);
+}
+
+static guint adapterTimeoutAddSeconds(guint interval, GSourceFunc function, gpointer data)
+{
+	return g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, interval, adapterInvokeTimeout,
+			newTimeoutClosure(function, data), freeTimeoutClosure);
+}
+
+/*
+ * LSMessageReturn and LSMessageReply. The ...Error variants count the reply as an error of the method the message
+ * called.
+ */
+static bool methodReturn(LSHandle *lshandle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	return LSMessageReturn(lshandle, message, payload, lserror);
+}
+
+static bool methodReturnError(LSHandle *lshandle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	adapterStatsMethodFailed(LSMessageGetMethod(message));
+	return LSMessageReturn(lshandle, message, payload, lserror);
+}
+
+static bool methodReply(LSHandle *lshandle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	return LSMessageReply(lshandle, message, payload, lserror);
+}
+
+static bool methodReplyError(LSHandle *lshandle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	adapterStatsMethodFailed(LSMessageGetMethod(message));
+	return LSMessageReply(lshandle, message, payload, lserror);
+}
+
+void adapterSetDataPaths(const char *spoolPath, const char *avatarPath)
+{
+	incomingMessageSpoolPath = spoolPath;
+	avatarDirectory = avatarPath;
+}
+
+void adapterSetConfigureAccountFunction(AdapterAccountFunction function)
+{
+	configureAccount = function;
+}
+
+bool adapterIsAccountOnline(const char *accountKey)
+{
+	return onlineAccountData != NULL && g_hash_table_lookup(onlineAccountData, accountKey) != NULL;
+}
+
+bool adapterIsAccountPending(const char *accountKey)
+{
+	return pendingAccountData != NULL && g_hash_table_lookup(pendingAccountData, accountKey) != NULL;
+}
+
+static gint64 nowMicroseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 /*
  * Helper methods 
  * TODO: move them to the right spot
@@ -197,7 +473,7 @@ static int getPrplAvailabilityFromPalmAvailability(int palmAvailability)
  * (e.g. for logging into AIM, the java service uses "amiruci@aol.com", yet the aim prpl expects "amiruci"; same scenario with yahoo)
  * Free the returned string when you're done with it 
  */
-static char* getPrplFriendlyUsername(const char *serviceName, const char *username)
+char* getPrplFriendlyUsername(const char *serviceName, const char *username)
 {
 	if (!username || !serviceName)
 	{
@@ -237,7 +513,7 @@ static char* getPrplFriendlyUsername(const char *serviceName, const char *userna
  * The messaging service expects the username to be in the username@domain.com format, whereas the AIM prpl uses the username only
  * Free the returned string when you're done with it 
  */
-static char* getJavaFriendlyUsername(const char *username, const char *serviceName)
+char* getJavaFriendlyUsername(const char *username, const char *serviceName)
 {
 	if (!username || !serviceName)
 	{
@@ -261,10 +537,10 @@ static char* getJavaFriendlyUsername(const char *username, const char *serviceNa
 			g_string_erase(javaFriendlyUsername, charsToKeep, -1);
 		}
 	}
-	return javaFriendlyUsername->str;
+	return g_string_free(javaFriendlyUsername, FALSE);
 }
 
-static char* stripResourceFromGtalkUsername(const char *username)
+char* stripResourceFromGtalkUsername(const char *username)
 {
 	if (!username)
 	{
@@ -277,7 +553,7 @@ static char* stripResourceFromGtalkUsername(const char *username)
 		int charsToKeep = resource - username;
 		g_string_erase(javaFriendlyUsername, charsToKeep, -1);
 	}
-	return javaFriendlyUsername->str;
+	return g_string_free(javaFriendlyUsername, FALSE);
 }
 
 static char* getJavaFriendlyErrorCode(PurpleConnectionError type)
@@ -301,7 +577,7 @@ static char* getJavaFriendlyErrorCode(PurpleConnectionError type)
 	}
 	else
 	{
-		syslog(LOG_INFO, "PurpleConnectionError was %i", type);
+		eventWorkerSyslog(LOG_INFO, "PurpleConnectionError was %i", type);
 		javaFriendlyErrorCode = "AcctMgr_Generic_Error";
 	}
 	return javaFriendlyErrorCode;
@@ -333,14 +609,14 @@ static char* getPrplProtocolIdFromServiceName(const char *serviceName)
 	{
 		g_string_append(prplProtocolId, serviceName);
 	}
-	return prplProtocolId->str;
+	return g_string_free(prplProtocolId, FALSE);
 }
 
 /*
  * Given the prpl-specific protocol_id, it will return java-friendly serviceName (e.g. given "prpl-aim", it will return "aol")
  * Free the returned string when you're done with it 
  */
-static char* getServiceNameFromPrplProtocolId(char *prplProtocolId)
+char* getServiceNameFromPrplProtocolId(char *prplProtocolId)
 {
 	if (!prplProtocolId)
 	{
@@ -354,17 +630,17 @@ static char* getServiceNameFromPrplProtocolId(char *prplProtocolId)
 	{
 		// Special case for aol where the java serviceName is "aol" and the prpl protocol_id is "aim-prpl"
 		// I can imagine that we'll have more of these cases coming up...
-		serviceName = g_string_new("aol");
+		g_string_assign(serviceName, "aol");
 	}
 	else if (strcmp(serviceName->str, "jabber") == 0)
 	{
 		// Special case for gtalk where the java serviceName is "gmail" and the prpl protocol_id is "jabber-purple"
-		serviceName = g_string_new("gmail");
+		g_string_assign(serviceName, "gmail");
 	}
-	return serviceName->str;
+	return g_string_free(serviceName, FALSE);
 }
 
-static char* getAccountKey(const char *username, const char *serviceName)
+char* getAccountKey(const char *username, const char *serviceName)
 {
 	if (!username || !serviceName)
 	{
@@ -377,7 +653,7 @@ static char* getAccountKey(const char *username, const char *serviceName)
 	return accountKey;
 }
 
-static char* getAccountKeyFromPurpleAccount(PurpleAccount *account)
+char* getAccountKeyFromPurpleAccount(PurpleAccount *account)
 {
 	if (!account)
 	{
@@ -393,209 +669,85 @@ static char* getAccountKeyFromPurpleAccount(PurpleAccount *account)
 	return accountKey;
 }
 
-static const char* getField(struct json_object* message, const char* name)
-{
-	struct json_object* val = json_object_object_get(message, name);
-	if (val)
-	{
-		return json_object_get_string(val);
-	}
-	return NULL;
-}
-
-/**
- * Returns a GString containing the special stanza to enable server-side presence update queue
- * Clean up after yourself using g_string_free when you're done with the return value
- */
-static GString* getEnableQueueStanza(PurpleAccount *account)
-{
-	GString *stanza = NULL;
-	if (account != NULL)
-	{
-		stanza = g_string_new("");
-		PurpleConnection *pc = purple_account_get_connection(account);
-		if (pc == NULL)
-		{
-			return NULL;
-		}
-		const char *displayName = purple_connection_get_display_name(pc);
-		if (displayName == NULL)
-		{
-			return NULL;
-		}
-		g_string_append(stanza, "<iq from='");
-		g_string_append(stanza, displayName);
-		g_string_append(stanza, "' type='set'><query xmlns='google:queue'><enable/></query></iq>");
-	}
-	return stanza;
-}
-
-/**
- * Returns a GString containing the special stanza to disable and flush the server-side presence update queue
- * Clean up after yourself using g_string_free when you're done with the return value
+/*
+ * The account tables don't own their keys, and one key usually ends up in several of them and in timers. So the keys
+ * that go in there are interned: one copy per account for the life of the process, never freed.
  */
-static GString* getDisableQueueStanza(PurpleAccount *account)
+static char* getInternedAccountKey(const char *username, const char *serviceName)
 {
-	GString *stanza = NULL;
-	if (account != NULL)
+	char *accountKey = getAccountKey(username, serviceName);
+	if (*accountKey == '\0')
 	{
-		stanza = g_string_new("");
-		PurpleConnection *pc = purple_account_get_connection(account);
-		if (pc == NULL)
-		{
-			return NULL;
-		}
-		const char *displayName = purple_connection_get_display_name(pc);
-		if (displayName == NULL)
-		{
-			return NULL;
-		}
-		g_string_append(stanza, "<iq from='");
-		g_string_append(stanza, displayName);
-		g_string_append(stanza, "' type='set'><query xmlns='google:queue'><disable/><flush/></query></iq>");
+		/* getAccountKey's answer to NULLs, not allocated */
+		return accountKey;
 	}
-	return stanza;
+	char *internedKey = (char *) g_intern_string(accountKey);
+	free(accountKey);
+	return internedKey;
 }
 
-static void enableServerQueueForAccount(PurpleAccount *account)
+static char* getInternedAccountKeyFromPurpleAccount(PurpleAccount *account)
 {
 	if (!account)
 	{
-		return;
-	}
-
-	PurplePluginProtocolInfo *prpl_info = NULL;
-	PurpleConnection *gc = purple_account_get_connection(account);
-	PurplePlugin *prpl = NULL;
-	
-	if (gc != NULL)
-	{
-		prpl = purple_connection_get_prpl(gc);
+		return "";
 	}
+	char *serviceName = getServiceNameFromPrplProtocolId(account->protocol_id);
+	char *username = getJavaFriendlyUsername(account->username, serviceName);
+	char *accountKey = getInternedAccountKey(username, serviceName);
 
-	if (prpl != NULL)
-	{
-		prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(prpl);
-	}
+	free(serviceName);
+	free(username);
 
-	if (prpl_info && prpl_info->send_raw)
-	{
-		GString *enableQueueStanza = getEnableQueueStanza(account);
-		if (enableQueueStanza != NULL) 
-		{
-			syslog(LOG_INFO, "Enabling server queue");
-			prpl_info->send_raw(gc, enableQueueStanza->str, enableQueueStanza->len);
-			g_string_free(enableQueueStanza, TRUE);
-		}
-	}
+	return accountKey;
 }
 
-static void disableServerQueueForAccount(PurpleAccount *account)
+static const char* getField(struct json_object* message, const char* name)
 {
-	if (!account)
-	{
-		return;
-	}
-	PurplePluginProtocolInfo *prpl_info = NULL;
-	PurpleConnection *gc = purple_account_get_connection(account);
-	PurplePlugin *prpl = NULL;
-	
-	if (gc != NULL)
-	{
-		prpl = purple_connection_get_prpl(gc);
-	}
-
-	if (prpl != NULL)
-	{
-		prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(prpl);
-	}
-
-	if (prpl_info && prpl_info->send_raw)
+	struct json_object* val = json_object_object_get(message, name);
+	if (val)
 	{
-		GString *disableQueueStanza = getDisableQueueStanza(account);
-		if (disableQueueStanza != NULL) 
-		{
-			syslog(LOG_INFO, "Disabling server queue");
-			prpl_info->send_raw(gc, disableQueueStanza->str, disableQueueStanza->len);
-			g_string_free(disableQueueStanza, TRUE);
-		}
+		return json_object_get_string(val);
 	}
+	return NULL;
 }
 
-/**
- * Asking the gtalk server to enable/disable queueing of presence updates 
- * This is called when the screen is turned off (enalbe:true) or turned on (enable:false)
+/*
+ * A byte count for a payload. The json-c we build against on the device predates json_object_new_int64 (and the
+ * JSON_C_VERSION that comes with it), so there counts past 2 GB are clamped rather than wrapped.
  */
-static bool queuePresenceUpdates(bool enable)
-{
-	bool retVal;
-	bool success = TRUE;
-	PurpleAccount *account;
-	GList *onlineAccountKeys = NULL;
-	GList *iterator = NULL;
-	char *accountKey = "";
-	
-	onlineAccountKeys = g_hash_table_get_keys(onlineAccountData);
-	for (iterator = onlineAccountKeys; iterator != NULL; iterator = g_list_next(iterator))
-	{
-		accountKey = iterator->data;
-		account = g_hash_table_lookup(onlineAccountData, accountKey);
-		if (!account || strcmp(account->protocol_id, "prpl-jabber") != 0)
-		{
-			/*
-			 * enabling/disabling server queue is only supported by gtalk
-			 */
-			continue;
-		}
-		if (enable)
-		{
-			enableServerQueueForAccount(account);
-		}
-		else
-		{
-			disableServerQueueForAccount(account);
-		}
-	}
-	return TRUE;
-}
-
-static gboolean queuePresenceUpdatesTimer(gpointer data)
+static struct json_object* newJsonByteCount(guint64 bytes)
 {
-	if (currentDisplayState)
-	{
-		queuePresenceUpdates(FALSE);
-	}
-	return FALSE;
+#ifdef JSON_C_VERSION
+	return json_object_new_int64(MIN(bytes, G_MAXINT64));
+#else
+	return json_object_new_int(MIN(bytes, G_MAXINT32));
+#endif
 }
 
 static gboolean queuePresenceUpdatesForAccountTimerCallback(gpointer data)
 {
 	/*
-	 * if the display is still off, then enable the server queue for this account
+	 * if the display is still off, then the account goes idle as well
 	 */
 	if (!currentDisplayState)
 	{
-		char *accountKey = data;
-		PurpleAccount *account = g_hash_table_lookup(onlineAccountData, accountKey);
-		if (account != NULL)
-		{
-			enableServerQueueForAccount(account);
-		}
+		presenceStrategySetAccountIdle(data, TRUE);
 	}
 	return FALSE;
 }
 
-static void respondWithFullBuddyList(PurpleAccount *account, char *serviceName, char *myJavaFriendlyUsername)
+void respondWithFullBuddyList(PurpleAccount *account, char *serviceName, char *myJavaFriendlyUsername)
 {
 	if (!account || !myJavaFriendlyUsername || !serviceName)
 	{
-		syslog(LOG_INFO, "ERROR: respondWithFullBuddyList was passed NULL");
+		eventWorkerSyslog(LOG_INFO, "ERROR: respondWithFullBuddyList was passed NULL");
 		return;
 	}
 	GSList *buddyList = purple_find_buddies(account, NULL);
 	if (!buddyList)
 	{
-		syslog(LOG_INFO, "ERROR: the buddy list was NULL");
+		eventWorkerSyslog(LOG_INFO, "ERROR: the buddy list was NULL");
 	}
 
 	GString *jsonResponse = g_string_new("{\"serviceName\":\"");
@@ -608,7 +760,8 @@ static void respondWithFullBuddyList(PurpleAccount *account, char *serviceName,
 	PurpleBuddy *buddyToBeAdded = NULL;
 	PurpleGroup *group = NULL;
 
-	printf("\n\n\n\n\n\n ---------------- BUDDY LIST SIZE: %d----------------- \n\n\n\n\n\n", g_slist_length(buddyList));
+	ADAPTER_LOG(ADAPTER_LOG_DEBUG, "fullBuddyList", g_slist_length(buddyList), "serviceName", serviceName,
+			"username", myJavaFriendlyUsername);
 
 	bool firstItem = TRUE;
 
@@ -644,12 +797,7 @@ static void respondWithFullBuddyList(PurpleAccount *account, char *serviceName,
 		/*
 		 * Getting the avatar location
 		 */
-		PurpleBuddyIcon *icon = purple_buddy_get_icon(buddyToBeAdded);
-		char* buddyAvatarLocation = NULL;
-		if (icon != NULL)
-		{
-			buddyAvatarLocation = purple_buddy_icon_get_full_path(icon);
-		}
+		const char *buddyAvatarLocation = avatarStoreGetBuddyPath(buddyToBeAdded);
 
 		if (!firstItem)
 		{
@@ -664,32 +812,39 @@ static void respondWithFullBuddyList(PurpleAccount *account, char *serviceName,
 		json_object_object_add(payload, "buddyUsername", json_object_new_string(buddyToBeAdded->name));
 		json_object_object_add(payload, "displayName", json_object_new_string(buddyToBeAdded->alias));
 		json_object_object_add(payload, "avatarLocation", json_object_new_string((buddyAvatarLocation) ? buddyAvatarLocation : ""));
+		if (avatarStoreGetBuddyHash(buddyToBeAdded) != NULL)
+		{
+			json_object_object_add(payload, "avatarHash", json_object_new_string(avatarStoreGetBuddyHash(buddyToBeAdded)));
+		}
+		if (avatarStoreGetBuddyThumbnail(buddyToBeAdded, AVATAR_THUMBNAIL_SMALL) != NULL)
+		{
+			struct json_object *thumbnails = json_object_new_object();
+			int i;
+			for (i = 0; i < AVATAR_THUMBNAIL_COUNT; i++)
+			{
+				char size[12];
+				sprintf(size, "%u", avatarThumbnailSize(i));
+				json_object_object_add(thumbnails, size, json_object_new_string(avatarStoreGetBuddyThumbnail(buddyToBeAdded, i)));
+			}
+			json_object_object_add(payload, "avatarThumbnails", thumbnails);
+		}
 		json_object_object_add(payload, "customMessage", json_object_new_string((char*)customMessage));
 		json_object_object_add(payload, "availability", json_object_new_string(availabilityString));
 		json_object_object_add(payload, "groupName", json_object_new_string((char*)groupName));
 		g_string_append(jsonResponse, json_object_to_json_string(payload));
-		g_message(
-				"%s says: %s's presence: availability: '%s', custom message: '%s', avatar location: '%s', display name: '%s', group name:'%s'",
-				__FUNCTION__, buddyToBeAdded->name, availabilityString, customMessage, buddyAvatarLocation,
-				buddyToBeAdded->alias, groupName);
+		ADAPTER_LOG(ADAPTER_LOG_DEBUG, "buddyListEntry", 0, "buddy", buddyToBeAdded->name,
+				"availability", availabilityString, "customMessage", customMessage, "avatar", buddyAvatarLocation,
+				"displayName", buddyToBeAdded->alias, "group", groupName);
 		if (!is_error(payload)) 
 		{
 			json_object_put(payload);
 		}
-		if (buddyAvatarLocation)
-		{
-			g_free(buddyAvatarLocation);
-		}
 	}
 	g_string_append(jsonResponse, "]}");
-	LSError lserror;
-	LSErrorInit(&lserror);
-	bool retVal = LSSubscriptionReply(serviceHandle, "/getBuddyList", jsonResponse->str, &lserror);
-	if (!retVal)
-	{
-		LSErrorPrint(&lserror, stderr);
-	}
-	LSErrorFree(&lserror);
+	/*
+	 * Behind the presence updates already queued for the worker, so that none of them overtakes the full list
+	 */
+	eventWorkerReply("/getBuddyList", jsonResponse->str);
 	g_string_free(jsonResponse, TRUE);
 }
 
@@ -701,13 +856,31 @@ static void respondWithFullBuddyList(PurpleAccount *account, char *serviceName,
  * Callbacks
  */
 
-static void buddy_signed_on_off_cb(PurpleBuddy *buddy, gpointer data)
+/*
+ * Fires the presence__changed probe if it's attached. Getting the account key allocates, so it's not done otherwise.
+ */
+static void probePresenceChanged(PurpleBuddy *buddy, bool held)
+{
+	if (ADAPTER_PROBE_ENABLED(presence__changed))
+	{
+		char *accountKey = getAccountKeyFromPurpleAccount(purple_buddy_get_account(buddy));
+		ADAPTER_PROBE3(presence__changed, accountKey, buddy->name, held);
+		free(accountKey);
+	}
+}
+
+void buddy_signed_on_off_cb(PurpleBuddy *buddy, gpointer data)
 {
+	adapterStatsCount(STATS_PRESENCE_IN);
+	bool held = presenceStrategyHoldUpdate(buddy);
+	probePresenceChanged(buddy, held);
+	if (held)
+	{
+		return;
+	}
+
 	gboolean signed_on = GPOINTER_TO_INT(data);
 
-	LSError lserror;
-	LSErrorInit(&lserror);
-
 	PurpleAccount *account = purple_buddy_get_account(buddy);
 	char *serviceName = getServiceNameFromPrplProtocolId(account->protocol_id);
 	const char *myUsername = purple_account_get_username(account);
@@ -719,16 +892,10 @@ static void buddy_signed_on_off_cb(PurpleBuddy *buddy, gpointer data)
 	int newStatusPrimitive = purple_status_type_get_primitive(purple_status_get_type(activeStatus));
 	int newAvailabilityValue = getPalmAvailabilityFromPrplAvailability(newStatusPrimitive);
 	char availabilityString[2];
-	PurpleBuddyIcon *icon = purple_buddy_get_icon(buddy);
 	const char *customMessage = "";
-	char* buddyAvatarLocation = NULL;
+	const char *buddyAvatarLocation = avatarStoreGetBuddyPath(buddy);
 
 	sprintf(availabilityString, "%i", newAvailabilityValue);
-
-	if (icon != NULL)
-	{
-		buddyAvatarLocation = purple_buddy_icon_get_full_path(icon);
-	}
 		
 	if (buddy->name == NULL)
 	{
@@ -753,44 +920,46 @@ static void buddy_signed_on_off_cb(PurpleBuddy *buddy, gpointer data)
 		groupName = "";
 	}
 	
-	struct json_object *payload = json_object_new_object();
-	json_object_object_add(payload, "serviceName", json_object_new_string(serviceName));
-	json_object_object_add(payload, "username", json_object_new_string(myJavaFriendlyUsername));
-	json_object_object_add(payload, "buddyUsername", json_object_new_string(buddy->name));
-	json_object_object_add(payload, "displayName", json_object_new_string(buddy->alias));
-	json_object_object_add(payload, "avatarLocation", json_object_new_string((buddyAvatarLocation) ? buddyAvatarLocation : ""));
-	json_object_object_add(payload, "customMessage", json_object_new_string((char*)customMessage));
-	json_object_object_add(payload, "availability", json_object_new_string(availabilityString));
-	json_object_object_add(payload, "groupName", json_object_new_string((char*)groupName));
-
-	bool retVal = LSSubscriptionReply(serviceHandle, "/getBuddyList", json_object_to_json_string(payload), &lserror);
-	if (!retVal)
+	/*
+	 * The payload is built, sent and logged by the event worker
+	 */
+	const char *fields[PRESENCE_FIELD_COUNT];
+	fields[PRESENCE_SERVICE_NAME] = serviceName;
+	fields[PRESENCE_USERNAME] = myJavaFriendlyUsername;
+	fields[PRESENCE_BUDDY_USERNAME] = buddy->name;
+	fields[PRESENCE_DISPLAY_NAME] = buddy->alias;
+	fields[PRESENCE_AVATAR_LOCATION] = buddyAvatarLocation;
+	fields[PRESENCE_CUSTOM_MESSAGE] = customMessage;
+	fields[PRESENCE_AVAILABILITY] = availabilityString;
+	fields[PRESENCE_GROUP_NAME] = groupName;
+	fields[PRESENCE_AVATAR_HASH] = avatarStoreGetBuddyHash(buddy);
+	fields[PRESENCE_AVATAR_THUMBNAIL_SMALL] = avatarStoreGetBuddyThumbnail(buddy, AVATAR_THUMBNAIL_SMALL);
+	fields[PRESENCE_AVATAR_THUMBNAIL_LARGE] = avatarStoreGetBuddyThumbnail(buddy, AVATAR_THUMBNAIL_LARGE);
+	eventWorkerPost(EVENT_PRESENCE, __FUNCTION__, fields, PRESENCE_FIELD_COUNT);
+	adapterStatsCount(STATS_PRESENCE_OUT);
+	
+	if (serviceName)
 	{
-		LSErrorPrint(&lserror, stderr);
+		free(serviceName);
 	}
-	LSErrorFree(&lserror);
-	
-	g_message(
-			"%s says: %s's presence: availability: '%s', custom message: '%s', avatar location: '%s', display name: '%s', group name: '%s'",
-			__FUNCTION__, buddy->name, availabilityString, customMessage, buddyAvatarLocation, buddy->alias, groupName);
-	
 	if (myJavaFriendlyUsername)
 	{
 		free(myJavaFriendlyUsername);
 	}
-	if (!is_error(payload)) 
-	{
-		json_object_put(payload);
-	}	
-	if (buddyAvatarLocation)
-	{
-		g_free(buddyAvatarLocation);
-	}
 }
 
-static void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status, PurpleStatus *new_status,
-		gpointer unused)
+/*
+ * Sends the buddy's presence with new_status, unless the presence strategy holds it back
+ */
+static void postBuddyStatus(PurpleBuddy *buddy, PurpleStatus *new_status)
 {
+	bool held = presenceStrategyHoldUpdate(buddy);
+	probePresenceChanged(buddy, held);
+	if (held)
+	{
+		return;
+	}
+
 	/*
 	 * Getting the new availability
 	 */
@@ -808,19 +977,11 @@ static void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status
 		customMessage = "";
 	}
 
-	LSError lserror;
-	LSErrorInit(&lserror);
-
 	PurpleAccount *account = purple_buddy_get_account(buddy);
 	char *serviceName = getServiceNameFromPrplProtocolId(account->protocol_id);
 	char *username = getJavaFriendlyUsername(account->username, serviceName);
 
-	PurpleBuddyIcon *icon = purple_buddy_get_icon(buddy);
-	char* buddyAvatarLocation = NULL;	
-	if (icon != NULL)
-	{
-		buddyAvatarLocation = purple_buddy_icon_get_full_path(icon);
-	}
+	const char *buddyAvatarLocation = avatarStoreGetBuddyPath(buddy);
 
 	PurpleGroup *group = purple_buddy_get_group(buddy);
 	const char *groupName = purple_group_get_name(group);
@@ -835,25 +996,23 @@ static void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status
 		buddyName = "";
 	}
 
-	struct json_object *payload = json_object_new_object();
-	json_object_object_add(payload, "serviceName", json_object_new_string(serviceName));
-	json_object_object_add(payload, "username", json_object_new_string(username));
-	json_object_object_add(payload, "buddyUsername", json_object_new_string(buddyName));
-	json_object_object_add(payload, "avatarLocation", json_object_new_string((buddyAvatarLocation) ? buddyAvatarLocation : ""));
-	json_object_object_add(payload, "customMessage", json_object_new_string((char*)customMessage));
-	json_object_object_add(payload, "availability", json_object_new_string(availabilityString));
-	json_object_object_add(payload, "groupName", json_object_new_string((char*)groupName));
-
-	bool retVal = LSSubscriptionReply(serviceHandle, "/getBuddyList", json_object_to_json_string(payload), &lserror);
-	if (!retVal)
-	{
-		LSErrorPrint(&lserror, stderr);
-	}
-	LSErrorFree(&lserror);
-	
-	g_message(
-			"%s says: %s's presence: availability: '%s', custom message: '%s', avatar location: '%s', display name: '%s', group name: '%s'",
-			__FUNCTION__, buddy->name, availabilityString, customMessage, buddyAvatarLocation, buddy->alias, groupName);
+	/*
+	 * The payload is built, sent and logged by the event worker. There's no displayName in status updates.
+	 */
+	const char *fields[PRESENCE_FIELD_COUNT];
+	fields[PRESENCE_SERVICE_NAME] = serviceName;
+	fields[PRESENCE_USERNAME] = username;
+	fields[PRESENCE_BUDDY_USERNAME] = buddyName;
+	fields[PRESENCE_DISPLAY_NAME] = NULL;
+	fields[PRESENCE_AVATAR_LOCATION] = buddyAvatarLocation;
+	fields[PRESENCE_CUSTOM_MESSAGE] = customMessage;
+	fields[PRESENCE_AVAILABILITY] = availabilityString;
+	fields[PRESENCE_GROUP_NAME] = groupName;
+	fields[PRESENCE_AVATAR_HASH] = avatarStoreGetBuddyHash(buddy);
+	fields[PRESENCE_AVATAR_THUMBNAIL_SMALL] = avatarStoreGetBuddyThumbnail(buddy, AVATAR_THUMBNAIL_SMALL);
+	fields[PRESENCE_AVATAR_THUMBNAIL_LARGE] = avatarStoreGetBuddyThumbnail(buddy, AVATAR_THUMBNAIL_LARGE);
+	eventWorkerPost(EVENT_PRESENCE, __FUNCTION__, fields, PRESENCE_FIELD_COUNT);
+	adapterStatsCount(STATS_PRESENCE_OUT);
 	
 	if (serviceName)
 	{
@@ -863,24 +1022,39 @@ static void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status
 	{
 		free(username);
 	}
-	if (!is_error(payload)) 
-	{
-		json_object_put(payload);
-	}
-	if (buddyAvatarLocation)
-	{
-		g_free(buddyAvatarLocation);
-	}
 }
 
+void buddy_status_changed_cb(PurpleBuddy *buddy, PurpleStatus *old_status, PurpleStatus *new_status,
+		gpointer unused)
+{
+	adapterStatsCount(STATS_PRESENCE_IN);
+	postBuddyStatus(buddy, new_status);
+}
+
+/*
+ * The avatar store and the presence strategy re-send a buddy's presence through here. They only pass on what libpurple
+ * already told us of, so it isn't counted as incoming presence again.
+ */
 static void buddy_avatar_changed_cb(PurpleBuddy *buddy)
 {
-	PurpleStatus *activeStatus = purple_presence_get_active_status(purple_buddy_get_presence(buddy));
-	buddy_status_changed_cb(buddy, activeStatus, activeStatus, NULL);
+	postBuddyStatus(buddy, purple_presence_get_active_status(purple_buddy_get_presence(buddy)));
+}
+
+static void buddy_icon_changed_cb(PurpleBuddy *buddy, gpointer unused)
+{
+	adapterStatsCount(STATS_PRESENCE_IN);
+	buddy_avatar_changed_cb(buddy);
 }
 
 static bool displayEventHandler(LSHandle *sh , LSMessage *message, void *ctx)
 {
+    static WakeupSource *wakeupSource = NULL;
+    if (wakeupSource == NULL)
+    {
+    	wakeupSource = wakeupStatsGetSource(WAKEUP_BUS, displayEventHandler, "com.palm.display/control/status");
+    }
+    wakeupStatsCount(wakeupSource);
+
     const char *payload = LSMessageGetPayload(message);
     struct json_object *params = json_tokener_parse(payload);
     if (is_error(params)) goto end;
@@ -919,27 +1093,21 @@ static bool displayEventHandler(LSHandle *sh , LSMessage *message, void *ctx)
 		if (newDisplayState != currentDisplayState)
 		{
 			currentDisplayState = newDisplayState;
-			if (currentDisplayState)
-			{
-				/*
-				 * display has turned on, therefore we disable and flush the queue (after DISABLE_QUEUE_TIMEOUT_SECONDS seconds for perf reasons)
-				 */
-				purple_timeout_add_seconds(DISABLE_QUEUE_TIMEOUT_SECONDS, queuePresenceUpdatesTimer, NULL);
-			}
-			else
-			{
-				/*
-				 * display has turned off, therefore we enable the queue
-				 */
-				queuePresenceUpdates(TRUE);
-			}
+			wakeupStatsSetDisplayOn(currentDisplayState);
+			/*
+			 * display off enables the queue; display on disables and flushes it, unless the display goes off again
+			 * as quickly as it usually does
+			 */
+			displayHysteresisDisplayChanged(currentDisplayState);
 		}
     }
     else 
     {
     	currentDisplayState = TRUE;
+    	wakeupStatsSetDisplayOn(TRUE);
     	registeredForDisplayEvents = FALSE;
-    	queuePresenceUpdates(FALSE);
+    	/* no display events are coming, so there's nothing to wait for; this isn't a wake either */
+    	displayHysteresisSetIdle(FALSE);
     }
 
 end:
@@ -947,6 +1115,17 @@ end:
     return TRUE;
 }
 
+/*
+ * Fails the messages and drops the status changes (and held back presence updates) that are waiting for an account
+ * that just went offline
+ */
+static void dropQueuedOperations(const char *accountKey, const char *errorCode, const char *errorText)
+{
+	outboundQueueFail(accountKey, errorCode, errorText);
+	rateLimiterCancel(accountKey);
+	presenceStrategyRemoveAccount(accountKey);
+}
+
 static void account_logged_in(PurpleConnection *gc, gpointer unused)
 {
 	void *blist_handle = purple_blist_get_handle();
@@ -955,7 +1134,7 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 	PurpleAccount *loggedInAccount = purple_connection_get_account(gc);
 	g_return_if_fail(loggedInAccount != NULL);
 
-	char *accountKey = getAccountKeyFromPurpleAccount(loggedInAccount);
+	char *accountKey = getInternedAccountKeyFromPurpleAccount(loggedInAccount);
 
 	if (g_hash_table_lookup(onlineAccountData, accountKey) != NULL)
 	{
@@ -970,11 +1149,13 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 
 	purple_timeout_remove(timerHandle);
 	g_hash_table_remove(accountLoginTimers, accountKey);
+	loginTraceFinish(accountKey, "connected", NULL);
 
 	g_hash_table_insert(onlineAccountData, accountKey, loggedInAccount);
 	g_hash_table_remove(pendingAccountData, accountKey);
+	presenceStrategyAddAccount(accountKey, loggedInAccount);
 
-	syslog(LOG_INFO, "Account connected...");
+	eventWorkerSyslog(LOG_INFO, "Account connected...");
 
 	char *serviceName = getServiceNameFromPrplProtocolId(loggedInAccount->protocol_id);
 	char *myJavaFriendlyUsername = getJavaFriendlyUsername(loggedInAccount->username, serviceName);
@@ -988,14 +1169,19 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 	LSError lserror;
 	LSErrorInit(&lserror);
 
-	LSMessage *message = g_hash_table_lookup(loginMessages, getAccountKeyFromPurpleAccount(loggedInAccount));
-	bool retVal = LSMessageReply(serviceHandle, message, jsonResponse->str, &lserror);
+	LSMessage *message = g_hash_table_lookup(loginMessages, accountKey);
+	bool retVal = methodReply(serviceHandle, message, jsonResponse->str, &lserror);
 
 	if (!retVal)
 	{
 		LSErrorPrint(&lserror, stderr);
 	}
 
+	/*
+	 * Send whatever was queued up while we were signing on
+	 */
+	outboundQueueFlush(accountKey, loggedInAccount);
+
 	if (registeredForPresenceUpdateSignals == FALSE)
 	{
 		purple_signal_connect(blist_handle, "buddy-status-changed", &handle, PURPLE_CALLBACK(buddy_status_changed_cb),
@@ -1004,8 +1190,8 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 				GINT_TO_POINTER(TRUE));
 		purple_signal_connect(blist_handle, "buddy-signed-off", &handle, PURPLE_CALLBACK(buddy_signed_on_off_cb),
 				GINT_TO_POINTER(FALSE));
-		purple_signal_connect(blist_handle, "buddy-icon-changed", &handle, PURPLE_CALLBACK(buddy_avatar_changed_cb),
-				GINT_TO_POINTER(FALSE));
+		purple_signal_connect(blist_handle, "buddy-icon-changed", &handle, PURPLE_CALLBACK(buddy_icon_changed_cb),
+				NULL);
 		registeredForPresenceUpdateSignals = TRUE;
 	}
 	
@@ -1027,7 +1213,7 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 			guint handle = purple_timeout_add_seconds(POST_LOGIN_WAIT_SECONDS, queuePresenceUpdatesForAccountTimerCallback, accountKey);
 			if (!handle)
 			{
-				syslog(LOG_INFO, "purple_timeout_add_seconds failed in account_logged_in");
+				eventWorkerSyslog(LOG_INFO, "purple_timeout_add_seconds failed in account_logged_in");
 			}
 		}
 	}
@@ -1035,23 +1221,34 @@ static void account_logged_in(PurpleConnection *gc, gpointer unused)
 error:
 	LSErrorFree(&lserror);
 	g_string_free(jsonResponse, TRUE);
+	free(serviceName);
+	free(myJavaFriendlyUsername);
 }
 
 static void account_signed_off_cb(PurpleConnection *gc, void *data)
 {
-	syslog(LOG_INFO, "account_signed_off_cb");
+	eventWorkerSyslog(LOG_INFO, "account_signed_off_cb");
+
+	g_hash_table_remove(connectionWakeupSources, gc);
 
 	PurpleAccount *account = purple_connection_get_account(gc);
 	g_return_if_fail(account != NULL);
 
-	char *accountKey = getAccountKeyFromPurpleAccount(account);
+	/*
+	 * Don't hold on to conversations of an account that's gone
+	 */
+	conversationCacheRemoveAccount(account);
+
+	char *accountKey = getInternedAccountKeyFromPurpleAccount(account);
 	if (g_hash_table_lookup(onlineAccountData, accountKey) != NULL)
 	{
 		g_hash_table_remove(onlineAccountData, accountKey);
+		dropQueuedOperations(accountKey, "11", "The account was logged out");
 	}
 	else if (g_hash_table_lookup(pendingAccountData, accountKey) != NULL)
 	{
 		g_hash_table_remove(pendingAccountData, accountKey);
+		dropQueuedOperations(accountKey, "11", "The account was logged out before it finished logging in");
 	}
 	else
 	{
@@ -1060,7 +1257,7 @@ static void account_signed_off_cb(PurpleConnection *gc, void *data)
 	g_hash_table_remove(ipAddressesBoundTo, accountKey);
 	//g_hash_table_remove(connectionTypeData, accountKey);
 
-	syslog(LOG_INFO, "Account disconnected...");
+	eventWorkerSyslog(LOG_INFO, "Account disconnected...");
 
 	if (g_hash_table_lookup(offlineAccountData, accountKey) == NULL)
 	{
@@ -1085,7 +1282,7 @@ static void account_signed_off_cb(PurpleConnection *gc, void *data)
 		LSError lserror;
 		LSErrorInit(&lserror);
 
-		bool retVal = LSMessageReply(serviceHandle, message, jsonResponse->str, &lserror);
+		bool retVal = methodReply(serviceHandle, message, jsonResponse->str, &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -1097,6 +1294,31 @@ static void account_signed_off_cb(PurpleConnection *gc, void *data)
 	}
 }
 
+/*
+ * The connection for a login was created and is about to connect
+ */
+static void account_signing_on_cb(PurpleConnection *gc, gpointer unused)
+{
+	PurpleAccount *account = purple_connection_get_account(gc);
+	g_return_if_fail(account != NULL);
+
+	char *accountKey = getInternedAccountKeyFromPurpleAccount(account);
+	/* before the prpl's login adds the connection's first watch */
+	g_hash_table_insert(connectionWakeupSources, gc, wakeupStatsGetSource(WAKEUP_IO, account, accountKey));
+	loginTraceMark(accountKey, "signingOn");
+}
+
+/*
+ * The prpl's login went one step further: each step is a phase of the login's trace
+ */
+static void connect_progress_cb(PurpleConnection *gc, const char *text, size_t step, size_t step_count)
+{
+	PurpleAccount *account = purple_connection_get_account(gc);
+	g_return_if_fail(account != NULL);
+
+	loginTraceMark(getInternedAccountKeyFromPurpleAccount(account), text);
+}
+
 /*
  * This callback is called if a) the login attempt failed, or b) login was successful but the session was closed 
  * (e.g. connection problems, etc).
@@ -1104,13 +1326,13 @@ static void account_signed_off_cb(PurpleConnection *gc, void *data)
 static void account_login_failed(PurpleConnection *gc, PurpleConnectionError type, const gchar *description,
 		gpointer unused)
 {
-	syslog(LOG_INFO, "account_login_failed is called with description %s", description);
+	eventWorkerSyslog(LOG_INFO, "account_login_failed is called with description %s", description);
 
 	PurpleAccount *account = purple_connection_get_account(gc);
 	g_return_if_fail(account != NULL);
 
 	gboolean loggedOut = FALSE;
-	char *accountKey = getAccountKeyFromPurpleAccount(account);
+	char *accountKey = getInternedAccountKeyFromPurpleAccount(account);
 	if (g_hash_table_lookup(onlineAccountData, accountKey) != NULL)
 	{
 		/* 
@@ -1119,6 +1341,7 @@ static void account_login_failed(PurpleConnection *gc, PurpleConnectionError typ
 		 * get closed.
 		 */
 		loggedOut = TRUE;
+		dropQueuedOperations(accountKey, "11", "The account was disconnected");
 	}
 	else
 	{
@@ -1141,6 +1364,8 @@ static void account_login_failed(PurpleConnection *gc, PurpleConnectionError typ
 		else
 		{
 			g_hash_table_remove(pendingAccountData, accountKey);
+			loginTraceFinish(accountKey, "failed", description);
+			dropQueuedOperations(accountKey, "11", "The account failed to log in");
 		}
 	}
 
@@ -1169,20 +1394,22 @@ static void account_login_failed(PurpleConnection *gc, PurpleConnectionError typ
 	g_string_append(jsonResponse, "\",  \"localIpAddress\":\"");
 	g_string_append(jsonResponse, accountBoundToIpAddress);
 	g_string_append(jsonResponse, "\", \"errorText\":\"");
-	g_string_append(jsonResponse, g_strescape(description, NULL));
+	char *escapedDescription = g_strescape(description, NULL);
+	g_string_append(jsonResponse, escapedDescription);
+	g_free(escapedDescription);
 	if (loggedOut)
 	{
 		g_string_append(jsonResponse, "\", \"connectionStatus\":\"loggedOut\", \"connectionType\":\"");
 		g_string_append(jsonResponse, connectionType);
 		g_string_append(jsonResponse, "\"}");
-		syslog(LOG_INFO, "We were logged out. Reason: %s, prpl error code: %i", description, type);
+		eventWorkerSyslog(LOG_INFO, "We were logged out. Reason: %s, prpl error code: %i", description, type);
 	}
 	else
 	{
 		g_string_append(jsonResponse, "\", \"connectionType\":\"");
 		g_string_append(jsonResponse, connectionType);
 		g_string_append(jsonResponse, "\"}");
-		syslog(LOG_INFO, "Login failed. Reason: \"%s\", prpl error code: %i", description, type);
+		eventWorkerSyslog(LOG_INFO, "Login failed. Reason: \"%s\", prpl error code: %i", description, type);
 	}
 	g_hash_table_remove(onlineAccountData, accountKey);
 	g_hash_table_remove(ipAddressesBoundTo, accountKey);
@@ -1202,7 +1429,7 @@ static void account_login_failed(PurpleConnection *gc, PurpleConnectionError typ
 	LSMessage *message = g_hash_table_lookup(loginMessages, accountKey);
 	if (message != NULL)
 	{
-		bool retVal = LSMessageReply(serviceHandle, message, jsonResponse->str, &lserror);
+		bool retVal = methodReplyError(serviceHandle, message, jsonResponse->str, &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -1212,15 +1439,17 @@ static void account_login_failed(PurpleConnection *gc, PurpleConnectionError typ
 	}
 	LSErrorFree(&lserror);
 	g_string_free(jsonResponse, TRUE);
-	//free(accountKey);
+	free(serviceName);
+	free(myJavaFriendlyUsername);
 }
 
 static void account_status_changed(PurpleAccount *account, PurpleStatus *old, PurpleStatus *new, gpointer data)
 {
-	printf("\n\n ACCOUNT STATUS CHANGED \n\n");
+	ADAPTER_LOG(ADAPTER_LOG_DEBUG, "accountStatusChanged", 0, "account", purple_account_get_username(account),
+			"from", purple_status_get_id(old), "to", purple_status_get_id(new));
 }
 
-static void incoming_message_cb(PurpleConversation *conv, const char *who, const char *alias, const char *message,
+void incoming_message_cb(PurpleConversation *conv, const char *who, const char *alias, const char *message,
 		PurpleMessageFlags flags, time_t mtime)
 {
 	/*
@@ -1241,14 +1470,17 @@ static void incoming_message_cb(PurpleConversation *conv, const char *who, const
 	}
 
 	PurpleAccount *account = purple_conversation_get_account(conv);
+	conversationCacheTouch(conv);
 
 	char *serviceName = getServiceNameFromPrplProtocolId(account->protocol_id);
 	char *username = getJavaFriendlyUsername(account->username, serviceName);
+	char *usernameFromStripped = NULL;
+	char *accountKey = NULL;
 
 	if (strcmp(username, usernameFrom) == 0)
 	{
 		/* We get notified even though we sent the message. Just ignore it */
-		return;
+		goto end;
 	}
 
 	if (strcmp(serviceName, "aol") == 0 && (strcmp(usernameFrom, "aolsystemmsg") == 0 || strcmp(usernameFrom,
@@ -1257,28 +1489,31 @@ static void incoming_message_cb(PurpleConversation *conv, const char *who, const
 		/*
 		 * ignore messages from the annoying aolsystemmsg telling us that we're logged in somewhere else
 		 */
-		return;
+		goto end;
 	}
 
-	char *usernameFromStripped = stripResourceFromGtalkUsername(usernameFrom);
-
-	LSError lserror;
-	LSErrorInit(&lserror);
-
-	struct json_object *payload = json_object_new_object();
-	json_object_object_add(payload, "serviceName", json_object_new_string(serviceName));
-	json_object_object_add(payload, "username", json_object_new_string(username));
-	json_object_object_add(payload, "usernameFrom", json_object_new_string(usernameFromStripped));
-	json_object_object_add(payload, "messageText", json_object_new_string((char*)message));
+	usernameFromStripped = stripResourceFromGtalkUsername(usernameFrom);
+	accountKey = getAccountKey(username, serviceName);
+	char seq[16];
+	g_snprintf(seq, sizeof(seq), "%u", ++lastIncomingMessageSeq);
+
+	const char *fields[MESSAGE_FIELD_COUNT];
+	fields[MESSAGE_SERVICE_NAME] = serviceName;
+	fields[MESSAGE_USERNAME] = username;
+	fields[MESSAGE_USERNAME_FROM] = usernameFromStripped;
+	fields[MESSAGE_TEXT] = message;
+	fields[MESSAGE_ACCOUNT_KEY] = accountKey;
+	fields[MESSAGE_SEQ] = seq;
+	fields[MESSAGE_SEQ_EPOCH] = incomingMessageSeqEpochText;
+	ADAPTER_PROBE3(message__incoming, accountKey, usernameFromStripped, strlen(message));
+	eventWorkerPost(EVENT_INCOMING_MESSAGE, __FUNCTION__, fields, MESSAGE_FIELD_COUNT);
+	adapterStatsCount(STATS_MESSAGES_IN);
 
-	bool retVal = LSSubscriptionReply(serviceHandle, "/registerForIncomingMessages",
-			json_object_to_json_string(payload), &lserror);
-	if (!retVal)
+end:
+	if (accountKey)
 	{
-		LSErrorPrint(&lserror, stderr);
+		free(accountKey);
 	}
-
-	LSErrorFree(&lserror);
 	if (serviceName)
 	{
 		free(serviceName);
@@ -1291,10 +1526,6 @@ static void incoming_message_cb(PurpleConversation *conv, const char *who, const
 	{
 		free(usernameFromStripped);
 	}
-	if (!is_error(payload)) 
-	{
-		json_object_put(payload);
-	}
 }
 
 static gboolean connectTimeoutCallback(gpointer data)
@@ -1307,7 +1538,7 @@ static gboolean connectTimeoutCallback(gpointer data)
 		 * If the account is not pending anymore (which means login either already failed or succeeded) 
 		 * then we shouldn't have gotten to this point since we should have cancelled the timer
 		 */
-		syslog(LOG_INFO,
+		eventWorkerSyslog(LOG_INFO,
 				"WARNING: we shouldn't have gotten to connectTimeoutCallback since login had already failed/succeeded");
 		return FALSE;
 	}
@@ -1320,6 +1551,8 @@ static gboolean connectTimeoutCallback(gpointer data)
 	g_hash_table_remove(accountLoginTimers, accountKey);
 	g_hash_table_remove(pendingAccountData, accountKey);
 	g_hash_table_remove(ipAddressesBoundTo, accountKey);
+	loginTraceFinish(accountKey, "timeout", NULL);
+	dropQueuedOperations(accountKey, "11", "Connection timed out");
 
 	purple_account_disconnect(account);
 
@@ -1347,7 +1580,7 @@ static gboolean connectTimeoutCallback(gpointer data)
 	LSMessage *message = g_hash_table_lookup(loginMessages, accountKey);
 	if (message != NULL)
 	{
-		bool retVal = LSMessageReply(serviceHandle, message, jsonResponse->str, &lserror);
+		bool retVal = methodReplyError(serviceHandle, message, jsonResponse->str, &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -1358,7 +1591,6 @@ static gboolean connectTimeoutCallback(gpointer data)
 	LSErrorFree(&lserror);
 	free(serviceName);
 	free(username);
-	free(accountKey);
 	g_string_free(jsonResponse, TRUE);
 	return FALSE;
 }
@@ -1380,15 +1612,20 @@ static GHashTable* getClientInfo(void)
 	return clientInfo;
 }
 
-static void initializeLibpurple()
+void initializeLibpurple(void)
 {
 	signal(SIGCHLD, SIG_IGN);
 
 	/* Set a custom user directory (optional) */
 	purple_util_set_user_dir(CUSTOM_USER_DIRECTORY);
 
-	/* We do not want any debugging for now to keep the noise to a minimum. */
-	purple_debug_set_enabled(TRUE);
+	/*
+	 * Debug lines go to a ring that getPurpleDebugLog dumps, not to stdout. Only warnings and errors are formatted until
+	 * setPurpleDebugFilter asks for more.
+	 */
+	purple_debug_set_enabled(FALSE);
+	purpleDebugLogInit(PURPLE_DEBUG_LOG_BUDGET_BYTES, PURPLE_DEBUG_WARNING);
+	purple_debug_set_ui_ops(purpleDebugLogGetUiOps());
 
 	/* Set the core-uiops, which is used to
 	 * 	- initialize the ui specific preferences.
@@ -1399,6 +1636,8 @@ static void initializeLibpurple()
 	purple_core_set_ui_ops(&adapterCoreUIOps);
 
 	purple_eventloop_set_ui_ops(&adapterEventLoopUIOps);
+	connectionWakeupSources = g_hash_table_new(g_direct_hash, g_direct_equal);
+	sslConnections = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	/* purple_core_init () calls purple_dbus_init ().  We don't want libpurple's
 	 * own dbus server, so let's kill it here.  Ideally, it would never be
@@ -1409,18 +1648,38 @@ static void initializeLibpurple()
 
 	if (!purple_core_init(UI_ID))
 	{
-		syslog(LOG_INFO, "libpurple initialization failed.");
+		eventWorkerSyslog(LOG_INFO, "libpurple initialization failed.");
 		abort();
 	}
 
+	wrapSslOps();
+
 	/* Create and load the buddylist. */
 	purple_set_blist(purple_blist_new());
 	purple_blist_load();
 
-	purple_buddy_icons_set_cache_dir("/var/luna/data/im-avatars");
+	/*
+	 * Buddy icons are written by the avatar store. It has to see an icon change before the presence update goes out.
+	 */
+	static int handle;
+	avatarStoreInit(avatarDirectory, AVATAR_STORE_BUDGET_BYTES, AVATAR_THUMBNAIL_QUEUE_DEPTH, buddy_avatar_changed_cb);
+	purple_signal_connect(purple_blist_get_handle(), "buddy-icon-changed", &handle,
+			PURPLE_CALLBACK(avatarStoreUpdateBuddy), NULL);
+	purple_signal_connect(purple_blist_get_handle(), "buddy-removed", &handle,
+			PURPLE_CALLBACK(avatarStoreRemoveBuddy), NULL);
+
+	conversationCacheInit(MAX_CONVERSATIONS_PER_ACCOUNT, CONVERSATION_IDLE_SECONDS);
+	loginTraceInit(LOGIN_TRACE_HISTORY);
+
+	/*
+	 * Presence updates held back while the display was off go out as the buddy's current presence
+	 */
+	presenceStrategyInit(buddy_avatar_changed_cb);
+	displayHysteresisInit(DISABLE_QUEUE_TIMEOUT_SECONDS * 1000, DISABLE_QUEUE_TIMEOUT_SECONDS * 1000,
+			presenceStrategySetIdle, presenceStrategySetLocalIdle);
 
 	libpurpleInitialized = TRUE;
-	syslog(LOG_INFO, "libpurple initialized.\n");
+	eventWorkerSyslog(LOG_INFO, "libpurple initialized.\n");
 }
 /*
  * End of libpurple initialization methods
@@ -1441,6 +1700,8 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 	const char *username = NULL;
 	const char *password = NULL;
 	int availability = 0;
+	int maxConversations = 0;
+	bool lazyAvatars = FALSE;
 	const char *customMessage = NULL;
 	const char *localIpAddress = NULL;
 	const char *connectionType = NULL;
@@ -1457,7 +1718,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 
 	boolean invalidParameters = TRUE;
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	char *payload = strdup(LSMessageGetPayload(message));
 
@@ -1497,6 +1758,8 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 	}
 
 	availability = json_object_get_int(json_object_object_get(params, "availability"));
+	maxConversations = json_object_get_int(json_object_object_get(params, "maxConversations"));
+	lazyAvatars = json_object_get_boolean(json_object_object_get(params, "lazyAvatars"));
 
 	customMessage = getField(params, "customMessage");
 	if (!customMessage)
@@ -1526,7 +1789,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 
 	invalidParameters = FALSE;
 
-	syslog(LOG_INFO, "Parameters: servicename %s, connectionType %s", serviceName, connectionType);
+	eventWorkerSyslog(LOG_INFO, "Parameters: servicename %s, connectionType %s", serviceName, connectionType);
 
 	if (libpurpleInitialized == FALSE)
 	{
@@ -1536,7 +1799,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 	/* libpurple variables */
 	prplProtocolId = getPrplProtocolIdFromServiceName(serviceName);
 	transportFriendlyUserName = getPrplFriendlyUsername(serviceName, username);
-	accountKey = getAccountKey(username, serviceName);
+	accountKey = getInternedAccountKey(username, serviceName);
 
 	myJavaFriendlyUsername = getJavaFriendlyUsername(username, serviceName);
 
@@ -1576,7 +1839,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 			 */
 			if (accountIsAlreadyPending)
 			{
-				syslog(LOG_INFO, "We were already in the process of logging in");
+				eventWorkerSyslog(LOG_INFO, "We were already in the process of logging in");
 				/* 
 				 * keep the message in order to respond to it in either account_logged_in or account_login_failed 
 				 */
@@ -1597,14 +1860,14 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 			}
 			else if (accountIsAlreadyOnline)
 			{
-				syslog(LOG_INFO, "We were already logged in to the requested account");
+				eventWorkerSyslog(LOG_INFO, "We were already logged in to the requested account");
 				json_object_object_add(responsePayload, "accountWasAlreadyLoggedIn", json_object_new_boolean(TRUE));
 				json_object_object_add(responsePayload, "returnValue", json_object_new_boolean(TRUE));
 
 				LSError lserror;
 				LSErrorInit(&lserror);
 
-				bool retVal = LSMessageReply(serviceHandle, message, json_object_to_json_string(responsePayload),
+				bool retVal = methodReply(serviceHandle, message, json_object_to_json_string(responsePayload),
 						&lserror);
 				if (!retVal)
 				{
@@ -1622,7 +1885,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 			/*
 			 * We're not using the right interface. Close the current connection for this account and create a new one
 			 */
-			syslog(LOG_INFO,
+			eventWorkerSyslog(LOG_INFO,
 					"We have to logout and login again since the local IP address has changed. Logging out from account");
 			/*
 			 * Once the current connection is closed we don't want to let java know that the account was disconnected. 
@@ -1700,18 +1963,30 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 			 */
 			purple_account_set_string(account, "connect_server", "talk.google.com");
 		}
-		syslog(LOG_INFO, "Logging in...");
+		if (configureAccount != NULL)
+		{
+			configureAccount(account);
+		}
+		eventWorkerSyslog(LOG_INFO, "Logging in...");
 
 		free(transportFriendlyUserName);
 
 		purple_account_set_password(account, password);
 
+		if (maxConversations > 0)
+		{
+			conversationCacheSetLimit(account, maxConversations);
+		}
+		avatarStoreSetLazy(account, lazyAvatars);
+
 		if (registeredForAccountSignals == FALSE)
 		{
 			static int handle;
 			/*
 			 * Listen for a number of different signals:
 			 */
+			purple_signal_connect(purple_connections_get_handle(), "signing-on", &handle,
+					PURPLE_CALLBACK(account_signing_on_cb), NULL);
 			purple_signal_connect(purple_connections_get_handle(), "signed-on", &handle,
 					PURPLE_CALLBACK(account_logged_in), NULL);
 			purple_signal_connect(purple_connections_get_handle(), "signed-off", &handle,
@@ -1743,7 +2018,9 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 		}
 
 		/* It's necessary to enable the account first. */
+		loginTraceStart(accountKey, serviceName);
 		purple_account_set_enabled(account, UI_ID, TRUE);
+		loginTraceMark(accountKey, "enabled");
 
 		void *blist_handle = purple_blist_get_handle();
 		/* Now, to connect the account, create a status and activate it. */
@@ -1758,6 +2035,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 		PurpleSavedStatus *savedStatus = purple_savedstatus_new(NULL, prim);
 		purple_savedstatus_set_message(savedStatus, customMessage);
 		purple_savedstatus_activate_for_account(savedStatus, account);
+		loginTraceMark(accountKey, "statusActivated");
 
 		json_object_object_add(responsePayload, "returnValue", json_object_new_boolean(TRUE));
 	}
@@ -1778,7 +2056,7 @@ static bool login(LSHandle* lshandle, LSMessage *message, void *ctx)
 			json_object_object_add(responsePayload, "errorText",
 					json_object_new_string("Invalid parameter. Please double check the passed parameters."));
 		}
-		retVal = LSMessageReturn(lshandle, message, json_object_to_json_string(responsePayload), &lserror);
+		retVal = methodReturnError(lshandle, message, json_object_to_json_string(responsePayload), &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -1820,7 +2098,7 @@ static bool logout(LSHandle* lshandle, LSMessage *message, void *ctx)
 	const char *serviceName = "";
 	const char *username = "";
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	// get the message's payload (json object)
 	json_t *object = LSMessageGetPayloadJSON(message);
@@ -1845,9 +2123,10 @@ static bool logout(LSHandle* lshandle, LSMessage *message, void *ctx)
 		goto error;
 	}
 
-	syslog(LOG_INFO, "Parameters: servicename %s", serviceName);
+	eventWorkerSyslog(LOG_INFO, "Parameters: servicename %s", serviceName);
 
 	char *accountKey = getAccountKey(username, serviceName);
+	loginTraceFinish(accountKey, "cancelled", NULL);
 
 	PurpleAccount *accountTologoutFrom = g_hash_table_lookup(onlineAccountData, accountKey);
 	if (accountTologoutFrom == NULL)
@@ -1862,7 +2141,7 @@ static bool logout(LSHandle* lshandle, LSMessage *message, void *ctx)
 			g_string_append(
 					jsonResponse,
 					"\",  \"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"Trying to logout from an account that is not logged in\"}");
-			bool retVal = LSMessageReturn(lshandle, message, jsonResponse->str, &lserror);
+			bool retVal = methodReturnError(lshandle, message, jsonResponse->str, &lserror);
 			if (!retVal)
 			{
 				LSErrorPrint(&lserror, stderr);
@@ -1876,14 +2155,14 @@ static bool logout(LSHandle* lshandle, LSMessage *message, void *ctx)
 
 	/* keep the message in order to respond to it in either account_logged_in or account_login_failed */
 	LSMessageRef(message);
-	g_hash_table_insert(logoutMessages, getAccountKeyFromPurpleAccount(accountTologoutFrom), message);
+	g_hash_table_insert(logoutMessages, getInternedAccountKeyFromPurpleAccount(accountTologoutFrom), message);
 
 	purple_account_disconnect(accountTologoutFrom);
 
 	error: if (!success)
 	{
 		retVal
-				= LSMessageReturn(
+				= methodReturnError(
 						lshandle,
 						message,
 						"{\"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"Invalid parameter. Please double check the passed parameters.\"}",
@@ -1902,6 +2181,104 @@ static bool logout(LSHandle* lshandle, LSMessage *message, void *ctx)
 	return TRUE;
 }
 
+/*
+ * Sets the account's status. availability < 0 keeps the current status type and a NULL customMessage keeps the
+ * current custom message.
+ */
+static void setAccountStatus(PurpleAccount *account, int availability, const char *customMessage)
+{
+	PurpleStatus *status = purple_account_get_active_status(account);
+	if (customMessage == NULL)
+	{
+		customMessage = purple_value_get_string(purple_status_get_attr_value(status, "message"));
+		if (customMessage == NULL)
+		{
+			customMessage = "";
+		}
+	}
+
+	PurpleStatusType *type;
+	if (availability < 0)
+	{
+		type = purple_status_get_type(status);
+	}
+	else
+	{
+		type = purple_account_get_status_type_with_primitive(account,
+				getPrplAvailabilityFromPalmAvailability(availability));
+	}
+
+	GList *attrs = NULL;
+	attrs = g_list_append(attrs, "message");
+	attrs = g_list_append(attrs, (char*)customMessage);
+	purple_account_set_status_list(account, purple_status_type_get_id(type), TRUE, attrs);
+	g_list_free(attrs);
+}
+
+static void freePendingStatusChange(gpointer data)
+{
+	PendingStatusChange *change = data;
+	g_free(change->accountKey);
+	g_free(change->customMessage);
+	g_free(change);
+}
+
+/*
+ * The rate limiter cancelled the status change (the account went offline)
+ */
+static void dropPendingStatusChange(gpointer data)
+{
+	PendingStatusChange *change = data;
+	g_hash_table_remove(pendingStatusChanges, change->accountKey);
+}
+
+static void applyPendingStatusChange(const char *accountKey, gpointer data)
+{
+	PendingStatusChange *change = data;
+	PurpleAccount *account = g_hash_table_lookup(onlineAccountData, accountKey);
+	if (account != NULL)
+	{
+		setAccountStatus(account, change->availability, change->customMessage);
+	}
+	g_hash_table_remove(pendingStatusChanges, change->accountKey);
+}
+
+/*
+ * Changes the account's status now if the rate limiter lets us, otherwise later. Changes requested while an earlier one
+ * is still waiting are merged into it, so only the latest availability and custom message reach the server.
+ * Returns TRUE if the change was delayed.
+ */
+static bool requestStatusChange(const char *accountKey, const char *serviceName, PurpleAccount *account,
+		int availability, const char *customMessage)
+{
+	PendingStatusChange *change = g_hash_table_lookup(pendingStatusChanges, accountKey);
+	if (change == NULL)
+	{
+		if (rateLimiterTryAcquire(accountKey, serviceName, RATE_CLASS_STATUS))
+		{
+			setAccountStatus(account, availability, customMessage);
+			return FALSE;
+		}
+		change = g_new0(PendingStatusChange, 1);
+		change->accountKey = g_strdup(accountKey);
+		change->availability = -1;
+		g_hash_table_insert(pendingStatusChanges, change->accountKey, change);
+		rateLimiterWait(accountKey, serviceName, RATE_CLASS_STATUS, applyPendingStatusChange, change,
+				dropPendingStatusChange);
+	}
+
+	if (availability >= 0)
+	{
+		change->availability = availability;
+	}
+	if (customMessage != NULL)
+	{
+		g_free(change->customMessage);
+		change->customMessage = g_strdup(customMessage);
+	}
+	return TRUE;
+}
+
 static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 {
 	bool retVal;
@@ -1914,7 +2291,7 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 	const char *username = "";
 	int availability = 0;
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	// get the message's payload (json object)
 	json_t *object = LSMessageGetPayloadJSON(message);
@@ -1946,7 +2323,7 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 		goto error;
 	}
 
-	syslog(LOG_INFO, "Parameters: serviceName %s, availability %i", serviceName, availability);
+	eventWorkerSyslog(LOG_INFO, "Parameters: serviceName %s, availability %i", serviceName, availability);
 
 	char *accountKey = getAccountKey(username, serviceName);
 
@@ -1955,10 +2332,10 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 	if (account == NULL)
 	{
 		//this should never happen based on MessagingService's logic
-		syslog(LOG_INFO,
+		eventWorkerSyslog(LOG_INFO,
 				"setMyAvailability was called on an account that wasn't logged in. serviceName: %s, availability: %i",
 				serviceName, availability);
-		retVal = LSMessageReturn(lshandle, message, "{\"returnValue\":false}", &lserror);
+		retVal = methodReturnError(lshandle, message, "{\"returnValue\":false}", &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -1969,23 +2346,9 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 	else
 	{
 		/*
-		 * Let's get the current custom message and set it as well so that we don't overwrite it with ""
+		 * The current custom message is kept so that we don't overwrite it with ""
 		 */
-		PurplePresence *presence = purple_account_get_presence(account);
-		const PurpleStatus *status = purple_presence_get_active_status(presence);
-		const PurpleValue *value = purple_status_get_attr_value(status, "message");
-		const char *customMessage = purple_value_get_string(value);
-		if (customMessage == NULL)
-		{
-			customMessage = "";
-		}
-
-		PurpleStatusPrimitive prim = getPrplAvailabilityFromPalmAvailability(availability);
-		PurpleStatusType *type = purple_account_get_status_type_with_primitive(account, prim);
-		GList *attrs = NULL;
-		attrs = g_list_append(attrs, "message");
-		attrs = g_list_append(attrs, (char*)customMessage);
-		purple_account_set_status_list(account, purple_status_type_get_id(type), TRUE, attrs);
+		bool delayed = requestStatusChange(accountKey, serviceName, account, availability, NULL);
 
 		char availabilityString[2];
 		sprintf(availabilityString, "%i", availability);
@@ -1996,10 +2359,14 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 		g_string_append(jsonResponse, username);
 		g_string_append(jsonResponse, "\",  \"availability\":");
 		g_string_append(jsonResponse, availabilityString);
+		if (delayed)
+		{
+			g_string_append(jsonResponse, ", \"delayed\":true");
+		}
 		g_string_append(jsonResponse, ", \"returnValue\":true}");
 		LSError lserror;
 		LSErrorInit(&lserror);
-		retVal = LSMessageReturn(lshandle, message, jsonResponse->str, &lserror);
+		retVal = methodReturn(lshandle, message, jsonResponse->str, &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -2009,7 +2376,7 @@ static bool setMyAvailability(LSHandle* lshandle, LSMessage *message, void *ctx)
 
 	error: if (!retVal)
 	{
-		syslog(LOG_INFO, "%s: sending response failed", __FUNCTION__);
+		eventWorkerSyslog(LOG_INFO, "%s: sending response failed", __FUNCTION__);
 	}
 	LSErrorFree(&lserror);
 	return TRUE;
@@ -2027,7 +2394,7 @@ static bool setMyCustomMessage(LSHandle* lshandle, LSMessage *message, void *ctx
 	const char *username = "";
 	const char *customMessage = "";
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	char *payload = strdup(LSMessageGetPayload(message));
 
@@ -2064,29 +2431,29 @@ static bool setMyCustomMessage(LSHandle* lshandle, LSMessage *message, void *ctx
 		goto error;
 	}
 
-	syslog(LOG_INFO, "Parameters: serviceName %s", serviceName);
+	eventWorkerSyslog(LOG_INFO, "Parameters: serviceName %s", serviceName);
 
 	char *accountKey = getAccountKey(username, serviceName);
 
 	PurpleAccount *account = g_hash_table_lookup(onlineAccountData, accountKey);
 	if (account != NULL)
 	{
-		// get the account's current status type
-		PurpleStatusType *type = purple_status_get_type(purple_account_get_active_status(account));
-		GList *attrs = NULL;
-		attrs = g_list_append(attrs, "message");
-		attrs = g_list_append(attrs, (char*)customMessage);
-		purple_account_set_status_list(account, purple_status_type_get_id(type), TRUE, attrs);
+		// keeps the account's current status type
+		bool delayed = requestStatusChange(accountKey, serviceName, account, -1, customMessage);
 
 		struct json_object *payload = json_object_new_object();
 		json_object_object_add(payload, "serviceName", json_object_new_string((char*)serviceName));
 		json_object_object_add(payload, "username", json_object_new_string((char*)username));
 		json_object_object_add(payload, "customMessage", json_object_new_string((char*)customMessage));
+		if (delayed)
+		{
+			json_object_object_add(payload, "delayed", json_object_new_boolean(TRUE));
+		}
 		json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
 		LSError lserror;
 		LSErrorInit(&lserror);
 
-		retVal = LSMessageReturn(lshandle, message, json_object_to_json_string(payload), &lserror);
+		retVal = methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -2099,7 +2466,7 @@ static bool setMyCustomMessage(LSHandle* lshandle, LSMessage *message, void *ctx
 
 	error: if (!retVal)
 	{
-		syslog(LOG_INFO, "%s: sending response failed", __FUNCTION__);
+		eventWorkerSyslog(LOG_INFO, "%s: sending response failed", __FUNCTION__);
 	}
 	LSErrorFree(&lserror);
 	if (!is_error(params)) 
@@ -2121,7 +2488,7 @@ static bool getBuddyList(LSHandle* lshandle, LSMessage *message, void *ctx)
 	const char *username = "";
 	bool subscribe = FALSE;
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	// get the message's payload (json object)
 	json_t *object = LSMessageGetPayloadJSON(message);
@@ -2153,7 +2520,7 @@ static bool getBuddyList(LSHandle* lshandle, LSMessage *message, void *ctx)
 		goto error;
 	}
 
-	syslog(LOG_INFO, "Parameters: serviceName %s", serviceName);
+	eventWorkerSyslog(LOG_INFO, "Parameters: serviceName %s", serviceName);
 
 	/* subscribe to the buddy list if subscribe:true is present. LSSubscriptionProcess takes care of this for us */
 	bool subscribed;
@@ -2180,6 +2547,24 @@ static bool getBuddyList(LSHandle* lshandle, LSMessage *message, void *ctx)
 	return TRUE;
 }
 
+/*
+ * messageText is escaped the way the messaging service sends it over the bus (e.g. "\\n" for new lines)
+ */
+static bool sendImFromAccount(PurpleAccount *account, const char *usernameTo, const char *messageText)
+{
+	PurpleConversation *purpleConversation = conversationCacheGet(account, usernameTo);
+	if (purpleConversation == NULL)
+	{
+		return FALSE;
+	}
+
+	char *messageTextUnescaped = g_strcompress(messageText);
+	purple_conv_im_send(purple_conversation_get_im_data(purpleConversation), messageTextUnescaped);
+	g_free(messageTextUnescaped);
+	adapterStatsCount(STATS_MESSAGES_OUT);
+	return TRUE;
+}
+
 static bool sendMessage(LSHandle* lshandle, LSMessage *message, void *ctx)
 {
 	bool retVal;
@@ -2193,7 +2578,7 @@ static bool sendMessage(LSHandle* lshandle, LSMessage *message, void *ctx)
 	const char *usernameTo = "";
 	const char *messageText = "";
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	// get the message's payload (json object)
 	char *payload = strdup(LSMessageGetPayload(message));
@@ -2237,15 +2622,50 @@ static bool sendMessage(LSHandle* lshandle, LSMessage *message, void *ctx)
 		goto error;
 	}
 
-	char *messageTextUnescaped = g_strcompress(messageText);
-
 	char *accountKey = getAccountKey(username, serviceName);
 
 	PurpleAccount *accountToSendFrom = g_hash_table_lookup(onlineAccountData, accountKey);
-	if (accountToSendFrom == NULL)
+	bool accountIsPending = accountToSendFrom == NULL && g_hash_table_lookup(pendingAccountData, accountKey) != NULL;
+	bool rateLimited = accountToSendFrom != NULL && (outboundQueueAccountLength(accountKey) > 0
+			|| !rateLimiterTryAcquire(accountKey, serviceName, RATE_CLASS_MESSAGE));
+	if (accountIsPending || rateLimited)
+	{
+		/*
+		 * The account is signing on (the message is sent from account_logged_in) or sending it now would get us
+		 * throttled by the server (it is sent from a rate limiter timer).
+		 */
+		guint messageId = outboundQueueAdd(accountKey, serviceName, username, usernameTo, messageText,
+				getField(params, "clientId"));
+		if (messageId == 0)
+		{
+			retVal
+					= methodReturnError(
+							lshandle,
+							message,
+							"{\"returnValue\":false, \"errorCode\":\"13\", \"errorText\":\"Too many messages are waiting to be sent from this account\"}",
+							&lserror);
+		}
+		else
+		{
+			if (rateLimited)
+			{
+				outboundQueueFlush(accountKey, accountToSendFrom);
+			}
+			char *jsonResponse = g_strdup_printf("{\"returnValue\":true, \"%s\":true, \"messageId\":%u}",
+					rateLimited ? "delayed" : "queued", messageId);
+			retVal = methodReturn(lshandle, message, jsonResponse, &lserror);
+			g_free(jsonResponse);
+		}
+		if (!retVal)
+		{
+			LSErrorPrint(&lserror, stderr);
+		}
+		goto error;
+	}
+	else if (accountToSendFrom == NULL)
 	{
 		retVal
-				= LSMessageReturn(
+				= methodReturnError(
 						lshandle,
 						message,
 						"{\"returnValue\":false, \"errorCode\":\"11\", \"errorText\":\"Trying to send from an account that is not logged in\"}",
@@ -2258,21 +2678,23 @@ static bool sendMessage(LSHandle* lshandle, LSMessage *message, void *ctx)
 		goto error;
 	}
 
-	PurpleConversation *purpleConversation =
-			purple_conversation_new(PURPLE_CONV_TYPE_IM, accountToSendFrom, usernameTo);
-	purple_conv_im_send(purple_conversation_get_im_data(purpleConversation), messageTextUnescaped);
-
-	retVal = LSMessageReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+	if (sendImFromAccount(accountToSendFrom, usernameTo, messageText))
+	{
+		retVal = methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+	}
+	else
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"12\", \"errorText\":\"Could not open a conversation\"}",
+				&lserror);
+		success = FALSE;
+	}
 	if (!retVal)
 	{
 		LSErrorPrint(&lserror, stderr);
 	}
 
 	error: LSErrorFree(&lserror);
-	if (messageTextUnescaped)
-	{
-		free(messageTextUnescaped);
-	}
 	if (payload)
 	{
 		free(payload);
@@ -2288,78 +2710,1162 @@ static bool sendMessage(LSHandle* lshandle, LSMessage *message, void *ctx)
 	return TRUE;
 }
 
-static bool registerForIncomingMessages(LSHandle* lshandle, LSMessage *message, void *ctx)
+/*
+ * Sends a batch of messages from one account, in order: {serviceName, username, messages:[{usernameTo, messageText,
+ * clientId}, ...]}. The payload is parsed and the account looked up once for the whole batch, and the per-message
+ * results come back in a single reply, in the same order as the messages.
+ */
+static bool sendMessages(LSHandle* lshandle, LSMessage *message, void *ctx)
 {
 	bool retVal;
-	bool success = TRUE;
 	LSError lserror;
 	LSErrorInit(&lserror);
 
 	/* Passed parameters */
-	bool subscribe = FALSE;
+	const char *serviceName = NULL;
+	const char *username = NULL;
+	struct json_object *messages = NULL;
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	char *accountKey = NULL;
+	struct json_object *responsePayload = NULL;
 
-	// get the message's payload (json object)
-	json_t *object = LSMessageGetPayloadJSON(message);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
-	if (!object)
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (is_error(params))
 	{
-		success = FALSE;
-		goto error;
+		goto invalidParameters;
 	}
 
-	retVal = json_get_bool(object, "subscribe", &subscribe);
-	if (!retVal)
+	serviceName = getField(params, "serviceName");
+	username = getField(params, "username");
+	messages = json_object_object_get(params, "messages");
+	if (!serviceName || !username || !messages || !json_object_is_type(messages, json_type_array))
 	{
-		success = FALSE;
-		goto error;
+		goto invalidParameters;
+	}
+
+	accountKey = getAccountKey(username, serviceName);
+
+	PurpleAccount *accountToSendFrom = g_hash_table_lookup(onlineAccountData, accountKey);
+	bool accountIsPending = accountToSendFrom == NULL && g_hash_table_lookup(pendingAccountData, accountKey) != NULL;
+	if (accountToSendFrom == NULL && !accountIsPending)
+	{
+		retVal
+				= methodReturnError(
+						lshandle,
+						message,
+						"{\"returnValue\":false, \"errorCode\":\"11\", \"errorText\":\"Trying to send from an account that is not logged in\"}",
+						&lserror);
+		if (!retVal)
+		{
+			LSErrorPrint(&lserror, stderr);
+		}
+		goto end;
+	}
+
+	responsePayload = json_object_new_object();
+	json_object_object_add(responsePayload, "serviceName", json_object_new_string((char*)serviceName));
+	json_object_object_add(responsePayload, "username", json_object_new_string((char*)username));
+	struct json_object *results = json_object_new_array();
+
+	int messageCount = json_object_array_length(messages);
+	int i;
+	for (i = 0; i < messageCount; i++)
+	{
+		struct json_object *item = json_object_array_get_idx(messages, i);
+		const char *usernameTo = getField(item, "usernameTo");
+		const char *messageText = getField(item, "messageText");
+		const char *clientId = getField(item, "clientId");
+
+		struct json_object *result = json_object_new_object();
+		json_object_object_add(result, "index", json_object_new_int(i));
+		if (clientId)
+		{
+			json_object_object_add(result, "clientId", json_object_new_string((char*)clientId));
+		}
+
+		if (!usernameTo || !messageText)
+		{
+			json_object_object_add(result, "returnValue", json_object_new_boolean(FALSE));
+			json_object_object_add(result, "errorCode", json_object_new_string("1"));
+			json_object_object_add(result, "errorText", json_object_new_string("usernameTo and messageText are required"));
+		}
+		else if (accountIsPending || outboundQueueAccountLength(accountKey) > 0
+				|| !rateLimiterTryAcquire(accountKey, serviceName, RATE_CLASS_MESSAGE))
+		{
+			/*
+			 * The account is signing on (the message is sent from account_logged_in) or is being rate limited (the
+			 * message is sent from a rate limiter timer)
+			 */
+			guint messageId = outboundQueueAdd(accountKey, serviceName, username, usernameTo, messageText, clientId);
+			if (messageId == 0)
+			{
+				json_object_object_add(result, "returnValue", json_object_new_boolean(FALSE));
+				json_object_object_add(result, "errorCode", json_object_new_string("13"));
+				json_object_object_add(result, "errorText",
+						json_object_new_string("Too many messages are waiting to be sent from this account"));
+			}
+			else
+			{
+				json_object_object_add(result, "returnValue", json_object_new_boolean(TRUE));
+				json_object_object_add(result, accountIsPending ? "queued" : "delayed", json_object_new_boolean(TRUE));
+				json_object_object_add(result, "messageId", json_object_new_int(messageId));
+			}
+		}
+		else if (!sendImFromAccount(accountToSendFrom, usernameTo, messageText))
+		{
+			json_object_object_add(result, "returnValue", json_object_new_boolean(FALSE));
+			json_object_object_add(result, "errorCode", json_object_new_string("12"));
+			json_object_object_add(result, "errorText", json_object_new_string("Could not open a conversation"));
+		}
+		else
+		{
+			json_object_object_add(result, "returnValue", json_object_new_boolean(TRUE));
+		}
+		json_object_array_add(results, result);
+	}
+
+	if (!accountIsPending)
+	{
+		/* starts sending the delayed messages, if any */
+		outboundQueueFlush(accountKey, accountToSendFrom);
+	}
+
+	json_object_object_add(responsePayload, "results", results);
+	json_object_object_add(responsePayload, "returnValue", json_object_new_boolean(TRUE));
+
+	retVal = methodReturn(lshandle, message, json_object_to_json_string(responsePayload), &lserror);
+	if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	goto end;
+
+	invalidParameters:
+	retVal = methodReturnError(lshandle, message,
+			"{\"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"Invalid parameter. Please double check the passed parameters.\"}",
+			&lserror);
+	if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+
+	end: LSErrorFree(&lserror);
+	if (accountKey)
+	{
+		free(accountKey);
+	}
+	if (responsePayload && !is_error(responsePayload))
+	{
+		json_object_put(responsePayload);
+	}
+	if (!is_error(params))
+	{
+		json_object_put(params);
+	}
+	return TRUE;
+}
+
+/*
+ * Adds the caller to the subscribers of the method it called (i.e. the subscription key is the method name)
+ */
+static bool processSubscriptionRequest(LSHandle* lshandle, LSMessage *message, const char *caller)
+{
+	bool retVal;
+	bool success = TRUE;
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	/* Passed parameters */
+	bool subscribe = FALSE;
+
+	eventWorkerSyslog(LOG_INFO, "%s called.", caller);
+
+	// get the message's payload (json object)
+	json_t *object = LSMessageGetPayloadJSON(message);
+
+	if (!object)
+	{
+		success = FALSE;
+		goto error;
+	}
+
+	retVal = json_get_bool(object, "subscribe", &subscribe);
+	if (!retVal)
+	{
+		success = FALSE;
+		goto error;
 	}
 
 	if (LSMessageIsSubscription(message))
 	{
-		bool subscribed;
-		retVal = LSSubscriptionProcess(lshandle, message, &subscribed, &lserror);
-		if (!retVal)
+		bool subscribed;
+		retVal = LSSubscriptionProcess(lshandle, message, &subscribed, &lserror);
+		if (!retVal)
+		{
+			LSErrorPrint(&lserror, stderr);
+			retVal = methodReplyError(lshandle, message,
+					"{\"returnValue\": false, \"errorText\": \"Subscription error\"}", &lserror);
+			if (!retVal)
+			{
+				LSErrorPrint(&lserror, stderr);
+			}
+			goto error;
+		}
+
+	}
+	else
+	{
+		retVal = methodReplyError(lshandle, message,
+				"{\"returnValue\": false, \"errorText\": \"We were expecting a subscribe type message,"
+					" but we did not receive one.\"}", &lserror);
+		if (!retVal)
+		{
+			LSErrorPrint(&lserror, stderr);
+		}
+	}
+
+	error: LSErrorFree(&lserror);
+	return TRUE;
+}
+
+/*
+ * Sends a subscriber the spooled incoming messages that came after sinceSeq: those of the account with accountKey, or
+ * of all accounts if it is NULL
+ */
+static void replaySpooledMessages(LSHandle* lshandle, LSMessage *message, guint sinceSeq, const char *accountKey)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	GString *reply = g_string_new("");
+	g_string_printf(reply, "{\"returnValue\":true, \"replay\":true, \"seqEpoch\":%u, \"messages\":[",
+			incomingMessageSeqEpoch);
+	guint count = messageSpoolCollectSince(sinceSeq, accountKey, reply);
+	g_string_append(reply, "]}");
+
+	eventWorkerSyslog(LOG_INFO, "Replaying %u spooled messages since %u", count, sinceSeq);
+	if (!methodReply(lshandle, message, reply->str, &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	g_string_free(reply, TRUE);
+}
+
+/*
+ * Subscription key of the batches that go out batchMaxDelayMs (already clamped) after their first message, for the
+ * messages of accountKey or of all accounts if it is NULL
+ */
+static char* getIncomingBatchSubscriptionKey(const char *accountKey, int batchMaxDelayMs)
+{
+	return g_strdup_printf("/registerForIncomingMessages/batch/%d/%s", batchMaxDelayMs, accountKey ? accountKey : "*");
+}
+
+/*
+ * Without parameters other than subscribe:true, subscribers get every incoming message in its own reply.
+ * Passing serviceName and username limits the subscription to the messages of that account. Passing batchMaxDelayMs
+ * makes the messages come in batches ({"messages":[...]}) sent at most that many milliseconds after the first message
+ * of the batch was received. Every message carries a sequence number (seq) and the epoch it counts in (seqEpoch):
+ * seqs only go up within an epoch, and start over in a new one if the spool was lost.
+ * Passing sinceSeq (the last seq the subscriber saw) additionally gets it {"replay":true, "seqEpoch":..., "messages":
+ * [...]} with the spooled messages that came after it, of the subscriber's account if it passed one. If it also passes
+ * the seqEpoch of sinceSeq and that is not the current one, it gets every spooled message. Messages that arrive while subscribing may show up both in the
+ * replay and on their own, so subscribers should skip seqs they have already seen.
+ */
+static bool registerForIncomingMessages(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	bool retVal;
+	LSError lserror;
+
+	/* Passed parameters */
+	const char *serviceName = NULL;
+	const char *username = NULL;
+	int batchMaxDelayMs = 0;
+	int sinceSeq = 0;
+	int seqEpoch = 0;
+	bool replay = FALSE;
+
+	json_t *object = LSMessageGetPayloadJSON(message);
+	if (object)
+	{
+		json_get_string(object, "serviceName", &serviceName);
+		json_get_string(object, "username", &username);
+		json_get_int(object, "batchMaxDelayMs", &batchMaxDelayMs);
+		replay = json_get_int(object, "sinceSeq", &sinceSeq) && sinceSeq >= 0;
+		if (replay && json_get_int(object, "seqEpoch", &seqEpoch) && (guint) seqEpoch != incomingMessageSeqEpoch)
+		{
+			/* the seqs it saw were counted in another epoch */
+			sinceSeq = 0;
+		}
+	}
+
+	if ((!serviceName || !username) && batchMaxDelayMs <= 0)
+	{
+		processSubscriptionRequest(lshandle, message, __FUNCTION__);
+		if (replay && LSMessageIsSubscription(message))
+		{
+			replaySpooledMessages(lshandle, message, sinceSeq, NULL);
+		}
+		return TRUE;
+	}
+
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
+
+	LSErrorInit(&lserror);
+	if (!LSMessageIsSubscription(message))
+	{
+		retVal = methodReplyError(lshandle, message,
+				"{\"returnValue\": false, \"errorText\": \"We were expecting a subscribe type message,"
+					" but we did not receive one.\"}", &lserror);
+		if (!retVal)
+		{
+			LSErrorPrint(&lserror, stderr);
+		}
+		LSErrorFree(&lserror);
+		return TRUE;
+	}
+
+	char *accountKey = (serviceName && username) ? getAccountKey(username, serviceName) : NULL;
+	char *subscriptionKey;
+	if (batchMaxDelayMs > 0)
+	{
+		batchMaxDelayMs = CLAMP(batchMaxDelayMs, MIN_INCOMING_BATCH_DELAY_MS, MAX_INCOMING_BATCH_DELAY_MS);
+		subscriptionKey = getIncomingBatchSubscriptionKey(accountKey, batchMaxDelayMs);
+		eventWorkerAddIncomingBatch(subscriptionKey, accountKey, batchMaxDelayMs);
+	}
+	else
+	{
+		subscriptionKey = g_strconcat("/registerForIncomingMessages/", accountKey, NULL);
+	}
+
+	retVal = LSSubscriptionAdd(lshandle, subscriptionKey, message, &lserror);
+	if (retVal)
+	{
+		retVal = methodReply(lshandle, message, "{\"returnValue\": true, \"subscribed\": true}", &lserror);
+		if (replay)
+		{
+			replaySpooledMessages(lshandle, message, sinceSeq, accountKey);
+		}
+	}
+	else
+	{
+		LSErrorPrint(&lserror, stderr);
+		LSErrorFree(&lserror);
+		LSErrorInit(&lserror);
+		if (batchMaxDelayMs > 0)
+		{
+			eventWorkerRemoveIncomingBatch(subscriptionKey);
+		}
+		retVal = methodReplyError(lshandle, message, "{\"returnValue\": false, \"errorText\": \"Subscription error\"}",
+				&lserror);
+	}
+	if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+
+	LSErrorFree(&lserror);
+	g_free(subscriptionKey);
+	if (accountKey)
+	{
+		free(accountKey);
+	}
+	return TRUE;
+}
+
+/*
+ * luna-service drops a cancelled subscription from its key by itself; a batching subscriber of
+ * registerForIncomingMessages also has to let go of its batch, whose key we get from the payload again
+ */
+static bool subscriptionCancelled(LSHandle *lshandle, LSMessage *message, void *ctx)
+{
+	const char *method = LSMessageGetMethod(message);
+	const char *serviceName = NULL;
+	const char *username = NULL;
+	int batchMaxDelayMs = 0;
+
+	if (method != NULL && strcmp(method, "getStats") == 0)
+	{
+		/* nobody left to push the stats to */
+		if (statsSubscribers > 0 && --statsSubscribers == 0 && statsTimer != 0)
+		{
+			purple_timeout_remove(statsTimer);
+			statsTimer = 0;
+		}
+		return TRUE;
+	}
+	if (method == NULL || strcmp(method, "registerForIncomingMessages") != 0)
+	{
+		return TRUE;
+	}
+	json_t *object = LSMessageGetPayloadJSON(message);
+	if (!object || !json_get_int(object, "batchMaxDelayMs", &batchMaxDelayMs) || batchMaxDelayMs <= 0)
+	{
+		return TRUE;
+	}
+	json_get_string(object, "serviceName", &serviceName);
+	json_get_string(object, "username", &username);
+
+	char *accountKey = (serviceName && username) ? getAccountKey(username, serviceName) : NULL;
+	char *subscriptionKey = getIncomingBatchSubscriptionKey(accountKey,
+			CLAMP(batchMaxDelayMs, MIN_INCOMING_BATCH_DELAY_MS, MAX_INCOMING_BATCH_DELAY_MS));
+	eventWorkerRemoveIncomingBatch(subscriptionKey);
+	g_free(subscriptionKey);
+	if (accountKey)
+	{
+		free(accountKey);
+	}
+	return TRUE;
+}
+
+/*
+ * Subscribers get one update per message that was queued by sendMessage/sendMessages while the account was signing
+ * on or held back by the rate limiter: {serviceName, username, usernameTo, messageId, clientId, delivered, errorCode,
+ * errorText}
+ */
+static bool registerForMessageDeliveryStatus(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	return processSubscriptionRequest(lshandle, message, __FUNCTION__);
+}
+
+
+
+
+
+
+
+/*
+ * How much outgoing traffic the rate limiter held back. For each class ("message", "status"): {operations, delayed,
+ * waiting, averageDelayMs, maxDelayMs}
+ */
+static bool getRateLimitStats(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	int i;
+
+	struct json_object *payload = json_object_new_object();
+	for (i = 0; i < RATE_CLASS_COUNT; i++)
+	{
+		RateLimitStats stats;
+		rateLimiterGetStats(i, &stats);
+
+		struct json_object *classStats = json_object_new_object();
+		json_object_object_add(classStats, "operations", json_object_new_int(stats.operations));
+		json_object_object_add(classStats, "delayed", json_object_new_int(stats.delayed));
+		json_object_object_add(classStats, "waiting", json_object_new_int(stats.waiting));
+		json_object_object_add(classStats, "averageDelayMs",
+				json_object_new_int(stats.delayed ? stats.totalDelayMs / stats.delayed : 0));
+		json_object_object_add(classStats, "maxDelayMs", json_object_new_int(stats.maxDelayMs));
+		json_object_object_add(payload, rateLimiterClassName(i), classStats);
+	}
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+/*
+ * Returns the location of a buddy's avatar, writing it to the avatar store first if the account has lazy avatars and
+ * nobody asked for it yet: {serviceName, username, buddyUsername}
+ */
+static bool fetchAvatar(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	bool retVal;
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	const char *serviceName = NULL;
+	const char *username = NULL;
+	const char *buddyUsername = NULL;
+	char *accountKey = NULL;
+	const char *avatarLocation = NULL;
+	PurpleBuddy *buddy = NULL;
+
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (!is_error(params))
+	{
+		serviceName = getField(params, "serviceName");
+		username = getField(params, "username");
+		buddyUsername = getField(params, "buddyUsername");
+	}
+	if (!serviceName || !username || !buddyUsername)
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"Invalid parameter. Please double check the passed parameters.\"}",
+				&lserror);
+		goto done;
+	}
+
+	accountKey = getAccountKey(username, serviceName);
+	PurpleAccount *account = g_hash_table_lookup(onlineAccountData, accountKey);
+	if (account == NULL)
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"11\", \"errorText\":\"The account is not logged in\"}",
+				&lserror);
+		goto done;
+	}
+
+	buddy = purple_find_buddy(account, buddyUsername);
+	avatarLocation = buddy ? avatarStoreFetchBuddy(buddy) : NULL;
+	if (avatarLocation == NULL)
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"14\", \"errorText\":\"The buddy has no avatar\"}", &lserror);
+		goto done;
+	}
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "avatarLocation", json_object_new_string(avatarLocation));
+	json_object_object_add(payload, "avatarHash", json_object_new_string(avatarStoreGetBuddyHash(buddy)));
+	retVal = methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror);
+	json_object_put(payload);
+
+	done: if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	if (accountKey)
+	{
+		free(accountKey);
+	}
+	if (!is_error(params))
+	{
+		json_object_put(params);
+	}
+	return TRUE;
+}
+
+/*
+ * What every online account does with presence updates while the display is off:
+ * {"accounts":[{serviceName, username, strategy, idle}, ...]}
+ */
+static bool getPresenceStrategies(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	GHashTableIter iter;
+	gpointer key, value;
+
+	struct json_object *accounts = json_object_new_array();
+	g_hash_table_iter_init(&iter, onlineAccountData);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		PurpleAccount *account = value;
+		const char *strategy = presenceStrategyGetName(key);
+		if (strategy == NULL)
+		{
+			continue;
+		}
+		char *serviceName = getServiceNameFromPrplProtocolId(account->protocol_id);
+		char *username = getJavaFriendlyUsername(account->username, serviceName);
+
+		struct json_object *accountPresence = json_object_new_object();
+		json_object_object_add(accountPresence, "serviceName", json_object_new_string(serviceName));
+		json_object_object_add(accountPresence, "username", json_object_new_string(username));
+		json_object_object_add(accountPresence, "strategy", json_object_new_string((char*) strategy));
+		json_object_object_add(accountPresence, "idle", json_object_new_boolean(presenceStrategyIsIdle(key)));
+		json_object_array_add(accounts, accountPresence);
+
+		free(serviceName);
+		free(username);
+	}
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "accounts", accounts);
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+/*
+ * How often the display changes reached the servers and how many presence updates we didn't pass on because of them
+ */
+static bool getDisplayQueueStats(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	DisplayHysteresisStats displayStats;
+	PresenceStrategyStats presenceStats;
+
+	displayHysteresisGetStats(&displayStats);
+	presenceStrategyGetStats(&presenceStats);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "toggles", json_object_new_int(displayStats.toggles));
+	json_object_object_add(payload, "suppressedWakes", json_object_new_int(displayStats.suppressedWakes));
+	json_object_object_add(payload, "leaveDelayMs", json_object_new_int(displayStats.leaveDelayMs));
+	json_object_object_add(payload, "typicalWakeMs", json_object_new_int(displayStats.typicalWakeMs));
+	json_object_object_add(payload, "presenceUpdatesHeld", json_object_new_int(presenceStats.held));
+	json_object_object_add(payload, "presenceUpdatesReleased", json_object_new_int(presenceStats.released));
+	json_object_object_add(payload, "presenceUpdatesSaved", json_object_new_int(presenceStats.held - presenceStats.released));
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+static void addWakeupSource(WakeupType type, const char *name, guint displayOn, guint displayOff, gpointer data)
+{
+	struct json_object *source = json_object_new_object();
+	json_object_object_add(source, "type", json_object_new_string((char*) wakeupTypeName(type)));
+	json_object_object_add(source, "name", json_object_new_string((char*) name));
+	json_object_object_add(source, "displayOn", json_object_new_int(displayOn));
+	json_object_object_add(source, "displayOff", json_object_new_int(displayOff));
+	json_object_array_add(data, source);
+}
+
+/*
+ * What woke the main loop up, with the display on and off: {displayOn:{wakeups}, displayOff:{wakeups, seconds,
+ * wakeupsPerMinute}, sources:[{type, name, displayOn, displayOff}, ...]}
+ */
+static bool getWakeupStats(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	guint displayOnWakeups, displayOffWakeups;
+	guint64 displayOffMs;
+
+	wakeupStatsGetTotals(&displayOnWakeups, &displayOffWakeups, &displayOffMs);
+
+	struct json_object *displayOn = json_object_new_object();
+	json_object_object_add(displayOn, "wakeups", json_object_new_int(displayOnWakeups));
+
+	struct json_object *displayOff = json_object_new_object();
+	json_object_object_add(displayOff, "wakeups", json_object_new_int(displayOffWakeups));
+	json_object_object_add(displayOff, "seconds", json_object_new_int(displayOffMs / 1000));
+	json_object_object_add(displayOff, "wakeupsPerMinute",
+			json_object_new_double(displayOffMs ? displayOffWakeups * 60000.0 / displayOffMs : 0));
+
+	struct json_object *sources = json_object_new_array();
+	wakeupStatsForEach(addWakeupSource, sources);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "displayOn", displayOn);
+	json_object_object_add(payload, "displayOff", displayOff);
+	json_object_object_add(payload, "sources", sources);
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+static void addLoginTrace(const LoginTrace *trace, gpointer data)
+{
+	guint i;
+	struct json_object *phases = json_object_new_array();
+	for (i = 0; i < trace->phaseCount; i++)
+	{
+		struct json_object *phase = json_object_new_object();
+		json_object_object_add(phase, "phase", json_object_new_string((char*) trace->phases[i].name));
+		json_object_object_add(phase, "atMs", json_object_new_int(trace->phases[i].atMs));
+		json_object_array_add(phases, phase);
+	}
+
+	struct json_object *loginTrace = json_object_new_object();
+	json_object_object_add(loginTrace, "account", json_object_new_string(trace->accountKey));
+	json_object_object_add(loginTrace, "serviceName", json_object_new_string(trace->serviceName));
+	json_object_object_add(loginTrace, "outcome", json_object_new_string((char*) trace->outcome));
+	if (trace->error != NULL)
+	{
+		json_object_object_add(loginTrace, "error", json_object_new_string(trace->error));
+	}
+	json_object_object_add(loginTrace, "totalMs", json_object_new_int(trace->totalMs));
+	json_object_object_add(loginTrace, "phases", phases);
+	json_object_array_add(data, loginTrace);
+}
+
+static void addLoginService(const char *serviceName, guint connected, guint failed, const LoginPhaseStats *phases,
+		guint phaseCount, gpointer data)
+{
+	guint i;
+	struct json_object *histograms = json_object_new_array();
+	for (i = 0; i < phaseCount; i++)
+	{
+		struct json_object *phase = json_object_new_object();
+		json_object_object_add(phase, "phase", json_object_new_string((char*) phases[i].name));
+		json_object_object_add(phase, "count", json_object_new_int(phases[i].count));
+		json_object_object_add(phase, "p50Ms", json_object_new_int(phases[i].p50Ms));
+		json_object_object_add(phase, "p90Ms", json_object_new_int(phases[i].p90Ms));
+		json_object_object_add(phase, "p99Ms", json_object_new_int(phases[i].p99Ms));
+		json_object_object_add(phase, "maxMs", json_object_new_int(phases[i].maxMs));
+		json_object_array_add(histograms, phase);
+	}
+
+	struct json_object *service = json_object_new_object();
+	json_object_object_add(service, "connected", json_object_new_int(connected));
+	json_object_object_add(service, "failed", json_object_new_int(failed));
+	json_object_object_add(service, "phases", histograms);
+	json_object_object_add(data, (char*) serviceName, service);
+}
+
+/*
+ * The last LOGIN_TRACE_HISTORY logins with the time each phase was reached, and per service how long each phase takes
+ * until the next one is reached (or the login ends):
+ * {traces:[{account, serviceName, outcome, error, totalMs, phases:[{phase, atMs}, ...]}, ...],
+ * services:{<serviceName>:{connected, failed, phases:[{phase, count, p50Ms, p90Ms, p99Ms, maxMs}, ...]}}}
+ */
+static bool getLoginTraces(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	struct json_object *traces = json_object_new_array();
+	loginTraceForEach(addLoginTrace, traces);
+
+	struct json_object *services = json_object_new_object();
+	loginTraceForEachService(addLoginService, services);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "traces", traces);
+	json_object_object_add(payload, "services", services);
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+/*
+ * Sets the log level: {"level":"error"|"warning"|"info"|"debug"}. Returns the level it was.
+ */
+static bool setLogLevel(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	const char *levelName = is_error(params) ? NULL : getField(params, "level");
+	int level = levelName != NULL ? adapterLogLevelFromName(levelName) : -1;
+	if (level < 0)
+	{
+		if (!methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"level must be error, warning, info or debug\"}",
+				&lserror))
 		{
 			LSErrorPrint(&lserror, stderr);
-			retVal = LSMessageReply(lshandle, message,
-					"{\"returnValue\": false, \"errorText\": \"Subscription error\"}", &lserror);
-			if (!retVal)
-			{
-				LSErrorPrint(&lserror, stderr);
-			}
-			goto error;
 		}
+		LSErrorFree(&lserror);
+		if (!is_error(params))
+		{
+			json_object_put(params);
+		}
+		return TRUE;
+	}
 
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "previousLevel", json_object_new_string((char*) adapterLogLevelName(adapterLogGetLevel())));
+	adapterLogSetLevel(level);
+	json_object_object_add(payload, "level", json_object_new_string((char*) adapterLogLevelName(level)));
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
 	}
-	else
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	json_object_put(params);
+	return TRUE;
+}
+
+static void addLogRecord(const AdapterLogRecord *record, gpointer data)
+{
+	guint i;
+	struct json_object *entry = json_object_new_object();
+	json_object_object_add(entry, "seq", json_object_new_int(record->seq));
+	json_object_object_add(entry, "timeMs", json_object_new_double(record->timeMs));
+	json_object_object_add(entry, "level", json_object_new_string((char*) adapterLogLevelName(record->level)));
+	json_object_object_add(entry, "event", json_object_new_string((char*) record->event));
+	json_object_object_add(entry, "value", json_object_new_double(record->value));
+	for (i = 0; i < record->fieldCount; i++)
+	{
+		json_object_object_add(entry, (char*) record->keys[i], json_object_new_string((char*) record->values[i]));
+	}
+	json_object_array_add(data, entry);
+}
+
+/*
+ * The log ring, oldest first: {"limit":N} for only the last N records. Records are
+ * {seq, timeMs, level, event, value, <key>:<value>, ...}.
+ */
+static bool dumpLog(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	guint limit = 0;
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (!is_error(params))
 	{
-		retVal = LSMessageReply(lshandle, message,
-				"{\"returnValue\": false, \"errorText\": \"We were expecting a subscribe type message,"
-					" but we did not receive one.\"}", &lserror);
-		if (!retVal)
+		struct json_object *limitParam = json_object_object_get(params, "limit");
+		if (limitParam != NULL && json_object_get_int(limitParam) > 0)
+		{
+			limit = json_object_get_int(limitParam);
+		}
+		json_object_put(params);
+	}
+
+	struct json_object *records = json_object_new_array();
+	adapterLogForEach(limit, addLogRecord, records);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "level", json_object_new_string((char*) adapterLogLevelName(adapterLogGetLevel())));
+	json_object_object_add(payload, "records", records);
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+static void addPurpleDebugLine(gint64 timeMs, PurpleDebugLevel level, const char *category, const char *text,
+		gpointer data)
+{
+	struct json_object *line = json_object_new_object();
+	json_object_object_add(line, "timeMs", json_object_new_double(timeMs));
+	json_object_object_add(line, "level", json_object_new_string((char*) purpleDebugLevelName(level)));
+	json_object_object_add(line, "category", json_object_new_string((char*) category));
+	json_object_object_add(line, "text", json_object_new_string((char*) text));
+	json_object_array_add(data, line);
+}
+
+static void addPurpleDebugCategory(const char *category, gpointer data)
+{
+	json_object_array_add(data, json_object_new_string((char*) category));
+}
+
+/*
+ * libpurple's debug output, oldest first: {"limit":N} for only the last N lines.
+ * {level, categories:[...], kept, filtered, evicted, bytes, lines:[{timeMs, level, category, text}, ...]}
+ */
+static bool getPurpleDebugLog(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	guint limit = 0;
+	PurpleDebugLogStats debugStats;
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (!is_error(params))
+	{
+		struct json_object *limitParam = json_object_object_get(params, "limit");
+		if (limitParam != NULL && json_object_get_int(limitParam) > 0)
+		{
+			limit = json_object_get_int(limitParam);
+		}
+		json_object_put(params);
+	}
+
+	struct json_object *categories = json_object_new_array();
+	purpleDebugLogForEachCategory(addPurpleDebugCategory, categories);
+
+	struct json_object *lines = json_object_new_array();
+	purpleDebugLogForEach(limit, addPurpleDebugLine, lines);
+
+	purpleDebugLogGetStats(&debugStats);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "level", json_object_new_string((char*) purpleDebugLevelName(purpleDebugLogGetLevel())));
+	json_object_object_add(payload, "categories", categories);
+	json_object_object_add(payload, "kept", json_object_new_int(debugStats.kept));
+	json_object_object_add(payload, "filtered", json_object_new_int(debugStats.filtered));
+	json_object_object_add(payload, "evicted", json_object_new_int(debugStats.evicted));
+	json_object_object_add(payload, "bytes", json_object_new_int(debugStats.bytes));
+	json_object_object_add(payload, "lines", lines);
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
+
+/*
+ * Which libpurple debug lines are kept: {"level":"misc"|"info"|"warning"|"error"|"fatal"|"off",
+ * "categories":["jabber", "dns", ...]}. Without categories (or with an empty list) every category is kept.
+ */
+static bool setPurpleDebugFilter(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	int level = -1;
+	struct json_object *categories = NULL;
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (!is_error(params))
+	{
+		const char *levelName = getField(params, "level");
+		level = levelName != NULL ? purpleDebugLevelFromName(levelName) : -1;
+		categories = json_object_object_get(params, "categories");
+	}
+	if (level < 0 || (categories != NULL && !json_object_is_type(categories, json_type_array)))
+	{
+		if (!methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"1\", \"errorText\":\"Invalid parameter. Please double check the passed parameters.\"}",
+				&lserror))
 		{
 			LSErrorPrint(&lserror, stderr);
 		}
+		LSErrorFree(&lserror);
+		if (!is_error(params))
+		{
+			json_object_put(params);
+		}
+		return TRUE;
 	}
 
-	error: LSErrorFree(&lserror);
+	int i;
+	int categoryCount = categories != NULL ? json_object_array_length(categories) : 0;
+	const char **categoryNames = g_new0(const char *, categoryCount + 1);
+	for (i = 0; i < categoryCount; i++)
+	{
+		categoryNames[i] = json_object_get_string(json_object_array_get_idx(categories, i));
+	}
+	purpleDebugLogSetFilter(level, categoryNames);
+	g_free(categoryNames);
+	json_object_put(params);
+
+	if (!methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	return TRUE;
+}
+
+/*
+ * {"maxBytes":1048576}, optional and at most EVENT_TRACE_MAX_BYTES
+ * Records buddy list signals and incoming IMs to EVENT_TRACE_PATH for Tools/replay until stopEventTrace is called or
+ * maxBytes are written. The previous trace is replaced.
+ */
+static bool startEventTrace(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	gsize maxBytes = EVENT_TRACE_MAX_BYTES;
+	bool retVal;
+
+	struct json_object *params = json_tokener_parse(LSMessageGetPayload(message));
+	if (!is_error(params) && json_object_object_get(params, "maxBytes") != NULL)
+	{
+		maxBytes = CLAMP(json_object_get_int(json_object_object_get(params, "maxBytes")), 0, EVENT_TRACE_MAX_BYTES);
+	}
+
+	if (!libpurpleInitialized)
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"15\", \"errorText\":\"No account has logged in yet\"}", &lserror);
+	}
+	else if (!eventTraceStart(EVENT_TRACE_PATH, maxBytes))
+	{
+		retVal = methodReturnError(lshandle, message,
+				"{\"returnValue\":false, \"errorCode\":\"16\", \"errorText\":\"Already recording, or the trace file can't be created\"}",
+				&lserror);
+	}
+	else
+	{
+		eventWorkerSyslog(LOG_INFO, "Recording events to %s", EVENT_TRACE_PATH);
+		retVal = methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+	}
+	if (!retVal)
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	if (!is_error(params))
+	{
+		json_object_put(params);
+	}
+	return TRUE;
+}
+
+/*
+ * {"returnValue":true, "events":1234, "bytes":56789}: what the recording wrote
+ */
+static bool stopEventTrace(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	guint events;
+	gsize bytes;
+
+	eventTraceStop();
+	eventTraceGetCounts(&events, &bytes);
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "events", json_object_new_int(events));
+	json_object_object_add(payload, "bytes", newJsonByteCount(bytes));
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
 	return TRUE;
 }
 
+static void addMethodStats(const MethodStats *stats, gpointer data)
+{
+	struct json_object *method = json_object_new_object();
+	json_object_object_add(method, "calls", json_object_new_int(stats->calls));
+	json_object_object_add(method, "errors", json_object_new_int(stats->errors));
+	json_object_object_add(method, "p50Us", json_object_new_int(stats->p50Us));
+	json_object_object_add(method, "p90Us", json_object_new_int(stats->p90Us));
+	json_object_object_add(method, "p99Us", json_object_new_int(stats->p99Us));
+	json_object_object_add(method, "maxUs", json_object_new_int(stats->maxUs));
+	json_object_object_add(data, (char*) stats->method, method);
+}
+
+/*
+ * Returns a new getStats payload
+ */
+static struct json_object* buildStats(void)
+{
+	int i;
+
+	struct json_object *methods = json_object_new_object();
+	adapterStatsForEachMethod(addMethodStats, methods);
+
+	struct json_object *counters = json_object_new_object();
+	for (i = 0; i < STATS_COUNTER_COUNT; i++)
+	{
+		json_object_object_add(counters, adapterStatsCounterName(i), json_object_new_int(adapterStatsGetCounter(i)));
+	}
+
+	struct json_object *tables = json_object_new_object();
+	json_object_object_add(tables, "onlineAccounts", json_object_new_int(g_hash_table_size(onlineAccountData)));
+	json_object_object_add(tables, "pendingAccounts", json_object_new_int(g_hash_table_size(pendingAccountData)));
+	json_object_object_add(tables, "offlineAccounts", json_object_new_int(g_hash_table_size(offlineAccountData)));
+	json_object_object_add(tables, "loginTimers", json_object_new_int(g_hash_table_size(accountLoginTimers)));
+	json_object_object_add(tables, "loginMessages", json_object_new_int(g_hash_table_size(loginMessages)));
+	json_object_object_add(tables, "logoutMessages", json_object_new_int(g_hash_table_size(logoutMessages)));
+	json_object_object_add(tables, "connectionTypes", json_object_new_int(g_hash_table_size(connectionTypeData)));
+	json_object_object_add(tables, "boundAddresses", json_object_new_int(g_hash_table_size(ipAddressesBoundTo)));
+	json_object_object_add(tables, "pendingStatusChanges", json_object_new_int(g_hash_table_size(pendingStatusChanges)));
+
+	struct json_object *conversations = json_object_new_object();
+	json_object_object_add(conversations, "cached", json_object_new_int(conversationCacheSize()));
+	json_object_object_add(conversations, "live",
+			json_object_new_int(libpurpleInitialized ? g_list_length(purple_get_conversations()) : 0));
+
+	struct json_object *avatars = json_object_new_object();
+	json_object_object_add(avatars, "count", json_object_new_int(avatarStoreCount()));
+	json_object_object_add(avatars, "bytes", newJsonByteCount(avatarStoreSize()));
+
+	struct json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "returnValue", json_object_new_boolean(TRUE));
+	json_object_object_add(payload, "methods", methods);
+	json_object_object_add(payload, "counters", counters);
+	json_object_object_add(payload, "tables", tables);
+	json_object_object_add(payload, "conversations", conversations);
+	json_object_object_add(payload, "avatars", avatars);
+	json_object_object_add(payload, "pendingTimers", json_object_new_int(pendingTimers));
+	json_object_object_add(payload, "rssBytes", newJsonByteCount(adapterStatsGetRssBytes()));
+	return payload;
+}
+
+static gboolean pushStats(gpointer data)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
 
+	struct json_object *payload = buildStats();
+	const char *payloadText = json_object_to_json_string(payload);
+	ADAPTER_PROBE2(subscription__reply, "/getStats", strlen(payloadText));
+	if (!LSSubscriptionReply(serviceHandle, "/getStats", payloadText, &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
 
+/*
+ * Call counts, error counts and latencies per method, traffic counters and the sizes of our state. With subscribe:true
+ * the stats are pushed again every STATS_PUSH_INTERVAL_SECONDS.
+ */
+static bool getStats(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	LSError lserror;
+	LSErrorInit(&lserror);
+	bool subscribed = FALSE;
 
+	if (LSMessageIsSubscription(message) && !LSSubscriptionProcess(lshandle, message, &subscribed, &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+		LSErrorFree(&lserror);
+		LSErrorInit(&lserror);
+	}
+	/* the timer runs only while someone is subscribed; subscriptionCancelled stops it */
+	if (subscribed && statsSubscribers++ == 0)
+	{
+		statsTimer = purple_timeout_add_seconds(STATS_PUSH_INTERVAL_SECONDS, pushStats, NULL);
+	}
 
+	struct json_object *payload = buildStats();
+	json_object_object_add(payload, "subscribed", json_object_new_boolean(subscribed));
+	if (!methodReturn(lshandle, message, json_object_to_json_string(payload), &lserror))
+	{
+		LSErrorPrint(&lserror, stderr);
+	}
+	LSErrorFree(&lserror);
+	json_object_put(payload);
+	return TRUE;
+}
 
+static gboolean disableTimer(gpointer data)
+{
+	/*
+	 * only leave idle if the display is on; otherwise the next display change takes care of it
+	 */
+	if (currentDisplayState)
+	{
+		displayHysteresisSetIdle(FALSE);
+	}
+	return FALSE;
+}
 
 static bool enable(LSHandle* lshandle, LSMessage *message, void *ctx)
 {
 	LSError lserror;
 	LSErrorInit(&lserror);
-	queuePresenceUpdates(TRUE);
-	LSMessageReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+	displayHysteresisSetIdle(TRUE);
+	methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
 	return TRUE;
 }
 
@@ -2367,9 +3873,8 @@ static bool disable(LSHandle* lshandle, LSMessage *message, void *ctx)
 {
 	LSError lserror;
 	LSErrorInit(&lserror);
-	//queuePresenceUpdates(FALSE);
-	purple_timeout_add_seconds(DISABLE_QUEUE_TIMEOUT_SECONDS, queuePresenceUpdatesTimer, NULL);
-	LSMessageReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+	purple_timeout_add_seconds(DISABLE_QUEUE_TIMEOUT_SECONDS, disableTimer, NULL);
+	methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
 	return TRUE;
 }
 
@@ -2395,7 +3900,7 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 	char *accountKey = "";
 	GSList *accountIterator = NULL;
 
-	syslog(LOG_INFO, "%s called.", __FUNCTION__);
+	eventWorkerSyslog(LOG_INFO, "%s called.", __FUNCTION__);
 
 	LSErrorInit(&lserror);
 
@@ -2415,7 +3920,7 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 		goto error;
 	}
 
-	syslog(LOG_INFO, "deviceConnectionClosed");
+	eventWorkerSyslog(LOG_INFO, "deviceConnectionClosed");
 
 	onlineAndPendingAccountKeys = g_hash_table_get_keys(ipAddressesBoundTo);
 	for (iterator = onlineAndPendingAccountKeys; iterator != NULL; iterator = g_list_next(iterator))
@@ -2433,15 +3938,15 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 				account = g_hash_table_lookup(pendingAccountData, accountKey);
 				if (account == NULL)
 				{
-					syslog(LOG_INFO, "account was not found in the hash");
+					eventWorkerSyslog(LOG_INFO, "account was not found in the hash");
 					continue;
 				}
-				syslog(LOG_INFO, "Abandoning login");
+				eventWorkerSyslog(LOG_INFO, "Abandoning login");
 			}
 			else
 			{
 				accountWasLoggedIn = TRUE;
-				syslog(LOG_INFO, "Logging out");
+				eventWorkerSyslog(LOG_INFO, "Logging out");
 			}
 
 			if (g_hash_table_lookup(onlineAccountData, accountKey) != NULL)
@@ -2452,6 +3957,7 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 			{
 				g_hash_table_remove(pendingAccountData, accountKey);
 			}
+			dropQueuedOperations(accountKey, "11", "Connection failure");
 			if (g_hash_table_lookup(offlineAccountData, accountKey) == NULL)
 			{
 				/*
@@ -2503,7 +4009,7 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 			LSMessage *message = g_hash_table_lookup(loginMessages, accountKey);
 			if (message != NULL)
 			{
-				retVal = LSMessageReply(serviceHandle, message, jsonResponse->str, &lserror);
+				retVal = methodReplyError(serviceHandle, message, jsonResponse->str, &lserror);
 				if (!retVal)
 				{
 					LSErrorPrint(&lserror, stderr);
@@ -2521,8 +4027,8 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 
 	if (g_slist_length(accountToLogoutList) == 0)
 	{
-		syslog(LOG_INFO, "No accounts were connected on the requested ip address");
-		retVal = LSMessageReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+		eventWorkerSyslog(LOG_INFO, "No accounts were connected on the requested ip address");
+		retVal = methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
 		if (!retVal)
 		{
 			LSErrorPrint(&lserror, stderr);
@@ -2546,11 +4052,11 @@ static bool deviceConnectionClosed(LSHandle* lshandle, LSMessage *message, void
 
 	error: if (!success)
 	{
-		retVal = LSMessageReturn(lshandle, message, "{\"returnValue\":false}", &lserror);
+		retVal = methodReturnError(lshandle, message, "{\"returnValue\":false}", &lserror);
 	}
 	else
 	{
-		retVal = LSMessageReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
+		retVal = methodReturn(lshandle, message, "{\"returnValue\":true}", &lserror);
 	}
 
 	if (!retVal)
@@ -2574,44 +4080,145 @@ static LSMethod methods[] =
 { "logout", logout },
 { "getBuddyList", getBuddyList },
 { "registerForIncomingMessages", registerForIncomingMessages },
+{ "registerForMessageDeliveryStatus", registerForMessageDeliveryStatus },
 { "sendMessage", sendMessage },
+{ "sendMessages", sendMessages },
 { "setMyAvailability", setMyAvailability },
 { "setMyCustomMessage", setMyCustomMessage },
 { "deviceConnectionClosed", deviceConnectionClosed },
+{ "getRateLimitStats", getRateLimitStats },
+{ "fetchAvatar", fetchAvatar },
+{ "getPresenceStrategies", getPresenceStrategies },
+{ "getDisplayQueueStats", getDisplayQueueStats },
+{ "getWakeupStats", getWakeupStats },
+{ "getStats", getStats },
+{ "getLoginTraces", getLoginTraces },
+{ "setLogLevel", setLogLevel },
+{ "dumpLog", dumpLog },
+{ "getPurpleDebugLog", getPurpleDebugLog },
+{ "setPurpleDebugFilter", setPurpleDebugFilter },
+{ "startEventTrace", startEventTrace },
+{ "stopEventTrace", stopEventTrace },
 { "enable", enable },
 { "disable", disable },
 { }, 
 };
 
-int main(int argc, char *argv[])
+/**
+ * What's registered on the bus: every method goes through countedMethodCall first
+ */
+static LSMethod countedMethods[G_N_ELEMENTS(methods)];
+
+/*
+ * A method of methods[] with its wakeup source and stats, looked up when the methods are registered
+ */
+typedef struct _CountedMethod
+{
+	const LSMethod *method;
+	WakeupSource *wakeupSource;
+	MethodCounters *stats;
+} CountedMethod;
+
+static CountedMethod countedMethodData[G_N_ELEMENTS(methods)];
+
+/**
+ * key: method name, value: its CountedMethod, so that a call is a single lookup
+ */
+static GHashTable *countedMethodsByName = NULL;
+
+static bool countedMethodCall(LSHandle* lshandle, LSMessage *message, void *ctx)
+{
+	CountedMethod *counted = g_hash_table_lookup(countedMethodsByName, LSMessageGetMethod(message));
+	if (counted == NULL)
+	{
+		return FALSE;
+	}
+
+	wakeupStatsCount(counted->wakeupSource);
+	ADAPTER_PROBE2(method__entry, counted->method->name, strlen(LSMessageGetPayload(message)));
+	gint64 start = nowMicroseconds();
+	bool handled = counted->method->function(lshandle, message, ctx);
+	guint latencyUs = nowMicroseconds() - start;
+	adapterStatsMethodCalled(counted->stats, latencyUs);
+	ADAPTER_PROBE2(method__exit, counted->method->name, latencyUs);
+	return handled;
+}
+
+int adapterMain(int argc, char *argv[])
 {
 	/* lunaservice variables */
 	bool retVal = FALSE;
 	LSError lserror;
 	LSErrorInit(&lserror);
 
+	/*
+	 * The event worker is a thread; GLib before 2.32 wants this before any other GLib call
+	 */
+	if (!g_thread_supported())
+	{
+		g_thread_init(NULL);
+	}
+
 	GMainLoop *loop = g_main_loop_new(NULL, FALSE);
 	if (loop == NULL)
 		goto error;
 
-	syslog(LOG_INFO, "Registering %s ... ", dbusAddress);
+	eventWorkerSyslog(LOG_INFO, "Registering %s ... ", dbusAddress);
 	g_message("Registering %s ... ", dbusAddress);
 
 	retVal = LSRegister(dbusAddress, &serviceHandle, &lserror);
 	if (!retVal)
 		goto error;
 
-	retVal = LSRegisterCategory(serviceHandle, "/", methods, NULL, NULL, &lserror);
+	int i;
+	countedMethodsByName = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; methods[i].name != NULL; i++)
+	{
+		countedMethods[i].name = methods[i].name;
+		countedMethods[i].function = countedMethodCall;
+		countedMethodData[i].method = &methods[i];
+		countedMethodData[i].wakeupSource = wakeupStatsGetSource(WAKEUP_BUS, methods[i].name, methods[i].name);
+		countedMethodData[i].stats = adapterStatsGetMethodCounters(methods[i].name);
+		g_hash_table_insert(countedMethodsByName, (gpointer) methods[i].name, &countedMethodData[i]);
+	}
+	retVal = LSRegisterCategory(serviceHandle, "/", countedMethods, NULL, NULL, &lserror);
+	if (!retVal)
+		goto error;
+
+	retVal = LSSubscriptionSetCancelFunction(serviceHandle, subscriptionCancelled, NULL, &lserror);
 	if (!retVal)
 		goto error;
 
-	syslog(LOG_INFO, "Succeeded.");
+	eventWorkerSyslog(LOG_INFO, "Succeeded.");
 	g_message("Succeeded.");
 
 	retVal = LSGmainAttach(serviceHandle, loop, &lserror);
 	if (!retVal)
 		goto error;
 
+	/*
+	 * Sequence numbers of incoming messages carry on from where the spool left off. Without it they start over, in an
+	 * epoch of their own so that subscribers don't take the new seqs for ones they have already seen.
+	 */
+	if (messageSpoolOpen(incomingMessageSpoolPath, INCOMING_MESSAGE_SPOOL_SIZE))
+	{
+		lastIncomingMessageSeq = messageSpoolLastSeq();
+		incomingMessageSeqEpoch = messageSpoolEpoch();
+	}
+	else
+	{
+		incomingMessageSeqEpoch = g_random_int_range(1, G_MAXINT32);
+	}
+	g_snprintf(incomingMessageSeqEpochText, sizeof(incomingMessageSeqEpochText), "%u", incomingMessageSeqEpoch);
+
+	/*
+	 * Presence and incoming message payloads are built by the event worker thread and sent from the main loop
+	 */
+	eventWorkerStart(serviceHandle);
+
+	rateLimiterInit();
+	outboundQueueInit(MAX_QUEUED_MESSAGES_PER_ACCOUNT, sendImFromAccount);
+
 	//TODO: replace the NULLs with real functions to prevent memory leaks
 	onlineAccountData = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
 	pendingAccountData = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
@@ -2621,6 +4228,7 @@ int main(int argc, char *argv[])
 	ipAddressesBoundTo = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
 	connectionTypeData = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
 	offlineAccountData = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+	pendingStatusChanges = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, freePendingStatusChange);
 
 	g_main_loop_run(loop); 
 
@@ -2630,6 +4238,11 @@ int main(int argc, char *argv[])
 		LSErrorFree(&lserror);
 	}
 
+	eventTraceStop();
+	eventWorkerStop();
+	messageSpoolClose();
+	avatarStoreShutdown();
+
 	if (serviceHandle)
 	{
 		retVal = LSUnregister(serviceHandle, &lserror);
@@ -0,0 +1,239 @@
+/*
+ * <LoginTrace.c: login phase timestamps and per service histograms>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Main loop only. A phase's duration is the time from its mark to the next one (or to the end of the login), so a slow
+ * DNS lookup shows up under "Connecting", the step that was waiting on it, and not in every phase after it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "AdapterProbes.h"
+#include "LoginTrace.h"
+
+#define PHASE_SAMPLES 64
+
+typedef struct _PhaseSamples
+{
+	const char *name;
+	guint count;
+	guint maxMs;
+	/* ring of the most recent durations; count tells how much of it is used and where the next one goes */
+	guint samples[PHASE_SAMPLES];
+} PhaseSamples;
+
+typedef struct _ServiceHistograms
+{
+	char *serviceName;
+	guint connected;
+	guint failed;
+	/* PhaseSamples, in the order the phases were first seen; "total" comes first */
+	GPtrArray *phases;
+} ServiceHistograms;
+
+static guint maxHistory = 0;
+
+/**
+ * Finished LoginTraces, oldest first
+ */
+static GQueue history = G_QUEUE_INIT;
+
+/**
+ * key: accountKey (owned by the value), value: LoginTrace still open
+ */
+static GHashTable *openTraces = NULL;
+
+/**
+ * key: serviceName (owned by the value), value: ServiceHistograms
+ */
+static GHashTable *serviceHistograms = NULL;
+
+static gint64 nowMicroseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void freeTrace(LoginTrace *trace)
+{
+	g_free(trace->accountKey);
+	g_free(trace->serviceName);
+	g_free(trace->error);
+	g_free(trace);
+}
+
+static PhaseSamples* getPhaseSamples(ServiceHistograms *service, const char *name)
+{
+	guint i;
+	for (i = 0; i < service->phases->len; i++)
+	{
+		PhaseSamples *phase = g_ptr_array_index(service->phases, i);
+		if (phase->name == name)
+		{
+			return phase;
+		}
+	}
+	PhaseSamples *phase = g_new0(PhaseSamples, 1);
+	phase->name = name;
+	g_ptr_array_add(service->phases, phase);
+	return phase;
+}
+
+static void addSample(ServiceHistograms *service, const char *name, guint ms)
+{
+	PhaseSamples *phase = getPhaseSamples(service, name);
+	phase->samples[phase->count % PHASE_SAMPLES] = ms;
+	phase->count++;
+	phase->maxMs = MAX(phase->maxMs, ms);
+}
+
+static void addToHistograms(const LoginTrace *trace)
+{
+	guint i;
+	ServiceHistograms *service = g_hash_table_lookup(serviceHistograms, trace->serviceName);
+	if (service == NULL)
+	{
+		service = g_new0(ServiceHistograms, 1);
+		service->serviceName = g_strdup(trace->serviceName);
+		service->phases = g_ptr_array_new();
+		getPhaseSamples(service, g_intern_static_string("total"));
+		g_hash_table_insert(serviceHistograms, service->serviceName, service);
+	}
+
+	if (strcmp(trace->outcome, "connected") == 0)
+	{
+		service->connected++;
+		addSample(service, g_intern_static_string("total"), trace->totalMs);
+	}
+	else
+	{
+		service->failed++;
+	}
+
+	for (i = 0; i < trace->phaseCount; i++)
+	{
+		guint endMs = i + 1 < trace->phaseCount ? trace->phases[i + 1].atMs : trace->totalMs;
+		addSample(service, trace->phases[i].name, endMs - trace->phases[i].atMs);
+	}
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+	guint sampleA = *(const guint *) a;
+	guint sampleB = *(const guint *) b;
+	return sampleA < sampleB ? -1 : sampleA > sampleB;
+}
+
+void loginTraceInit(guint historySize)
+{
+	maxHistory = historySize;
+	openTraces = g_hash_table_new(g_str_hash, g_str_equal);
+	serviceHistograms = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+void loginTraceStart(const char *accountKey, const char *serviceName)
+{
+	loginTraceFinish(accountKey, "abandoned", NULL);
+
+	LoginTrace *trace = g_new0(LoginTrace, 1);
+	trace->accountKey = g_strdup(accountKey);
+	trace->serviceName = g_strdup(serviceName);
+	trace->startUs = nowMicroseconds();
+	g_hash_table_insert(openTraces, trace->accountKey, trace);
+}
+
+void loginTraceMark(const char *accountKey, const char *phase)
+{
+	LoginTrace *trace = g_hash_table_lookup(openTraces, accountKey);
+	if (trace == NULL || phase == NULL || trace->phaseCount == LOGIN_TRACE_MAX_PHASES)
+	{
+		return;
+	}
+	trace->phases[trace->phaseCount].name = g_intern_string(phase);
+	trace->phases[trace->phaseCount].atMs = (nowMicroseconds() - trace->startUs) / 1000;
+	ADAPTER_PROBE3(login__phase, accountKey, phase, trace->phases[trace->phaseCount].atMs);
+	trace->phaseCount++;
+}
+
+void loginTraceFinish(const char *accountKey, const char *outcome, const char *error)
+{
+	LoginTrace *trace = g_hash_table_lookup(openTraces, accountKey);
+	if (trace == NULL)
+	{
+		return;
+	}
+	g_hash_table_remove(openTraces, accountKey);
+
+	trace->outcome = outcome;
+	trace->error = g_strdup(error);
+	trace->totalMs = (nowMicroseconds() - trace->startUs) / 1000;
+	ADAPTER_PROBE3(login__done, accountKey, outcome, trace->totalMs);
+	addToHistograms(trace);
+
+	g_queue_push_tail(&history, trace);
+	while (g_queue_get_length(&history) > maxHistory)
+	{
+		freeTrace(g_queue_pop_head(&history));
+	}
+}
+
+void loginTraceForEach(LoginTraceFunction function, gpointer data)
+{
+	GList *iter;
+	for (iter = history.head; iter != NULL; iter = iter->next)
+	{
+		function(iter->data, data);
+	}
+}
+
+void loginTraceForEachService(LoginServiceFunction function, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	guint sorted[PHASE_SAMPLES];
+	guint i;
+
+	if (serviceHistograms == NULL)
+	{
+		return;
+	}
+	g_hash_table_iter_init(&iter, serviceHistograms);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		ServiceHistograms *service = value;
+		LoginPhaseStats *stats = g_new0(LoginPhaseStats, service->phases->len);
+
+		for (i = 0; i < service->phases->len; i++)
+		{
+			PhaseSamples *phase = g_ptr_array_index(service->phases, i);
+			guint samples = MIN(phase->count, PHASE_SAMPLES);
+
+			stats[i].name = phase->name;
+			stats[i].count = phase->count;
+			stats[i].maxMs = phase->maxMs;
+			if (samples > 0)
+			{
+				memcpy(sorted, phase->samples, samples * sizeof(guint));
+				qsort(sorted, samples, sizeof(guint), compareSamples);
+				stats[i].p50Ms = sorted[(samples - 1) * 50 / 100];
+				stats[i].p90Ms = sorted[(samples - 1) * 90 / 100];
+				stats[i].p99Ms = sorted[(samples - 1) * 99 / 100];
+			}
+		}
+		function(service->serviceName, service->connected, service->failed, stats, service->phases->len, data);
+		g_free(stats);
+	}
+}
@@ -0,0 +1,456 @@
+/*
+ * <MarkupNormalizer.c: turns the HTML that prpls hand us into plain text>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * AIM and Yahoo wrap incoming messages in <HTML><BODY><FONT ...> and escape them; gtalk mostly sends plain text with
+ * the odd &amp;. This is a single pass over the message: runs of text without '<' or '&' are found eight bytes at a
+ * time and copied as they are, tags are dropped (or turned into spans) and entities are decoded. purple_markup_strip_html
+ * does the same job but allocates a copy of the message and walks it byte by byte.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "MarkupNormalizer.h"
+
+/*
+ * Longest entity we decode, without the '&' and ';' ("#x10FFFF")
+ */
+#define MAX_ENTITY_LENGTH 8
+
+/*
+ * end of a span whose closing tag we haven't seen yet
+ */
+#define OPEN_SPAN_END G_MAXSIZE
+
+#define TAG_BREAK -1
+
+#define REPEATED_BYTE(c) (G_GUINT64_CONSTANT(0x0101010101010101) * (guint8) (c))
+#define HAS_ZERO_BYTE(word) (((word) - REPEATED_BYTE(0x01)) & ~(word) & REPEATED_BYTE(0x80))
+
+typedef struct _EntityReplacement
+{
+	const char *name;
+	const char *replacement;
+} EntityReplacement;
+
+/*
+ * Replacements are never longer than their entity
+ */
+static const EntityReplacement entityReplacements[] =
+{
+	{ "amp", "&" },
+	{ "lt", "<" },
+	{ "gt", ">" },
+	{ "quot", "\"" },
+	{ "apos", "'" },
+	{ "nbsp", " " },
+	{ "copy", "\xc2\xa9" },
+	{ "reg", "\xc2\xae" },
+	{ NULL, NULL }
+};
+
+typedef struct _TagAction
+{
+	const char *name;
+	/* a FormattingSpanType or TAG_BREAK */
+	int action;
+} TagAction;
+
+static const TagAction tagActions[] =
+{
+	{ "br", TAG_BREAK },
+	{ "b", SPAN_BOLD },
+	{ "strong", SPAN_BOLD },
+	{ "i", SPAN_ITALIC },
+	{ "em", SPAN_ITALIC },
+	{ "u", SPAN_UNDERLINE },
+	{ "a", SPAN_LINK },
+	{ NULL, 0 }
+};
+
+/*
+ * Length of the prefix of text that has no '<' and no '&'
+ */
+static gsize findMarkup(const char *text, gsize length)
+{
+	gsize i = 0;
+	for (; i + sizeof(guint64) <= length; i += sizeof(guint64))
+	{
+		guint64 word;
+		memcpy(&word, text + i, sizeof(word));
+		if (HAS_ZERO_BYTE(word ^ REPEATED_BYTE('<')) | HAS_ZERO_BYTE(word ^ REPEATED_BYTE('&')))
+		{
+			break;
+		}
+	}
+	for (; i < length; i++)
+	{
+		if (text[i] == '<' || text[i] == '&')
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+static gboolean decodeNumericEntity(const char *name, gsize nameLength, char *out, gsize *outLength)
+{
+	/* name[0] is '#' */
+	gsize i = 1;
+	guint base = 10;
+	gunichar codePoint = 0;
+
+	if (i < nameLength && (name[i] == 'x' || name[i] == 'X'))
+	{
+		base = 16;
+		i++;
+	}
+	if (i == nameLength)
+	{
+		return FALSE;
+	}
+	for (; i < nameLength; i++)
+	{
+		int digit = base == 16 ? g_ascii_xdigit_value(name[i]) : g_ascii_digit_value(name[i]);
+		if (digit < 0)
+		{
+			return FALSE;
+		}
+		codePoint = codePoint * base + digit;
+		if (codePoint > 0x10FFFF)
+		{
+			return FALSE;
+		}
+	}
+	if (codePoint == 0 || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+	{
+		return FALSE;
+	}
+	*outLength += g_unichar_to_utf8(codePoint, out + *outLength);
+	return TRUE;
+}
+
+/*
+ * text starts with '&'. Returns the number of bytes used up.
+ */
+static gsize decodeEntity(const char *text, gsize length, char *out, gsize *outLength)
+{
+	gsize end = 1;
+	while (end < length && end <= MAX_ENTITY_LENGTH + 1 && text[end] != ';')
+	{
+		end++;
+	}
+
+	if (end < length && text[end] == ';' && end > 1)
+	{
+		const char *name = text + 1;
+		gsize nameLength = end - 1;
+
+		if (name[0] == '#')
+		{
+			if (decodeNumericEntity(name, nameLength, out, outLength))
+			{
+				return end + 1;
+			}
+		}
+		else
+		{
+			const EntityReplacement *entity;
+			for (entity = entityReplacements; entity->name != NULL; entity++)
+			{
+				if (strlen(entity->name) == nameLength && strncmp(entity->name, name, nameLength) == 0)
+				{
+					gsize replacementLength = strlen(entity->replacement);
+					memcpy(out + *outLength, entity->replacement, replacementLength);
+					*outLength += replacementLength;
+					return end + 1;
+				}
+			}
+		}
+	}
+
+	/* not an entity we know, keep the '&' */
+	out[(*outLength)++] = '&';
+	return 1;
+}
+
+/*
+ * Finds the value of an attribute in the attributes part of a tag (quotes removed)
+ */
+static gboolean findAttribute(const char *attributes, gsize length, const char *attributeName, const char **value,
+		gsize *valueLength)
+{
+	gsize nameLength = strlen(attributeName);
+	gsize i = 0;
+
+	while (i < length)
+	{
+		while (i < length && !g_ascii_isalpha(attributes[i]))
+		{
+			i++;
+		}
+		gsize nameStart = i;
+		while (i < length && (g_ascii_isalnum(attributes[i]) || attributes[i] == '-'))
+		{
+			i++;
+		}
+		gboolean matches = i - nameStart == nameLength
+				&& g_ascii_strncasecmp(attributes + nameStart, attributeName, nameLength) == 0;
+
+		while (i < length && g_ascii_isspace(attributes[i]))
+		{
+			i++;
+		}
+		if (i >= length || attributes[i] != '=')
+		{
+			continue;
+		}
+		i++;
+		while (i < length && g_ascii_isspace(attributes[i]))
+		{
+			i++;
+		}
+
+		gsize valueStart = i;
+		gsize valueEnd;
+		if (i < length && (attributes[i] == '"' || attributes[i] == '\''))
+		{
+			char quote = attributes[i];
+			valueStart = ++i;
+			while (i < length && attributes[i] != quote)
+			{
+				i++;
+			}
+			valueEnd = i++;
+		}
+		else
+		{
+			while (i < length && !g_ascii_isspace(attributes[i]))
+			{
+				i++;
+			}
+			valueEnd = i;
+		}
+
+		if (matches)
+		{
+			*value = attributes + valueStart;
+			*valueLength = valueEnd - valueStart;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void openSpan(FormattingSpanType type, gsize start, const char *href, gsize hrefLength, FormattingSpan *spans,
+		guint maxSpans, guint *spanCount)
+{
+	if (spans == NULL || *spanCount >= maxSpans)
+	{
+		return;
+	}
+	FormattingSpan *span = &spans[(*spanCount)++];
+	span->type = type;
+	span->start = start;
+	span->end = OPEN_SPAN_END;
+	span->href = href;
+	span->hrefLength = hrefLength;
+}
+
+static void closeSpan(FormattingSpanType type, gsize end, FormattingSpan *spans, guint *spanCount)
+{
+	guint i;
+	if (spans == NULL)
+	{
+		return;
+	}
+	for (i = *spanCount; i-- > 0;)
+	{
+		if (spans[i].type == type && spans[i].end == OPEN_SPAN_END)
+		{
+			spans[i].end = end;
+			if (spans[i].start == end && i == *spanCount - 1)
+			{
+				/* nothing in it */
+				(*spanCount)--;
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * text starts with '<'. Returns the number of bytes used up.
+ */
+static gsize processTag(const char *text, gsize length, char *out, gsize *outLength, FormattingSpan *spans,
+		guint maxSpans, guint *spanCount)
+{
+	gsize i = 1;
+	gboolean closing = FALSE;
+
+	if (length >= 4 && strncmp(text, "<!--", 4) == 0)
+	{
+		const char *commentEnd = g_strstr_len(text + 4, length - 4, "-->");
+		if (commentEnd != NULL)
+		{
+			return commentEnd + 3 - text;
+		}
+	}
+
+	if (i < length && text[i] == '/')
+	{
+		closing = TRUE;
+		i++;
+	}
+	gsize nameStart = i;
+	if (i >= length || !g_ascii_isalpha(text[i]))
+	{
+		/* "a < b", "<3" */
+		out[(*outLength)++] = '<';
+		return 1;
+	}
+	while (i < length && g_ascii_isalnum(text[i]))
+	{
+		i++;
+	}
+	gsize nameLength = i - nameStart;
+
+	gsize attributesStart = i;
+	char quote = 0;
+	for (; i < length; i++)
+	{
+		if (quote)
+		{
+			if (text[i] == quote)
+			{
+				quote = 0;
+			}
+		}
+		else if (text[i] == '"' || text[i] == '\'')
+		{
+			quote = text[i];
+		}
+		else if (text[i] == '>')
+		{
+			break;
+		}
+	}
+	if (i >= length)
+	{
+		/* never closed, so it wasn't a tag */
+		out[(*outLength)++] = '<';
+		return 1;
+	}
+
+	const TagAction *tag;
+	for (tag = tagActions; tag->name != NULL; tag++)
+	{
+		if (strlen(tag->name) == nameLength && g_ascii_strncasecmp(tag->name, text + nameStart, nameLength) == 0)
+		{
+			break;
+		}
+	}
+
+	if (tag->name == NULL)
+	{
+		/* <font>, <html>, <body>, <span>... */
+	}
+	else if (tag->action == TAG_BREAK)
+	{
+		if (!closing)
+		{
+			out[(*outLength)++] = '\n';
+		}
+	}
+	else if (closing)
+	{
+		closeSpan(tag->action, *outLength, spans, spanCount);
+	}
+	else
+	{
+		const char *href = NULL;
+		gsize hrefLength = 0;
+		if (tag->action == SPAN_LINK)
+		{
+			findAttribute(text + attributesStart, i - attributesStart, "href", &href, &hrefLength);
+		}
+		openSpan(tag->action, *outLength, href, hrefLength, spans, maxSpans, spanCount);
+	}
+
+	return i + 1;
+}
+
+gsize markupNormalize(const char *markup, gsize length, char *out, FormattingSpan *spans, guint maxSpans,
+		guint *spanCount)
+{
+	gsize in = 0;
+	gsize outLength = 0;
+	guint count = 0;
+	guint i;
+
+	while (in < length)
+	{
+		gsize run = findMarkup(markup + in, length - in);
+		memcpy(out + outLength, markup + in, run);
+		outLength += run;
+		in += run;
+
+		if (in >= length)
+		{
+			break;
+		}
+		if (markup[in] == '&')
+		{
+			in += decodeEntity(markup + in, length - in, out, &outLength);
+		}
+		else
+		{
+			in += processTag(markup + in, length - in, out, &outLength, spans, maxSpans, &count);
+		}
+	}
+	out[outLength] = '\0';
+
+	if (spans != NULL)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (spans[i].end == OPEN_SPAN_END)
+			{
+				spans[i].end = outLength;
+			}
+		}
+	}
+	if (spanCount != NULL)
+	{
+		*spanCount = count;
+	}
+	return outLength;
+}
+
+const char* markupSpanTypeName(FormattingSpanType type)
+{
+	switch (type)
+	{
+	case SPAN_BOLD:
+		return "bold";
+	case SPAN_ITALIC:
+		return "italic";
+	case SPAN_UNDERLINE:
+		return "underline";
+	case SPAN_LINK:
+		return "link";
+	}
+	return "";
+}
@@ -0,0 +1,428 @@
+/*
+ * <MessageSpool.c: memory-mapped ring of the most recent incoming messages>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * If nobody is subscribed to /registerForIncomingMessages (e.g. the messaging service is restarting) the messages we
+ * send are lost. Every incoming message is therefore also appended to a fixed-size file that is mapped into memory,
+ * so that a subscriber can ask for everything after the last sequence number it saw.
+ *
+ * Layout: a SpoolHeader followed by a ring of records. Each record is a SpoolRecord followed by the key of the account
+ * the message came to and its payload (padded to 4 bytes together), so that a replay can be limited to one account. A record that doesn't fit before the end of the file is written at the start of the ring instead, and a
+ * wrap marker is left where it would have gone. The header knows where the oldest record is, where the next one goes
+ * and how many there are; at startup we walk the records from the oldest one and stop at the first one whose checksum
+ * doesn't match (a write that was cut short).
+ *
+ * Writing a record is a memcpy into the mapping plus a CRC; the kernel writes the pages back on its own, so the
+ * records survive the process (but not necessarily the device) going down.
+ */
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "MessageSpool.h"
+
+#define SPOOL_MAGIC 0x53504f4c		/* "SPOL" */
+#define SPOOL_VERSION 2
+#define RECORD_MAGIC 0x5245434d		/* "RECM" */
+#define WRAP_MAGIC 0x57524150		/* "WRAP" */
+
+#define ALIGN4(n) (((n) + 3) & ~3)
+
+typedef struct _SpoolHeader
+{
+	guint32 magic;
+	guint32 version;
+	guint32 size;
+	guint32 oldestOffset;
+	guint32 writeOffset;
+	guint32 recordCount;
+	/* kept in the header so that sequence numbers keep going up even if all the records are lost */
+	guint32 lastSeq;
+	/* changes whenever lastSeq starts over, i.e. whenever the spool does */
+	guint32 epoch;
+} SpoolHeader;
+
+typedef struct _SpoolRecord
+{
+	guint32 magic;
+	guint32 length;
+	guint32 seq;
+	/* CRC-32 of length, seq, keyLength, the key and the payload */
+	guint32 checksum;
+	/* the key comes first, without a terminating NUL */
+	guint32 keyLength;
+} SpoolRecord;
+
+#define DATA_START ((guint32) sizeof(SpoolHeader))
+
+static guint8 *spool = NULL;
+static guint32 spoolSize = 0;
+static SpoolHeader *header = NULL;
+static pthread_mutex_t spoolLock = PTHREAD_MUTEX_INITIALIZER;
+static guint32 crcTable[256];
+
+static void initCrcTable(void)
+{
+	guint32 i;
+	int bit;
+	for (i = 0; i < 256; i++)
+	{
+		guint32 crc = i;
+		for (bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+		}
+		crcTable[i] = crc;
+	}
+}
+
+static guint32 updateCrc(guint32 crc, const guint8 *data, gsize length)
+{
+	while (length--)
+	{
+		crc = crcTable[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+static guint32 getRecordChecksum(const SpoolRecord *record)
+{
+	guint32 crc = 0xffffffff;
+	crc = updateCrc(crc, (const guint8 *) &record->length, sizeof(record->length));
+	crc = updateCrc(crc, (const guint8 *) &record->seq, sizeof(record->seq));
+	crc = updateCrc(crc, (const guint8 *) &record->keyLength, sizeof(record->keyLength));
+	crc = updateCrc(crc, (const guint8 *) (record + 1), record->keyLength + record->length);
+	return crc ^ 0xffffffff;
+}
+
+/*
+ * Size of a record with dataLength bytes of key and payload
+ */
+static guint32 getRecordSize(guint32 dataLength)
+{
+	return sizeof(SpoolRecord) + ALIGN4(dataLength);
+}
+
+static guint32 getStoredRecordSize(const SpoolRecord *record)
+{
+	return getRecordSize(record->keyLength + record->length);
+}
+
+static SpoolRecord* getRecordAt(guint32 offset)
+{
+	return (SpoolRecord *) (spool + offset);
+}
+
+/*
+ * Where the record after the one ending at offset starts: offset itself, or the start of the ring if there's a wrap
+ * marker (or no room for a record) at offset. Only call this for offsets that are followed by another record.
+ */
+static guint32 followWrap(guint32 offset)
+{
+	if (offset + sizeof(SpoolRecord) > spoolSize || getRecordAt(offset)->magic == WRAP_MAGIC)
+	{
+		return DATA_START;
+	}
+	return offset;
+}
+
+/*
+ * Positive and fits a JSON int
+ */
+static guint32 newEpoch(void)
+{
+	return g_random_int_range(1, G_MAXINT32);
+}
+
+static void resetSpool(void)
+{
+	memset(spool, 0, DATA_START);
+	header->magic = SPOOL_MAGIC;
+	header->version = SPOOL_VERSION;
+	header->size = spoolSize;
+	header->oldestOffset = DATA_START;
+	header->writeOffset = DATA_START;
+	header->recordCount = 0;
+	header->lastSeq = 0;
+	header->epoch = newEpoch();
+}
+
+static gboolean isValidRecord(guint32 offset)
+{
+	if (offset < DATA_START || offset + sizeof(SpoolRecord) > spoolSize)
+	{
+		return FALSE;
+	}
+	SpoolRecord *record = getRecordAt(offset);
+	if (record->magic != RECORD_MAGIC || record->length > spoolSize || record->keyLength > spoolSize
+			|| offset + getStoredRecordSize(record) > spoolSize)
+	{
+		return FALSE;
+	}
+	return record->checksum == getRecordChecksum(record);
+}
+
+/*
+ * Walks the records the header knows about and drops everything from the first one that is damaged
+ */
+static void recoverSpool(void)
+{
+	if (header->magic != SPOOL_MAGIC || header->version != SPOOL_VERSION || header->size != spoolSize
+			|| header->oldestOffset < DATA_START || header->oldestOffset >= spoolSize
+			|| header->writeOffset < DATA_START || header->writeOffset > spoolSize)
+	{
+		syslog(LOG_INFO, "Incoming message spool is not valid. Starting with an empty one.");
+		resetSpool();
+		return;
+	}
+
+	if (header->epoch == 0 || header->epoch > G_MAXINT32)
+	{
+		header->epoch = newEpoch();
+	}
+
+	guint32 offset = header->oldestOffset;
+	guint32 end = header->oldestOffset;
+	guint32 validRecords = 0;
+	while (validRecords < header->recordCount)
+	{
+		if (validRecords > 0)
+		{
+			offset = followWrap(end);
+		}
+		if (!isValidRecord(offset))
+		{
+			break;
+		}
+		header->lastSeq = MAX(header->lastSeq, getRecordAt(offset)->seq);
+		end = offset + getStoredRecordSize(getRecordAt(offset));
+		validRecords++;
+	}
+
+	if (validRecords < header->recordCount)
+	{
+		syslog(LOG_INFO, "Dropped %u damaged records from the incoming message spool",
+				header->recordCount - validRecords);
+	}
+	header->recordCount = validRecords;
+	if (validRecords == 0)
+	{
+		header->oldestOffset = DATA_START;
+		header->writeOffset = DATA_START;
+	}
+	else
+	{
+		header->writeOffset = end;
+	}
+}
+
+static void evictOldestRecord(void)
+{
+	guint32 oldest = header->oldestOffset;
+	header->recordCount--;
+	if (header->recordCount > 0)
+	{
+		header->oldestOffset = followWrap(oldest + getStoredRecordSize(getRecordAt(oldest)));
+	}
+}
+
+bool messageSpoolOpen(const char *path, guint32 size)
+{
+	struct stat fileStat;
+
+	if (spool != NULL)
+	{
+		return TRUE;
+	}
+
+	initCrcTable();
+
+	size = ALIGN4(size);
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+	{
+		syslog(LOG_INFO, "Could not open the incoming message spool %s", path);
+		return FALSE;
+	}
+
+	gboolean resizing = fstat(fd, &fileStat) != 0 || fileStat.st_size != size;
+	if (resizing && ftruncate(fd, size) != 0)
+	{
+		syslog(LOG_INFO, "Could not size the incoming message spool %s", path);
+		close(fd);
+		return FALSE;
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		syslog(LOG_INFO, "Could not map the incoming message spool %s", path);
+		return FALSE;
+	}
+
+	spool = mapping;
+	spoolSize = size;
+	header = mapping;
+
+	if (resizing)
+	{
+		resetSpool();
+	}
+	else
+	{
+		recoverSpool();
+	}
+	syslog(LOG_INFO, "Incoming message spool has %u records, last seq %u, epoch %u", header->recordCount, header->lastSeq,
+			header->epoch);
+	return TRUE;
+}
+
+void messageSpoolClose(void)
+{
+	pthread_mutex_lock(&spoolLock);
+	if (spool != NULL)
+	{
+		munmap(spool, spoolSize);
+		spool = NULL;
+		header = NULL;
+	}
+	pthread_mutex_unlock(&spoolLock);
+}
+
+guint messageSpoolLastSeq(void)
+{
+	guint lastSeq = 0;
+	pthread_mutex_lock(&spoolLock);
+	if (spool != NULL)
+	{
+		lastSeq = header->lastSeq;
+	}
+	pthread_mutex_unlock(&spoolLock);
+	return lastSeq;
+}
+
+guint messageSpoolEpoch(void)
+{
+	guint epoch = 0;
+	pthread_mutex_lock(&spoolLock);
+	if (spool != NULL)
+	{
+		epoch = header->epoch;
+	}
+	pthread_mutex_unlock(&spoolLock);
+	return epoch;
+}
+
+void messageSpoolAppend(guint seq, const char *key, const char *payload, gsize length)
+{
+	gsize keyLength = key ? strlen(key) : 0;
+
+	pthread_mutex_lock(&spoolLock);
+	if (spool == NULL || length > spoolSize || keyLength > spoolSize
+			|| getRecordSize(keyLength + length) > spoolSize - DATA_START)
+	{
+		pthread_mutex_unlock(&spoolLock);
+		return;
+	}
+
+	guint32 needed = getRecordSize(keyLength + length);
+	guint32 offset = header->recordCount > 0 ? header->writeOffset : DATA_START;
+
+	if (offset + needed > spoolSize)
+	{
+		/*
+		 * Doesn't fit before the end of the file. Whatever is left between here and the end is dropped and we carry
+		 * on at the start of the ring.
+		 */
+		while (header->recordCount > 0 && header->oldestOffset >= offset)
+		{
+			evictOldestRecord();
+		}
+		if (offset + sizeof(SpoolRecord) <= spoolSize)
+		{
+			getRecordAt(offset)->magic = WRAP_MAGIC;
+		}
+		offset = DATA_START;
+	}
+
+	while (header->recordCount > 0 && header->oldestOffset >= offset && header->oldestOffset < offset + needed)
+	{
+		evictOldestRecord();
+	}
+	if (header->recordCount == 0)
+	{
+		header->oldestOffset = offset;
+	}
+
+	/*
+	 * The header no longer points at what we're about to overwrite. Write the record, magic last, then publish it.
+	 */
+	SpoolRecord *record = getRecordAt(offset);
+	record->magic = 0;
+	record->length = length;
+	record->seq = seq;
+	record->keyLength = keyLength;
+	if (keyLength > 0)
+	{
+		memcpy(record + 1, key, keyLength);
+	}
+	memcpy((guint8 *) (record + 1) + keyLength, payload, length);
+	record->checksum = getRecordChecksum(record);
+	record->magic = RECORD_MAGIC;
+
+	header->writeOffset = offset + needed;
+	header->lastSeq = seq;
+	header->recordCount++;
+
+	pthread_mutex_unlock(&spoolLock);
+}
+
+guint messageSpoolCollectSince(guint sinceSeq, const char *key, GString *out)
+{
+	gsize keyLength = key ? strlen(key) : 0;
+	guint collected = 0;
+	guint32 i;
+
+	pthread_mutex_lock(&spoolLock);
+	if (spool != NULL && header->recordCount > 0)
+	{
+		guint32 offset = header->oldestOffset;
+		for (i = 0; i < header->recordCount; i++)
+		{
+			SpoolRecord *record = getRecordAt(offset);
+			const char *recordKey = (const char *) (record + 1);
+			if (record->seq > sinceSeq
+					&& (key == NULL || (record->keyLength == keyLength && memcmp(recordKey, key, keyLength) == 0)))
+			{
+				if (collected > 0)
+				{
+					g_string_append_c(out, ',');
+				}
+				g_string_append_len(out, recordKey + record->keyLength, record->length);
+				collected++;
+			}
+			offset = followWrap(offset + getStoredRecordSize(record));
+		}
+	}
+	pthread_mutex_unlock(&spoolLock);
+	return collected;
+}
@@ -0,0 +1,253 @@
+/*
+ * <OutboundQueue.c: holds outgoing messages while their account is still signing on>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * sendMessage used to fail with errorCode 11 whenever the account was not online yet, even if it was about to sign on.
+ * Messages for a pending account now wait here (bounded, per account) and go out in order once account_logged_in is
+ * called. Messages of an online account that the rate limiter holds back wait here too. The outcome of every queued
+ * message is published on /registerForMessageDeliveryStatus.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <syslog.h>
+
+#include "EventWorker.h"
+#include "OutboundQueue.h"
+#include "RateLimiter.h"
+
+typedef struct _QueuedMessage
+{
+	guint id;
+	char *serviceName;
+	char *username;
+	char *usernameTo;
+	char *messageText;
+	char *clientId;
+} QueuedMessage;
+
+typedef struct _AccountQueue
+{
+	/* QueuedMessages, oldest first */
+	GQueue messages;
+	/* set once the account is online and the queue is being sent */
+	PurpleAccount *account;
+	/* TRUE while we're waiting for the rate limiter to let the next message go */
+	gboolean waitingForToken;
+} AccountQueue;
+
+/**
+ * key: accountKey, value: AccountQueue
+ */
+static GHashTable *queuedMessages = NULL;
+static guint maxQueuedMessages = 0;
+static guint totalQueuedMessages = 0;
+static guint lastMessageId = 0;
+static OutboundSendFunction sendMessageFunction = NULL;
+
+static void freeQueuedMessage(QueuedMessage *queuedMessage)
+{
+	g_free(queuedMessage->serviceName);
+	g_free(queuedMessage->username);
+	g_free(queuedMessage->usernameTo);
+	g_free(queuedMessage->messageText);
+	g_free(queuedMessage->clientId);
+	g_free(queuedMessage);
+}
+
+static void postDeliveryStatus(const QueuedMessage *queuedMessage, const char *errorCode, const char *errorText)
+{
+	char messageId[16];
+	g_snprintf(messageId, sizeof(messageId), "%u", queuedMessage->id);
+
+	const char *fields[DELIVERY_FIELD_COUNT];
+	fields[DELIVERY_SERVICE_NAME] = queuedMessage->serviceName;
+	fields[DELIVERY_USERNAME] = queuedMessage->username;
+	fields[DELIVERY_USERNAME_TO] = queuedMessage->usernameTo;
+	fields[DELIVERY_CLIENT_ID] = queuedMessage->clientId;
+	fields[DELIVERY_MESSAGE_ID] = messageId;
+	fields[DELIVERY_ERROR_CODE] = errorCode;
+	fields[DELIVERY_ERROR_TEXT] = errorText;
+	eventWorkerPost(EVENT_DELIVERY_STATUS, __FUNCTION__, fields, DELIVERY_FIELD_COUNT);
+}
+
+static void freeAccountQueue(AccountQueue *queue)
+{
+	QueuedMessage *queuedMessage;
+	while ((queuedMessage = g_queue_pop_head(&queue->messages)) != NULL)
+	{
+		freeQueuedMessage(queuedMessage);
+	}
+	g_free(queue);
+}
+
+/*
+ * Takes the account's queue out of the table. The caller owns it afterwards.
+ */
+static AccountQueue* stealQueue(const char *accountKey)
+{
+	gpointer originalKey = NULL;
+	gpointer queue = NULL;
+
+	if (queuedMessages == NULL
+			|| !g_hash_table_lookup_extended(queuedMessages, accountKey, &originalKey, &queue))
+	{
+		return NULL;
+	}
+	g_hash_table_steal(queuedMessages, accountKey);
+	g_free(originalKey);
+	totalQueuedMessages -= ((AccountQueue *) queue)->messages.length;
+	return queue;
+}
+
+static void sendQueuedMessage(AccountQueue *queue)
+{
+	QueuedMessage *queuedMessage = g_queue_pop_head(&queue->messages);
+	totalQueuedMessages--;
+	if (sendMessageFunction(queue->account, queuedMessage->usernameTo, queuedMessage->messageText))
+	{
+		postDeliveryStatus(queuedMessage, NULL, NULL);
+	}
+	else
+	{
+		postDeliveryStatus(queuedMessage, "12", "Could not open a conversation");
+	}
+	freeQueuedMessage(queuedMessage);
+}
+
+/*
+ * The rate limiter took a token for the next message of the account
+ */
+static void sendNextQueuedMessage(const char *accountKey, gpointer data)
+{
+	AccountQueue *queue = g_hash_table_lookup(queuedMessages, accountKey);
+	if (queue == NULL)
+	{
+		return;
+	}
+	queue->waitingForToken = FALSE;
+	if (queue->account == NULL)
+	{
+		/* the account went offline and is signing on again; account_logged_in flushes the queue */
+		return;
+	}
+	sendQueuedMessage(queue);
+	outboundQueueFlush(accountKey, queue->account);
+}
+
+void outboundQueueInit(guint maxMessagesPerAccount, OutboundSendFunction sendFunction)
+{
+	maxQueuedMessages = maxMessagesPerAccount;
+	sendMessageFunction = sendFunction;
+	if (queuedMessages == NULL)
+	{
+		queuedMessages = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) freeAccountQueue);
+	}
+}
+
+guint outboundQueueAdd(const char *accountKey, const char *serviceName, const char *username, const char *usernameTo,
+		const char *messageText, const char *clientId)
+{
+	g_return_val_if_fail(queuedMessages != NULL, 0);
+
+	AccountQueue *queue = g_hash_table_lookup(queuedMessages, accountKey);
+	if (queue == NULL)
+	{
+		queue = g_new0(AccountQueue, 1);
+		g_queue_init(&queue->messages);
+		g_hash_table_insert(queuedMessages, g_strdup(accountKey), queue);
+	}
+	if (queue->messages.length >= maxQueuedMessages)
+	{
+		return 0;
+	}
+
+	QueuedMessage *queuedMessage = g_new0(QueuedMessage, 1);
+	if (++lastMessageId == 0)
+	{
+		/* 0 means "not queued" */
+		++lastMessageId;
+	}
+	queuedMessage->id = lastMessageId;
+	queuedMessage->serviceName = g_strdup(serviceName);
+	queuedMessage->username = g_strdup(username);
+	queuedMessage->usernameTo = g_strdup(usernameTo);
+	queuedMessage->messageText = g_strdup(messageText);
+	queuedMessage->clientId = g_strdup(clientId);
+
+	g_queue_push_tail(&queue->messages, queuedMessage);
+	totalQueuedMessages++;
+	return queuedMessage->id;
+}
+
+void outboundQueueFlush(const char *accountKey, PurpleAccount *account)
+{
+	AccountQueue *queue = queuedMessages ? g_hash_table_lookup(queuedMessages, accountKey) : NULL;
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	if (queue->account == NULL)
+	{
+		eventWorkerSyslog(LOG_INFO, "Sending %u queued messages", queue->messages.length);
+	}
+	queue->account = account;
+
+	while (!g_queue_is_empty(&queue->messages))
+	{
+		if (queue->waitingForToken)
+		{
+			return;
+		}
+		QueuedMessage *next = g_queue_peek_head(&queue->messages);
+		if (!rateLimiterTryAcquire(accountKey, next->serviceName, RATE_CLASS_MESSAGE))
+		{
+			queue->waitingForToken = TRUE;
+			rateLimiterWait(accountKey, next->serviceName, RATE_CLASS_MESSAGE, sendNextQueuedMessage, NULL, NULL);
+			return;
+		}
+		sendQueuedMessage(queue);
+	}
+	g_hash_table_remove(queuedMessages, accountKey);
+}
+
+void outboundQueueFail(const char *accountKey, const char *errorCode, const char *errorText)
+{
+	AccountQueue *queue = stealQueue(accountKey);
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	QueuedMessage *queuedMessage;
+	while ((queuedMessage = g_queue_pop_head(&queue->messages)) != NULL)
+	{
+		postDeliveryStatus(queuedMessage, errorCode, errorText);
+		freeQueuedMessage(queuedMessage);
+	}
+	freeAccountQueue(queue);
+}
+
+guint outboundQueueAccountLength(const char *accountKey)
+{
+	AccountQueue *queue = queuedMessages ? g_hash_table_lookup(queuedMessages, accountKey) : NULL;
+	return queue ? queue->messages.length : 0;
+}
+
+guint outboundQueueLength(void)
+{
+	return totalQueuedMessages;
+}
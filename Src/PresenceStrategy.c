@@ -0,0 +1,358 @@
+/*
+ * <PresenceStrategy.c: what each account does with presence updates while the display is off>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Nobody looks at presence while the display is off, yet every update wakes the radio and the CPU. How to avoid that
+ * depends on the server:
+ *  - Google Talk queues presence updates on request (google:queue) and sends them when the queue is flushed.
+ *  - XMPP servers that advertise Client State Indication (XEP-0352) in their stream features hold back what is not
+ *    urgent while the client says it is inactive.
+ *  - Everything else still sends every update. We at least don't pass them on: the latest presence of each buddy is
+ *    kept and sent to the clients when the display comes back on.
+ * The first strategy an account's server supports is picked when it signs on.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "PresenceStrategy.h"
+
+#define CSI_NAMESPACE "urn:xmpp:csi:0"
+#define STREAM_NAMESPACE "http://etherx.jabber.org/streams"
+
+typedef struct _PresenceStrategy
+{
+	const char *name;
+	bool (*isSupported)(PurpleAccount *account);
+	/* append the stanza that goes to the server when the account becomes idle / active; may append nothing */
+	void (*appendIdleStanza)(PurpleAccount *account, GString *stanza);
+	void (*appendActiveStanza)(PurpleAccount *account, GString *stanza);
+	/* presence updates of idle accounts are held back by us */
+	bool holdsUpdates;
+} PresenceStrategy;
+
+typedef struct _AccountPresence
+{
+	char *accountKey;
+	PurpleAccount *account;
+	const PresenceStrategy *strategy;
+	bool idle;
+	/* names of the buddies whose presence was held back (set) */
+	GHashTable *heldBuddies;
+} AccountPresence;
+
+/**
+ * key: accountKey (owned by the value), value: AccountPresence
+ */
+static GHashTable *accountPresence = NULL;
+
+/**
+ * key: PurpleAccount, value: the same AccountPresence
+ */
+static GHashTable *accountPresenceByAccount = NULL;
+
+/**
+ * PurpleAccounts whose server listed CSI in its last stream features
+ */
+static GHashTable *csiAccounts = NULL;
+
+static PresenceReleasedFunction presenceReleased = NULL;
+static PresenceStrategyStats presenceStrategyStats;
+
+static bool isGoogleTalkAccount(PurpleAccount *account)
+{
+	if (strcmp(purple_account_get_protocol_id(account), "prpl-jabber") != 0)
+	{
+		return FALSE;
+	}
+	const char *domain = strchr(purple_account_get_username(account), '@');
+	return strcmp(purple_account_get_string(account, "connect_server", ""), "talk.google.com") == 0
+			|| (domain != NULL && (g_str_has_prefix(domain, "@gmail.com") || g_str_has_prefix(domain, "@googlemail.com")));
+}
+
+static void appendGoogleQueueStanza(PurpleAccount *account, GString *stanza, const char *command)
+{
+	PurpleConnection *pc = purple_account_get_connection(account);
+	const char *displayName = pc ? purple_connection_get_display_name(pc) : NULL;
+	if (displayName != NULL)
+	{
+		g_string_append_printf(stanza, "<iq from='%s' type='set'><query xmlns='google:queue'>%s</query></iq>",
+				displayName, command);
+	}
+}
+
+static void appendGoogleQueueEnable(PurpleAccount *account, GString *stanza)
+{
+	appendGoogleQueueStanza(account, stanza, "<enable/>");
+}
+
+static void appendGoogleQueueDisable(PurpleAccount *account, GString *stanza)
+{
+	appendGoogleQueueStanza(account, stanza, "<disable/><flush/>");
+}
+
+static bool isCsiSupported(PurpleAccount *account)
+{
+	return g_hash_table_lookup(csiAccounts, account) != NULL;
+}
+
+static void appendCsiInactive(PurpleAccount *account, GString *stanza)
+{
+	g_string_append(stanza, "<inactive xmlns='" CSI_NAMESPACE "'/>");
+}
+
+static void appendCsiActive(PurpleAccount *account, GString *stanza)
+{
+	g_string_append(stanza, "<active xmlns='" CSI_NAMESPACE "'/>");
+}
+
+static bool isAlwaysSupported(PurpleAccount *account)
+{
+	return TRUE;
+}
+
+/**
+ * In order of preference
+ */
+static const PresenceStrategy presenceStrategies[] =
+{
+	{ "csi", isCsiSupported, appendCsiInactive, appendCsiActive, FALSE },
+	{ "google:queue", isGoogleTalkAccount, appendGoogleQueueEnable, appendGoogleQueueDisable, FALSE },
+	{ "local", isAlwaysSupported, NULL, NULL, TRUE }
+};
+
+static void freeAccountPresence(gpointer data)
+{
+	AccountPresence *presence = data;
+	g_free(presence->accountKey);
+	g_hash_table_destroy(presence->heldBuddies);
+	g_free(presence);
+}
+
+/*
+ * Remembers whether the server offers CSI. The features after authentication are the last ones before signed-on.
+ */
+static void jabberReceivingXmlnode(PurpleConnection *gc, xmlnode **packet, gpointer unused)
+{
+	xmlnode *node = *packet;
+	if (node == NULL || strcmp(node->name, "features") != 0 || g_strcmp0(xmlnode_get_namespace(node), STREAM_NAMESPACE) != 0)
+	{
+		return;
+	}
+	PurpleAccount *account = purple_connection_get_account(gc);
+	if (xmlnode_get_child_with_namespace(node, "csi", CSI_NAMESPACE) != NULL)
+	{
+		g_hash_table_insert(csiAccounts, account, account);
+	}
+	else
+	{
+		g_hash_table_remove(csiAccounts, account);
+	}
+}
+
+static void sendStanza(PurpleAccount *account, GString *stanza)
+{
+	PurpleConnection *gc = purple_account_get_connection(account);
+	PurplePlugin *prpl = gc ? purple_connection_get_prpl(gc) : NULL;
+	PurplePluginProtocolInfo *prpl_info = prpl ? PURPLE_PLUGIN_PROTOCOL_INFO(prpl) : NULL;
+
+	if (prpl_info && prpl_info->send_raw)
+	{
+		prpl_info->send_raw(gc, stanza->str, stanza->len);
+	}
+}
+
+static gboolean releaseHeldBuddy(gpointer key, gpointer value, gpointer data)
+{
+	AccountPresence *presence = data;
+	PurpleBuddy *buddy = purple_find_buddy(presence->account, key);
+	if (buddy != NULL)
+	{
+		presenceStrategyStats.released++;
+		presenceReleased(buddy);
+	}
+	return TRUE;
+}
+
+/*
+ * stanza is scratch space, so that setting all accounts idle doesn't allocate per account
+ */
+static void setAccountIdle(AccountPresence *presence, bool idle, GString *stanza)
+{
+	const PresenceStrategy *strategy = presence->strategy;
+	void (*appendStanza)(PurpleAccount *, GString *) = idle ? strategy->appendIdleStanza : strategy->appendActiveStanza;
+
+	if (presence->idle == idle)
+	{
+		return;
+	}
+	presence->idle = idle;
+
+	if (appendStanza != NULL)
+	{
+		g_string_truncate(stanza, 0);
+		appendStanza(presence->account, stanza);
+		if (stanza->len > 0)
+		{
+			sendStanza(presence->account, stanza);
+		}
+	}
+	if (!idle && strategy->holdsUpdates)
+	{
+		g_hash_table_foreach_remove(presence->heldBuddies, releaseHeldBuddy, presence);
+	}
+	syslog(LOG_INFO, "%s presence strategy %s for %s", idle ? "Entered" : "Left", strategy->name, presence->accountKey);
+}
+
+void presenceStrategyInit(PresenceReleasedFunction released)
+{
+	static int handle;
+
+	if (accountPresence != NULL)
+	{
+		return;
+	}
+	presenceReleased = released;
+	accountPresence = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, freeAccountPresence);
+	accountPresenceByAccount = g_hash_table_new(g_direct_hash, g_direct_equal);
+	csiAccounts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	PurplePlugin *jabber = purple_plugins_find_with_id("prpl-jabber");
+	if (jabber == NULL || purple_signal_connect(jabber, "jabber-receiving-xmlnode", &handle,
+			PURPLE_CALLBACK(jabberReceivingXmlnode), NULL) == 0)
+	{
+		syslog(LOG_INFO, "Can't see XMPP stream features. CSI won't be used");
+	}
+}
+
+void presenceStrategyAddAccount(const char *accountKey, PurpleAccount *account)
+{
+	g_return_if_fail(accountPresence != NULL);
+
+	const PresenceStrategy *strategy = presenceStrategies;
+	while (!strategy->isSupported(account))
+	{
+		strategy++;
+	}
+
+	presenceStrategyRemoveAccount(accountKey);
+	AccountPresence *presence = g_new0(AccountPresence, 1);
+	presence->accountKey = g_strdup(accountKey);
+	presence->account = account;
+	presence->strategy = strategy;
+	presence->heldBuddies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_insert(accountPresence, presence->accountKey, presence);
+	g_hash_table_insert(accountPresenceByAccount, account, presence);
+	syslog(LOG_INFO, "Presence strategy for %s: %s", accountKey, strategy->name);
+}
+
+void presenceStrategyRemoveAccount(const char *accountKey)
+{
+	AccountPresence *presence = accountPresence ? g_hash_table_lookup(accountPresence, accountKey) : NULL;
+	if (presence != NULL)
+	{
+		g_hash_table_remove(csiAccounts, presence->account);
+		g_hash_table_remove(accountPresenceByAccount, presence->account);
+		g_hash_table_remove(accountPresence, accountKey);
+	}
+}
+
+void presenceStrategySetIdle(bool idle)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (accountPresence == NULL)
+	{
+		return;
+	}
+	GString *stanza = g_string_sized_new(128);
+	g_hash_table_iter_init(&iter, accountPresence);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		setAccountIdle(value, idle, stanza);
+	}
+	g_string_free(stanza, TRUE);
+}
+
+void presenceStrategySetLocalIdle(bool idle)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (accountPresence == NULL)
+	{
+		return;
+	}
+	/* the local strategy sends no stanza, so there's nothing to put in one */
+	GString *stanza = g_string_sized_new(0);
+	g_hash_table_iter_init(&iter, accountPresence);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		AccountPresence *presence = value;
+		if (presence->strategy->holdsUpdates)
+		{
+			setAccountIdle(presence, idle, stanza);
+		}
+	}
+	g_string_free(stanza, TRUE);
+}
+
+void presenceStrategySetAccountIdle(const char *accountKey, bool idle)
+{
+	AccountPresence *presence = accountPresence ? g_hash_table_lookup(accountPresence, accountKey) : NULL;
+	if (presence != NULL)
+	{
+		GString *stanza = g_string_sized_new(128);
+		setAccountIdle(presence, idle, stanza);
+		g_string_free(stanza, TRUE);
+	}
+}
+
+bool presenceStrategyHoldUpdate(PurpleBuddy *buddy)
+{
+	AccountPresence *presence = accountPresenceByAccount ?
+			g_hash_table_lookup(accountPresenceByAccount, purple_buddy_get_account(buddy)) : NULL;
+	if (presence == NULL || !presence->idle || !presence->strategy->holdsUpdates)
+	{
+		return FALSE;
+	}
+	presenceStrategyStats.held++;
+	if (g_hash_table_lookup(presence->heldBuddies, purple_buddy_get_name(buddy)) == NULL)
+	{
+		char *name = g_strdup(purple_buddy_get_name(buddy));
+		g_hash_table_insert(presence->heldBuddies, name, name);
+	}
+	return TRUE;
+}
+
+const char* presenceStrategyGetName(const char *accountKey)
+{
+	AccountPresence *presence = accountPresence ? g_hash_table_lookup(accountPresence, accountKey) : NULL;
+	return presence ? presence->strategy->name : NULL;
+}
+
+void presenceStrategyGetStats(PresenceStrategyStats *stats)
+{
+	*stats = presenceStrategyStats;
+}
+
+bool presenceStrategyIsIdle(const char *accountKey)
+{
+	AccountPresence *presence = accountPresence ? g_hash_table_lookup(accountPresence, accountKey) : NULL;
+	return presence != NULL && presence->idle;
+}
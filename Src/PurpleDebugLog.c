@@ -0,0 +1,197 @@
+/*
+ * <PurpleDebugLog.c: a byte-bounded ring of libpurple debug lines>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * libpurple calls is_enabled before it formats a debug line (since 2.6.0) and print only for the lines it formatted.
+ * Main loop only: that's the only thread libpurple logs from.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PurpleDebugLog.h"
+
+/**
+ * Longer lines (whole XMPP stanzas, mostly) are cut
+ */
+#define MAX_LINE_BYTES 4096
+
+typedef struct _DebugLine
+{
+	gint64 timeMs;
+	PurpleDebugLevel level;
+	/* interned */
+	const char *category;
+	char *text;
+} DebugLine;
+
+static PurpleDebugLevel minimumLevel = PURPLE_DEBUG_WARNING;
+
+/**
+ * Interned category names; empty means every category
+ */
+static GHashTable *categories = NULL;
+
+/**
+ * DebugLines, oldest first
+ */
+static GQueue lines = G_QUEUE_INIT;
+
+static guint64 budget = 0;
+static PurpleDebugLogStats stats;
+
+static const char *levelNames[] = { "all", "misc", "info", "warning", "error", "fatal", "off" };
+
+static void freeLine(DebugLine *line)
+{
+	stats.bytes -= strlen(line->text) + 1;
+	g_free(line->text);
+	g_free(line);
+}
+
+static gboolean isEnabled(PurpleDebugLevel level, const char *category)
+{
+	if (level < minimumLevel)
+	{
+		stats.filtered++;
+		return FALSE;
+	}
+	if (g_hash_table_size(categories) > 0
+			&& (category == NULL || g_hash_table_lookup(categories, g_intern_string(category)) == NULL))
+	{
+		stats.filtered++;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void print(PurpleDebugLevel level, const char *category, const char *text)
+{
+	struct timespec now;
+
+	/* libpurple before 2.6.0 doesn't ask first */
+	if (!isEnabled(level, category))
+	{
+		return;
+	}
+
+	gsize length = strlen(text);
+	while (length > 0 && text[length - 1] == '\n')
+	{
+		length--;
+	}
+	length = MIN(length, MAX_LINE_BYTES);
+
+	DebugLine *line = g_new(DebugLine, 1);
+	clock_gettime(CLOCK_REALTIME, &now);
+	line->timeMs = (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	line->level = level;
+	line->category = g_intern_string(category != NULL ? category : "");
+	line->text = g_strndup(text, length);
+	g_queue_push_tail(&lines, line);
+	stats.bytes += length + 1;
+	stats.kept++;
+
+	while (stats.bytes > budget && g_queue_get_length(&lines) > 1)
+	{
+		freeLine(g_queue_pop_head(&lines));
+		stats.evicted++;
+	}
+}
+
+static PurpleDebugUiOps debugUiOps =
+{ print, isEnabled, NULL, NULL, NULL, NULL };
+
+void purpleDebugLogInit(guint64 budgetBytes, PurpleDebugLevel level)
+{
+	budget = budgetBytes;
+	minimumLevel = level;
+	categories = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+PurpleDebugUiOps* purpleDebugLogGetUiOps(void)
+{
+	return &debugUiOps;
+}
+
+void purpleDebugLogSetFilter(PurpleDebugLevel level, const char **categoryNames)
+{
+	minimumLevel = level;
+	g_hash_table_remove_all(categories);
+	while (categoryNames != NULL && *categoryNames != NULL)
+	{
+		const char *category = g_intern_string(*categoryNames);
+		g_hash_table_insert(categories, (gpointer) category, (gpointer) category);
+		categoryNames++;
+	}
+}
+
+PurpleDebugLevel purpleDebugLogGetLevel(void)
+{
+	return minimumLevel;
+}
+
+void purpleDebugLogForEachCategory(PurpleDebugCategoryFunction function, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(&iter, categories);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		function(key, data);
+	}
+}
+
+void purpleDebugLogForEach(guint limit, PurpleDebugLineFunction function, gpointer data)
+{
+	GList *iter = lines.head;
+	guint length = g_queue_get_length(&lines);
+	guint skip = limit > 0 && limit < length ? length - limit : 0;
+
+	for (; iter != NULL && skip > 0; iter = iter->next)
+	{
+		skip--;
+	}
+	for (; iter != NULL; iter = iter->next)
+	{
+		DebugLine *line = iter->data;
+		function(line->timeMs, line->level, line->category, line->text, data);
+	}
+}
+
+void purpleDebugLogGetStats(PurpleDebugLogStats *debugStats)
+{
+	*debugStats = stats;
+}
+
+const char* purpleDebugLevelName(PurpleDebugLevel level)
+{
+	return levelNames[level];
+}
+
+int purpleDebugLevelFromName(const char *name)
+{
+	int level;
+	for (level = PURPLE_DEBUG_MISC; level <= PURPLE_DEBUG_LOG_OFF; level++)
+	{
+		if (strcmp(levelNames[level], name) == 0)
+		{
+			return level;
+		}
+	}
+	return -1;
+}
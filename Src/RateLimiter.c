@@ -0,0 +1,261 @@
+/*
+ * <RateLimiter.c: paces what we send to the IM servers per account>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * AIM and Yahoo throttle (and eventually disconnect) clients that send too many IMs or status changes in a short time,
+ * and logging back in costs far more than waiting a bit. Every account has a token bucket per operation class. An
+ * operation that finds the bucket empty is not rejected; it waits in the bucket's queue and a timer runs it when the
+ * next token is due.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "RateLimiter.h"
+
+typedef struct _RateLimitDefaults
+{
+	/* NULL for everything else */
+	const char *serviceName;
+	/* tokens a bucket can hold, i.e. how many operations can go out back to back */
+	double burst[RATE_CLASS_COUNT];
+	double perSecond[RATE_CLASS_COUNT];
+} RateLimitDefaults;
+
+static const RateLimitDefaults rateLimitDefaults[] =
+{
+	{ "aol", { 5, 2 }, { 1.0, 0.2 } },
+	{ "icq", { 5, 2 }, { 1.0, 0.2 } },
+	{ "yahoo", { 5, 2 }, { 1.0, 0.2 } },
+	{ "gmail", { 20, 3 }, { 5.0, 0.5 } },
+	{ "jabber", { 20, 3 }, { 5.0, 0.5 } },
+	{ NULL, { 10, 3 }, { 2.0, 0.5 } }
+};
+
+typedef struct _WaitingOperation
+{
+	RateLimitedFunction function;
+	gpointer data;
+	GDestroyNotify destroyData;
+	gint64 queuedAt;
+} WaitingOperation;
+
+typedef struct _AccountLimits AccountLimits;
+
+typedef struct _TokenBucket
+{
+	AccountLimits *owner;
+	RateLimitClass rateClass;
+	double tokens;
+	double capacity;
+	double perSecond;
+	gint64 refilledAt;
+	/* WaitingOperations, oldest first */
+	GQueue waiting;
+	/* runs the waiting operations; 0 if none is scheduled */
+	guint timer;
+} TokenBucket;
+
+struct _AccountLimits
+{
+	char *accountKey;
+	TokenBucket buckets[RATE_CLASS_COUNT];
+};
+
+/**
+ * key: accountKey (owned by the value), value: AccountLimits
+ */
+static GHashTable *accountLimits = NULL;
+static RateLimitStats rateLimitStats[RATE_CLASS_COUNT];
+
+static gint64 nowMilliseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static const RateLimitDefaults* getDefaults(const char *serviceName)
+{
+	const RateLimitDefaults *defaults;
+	for (defaults = rateLimitDefaults; defaults->serviceName != NULL; defaults++)
+	{
+		if (serviceName != NULL && strcmp(defaults->serviceName, serviceName) == 0)
+		{
+			break;
+		}
+	}
+	return defaults;
+}
+
+static AccountLimits* getAccountLimits(const char *accountKey, const char *serviceName)
+{
+	AccountLimits *limits = g_hash_table_lookup(accountLimits, accountKey);
+	if (limits != NULL)
+	{
+		return limits;
+	}
+
+	const RateLimitDefaults *defaults = getDefaults(serviceName);
+	gint64 now = nowMilliseconds();
+	int i;
+
+	limits = g_new0(AccountLimits, 1);
+	limits->accountKey = g_strdup(accountKey);
+	for (i = 0; i < RATE_CLASS_COUNT; i++)
+	{
+		TokenBucket *bucket = &limits->buckets[i];
+		bucket->owner = limits;
+		bucket->rateClass = i;
+		bucket->capacity = defaults->burst[i];
+		bucket->perSecond = defaults->perSecond[i];
+		bucket->tokens = bucket->capacity;
+		bucket->refilledAt = now;
+		g_queue_init(&bucket->waiting);
+	}
+	g_hash_table_insert(accountLimits, limits->accountKey, limits);
+	return limits;
+}
+
+static void refillBucket(TokenBucket *bucket, gint64 now)
+{
+	bucket->tokens = MIN(bucket->capacity, bucket->tokens + (now - bucket->refilledAt) * bucket->perSecond / 1000);
+	bucket->refilledAt = now;
+}
+
+static void scheduleWaitingOperations(TokenBucket *bucket);
+
+static gboolean runWaitingOperations(gpointer data)
+{
+	TokenBucket *bucket = data;
+	RateLimitStats *stats = &rateLimitStats[bucket->rateClass];
+	gint64 now = nowMilliseconds();
+
+	bucket->timer = 0;
+	refillBucket(bucket, now);
+
+	WaitingOperation *operation;
+	while (bucket->tokens >= 1 && (operation = g_queue_pop_head(&bucket->waiting)) != NULL)
+	{
+		guint delayMs = now - operation->queuedAt;
+		bucket->tokens -= 1;
+		stats->operations++;
+		stats->delayed++;
+		stats->waiting--;
+		stats->totalDelayMs += delayMs;
+		stats->maxDelayMs = MAX(stats->maxDelayMs, delayMs);
+
+		/* may add or cancel operations of this bucket */
+		operation->function(bucket->owner->accountKey, operation->data);
+		g_free(operation);
+	}
+
+	scheduleWaitingOperations(bucket);
+	return FALSE;
+}
+
+static void scheduleWaitingOperations(TokenBucket *bucket)
+{
+	if (bucket->timer != 0 || g_queue_is_empty(&bucket->waiting))
+	{
+		return;
+	}
+	refillBucket(bucket, nowMilliseconds());
+	guint delayMs = bucket->tokens >= 1 ? 0 : (guint) ((1 - bucket->tokens) * 1000 / bucket->perSecond) + 1;
+	bucket->timer = purple_timeout_add(delayMs, runWaitingOperations, bucket);
+}
+
+void rateLimiterInit(void)
+{
+	if (accountLimits == NULL)
+	{
+		accountLimits = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+}
+
+bool rateLimiterTryAcquire(const char *accountKey, const char *serviceName, RateLimitClass rateClass)
+{
+	g_return_val_if_fail(accountLimits != NULL, TRUE);
+
+	TokenBucket *bucket = &getAccountLimits(accountKey, serviceName)->buckets[rateClass];
+	refillBucket(bucket, nowMilliseconds());
+	if (!g_queue_is_empty(&bucket->waiting) || bucket->tokens < 1)
+	{
+		return FALSE;
+	}
+	bucket->tokens -= 1;
+	rateLimitStats[rateClass].operations++;
+	return TRUE;
+}
+
+void rateLimiterWait(const char *accountKey, const char *serviceName, RateLimitClass rateClass,
+		RateLimitedFunction function, gpointer data, GDestroyNotify destroyData)
+{
+	g_return_if_fail(accountLimits != NULL);
+
+	TokenBucket *bucket = &getAccountLimits(accountKey, serviceName)->buckets[rateClass];
+
+	WaitingOperation *operation = g_new0(WaitingOperation, 1);
+	operation->function = function;
+	operation->data = data;
+	operation->destroyData = destroyData;
+	operation->queuedAt = nowMilliseconds();
+	g_queue_push_tail(&bucket->waiting, operation);
+	rateLimitStats[rateClass].waiting++;
+
+	scheduleWaitingOperations(bucket);
+}
+
+void rateLimiterCancel(const char *accountKey)
+{
+	AccountLimits *limits = accountLimits ? g_hash_table_lookup(accountLimits, accountKey) : NULL;
+	int i;
+
+	if (limits == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < RATE_CLASS_COUNT; i++)
+	{
+		TokenBucket *bucket = &limits->buckets[i];
+		WaitingOperation *operation;
+		while ((operation = g_queue_pop_head(&bucket->waiting)) != NULL)
+		{
+			rateLimitStats[i].waiting--;
+			if (operation->destroyData)
+			{
+				operation->destroyData(operation->data);
+			}
+			g_free(operation);
+		}
+		if (bucket->timer != 0)
+		{
+			purple_timeout_remove(bucket->timer);
+			bucket->timer = 0;
+		}
+	}
+}
+
+void rateLimiterGetStats(RateLimitClass rateClass, RateLimitStats *stats)
+{
+	*stats = rateLimitStats[rateClass];
+}
+
+const char* rateLimiterClassName(RateLimitClass rateClass)
+{
+	return rateClass == RATE_CLASS_MESSAGE ? "message" : "status";
+}
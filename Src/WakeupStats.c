@@ -0,0 +1,149 @@
+/*
+ * <WakeupStats.c: counts what wakes the main loop up, with the display on and off>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Every socket watch, libpurple timer and bus method goes through a wrapper of the adapter that counts the call here
+ * before it runs. The wrappers look up their source once, when they are set up, so counting is two increments. Names
+ * of functions come from dladdr: exported symbols by name, everything else as "object+offset" for addr2line.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+
+#include <glib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "WakeupStats.h"
+
+struct _WakeupSource
+{
+	WakeupType type;
+	char *name;
+	/* [0]: display off, [1]: display on */
+	guint wakeups[2];
+};
+
+/**
+ * Per WakeupType. key: identity, value: WakeupSource
+ */
+static GHashTable *wakeupSources[WAKEUP_TYPE_COUNT];
+static bool displayOn = TRUE;
+static guint totalWakeups[2];
+static guint64 displayOffMs = 0;
+/* when the display went off; only meaningful while it is */
+static gint64 displayOffAt = 0;
+
+static gint64 nowMilliseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static char* getSymbolName(gconstpointer address)
+{
+	Dl_info info;
+	if (dladdr(address, &info) == 0 || info.dli_fname == NULL)
+	{
+		return g_strdup_printf("%p", address);
+	}
+	if (info.dli_sname != NULL && info.dli_saddr == address)
+	{
+		return g_strdup(info.dli_sname);
+	}
+	const char *object = strrchr(info.dli_fname, '/');
+	return g_strdup_printf("%s+%#lx", object ? object + 1 : info.dli_fname,
+			(unsigned long) ((const char *) address - (const char *) info.dli_fbase));
+}
+
+WakeupSource* wakeupStatsGetSource(WakeupType type, gconstpointer identity, const char *name)
+{
+	if (wakeupSources[type] == NULL)
+	{
+		wakeupSources[type] = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	WakeupSource *source = g_hash_table_lookup(wakeupSources[type], identity);
+	if (source == NULL)
+	{
+		source = g_new0(WakeupSource, 1);
+		source->type = type;
+		source->name = name ? g_strdup(name) : getSymbolName(identity);
+		g_hash_table_insert(wakeupSources[type], (gpointer) identity, source);
+	}
+	return source;
+}
+
+void wakeupStatsCount(WakeupSource *source)
+{
+	source->wakeups[displayOn]++;
+	totalWakeups[displayOn]++;
+}
+
+void wakeupStatsSetDisplayOn(bool on)
+{
+	if (on == displayOn)
+	{
+		return;
+	}
+	displayOn = on;
+	if (on)
+	{
+		displayOffMs += nowMilliseconds() - displayOffAt;
+	}
+	else
+	{
+		displayOffAt = nowMilliseconds();
+	}
+}
+
+void wakeupStatsForEach(WakeupSourceFunction function, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	int type;
+
+	for (type = 0; type < WAKEUP_TYPE_COUNT; type++)
+	{
+		if (wakeupSources[type] == NULL)
+		{
+			continue;
+		}
+		g_hash_table_iter_init(&iter, wakeupSources[type]);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+		{
+			WakeupSource *source = value;
+			function(source->type, source->name, source->wakeups[1], source->wakeups[0], data);
+		}
+	}
+}
+
+void wakeupStatsGetTotals(guint *displayOnWakeups, guint *displayOffWakeups, guint64 *offMs)
+{
+	*displayOnWakeups = totalWakeups[1];
+	*displayOffWakeups = totalWakeups[0];
+	*offMs = displayOffMs + (displayOn ? 0 : nowMilliseconds() - displayOffAt);
+}
+
+const char* wakeupStatsGetName(const WakeupSource *source)
+{
+	return source->name;
+}
+
+const char* wakeupTypeName(WakeupType type)
+{
+	static const char *names[WAKEUP_TYPE_COUNT] = { "io", "timer", "bus" };
+	return names[type];
+}
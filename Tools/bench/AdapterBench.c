@@ -0,0 +1,420 @@
+/*
+ * <AdapterBench.c: ns/op and allocations/op of the helpers and payload builders that run on every event>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: AdapterBench [--filter SUBSTRING] [--min-time MS] [--baseline FILE]
+ * Linked against the adapter's own objects, so that what is measured is what the build (and, under PROFILE=pgo-use, the
+ * profile) made of them, and against the load test's bus shim (Tools/loadtest) so that presence updates and the buddy
+ * list are built and "sent" in-process. libpurple is initialized as the adapter does it and one account gets a roster
+ * of BUDDY_COUNT buddies; nothing connects.
+ *
+ * Each benchmark is run with a growing number of iterations until one run takes at least --min-time, like Go's
+ * testing.B. Allocations are counted by malloc and friends below, which stand in for libc's for the whole process (so
+ * GLib's and json-c's count too); GSlice is switched to plain malloc for that. The result is one JSON object on
+ * stdout. With --baseline (an earlier output) every benchmark also gets its ns/op as a ratio to the baseline's and its
+ * allocs/op as the difference.
+ */
+
+#include "purple.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cjson/json.h>
+
+#include "AdapterLog.h"
+#include "LibpurpleAdapter.h"
+#include "LoadTestData.h"
+#include "LunaServiceShim.h"
+#include "MessageSpool.h"
+
+#define BENCH_USERNAME "bench@localhost"
+#define BUDDY_COUNT 100
+#define DEFAULT_MIN_TIME_MS 200
+#define MAX_ITERATIONS 100000000
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static volatile gsize allocations = 0;
+static volatile gsize allocatedBytes = 0;
+
+void* malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	__sync_fetch_and_add(&allocatedBytes, size);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	__sync_fetch_and_add(&allocatedBytes, count * size);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void *pointer, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	__sync_fetch_and_add(&allocatedBytes, size);
+	return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer)
+{
+	__libc_free(pointer);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	__sync_fetch_and_add(&allocatedBytes, size);
+	*pointer = __libc_memalign(alignment, size);
+	return *pointer != NULL ? 0 : ENOMEM;
+}
+
+typedef void (*BenchFunction)(guint iterations);
+
+typedef struct _Bench
+{
+	const char *name;
+	BenchFunction function;
+} Bench;
+
+static PurpleAccount *benchAccount = NULL;
+static PurpleBuddy *benchBuddies[BUDDY_COUNT];
+/* keeps the calls from being optimized away */
+static gsize checksum = 0;
+
+static void benchGetAccountKey(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *accountKey = getAccountKey(BENCH_USERNAME, "gmail");
+		checksum += accountKey[0];
+		free(accountKey);
+	}
+}
+
+static void benchGetAccountKeyFromPurpleAccount(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *accountKey = getAccountKeyFromPurpleAccount(benchAccount);
+		checksum += accountKey[0];
+		free(accountKey);
+	}
+}
+
+static void benchGetJavaFriendlyUsername(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *username = getJavaFriendlyUsername(BENCH_USERNAME "/Talk.v104A1B2C3D4", "gmail");
+		checksum += username[0];
+		free(username);
+	}
+}
+
+static void benchGetPrplFriendlyUsername(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *username = getPrplFriendlyUsername("aol", "benchbuddy@aol.com");
+		checksum += username[0];
+		free(username);
+	}
+}
+
+static void benchStripResourceFromGtalkUsername(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *username = stripResourceFromGtalkUsername("buddy42@localhost/Talk.v104A1B2C3D4");
+		checksum += username[0];
+		free(username);
+	}
+}
+
+static void benchGetServiceNameFromPrplProtocolId(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		char *serviceName = getServiceNameFromPrplProtocolId("prpl-jabber");
+		checksum += serviceName[0];
+		free(serviceName);
+	}
+}
+
+/*
+ * One buddy's presence update: the callback's own work and, since the event worker isn't started, building and
+ * replying with the payload
+ */
+static void benchBuddyStatusChanged(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		PurpleBuddy *buddy = benchBuddies[i % BUDDY_COUNT];
+		PurpleStatus *status = purple_presence_get_active_status(purple_buddy_get_presence(buddy));
+		buddy_status_changed_cb(buddy, status, status, NULL);
+	}
+}
+
+/*
+ * Spooling one incoming message the size the event worker usually writes; the ring wraps many times over a run
+ */
+static void benchMessageSpoolAppend(guint iterations)
+{
+	static const char payload[] = "{ \"serviceName\": \"gmail\", \"username\": \"" BENCH_USERNAME "\", "
+		"\"usernameFrom\": \"buddy42@localhost\", \"messageText\": \"<span style=\\\"font-weight: bold\\\">Running late<\\/span>"
+		", be there in 10 minutes\", \"seq\": 123456, \"plainText\": \"Running late, be there in 10 minutes\", "
+		"\"formatting\": [ { \"type\": \"bold\", \"start\": 0, \"end\": 12 } ] }";
+	static guint seq = 0;
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		messageSpoolAppend(++seq, BENCH_USERNAME "_gmail", payload, sizeof(payload) - 1);
+	}
+	checksum += messageSpoolLastSeq();
+}
+
+static void benchRespondWithFullBuddyList(guint iterations)
+{
+	guint i;
+	for (i = 0; i < iterations; i++)
+	{
+		respondWithFullBuddyList(benchAccount, "gmail", BENCH_USERNAME);
+	}
+}
+
+static Bench benches[] =
+{
+{ "getAccountKey", benchGetAccountKey },
+{ "getAccountKeyFromPurpleAccount", benchGetAccountKeyFromPurpleAccount },
+{ "getJavaFriendlyUsername", benchGetJavaFriendlyUsername },
+{ "getPrplFriendlyUsername", benchGetPrplFriendlyUsername },
+{ "stripResourceFromGtalkUsername", benchStripResourceFromGtalkUsername },
+{ "getServiceNameFromPrplProtocolId", benchGetServiceNameFromPrplProtocolId },
+{ "buddy_status_changed_cb", benchBuddyStatusChanged },
+{ "messageSpoolAppend", benchMessageSpoolAppend },
+{ "respondWithFullBuddyList/" G_STRINGIFY(BUDDY_COUNT), benchRespondWithFullBuddyList },
+{ NULL, NULL } };
+
+static gint64 nowNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void setUpRoster(void)
+{
+	PurpleGroup *group = purple_group_new("Buddies");
+	int i;
+
+	purple_blist_add_group(group, NULL);
+	benchAccount = purple_account_new(BENCH_USERNAME, "prpl-jabber");
+	purple_accounts_add(benchAccount);
+	for (i = 0; i < BUDDY_COUNT; i++)
+	{
+		char name[32];
+		char alias[32];
+		g_snprintf(name, sizeof(name), "buddy%d@localhost", i);
+		g_snprintf(alias, sizeof(alias), "Buddy %d", i);
+		benchBuddies[i] = purple_buddy_new(benchAccount, name, alias);
+		purple_blist_add_buddy(benchBuddies[i], NULL, group, NULL);
+		purple_prpl_got_user_status(benchAccount, name, i % 3 ? "available" : "away", "message",
+				i % 2 ? "In a meeting until 3" : "", NULL);
+	}
+}
+
+/*
+ * {"name", "iterations", "nsPerOp", "allocsPerOp", "bytesPerOp"}, plus nsPerOpRatio and allocsPerOpDelta if the baseline
+ * has the benchmark
+ */
+static struct json_object* runBench(const Bench *bench, gint64 minTimeNs, struct json_object *baseline)
+{
+	guint iterations = 1;
+	gint64 elapsed;
+	gsize allocationsBefore, bytesBefore;
+
+	/* warms up caches and the buddies' lazily created state */
+	bench->function(1);
+	for (;;)
+	{
+		allocationsBefore = allocations;
+		bytesBefore = allocatedBytes;
+		gint64 start = nowNanoseconds();
+		bench->function(iterations);
+		elapsed = nowNanoseconds() - start;
+		if (elapsed >= minTimeNs || iterations >= MAX_ITERATIONS)
+		{
+			break;
+		}
+		/* aim 20% past the minimum from what this run took, but grow at most 100x at a time */
+		guint64 next = elapsed > 0 ? (guint64) iterations * minTimeNs * 12 / 10 / elapsed : (guint64) iterations * 100;
+		iterations = MIN(MAX(next, (guint64) iterations + 1), MIN((guint64) iterations * 100, MAX_ITERATIONS));
+	}
+
+	double nsPerOp = (double) elapsed / iterations;
+	double allocsPerOp = (double) (allocations - allocationsBefore) / iterations;
+	struct json_object *result = json_object_new_object();
+	json_object_object_add(result, "name", json_object_new_string((char*)bench->name));
+	json_object_object_add(result, "iterations", json_object_new_int(iterations));
+	json_object_object_add(result, "nsPerOp", json_object_new_double(nsPerOp));
+	json_object_object_add(result, "allocsPerOp", json_object_new_double(allocsPerOp));
+	json_object_object_add(result, "bytesPerOp", json_object_new_double((double) (allocatedBytes - bytesBefore) / iterations));
+
+	if (baseline != NULL)
+	{
+		int i;
+		for (i = 0; i < json_object_array_length(baseline); i++)
+		{
+			struct json_object *old = json_object_array_get_idx(baseline, i);
+			if (strcmp(json_object_get_string(json_object_object_get(old, "name")), bench->name) == 0)
+			{
+				double oldNs = json_object_get_double(json_object_object_get(old, "nsPerOp"));
+				double oldAllocs = json_object_get_double(json_object_object_get(old, "allocsPerOp"));
+				json_object_object_add(result, "nsPerOpRatio", json_object_new_double(oldNs > 0 ? nsPerOp / oldNs : 0));
+				json_object_object_add(result, "allocsPerOpDelta", json_object_new_double(allocsPerOp - oldAllocs));
+				break;
+			}
+		}
+	}
+	return result;
+}
+
+static struct json_object* loadBaseline(const char *path)
+{
+	char *contents;
+	struct json_object *baseline;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		fprintf(stderr, "Can't read %s\n", path);
+		return NULL;
+	}
+	baseline = json_tokener_parse(contents);
+	g_free(contents);
+	if (baseline == NULL || is_error(baseline) || json_object_object_get(baseline, "benchmarks") == NULL)
+	{
+		fprintf(stderr, "%s is not AdapterBench output\n", path);
+		return NULL;
+	}
+	return baseline;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL;
+	gint64 minTimeNs = (gint64) DEFAULT_MIN_TIME_MS * 1000000;
+	struct json_object *baseline = NULL;
+	int i;
+
+	/* before GLib's first allocation, so that every g_slice_new shows up in allocsPerOp */
+	setenv("G_SLICE", "always-malloc", 1);
+
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--filter") == 0)
+		{
+			filter = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--min-time") == 0)
+		{
+			minTimeNs = (gint64) atoi(argv[i + 1]) * 1000000;
+		}
+		else if (strcmp(argv[i], "--baseline") == 0)
+		{
+			if ((baseline = loadBaseline(argv[i + 1])) == NULL)
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (i < argc)
+	{
+		fprintf(stderr, "Usage: %s [--filter SUBSTRING] [--min-time MS] [--baseline FILE]\n", argv[0]);
+		return 1;
+	}
+
+	g_type_init();
+	if (!g_thread_supported())
+	{
+		g_thread_init(NULL);
+	}
+	lsShimInit(NULL, NULL);
+	/* presence updates and log records go out as they would with the default level */
+	adapterLogSetLevel(ADAPTER_LOG_WARNING);
+	/* the spool and the avatars go to a directory of the run's own, not the device's */
+	const char *spoolPath = loadTestDataPath("im-incoming-spool");
+	adapterSetDataPaths(spoolPath, loadTestDataPath("im-avatars"));
+	initializeLibpurple();
+	if (purple_find_prpl("prpl-jabber") == NULL)
+	{
+		fprintf(stderr, "libpurple has no prpl-jabber\n");
+		return 1;
+	}
+	setUpRoster();
+
+	/* the incoming message spool gets a file of the adapter's size */
+	if (!messageSpoolOpen(spoolPath, INCOMING_MESSAGE_SPOOL_SIZE))
+	{
+		fprintf(stderr, "Could not open the spool %s\n", spoolPath);
+		loadTestDataRemove();
+		return 1;
+	}
+
+	struct json_object *results = json_object_new_array();
+	for (i = 0; benches[i].name != NULL; i++)
+	{
+		if (filter == NULL || strstr(benches[i].name, filter) != NULL)
+		{
+			json_object_array_add(results, runBench(&benches[i], minTimeNs,
+					baseline ? json_object_object_get(baseline, "benchmarks") : NULL));
+		}
+	}
+
+	struct json_object *output = json_object_new_object();
+	json_object_object_add(output, "buddies", json_object_new_int(BUDDY_COUNT));
+	json_object_object_add(output, "checksum", json_object_new_int((int) checksum));
+	json_object_object_add(output, "benchmarks", results);
+	printf("%s\n", json_object_to_json_string(output));
+	json_object_put(output);
+
+	messageSpoolClose();
+	loadTestDataRemove();
+	if (baseline != NULL)
+	{
+		json_object_put(baseline);
+	}
+	return 0;
+}
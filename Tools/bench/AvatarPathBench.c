@@ -0,0 +1,81 @@
+/*
+ * <AvatarPathBench.c: cost of getting a buddy's avatar location for a presence update>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: AvatarPathBench [iterations]
+ * Presence updates used to call purple_buddy_icon_get_full_path, which builds the path from the cache directory and
+ * the image's file name and returns a copy the caller frees. They now look up the path the avatar store keeps per
+ * buddy. The store's statics are filled in directly (the store is compiled into this file) so that no libpurple core
+ * is needed.
+ */
+
+#include "../../Src/AvatarStore.c"
+
+#include <stdlib.h>
+
+#define BUDDY_COUNT 500
+#define DEFAULT_ITERATIONS 2000
+
+static gint64 nowNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	static PurpleBuddy buddies[BUDDY_COUNT];
+	static char filenames[BUDDY_COUNT][48];
+	gsize checksum = 0;
+	int i, j;
+
+	storeDirectory = g_strdup("/var/luna/data/im-avatars");
+	avatarEntries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, freeAvatarEntry);
+	buddyAvatars = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (j = 0; j < BUDDY_COUNT; j++)
+	{
+		g_snprintf(filenames[j], sizeof(filenames[j]), "%08x%08x%08x%08x%08x.png", j, j * 7, j * 13, j * 31, j * 61);
+		g_hash_table_insert(buddyAvatars, &buddies[j], addEntry(filenames[j], 4096, 0));
+	}
+
+	gint64 start = nowNanoseconds();
+	for (i = 0; i < iterations; i++)
+	{
+		for (j = 0; j < BUDDY_COUNT; j++)
+		{
+			char *path = g_build_filename(storeDirectory, filenames[j], NULL);
+			checksum += path[0];
+			g_free(path);
+		}
+	}
+	double buildNs = (double) (nowNanoseconds() - start) / ((gint64) iterations * BUDDY_COUNT);
+
+	start = nowNanoseconds();
+	for (i = 0; i < iterations; i++)
+	{
+		for (j = 0; j < BUDDY_COUNT; j++)
+		{
+			checksum += avatarStoreGetBuddyPath(&buddies[j])[0];
+		}
+	}
+	double cachedNs = (double) (nowNanoseconds() - start) / ((gint64) iterations * BUDDY_COUNT);
+
+	printf("build path + g_free         %8.1f ns/event\n", buildNs);
+	printf("avatarStoreGetBuddyPath     %8.1f ns/event (no allocation)\n", cachedNs);
+	printf("saving                      %8.1f ns/event\n", buildNs - cachedNs);
+	/* keeps the loops from being optimized away */
+	printf("(%d buddies, %d iterations, checksum %lu)\n", BUDDY_COUNT, iterations, (unsigned long) checksum);
+	return 0;
+}
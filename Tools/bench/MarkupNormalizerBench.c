@@ -0,0 +1,116 @@
+/*
+ * <MarkupNormalizerBench.c: markupNormalize vs. purple_markup_strip_html over a corpus of messages>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: MarkupNormalizerBench [corpus file] [iterations]
+ * The corpus has one message per line. Both normalizers are run over every message of the corpus, iterations times.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "MarkupNormalizer.h"
+
+#define DEFAULT_CORPUS "Tools/bench/markup-corpus.txt"
+#define DEFAULT_ITERATIONS 20000
+#define MAX_FORMATTING_SPANS 32
+
+static gint64 nowNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void report(const char *name, gint64 elapsed, guint messages, gsize bytes)
+{
+	printf("%-26s %8.1f ns/message %8.1f MB/s\n", name, (double) elapsed / messages,
+			(bytes / 1048576.0) / (elapsed / 1000000000.0));
+}
+
+int main(int argc, char *argv[])
+{
+	const char *corpusPath = argc > 1 ? argv[1] : DEFAULT_CORPUS;
+	int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+	char *corpus = NULL;
+	GError *error = NULL;
+	int i;
+	guint j;
+
+	if (!g_file_get_contents(corpusPath, &corpus, NULL, &error))
+	{
+		fprintf(stderr, "Could not read %s: %s\n", corpusPath, error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	char **messages = g_strsplit(corpus, "\n", -1);
+	guint messageCount = 0;
+	gsize corpusBytes = 0;
+	gsize longest = 0;
+	while (messages[messageCount] != NULL && messages[messageCount][0] != '\0')
+	{
+		gsize length = strlen(messages[messageCount]);
+		corpusBytes += length;
+		longest = MAX(longest, length);
+		messageCount++;
+	}
+	if (messageCount == 0)
+	{
+		fprintf(stderr, "%s has no messages\n", corpusPath);
+		return 1;
+	}
+
+	char *out = g_malloc(longest + 1);
+	FormattingSpan spans[MAX_FORMATTING_SPANS];
+	guint spanCount;
+	gsize checksum = 0;
+
+	gint64 start = nowNanoseconds();
+	for (i = 0; i < iterations; i++)
+	{
+		for (j = 0; j < messageCount; j++)
+		{
+			checksum += markupNormalize(messages[j], strlen(messages[j]), out, spans, MAX_FORMATTING_SPANS,
+					&spanCount);
+		}
+	}
+	report("markupNormalize", nowNanoseconds() - start, iterations * messageCount,
+			(gsize) iterations * corpusBytes);
+
+	start = nowNanoseconds();
+	for (i = 0; i < iterations; i++)
+	{
+		for (j = 0; j < messageCount; j++)
+		{
+			char *stripped = purple_markup_strip_html(messages[j]);
+			checksum += strlen(stripped);
+			g_free(stripped);
+		}
+	}
+	report("purple_markup_strip_html", nowNanoseconds() - start, iterations * messageCount,
+			(gsize) iterations * corpusBytes);
+
+	/* keeps the loops from being optimized away */
+	printf("(%u messages, %d iterations, checksum %lu)\n", messageCount, iterations, (unsigned long) checksum);
+
+	g_free(out);
+	g_strfreev(messages);
+	g_free(corpus);
+	return 0;
+}
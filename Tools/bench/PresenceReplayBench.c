@@ -0,0 +1,175 @@
+/*
+ * <PresenceReplayBench.c: a presence storm through the event worker, with and without its thread>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: PresenceReplayBench [buddies] [updates] [batch]
+ * Replays updates presence changes, round robin over a roster of buddies, into eventWorkerPost: batch of them per main
+ * loop iteration, as a roster flush arrives from the server. Runs twice, first with the events processed inline on
+ * the main loop (the worker not started) and then with the worker thread. For each run it prints the updates per
+ * second until the last reply reached the subscriber (Tools/loadtest's bus shim), the main loop's CPU time per update
+ * (posting, plus sending the replies with the worker) and how many replies went out; with the worker fewer can go
+ * out than were posted, when updates for the same buddy are merged while the worker catches up.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lunaservice.h>
+
+#include "EventWorker.h"
+#include "LunaServiceShim.h"
+
+#define DEFAULT_BUDDIES 500
+#define DEFAULT_UPDATES 200000
+#define DEFAULT_BATCH 64
+/* sent behind the last update; when it arrives, everything before it has */
+#define END_PAYLOAD "{\"end\":true}"
+
+static int buddyCount = DEFAULT_BUDDIES;
+static int updateCount = DEFAULT_UPDATES;
+static int batchSize = DEFAULT_BATCH;
+
+static char **buddyNames = NULL;
+static GMainLoop *loop = NULL;
+static int posted = 0;
+static guint replies = 0;
+
+static gint64 nowNanoseconds(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (gint64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void replyReceived(const char *method, const char *payload, gpointer data)
+{
+	if (strcmp(payload, END_PAYLOAD) == 0)
+	{
+		g_main_loop_quit(loop);
+		return;
+	}
+	replies++;
+}
+
+static bool subscribe(LSHandle *handle, LSMessage *message, void *data)
+{
+	return LSSubscriptionAdd(handle, "/getBuddyList", message, NULL);
+}
+
+static LSMethod methods[] =
+{
+{ "subscribe", subscribe },
+{ NULL, NULL } };
+
+static void postUpdate(int update)
+{
+	static const char *customMessages[] = { "", "In a meeting until 3", "Running late, be there in 10 minutes" };
+	const char *fields[PRESENCE_FIELD_COUNT];
+	char availability[2];
+	int buddy = update % buddyCount;
+
+	sprintf(availability, "%d", update % 5);
+	memset(fields, 0, sizeof(fields));
+	fields[PRESENCE_SERVICE_NAME] = "gmail";
+	fields[PRESENCE_USERNAME] = "bench@localhost";
+	fields[PRESENCE_BUDDY_USERNAME] = buddyNames[buddy];
+	fields[PRESENCE_DISPLAY_NAME] = buddyNames[buddy];
+	fields[PRESENCE_AVATAR_LOCATION] = "/var/luna/data/im-avatars/0123456789abcdef0123456789abcdef.png";
+	fields[PRESENCE_CUSTOM_MESSAGE] = customMessages[update % G_N_ELEMENTS(customMessages)];
+	fields[PRESENCE_AVAILABILITY] = availability;
+	fields[PRESENCE_GROUP_NAME] = "Buddies";
+	eventWorkerPost(EVENT_PRESENCE, __FUNCTION__, fields, PRESENCE_FIELD_COUNT);
+}
+
+static gboolean postBatch(gpointer data)
+{
+	int i;
+	for (i = 0; i < batchSize && posted < updateCount; i++)
+	{
+		postUpdate(posted++);
+	}
+	if (posted < updateCount)
+	{
+		return TRUE;
+	}
+	eventWorkerReply("/getBuddyList", END_PAYLOAD);
+	return FALSE;
+}
+
+static void replay(const char *name)
+{
+	posted = 0;
+	replies = 0;
+	gint64 startNs = nowNanoseconds(CLOCK_MONOTONIC);
+	gint64 startCpuNs = nowNanoseconds(CLOCK_THREAD_CPUTIME_ID);
+
+	g_idle_add(postBatch, NULL);
+	g_main_loop_run(loop);
+
+	gint64 elapsedNs = nowNanoseconds(CLOCK_MONOTONIC) - startNs;
+	gint64 cpuNs = nowNanoseconds(CLOCK_THREAD_CPUTIME_ID) - startCpuNs;
+	printf("%-8s %10.0f updates/s %8.2f us main loop CPU/update %8u replies\n", name,
+			updateCount / (elapsedNs / 1000000000.0), cpuNs / 1000.0 / updateCount, replies);
+}
+
+int main(int argc, char *argv[])
+{
+	LSHandle *handle = NULL;
+	int i;
+
+	buddyCount = argc > 1 ? atoi(argv[1]) : DEFAULT_BUDDIES;
+	updateCount = argc > 2 ? atoi(argv[2]) : DEFAULT_UPDATES;
+	batchSize = argc > 3 ? atoi(argv[3]) : DEFAULT_BATCH;
+	if (buddyCount <= 0 || updateCount <= 0 || batchSize <= 0)
+	{
+		fprintf(stderr, "Usage: %s [buddies] [updates] [batch]\n", argv[0]);
+		return 1;
+	}
+
+	if (!g_thread_supported())
+	{
+		g_thread_init(NULL);
+	}
+	buddyNames = g_new0(char *, buddyCount);
+	for (i = 0; i < buddyCount; i++)
+	{
+		buddyNames[i] = g_strdup_printf("buddy%d@localhost", i);
+	}
+
+	loop = g_main_loop_new(NULL, FALSE);
+	lsShimInit(NULL, NULL);
+	LSRegister("com.palm.imlibpurple.bench", &handle, NULL);
+	LSRegisterCategory(handle, "/", methods, NULL, NULL, NULL);
+	lsShimCall("subscribe", "{\"subscribe\":true}", replyReceived, NULL);
+
+	replay("inline");
+	if (!eventWorkerStart(handle))
+	{
+		fprintf(stderr, "Could not start the event worker\n");
+		return 1;
+	}
+	replay("worker");
+	eventWorkerStop();
+
+	printf("(%d buddies, %d updates, %d per main loop iteration)\n", buddyCount, updateCount, batchSize);
+	g_main_loop_unref(loop);
+	for (i = 0; i < buddyCount; i++)
+	{
+		g_free(buddyNames[i]);
+	}
+	g_free(buddyNames);
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * <JsonUtilsShim.c: the json_utils calls the adapter makes, on top of json-c>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Kept apart from LunaServiceShim.c because json_utils.h has its own json_t: to the adapter it's opaque, and here it
+ * is always a json-c object owned by the message.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include <cjson/json.h>
+
+#include "LunaServiceShim.h"
+
+struct json_object* LSMessageGetPayloadJSON(struct LSMessage *message)
+{
+	return lsShimMessagePayloadJSON(message);
+}
+
+static struct json_object* getMember(struct json_object *object, const char *key, enum json_type type)
+{
+	struct json_object *member = object != NULL ? json_object_object_get(object, key) : NULL;
+	return member != NULL && json_object_is_type(member, type) ? member : NULL;
+}
+
+bool json_get_string(struct json_object *object, const char *key, const char **value)
+{
+	struct json_object *member = getMember(object, key, json_type_string);
+	if (member == NULL)
+	{
+		return FALSE;
+	}
+	*value = json_object_get_string(member);
+	return TRUE;
+}
+
+bool json_get_int(struct json_object *object, const char *key, int *value)
+{
+	struct json_object *member = getMember(object, key, json_type_int);
+	if (member == NULL)
+	{
+		return FALSE;
+	}
+	*value = json_object_get_int(member);
+	return TRUE;
+}
+
+bool json_get_bool(struct json_object *object, const char *key, bool *value)
+{
+	struct json_object *member = getMember(object, key, json_type_boolean);
+	if (member == NULL)
+	{
+		return FALSE;
+	}
+	*value = json_object_get_boolean(member);
+	return TRUE;
+}
@@ -0,0 +1,75 @@
+/*
+ * <LoadTestClock.c: send times of load test traffic, by sequence number>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "LoadTestClock.h"
+
+/* a power of two; far more than can be in flight */
+#define CLOCK_SLOTS 65536
+
+typedef struct _ClockSlot
+{
+	guint seq;
+	gint64 sentUs;
+} ClockSlot;
+
+static pthread_mutex_t clockMutex = PTHREAD_MUTEX_INITIALIZER;
+static ClockSlot slots[CLOCK_SLOTS];
+static guint lastSeq = 0;
+
+gint64 loadTestClockNowUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+guint loadTestClockStamp(void)
+{
+	gint64 now = loadTestClockNowUs();
+	pthread_mutex_lock(&clockMutex);
+	guint seq = ++lastSeq;
+	slots[seq & (CLOCK_SLOTS - 1)].seq = seq;
+	slots[seq & (CLOCK_SLOTS - 1)].sentUs = now;
+	pthread_mutex_unlock(&clockMutex);
+	return seq;
+}
+
+gint64 loadTestClockElapsedUs(guint seq)
+{
+	gint64 now = loadTestClockNowUs();
+	gint64 elapsed = -1;
+	pthread_mutex_lock(&clockMutex);
+	if (slots[seq & (CLOCK_SLOTS - 1)].seq == seq)
+	{
+		elapsed = now - slots[seq & (CLOCK_SLOTS - 1)].sentUs;
+	}
+	pthread_mutex_unlock(&clockMutex);
+	return elapsed;
+}
+
+gint64 loadTestClockElapsedUsIn(const char *text)
+{
+	const char *stamp = text != NULL ? strstr(text, "lt:") : NULL;
+	if (stamp == NULL)
+	{
+		return -1;
+	}
+	return loadTestClockElapsedUs(strtoul(stamp + 3, NULL, 10));
+}
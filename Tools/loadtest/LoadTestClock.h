@@ -0,0 +1,41 @@
+/*
+ * <LoadTestClock.h: send times of load test traffic, by sequence number>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Every presence and message the load test sends carries "lt:<seq>" in its text; whoever sees it arrive asks the
+ * clock how long ago that was. Safe from any thread.
+ */
+
+#ifndef LOAD_TEST_CLOCK_H
+#define LOAD_TEST_CLOCK_H
+
+#include <glib.h>
+
+gint64 loadTestClockNowUs(void);
+
+/**
+ * A new sequence number, sent now
+ */
+guint loadTestClockStamp(void);
+
+/**
+ * Microseconds since seq was stamped, or -1 if it wasn't (or so long ago its slot has been reused)
+ */
+gint64 loadTestClockElapsedUs(guint seq);
+
+/**
+ * Finds "lt:<seq>" in text: the microseconds since seq was stamped, or -1
+ */
+gint64 loadTestClockElapsedUsIn(const char *text);
+
+#endif
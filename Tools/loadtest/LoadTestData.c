@@ -0,0 +1,90 @@
+/*
+ * <LoadTestData.c: a directory of the run's own for the files the adapter keeps>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "LoadTestData.h"
+
+static char *dataDirectory = NULL;
+
+/**
+ * key: name, value: its path in dataDirectory
+ */
+static GHashTable *dataPaths = NULL;
+
+const char* loadTestDataPath(const char *name)
+{
+	if (dataDirectory == NULL)
+	{
+		dataDirectory = g_build_filename(g_get_tmp_dir(), "LibpurpleAdapter-XXXXXX", NULL);
+		if (mkdtemp(dataDirectory) == NULL)
+		{
+			fprintf(stderr, "Could not create %s\n", dataDirectory);
+			exit(1);
+		}
+		dataPaths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	}
+
+	char *path = g_hash_table_lookup(dataPaths, name);
+	if (path == NULL)
+	{
+		path = g_build_filename(dataDirectory, name, NULL);
+		g_hash_table_insert(dataPaths, g_strdup(name), path);
+	}
+	return path;
+}
+
+static void removeTree(const char *path)
+{
+	struct stat status;
+	if (lstat(path, &status) == 0 && S_ISDIR(status.st_mode))
+	{
+		GDir *directory = g_dir_open(path, 0, NULL);
+		const char *name;
+		while (directory != NULL && (name = g_dir_read_name(directory)) != NULL)
+		{
+			char *child = g_build_filename(path, name, NULL);
+			removeTree(child);
+			g_free(child);
+		}
+		if (directory != NULL)
+		{
+			g_dir_close(directory);
+		}
+		g_rmdir(path);
+	}
+	else
+	{
+		g_unlink(path);
+	}
+}
+
+void loadTestDataRemove(void)
+{
+	if (dataDirectory != NULL)
+	{
+		removeTree(dataDirectory);
+		g_hash_table_destroy(dataPaths);
+		dataPaths = NULL;
+		g_free(dataDirectory);
+		dataDirectory = NULL;
+	}
+}
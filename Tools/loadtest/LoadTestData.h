@@ -0,0 +1,34 @@
+/*
+ * <LoadTestData.h: a directory of the run's own for the files the adapter keeps>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The load test, the soak test, the bench and the replay tool run the adapter's code, which keeps its incoming message
+ * spool and its avatars under /var/luna/data. Their builds point those paths here instead, so that a run never touches
+ * (or trains on) a device's real data and two runs don't share files.
+ */
+
+#ifndef LOAD_TEST_DATA_H
+#define LOAD_TEST_DATA_H
+
+/**
+ * name in a directory that is created under $TMPDIR (or /tmp) the first time this is called. The string is kept for
+ * the rest of the run. Exits if the directory can't be created.
+ */
+const char* loadTestDataPath(const char *name);
+
+/**
+ * Removes the directory and everything in it, if it was created
+ */
+void loadTestDataRemove(void);
+
+#endif
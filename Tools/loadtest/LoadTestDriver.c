@@ -0,0 +1,506 @@
+/*
+ * <LoadTestDriver.c: drives the adapter against the loopback XMPP server and reports what it measured>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: LibpurpleAdapterLoadTest [--accounts N] [--buddies M] [--presence-rate R] [--message-rate R]
+ *                                 [--send-rate R] [--duration S] [--script FILE]
+ *
+ * Logs in N accounts (load0@localhost ...) with M buddies each, then runs the phases of the script, or one phase of
+ * --duration seconds with the given rates. A script has one phase per line:
+ *
+ *   # seconds  presence/s  incoming messages/s  outgoing messages/s
+ *   30         200         20                   5
+ *
+ * Presence and incoming messages are sent by the server to random accounts; outgoing ones go through the sendMessage
+ * method. The report is one JSON object on stdout: logins, throughput and latency percentiles from send to the
+ * subscriber (or to the server, for outgoing messages), and RSS.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cjson/json.h>
+
+#include "AdapterStats.h"
+#include "LibpurpleAdapter.h"
+#include "LoadTestClock.h"
+#include "LoadTestData.h"
+#include "LoopbackXmppServer.h"
+#include "LunaServiceShim.h"
+
+#define LOGIN_SPACING_MS 20
+#define LOGIN_WAIT_SECONDS 60
+#define SEND_TICK_MS 10
+#define RSS_SAMPLE_SECONDS 1
+
+typedef struct _Phase
+{
+	guint seconds;
+	double presenceRate;
+	double messageRate;
+	double sendRate;
+} Phase;
+
+typedef struct _Latencies
+{
+	pthread_mutex_t mutex;
+	/* microseconds, as guint */
+	GArray *samples;
+	guint unmatched;
+} Latencies;
+
+typedef struct _Account
+{
+	guint index;
+	char *username;
+	gint64 loginStartUs;
+	/* replies during the login call are the acknowledgement, not the result */
+	gboolean inLoginCall;
+	gboolean loggedIn;
+	gboolean failed;
+} Account;
+
+/* options */
+static gint accountCount = 10;
+static gint buddyCount = 100;
+static gdouble presenceRate = 50;
+static gdouble messageRate = 10;
+static gdouble sendRate = 5;
+static gint duration = 30;
+static gchar *scriptPath = NULL;
+
+static GOptionEntry options[] =
+{
+{ "accounts", 0, 0, G_OPTION_ARG_INT, &accountCount, "Accounts to log in", "N" },
+{ "buddies", 0, 0, G_OPTION_ARG_INT, &buddyCount, "Buddies per account", "M" },
+{ "presence-rate", 0, 0, G_OPTION_ARG_DOUBLE, &presenceRate, "Presence changes per second", "R" },
+{ "message-rate", 0, 0, G_OPTION_ARG_DOUBLE, &messageRate, "Incoming messages per second", "R" },
+{ "send-rate", 0, 0, G_OPTION_ARG_DOUBLE, &sendRate, "Outgoing messages per second", "R" },
+{ "duration", 0, 0, G_OPTION_ARG_INT, &duration, "Seconds of traffic, without a script", "S" },
+{ "script", 0, 0, G_OPTION_ARG_FILENAME, &scriptPath, "Phases to run", "FILE" },
+{ NULL } };
+
+static GMainLoop *adapterLoop = NULL;
+static guint16 serverPort = 0;
+
+static Account *accounts = NULL;
+static guint nextLogin = 0;
+static guint loginsDone = 0;
+
+static GArray *phases = NULL;
+static guint currentPhase = 0;
+static double sendCredit = 0;
+static gint64 lastSendTickUs = 0;
+static gint64 trafficStartUs = 0;
+static gint64 trafficEndUs = 0;
+
+static Latencies loginLatencies;
+static Latencies presenceLatencies;
+static Latencies incomingLatencies;
+static Latencies outgoingLatencies;
+static guint messagesSent = 0;
+
+static guint64 rssStart = 0;
+static guint64 rssPeak = 0;
+
+static void initLatencies(Latencies *latencies)
+{
+	pthread_mutex_init(&latencies->mutex, NULL);
+	latencies->samples = g_array_new(FALSE, FALSE, sizeof(guint));
+	latencies->unmatched = 0;
+}
+
+static void addLatency(Latencies *latencies, gint64 us)
+{
+	pthread_mutex_lock(&latencies->mutex);
+	if (us < 0)
+	{
+		latencies->unmatched++;
+	}
+	else
+	{
+		guint sample = us;
+		g_array_append_val(latencies->samples, sample);
+	}
+	pthread_mutex_unlock(&latencies->mutex);
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+	guint sampleA = *(const guint *) a;
+	guint sampleB = *(const guint *) b;
+	return sampleA < sampleB ? -1 : sampleA > sampleB;
+}
+
+/*
+ * {count, perSecond, unmatched, p50Us, p90Us, p99Us, maxUs}
+ */
+static struct json_object* reportLatencies(Latencies *latencies, double seconds)
+{
+	struct json_object *report = json_object_new_object();
+	pthread_mutex_lock(&latencies->mutex);
+	guint count = latencies->samples->len;
+	guint *samples = (guint *) latencies->samples->data;
+
+	qsort(samples, count, sizeof(guint), compareSamples);
+	json_object_object_add(report, "count", json_object_new_int(count));
+	json_object_object_add(report, "perSecond", json_object_new_double(seconds > 0 ? count / seconds : 0));
+	json_object_object_add(report, "unmatched", json_object_new_int(latencies->unmatched));
+	json_object_object_add(report, "p50Us", json_object_new_int(count ? samples[(count - 1) * 50 / 100] : 0));
+	json_object_object_add(report, "p90Us", json_object_new_int(count ? samples[(count - 1) * 90 / 100] : 0));
+	json_object_object_add(report, "p99Us", json_object_new_int(count ? samples[(count - 1) * 99 / 100] : 0));
+	json_object_object_add(report, "maxUs", json_object_new_int(count ? samples[count - 1] : 0));
+	pthread_mutex_unlock(&latencies->mutex);
+	return report;
+}
+
+static void sampleRss(void)
+{
+	rssPeak = MAX(rssPeak, adapterStatsGetRssBytes());
+}
+
+static gboolean sampleRssTimer(gpointer data)
+{
+	sampleRss();
+	return TRUE;
+}
+
+static void report(void)
+{
+	LoopbackXmppStats serverStats;
+	guint i, failed = 0;
+	double seconds = (trafficEndUs - trafficStartUs) / 1000000.0;
+
+	loopbackXmppGetStats(&serverStats);
+	sampleRss();
+	for (i = 0; i < accountCount; i++)
+	{
+		failed += accounts[i].failed;
+	}
+
+	struct json_object *login = reportLatencies(&loginLatencies, 0);
+	json_object_object_add(login, "failed", json_object_new_int(failed));
+
+	struct json_object *presence = reportLatencies(&presenceLatencies, seconds);
+	json_object_object_add(presence, "sent", json_object_new_int(serverStats.presenceSent));
+
+	struct json_object *incoming = reportLatencies(&incomingLatencies, seconds);
+	json_object_object_add(incoming, "sent", json_object_new_int(serverStats.messagesSent));
+
+	struct json_object *outgoing = reportLatencies(&outgoingLatencies, seconds);
+	json_object_object_add(outgoing, "sent", json_object_new_int(messagesSent));
+
+	struct json_object *rss = json_object_new_object();
+	json_object_object_add(rss, "startBytes", json_object_new_double(rssStart));
+	json_object_object_add(rss, "peakBytes", json_object_new_double(rssPeak));
+	json_object_object_add(rss, "endBytes", json_object_new_double(adapterStatsGetRssBytes()));
+
+	struct json_object *result = json_object_new_object();
+	json_object_object_add(result, "accounts", json_object_new_int(accountCount));
+	json_object_object_add(result, "buddiesPerAccount", json_object_new_int(buddyCount));
+	json_object_object_add(result, "trafficSeconds", json_object_new_double(seconds));
+	json_object_object_add(result, "login", login);
+	json_object_object_add(result, "presence", presence);
+	json_object_object_add(result, "messagesIn", incoming);
+	json_object_object_add(result, "messagesOut", outgoing);
+	json_object_object_add(result, "rss", rss);
+	json_object_object_add(result, "liveBusMessages", json_object_new_int(lsShimLiveMessages()));
+	printf("%s\n", json_object_to_json_string(result));
+	json_object_put(result);
+}
+
+static gboolean finish(gpointer data)
+{
+	trafficEndUs = loadTestClockNowUs();
+	loopbackXmppSetRates(0, 0);
+	report();
+	g_main_loop_quit(adapterLoop);
+	return FALSE;
+}
+
+static void sendOneMessage(void)
+{
+	guint loggedIn = 0, i, pick;
+	for (i = 0; i < accountCount; i++)
+	{
+		loggedIn += accounts[i].loggedIn;
+	}
+	if (loggedIn == 0)
+	{
+		return;
+	}
+	pick = g_random_int_range(0, loggedIn);
+	for (i = 0; !accounts[i].loggedIn || pick-- > 0; i++)
+		;
+
+	char *payload = g_strdup_printf("{\"serviceName\":\"gmail\", \"username\":\"%s\", "
+		"\"usernameTo\":\"buddy%d@" LOOPBACK_XMPP_DOMAIN "\", \"messageText\":\"lt:%u\"}", accounts[i].username,
+			g_random_int_range(0, buddyCount), loadTestClockStamp());
+	lsShimCall("sendMessage", payload, NULL, NULL);
+	g_free(payload);
+	messagesSent++;
+}
+
+static gboolean sendTick(gpointer data)
+{
+	Phase *phase = &g_array_index(phases, Phase, currentPhase);
+	gint64 now = loadTestClockNowUs();
+
+	sendCredit += phase->sendRate * (now - lastSendTickUs) / 1000000.0;
+	lastSendTickUs = now;
+	for (; sendCredit >= 1; sendCredit--)
+	{
+		sendOneMessage();
+	}
+	return TRUE;
+}
+
+static gboolean nextPhase(gpointer data)
+{
+	static guint sendTimer = 0;
+
+	if (data != NULL)
+	{
+		currentPhase++;
+	}
+	if (currentPhase >= phases->len)
+	{
+		g_source_remove(sendTimer);
+		finish(NULL);
+		return FALSE;
+	}
+
+	Phase *phase = &g_array_index(phases, Phase, currentPhase);
+	fprintf(stderr, "phase %u: %u s, presence %.1f/s, messages in %.1f/s, out %.1f/s\n", currentPhase, phase->seconds,
+			phase->presenceRate, phase->messageRate, phase->sendRate);
+	loopbackXmppSetRates(phase->presenceRate, phase->messageRate);
+	if (sendTimer == 0)
+	{
+		lastSendTickUs = loadTestClockNowUs();
+		sendTimer = g_timeout_add(SEND_TICK_MS, sendTick, NULL);
+	}
+	g_timeout_add_seconds(phase->seconds, nextPhase, GINT_TO_POINTER(TRUE));
+	return FALSE;
+}
+
+static gboolean startTraffic(gpointer data)
+{
+	static gboolean started = FALSE;
+	if (started)
+	{
+		return FALSE;
+	}
+	started = TRUE;
+	fprintf(stderr, "%u of %d accounts logged in\n", loginsDone, accountCount);
+	trafficStartUs = loadTestClockNowUs();
+	nextPhase(NULL);
+	return FALSE;
+}
+
+static void presenceReply(const char *method, const char *payload, gpointer data)
+{
+	if (strstr(payload, "\"fullBuddyList\"") != NULL || strstr(payload, "\"returnValue\"") != NULL)
+	{
+		return;
+	}
+	addLatency(&presenceLatencies, loadTestClockElapsedUsIn(payload));
+}
+
+static void incomingMessageReply(const char *method, const char *payload, gpointer data)
+{
+	if (strstr(payload, "\"returnValue\"") != NULL)
+	{
+		return;
+	}
+	addLatency(&incomingLatencies, loadTestClockElapsedUsIn(payload));
+}
+
+static void outgoingMessageReceived(const char *body)
+{
+	addLatency(&outgoingLatencies, loadTestClockElapsedUsIn(body));
+}
+
+static void loginDone(Account *account)
+{
+	if (++loginsDone == accountCount)
+	{
+		startTraffic(NULL);
+	}
+}
+
+static void loginReply(const char *method, const char *payload, gpointer data)
+{
+	Account *account = data;
+	gboolean success = strstr(payload, "\"returnValue\":true") != NULL || strstr(payload, "\"returnValue\": true") != NULL;
+
+	if (account->loggedIn || account->failed || (account->inLoginCall && success))
+	{
+		return;
+	}
+	if (!success)
+	{
+		fprintf(stderr, "%s failed to log in: %s\n", account->username, payload);
+		account->failed = TRUE;
+		loginDone(account);
+		return;
+	}
+
+	addLatency(&loginLatencies, loadTestClockNowUs() - account->loginStartUs);
+	account->loggedIn = TRUE;
+
+	char *subscribe = g_strdup_printf("{\"serviceName\":\"gmail\", \"username\":\"%s\", \"subscribe\":true}",
+			account->username);
+	lsShimCall("getBuddyList", subscribe, presenceReply, account);
+	g_free(subscribe);
+	loginDone(account);
+}
+
+static gboolean loginNext(gpointer data)
+{
+	if (nextLogin == accountCount)
+	{
+		return FALSE;
+	}
+	Account *account = &accounts[nextLogin++];
+	char *payload = g_strdup_printf("{\"serviceName\":\"gmail\", \"username\":\"%s\", \"password\":\"loadtest\", "
+		"\"availability\":0, \"localIpAddress\":\"127.0.0.1\", \"connectionType\":\"wifi\"}", account->username);
+	account->loginStartUs = loadTestClockNowUs();
+	account->inLoginCall = TRUE;
+	lsShimCall("login", payload, loginReply, account);
+	account->inLoginCall = FALSE;
+	g_free(payload);
+	return TRUE;
+}
+
+static void adapterAttached(GMainLoop *loop, gpointer data)
+{
+	adapterLoop = loop;
+	rssStart = rssPeak = adapterStatsGetRssBytes();
+	lsShimCall("registerForIncomingMessages", "{\"subscribe\":true}", incomingMessageReply, NULL);
+	g_timeout_add(LOGIN_SPACING_MS, loginNext, NULL);
+	g_timeout_add_seconds(LOGIN_WAIT_SECONDS, startTraffic, NULL);
+	g_timeout_add_seconds(RSS_SAMPLE_SECONDS, sampleRssTimer, NULL);
+}
+
+/*
+ * Called by the adapter's login before the account connects
+ */
+static void loadTestConfigureAccount(PurpleAccount *account)
+{
+	purple_account_set_string(account, "connect_server", "127.0.0.1");
+	purple_account_set_int(account, "port", serverPort);
+	purple_account_set_bool(account, "require_tls", FALSE);
+	purple_account_set_string(account, "connection_security", "opportunistic_tls");
+	purple_account_set_bool(account, "auth_plain_in_clear", TRUE);
+}
+
+static gboolean loadScript(const char *path)
+{
+	char *contents;
+	char **lines;
+	int i;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		fprintf(stderr, "Can't read %s\n", path);
+		return FALSE;
+	}
+	lines = g_strsplit(contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++)
+	{
+		Phase phase;
+		char *line = g_strstrip(lines[i]);
+		if (line[0] == '\0' || line[0] == '#')
+		{
+			continue;
+		}
+		if (sscanf(line, "%u %lf %lf %lf", &phase.seconds, &phase.presenceRate, &phase.messageRate, &phase.sendRate)
+				!= 4)
+		{
+			fprintf(stderr, "%s:%d: expected seconds, presence/s, incoming/s, outgoing/s\n", path, i + 1);
+			g_strfreev(lines);
+			g_free(contents);
+			return FALSE;
+		}
+		g_array_append_val(phases, phase);
+	}
+	g_strfreev(lines);
+	g_free(contents);
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("- load test the adapter against a loopback XMPP server");
+	int i;
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	phases = g_array_new(FALSE, FALSE, sizeof(Phase));
+	if (scriptPath != NULL)
+	{
+		if (!loadScript(scriptPath))
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		Phase phase = { duration, presenceRate, messageRate, sendRate };
+		g_array_append_val(phases, phase);
+	}
+
+	accounts = g_new0(Account, accountCount);
+	for (i = 0; i < accountCount; i++)
+	{
+		accounts[i].index = i;
+		accounts[i].username = g_strdup_printf("load%d@" LOOPBACK_XMPP_DOMAIN, i);
+	}
+	initLatencies(&loginLatencies);
+	initLatencies(&presenceLatencies);
+	initLatencies(&incomingLatencies);
+	initLatencies(&outgoingLatencies);
+
+	if (!g_thread_supported())
+	{
+		g_thread_init(NULL);
+	}
+	serverPort = loopbackXmppStart(buddyCount, outgoingMessageReceived);
+	if (serverPort == 0)
+	{
+		return 1;
+	}
+	fprintf(stderr, "loopback XMPP server on 127.0.0.1:%u\n", serverPort);
+
+	lsShimInit(adapterAttached, NULL);
+	adapterSetDataPaths(loadTestDataPath("im-incoming-spool"), loadTestDataPath("im-avatars"));
+	adapterSetConfigureAccountFunction(loadTestConfigureAccount);
+	char *adapterArgv[] = { argv[0], NULL };
+	int result = adapterMain(1, adapterArgv);
+
+	loopbackXmppStop();
+	loadTestDataRemove();
+	return result;
+}
@@ -0,0 +1,559 @@
+/*
+ * <LoopbackXmppServer.c: a scriptable XMPP server on 127.0.0.1 for load tests>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Stanzas are found by counting tag depth, not by parsing: libpurple escapes '<' and '>' in text and attributes, and
+ * that's all this needs. Writes block; it's the loopback interface and the adapter never waits on us.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "LoadTestClock.h"
+#include "LoopbackXmppServer.h"
+
+#define TRAFFIC_TICK_MS 10
+
+typedef struct _Session
+{
+	int fd;
+	guint watch;
+	GString *input;
+	char *username;
+	char *jid;
+	gboolean authenticated;
+	gboolean online;
+} Session;
+
+static GMainContext *serverContext = NULL;
+static GMainLoop *serverLoop = NULL;
+static pthread_t serverThread;
+static int listenFd = -1;
+
+static guint buddyCount = 0;
+static LoopbackXmppReceivedFunction receivedFunction = NULL;
+
+/**
+ * Sessions that have sent their initial presence
+ */
+static GPtrArray *onlineSessions = NULL;
+
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static LoopbackXmppStats stats;
+static double presenceRate = 0;
+static double messageRate = 0;
+
+static gint64 lastTickUs = 0;
+static double presenceCredit = 0;
+static double messageCredit = 0;
+
+static void sendText(Session *session, const char *text)
+{
+	size_t length = strlen(text);
+	while (length > 0)
+	{
+		ssize_t sent = send(session->fd, text, length, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (sent <= 0)
+		{
+			return;
+		}
+		text += sent;
+		length -= sent;
+	}
+}
+
+static void sendPrintf(Session *session, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+static void sendPrintf(Session *session, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	char *text = g_strdup_vprintf(format, args);
+	va_end(args);
+	sendText(session, text);
+	g_free(text);
+}
+
+/*
+ * The value of attribute name of the stanza's own tag, or NULL. Free it.
+ */
+static char* getAttribute(const char *stanza, const char *name)
+{
+	const char *end = strchr(stanza, '>');
+	size_t nameLength = strlen(name);
+	const char *at;
+
+	for (at = strstr(stanza, name); at != NULL && at < end; at = strstr(at + 1, name))
+	{
+		if (at[-1] == ' ' && at[nameLength] == '=' && (at[nameLength + 1] == '\'' || at[nameLength + 1] == '"'))
+		{
+			const char *value = at + nameLength + 2;
+			const char *valueEnd = strchr(value, at[nameLength + 1]);
+			return valueEnd != NULL ? g_strndup(value, valueEnd - value) : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The text of the first <name> element in stanza, or NULL. Free it.
+ */
+static char* getElementText(const char *stanza, const char *name)
+{
+	char *open = g_strdup_printf("<%s>", name);
+	char *close = g_strdup_printf("</%s>", name);
+	const char *start = strstr(stanza, open);
+	const char *end = start != NULL ? strstr(start, close) : NULL;
+	char *text = end != NULL ? g_strndup(start + strlen(open), end - start - strlen(open)) : NULL;
+	g_free(open);
+	g_free(close);
+	return text;
+}
+
+static void sendBuddyPresence(Session *session, guint buddy)
+{
+	guint seq = loadTestClockStamp();
+	sendPrintf(session, "<presence from='buddy%u@" LOOPBACK_XMPP_DOMAIN "/loadtest' to='%s'>%s<status>lt:%u</status>"
+		"</presence>", buddy, session->jid, seq % 2 ? "<show>away</show>" : "", seq);
+	pthread_mutex_lock(&statsMutex);
+	stats.presenceSent++;
+	pthread_mutex_unlock(&statsMutex);
+}
+
+static void sendBuddyMessage(Session *session, guint buddy)
+{
+	guint seq = loadTestClockStamp();
+	sendPrintf(session, "<message from='buddy%u@" LOOPBACK_XMPP_DOMAIN "/loadtest' to='%s' type='chat' id='lt%u'>"
+		"<body>lt:%u</body></message>", buddy, session->jid, seq, seq);
+	pthread_mutex_lock(&statsMutex);
+	stats.messagesSent++;
+	pthread_mutex_unlock(&statsMutex);
+}
+
+static void openStream(Session *session)
+{
+	sendText(session, "<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+		"xmlns:stream='http://etherx.jabber.org/streams' id='loadtest' from='" LOOPBACK_XMPP_DOMAIN "' version='1.0'>");
+	if (session->authenticated)
+	{
+		sendText(session, "<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+			"<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/></stream:features>");
+	}
+	else
+	{
+		sendText(session, "<stream:features><mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+			"<mechanism>PLAIN</mechanism></mechanisms></stream:features>");
+	}
+}
+
+static void handleAuth(Session *session, const char *stanza)
+{
+	/* base64 of "authzid\0authcid\0password" */
+	const char *start = strchr(stanza, '>');
+	const char *end = start != NULL ? strchr(start, '<') : NULL;
+	gsize length = 0;
+
+	if (end != NULL)
+	{
+		char *encoded = g_strndup(start + 1, end - start - 1);
+		guchar *decoded = g_base64_decode(encoded, &length);
+		const char *authcid = memchr(decoded, '\0', length);
+		if (authcid != NULL)
+		{
+			session->username = g_strndup(authcid + 1, length - (authcid + 1 - (const char *) decoded));
+		}
+		g_free(decoded);
+		g_free(encoded);
+	}
+	if (session->username == NULL)
+	{
+		sendText(session, "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><not-authorized/></failure>");
+		return;
+	}
+	session->authenticated = TRUE;
+	sendText(session, "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+}
+
+static void sendRoster(Session *session, const char *id)
+{
+	guint i;
+	GString *roster = g_string_new(NULL);
+	g_string_append_printf(roster, "<iq type='result' id='%s' to='%s'><query xmlns='jabber:iq:roster'>", id,
+			session->jid);
+	for (i = 0; i < buddyCount; i++)
+	{
+		g_string_append_printf(roster, "<item jid='buddy%u@" LOOPBACK_XMPP_DOMAIN "' name='Buddy %u' "
+			"subscription='both'><group>Load test</group></item>", i, i);
+	}
+	g_string_append(roster, "</query></iq>");
+	sendText(session, roster->str);
+	g_string_free(roster, TRUE);
+}
+
+static void handleIq(Session *session, const char *stanza)
+{
+	char *id = getAttribute(stanza, "id");
+	char *type = getAttribute(stanza, "type");
+	char *to = getAttribute(stanza, "to");
+
+	if (id == NULL || type == NULL || strcmp(type, "result") == 0 || strcmp(type, "error") == 0)
+	{
+		/* nothing to answer */
+	}
+	else if (strstr(stanza, "urn:ietf:params:xml:ns:xmpp-bind") != NULL)
+	{
+		g_free(session->jid);
+		session->jid = g_strdup_printf("%s@" LOOPBACK_XMPP_DOMAIN "/loadtest", session->username);
+		sendPrintf(session, "<iq type='result' id='%s'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>%s</jid>"
+			"</bind></iq>", id, session->jid);
+	}
+	else if (strstr(stanza, "jabber:iq:roster") != NULL && strcmp(type, "get") == 0)
+	{
+		sendRoster(session, id);
+	}
+	else if (to != NULL)
+	{
+		sendPrintf(session, "<iq type='result' id='%s' from='%s'/>", id, to);
+	}
+	else
+	{
+		sendPrintf(session, "<iq type='result' id='%s'/>", id);
+	}
+	g_free(id);
+	g_free(type);
+	g_free(to);
+}
+
+static void handlePresence(Session *session, const char *stanza)
+{
+	char *to = getAttribute(stanza, "to");
+	char *type = getAttribute(stanza, "type");
+	guint i;
+
+	if (to == NULL && type == NULL && !session->online && session->jid != NULL)
+	{
+		session->online = TRUE;
+		g_ptr_array_add(onlineSessions, session);
+		pthread_mutex_lock(&statsMutex);
+		stats.onlineSessions++;
+		pthread_mutex_unlock(&statsMutex);
+		for (i = 0; i < buddyCount; i++)
+		{
+			sendBuddyPresence(session, i);
+		}
+	}
+	g_free(to);
+	g_free(type);
+}
+
+static void handleMessage(Session *session, const char *stanza)
+{
+	char *body = getElementText(stanza, "body");
+	if (body == NULL)
+	{
+		/* typing notifications and the like */
+		return;
+	}
+	pthread_mutex_lock(&statsMutex);
+	stats.messagesReceived++;
+	pthread_mutex_unlock(&statsMutex);
+	if (receivedFunction != NULL)
+	{
+		receivedFunction(body);
+	}
+	g_free(body);
+}
+
+static void handleStanza(Session *session, const char *stanza)
+{
+	if (g_str_has_prefix(stanza, "<auth"))
+	{
+		handleAuth(session, stanza);
+	}
+	else if (g_str_has_prefix(stanza, "<iq"))
+	{
+		handleIq(session, stanza);
+	}
+	else if (g_str_has_prefix(stanza, "<presence"))
+	{
+		handlePresence(session, stanza);
+	}
+	else if (g_str_has_prefix(stanza, "<message"))
+	{
+		handleMessage(session, stanza);
+	}
+}
+
+/*
+ * Length of the complete element at the start of text, or 0 if it hasn't all arrived yet
+ */
+static gsize getElementLength(const char *text)
+{
+	const char *at = text;
+	int depth = 0;
+
+	while ((at = strchr(at, '<')) != NULL)
+	{
+		const char *end = strchr(at, '>');
+		if (end == NULL)
+		{
+			return 0;
+		}
+		if (at[1] == '/')
+		{
+			depth--;
+		}
+		else if (end[-1] != '/')
+		{
+			depth++;
+		}
+		at = end + 1;
+		if (depth == 0)
+		{
+			return at - text;
+		}
+	}
+	return 0;
+}
+
+/*
+ * FALSE once the stream is closed
+ */
+static gboolean processInput(Session *session)
+{
+	for (;;)
+	{
+		gsize skip = strspn(session->input->str, " \t\r\n");
+		g_string_erase(session->input, 0, skip);
+		const char *text = session->input->str;
+		const char *end;
+		gsize length;
+
+		if (text[0] == '\0')
+		{
+			return TRUE;
+		}
+		if (g_str_has_prefix(text, "<?xml"))
+		{
+			if ((end = strstr(text, "?>")) == NULL)
+			{
+				return TRUE;
+			}
+			length = end + 2 - text;
+		}
+		else if (g_str_has_prefix(text, "<stream:stream"))
+		{
+			if ((end = strchr(text, '>')) == NULL)
+			{
+				return TRUE;
+			}
+			length = end + 1 - text;
+			openStream(session);
+		}
+		else if (g_str_has_prefix(text, "</stream:stream>"))
+		{
+			sendText(session, "</stream:stream>");
+			return FALSE;
+		}
+		else
+		{
+			if ((length = getElementLength(text)) == 0)
+			{
+				return TRUE;
+			}
+			char *stanza = g_strndup(text, length);
+			handleStanza(session, stanza);
+			g_free(stanza);
+		}
+		g_string_erase(session->input, 0, length);
+	}
+}
+
+static void closeSession(Session *session)
+{
+	if (session->online)
+	{
+		g_ptr_array_remove_fast(onlineSessions, session);
+		pthread_mutex_lock(&statsMutex);
+		stats.onlineSessions--;
+		pthread_mutex_unlock(&statsMutex);
+	}
+	close(session->fd);
+	g_string_free(session->input, TRUE);
+	g_free(session->username);
+	g_free(session->jid);
+	g_free(session);
+}
+
+static gboolean sessionReadable(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	Session *session = data;
+	char buffer[4096];
+	ssize_t received = recv(session->fd, buffer, sizeof(buffer), 0);
+
+	if (received == 0 || (received < 0 && errno != EINTR))
+	{
+		closeSession(session);
+		return FALSE;
+	}
+	if (received > 0)
+	{
+		g_string_append_len(session->input, buffer, received);
+		if (!processInput(session))
+		{
+			closeSession(session);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void addWatch(int fd, GIOFunc function, gpointer data)
+{
+	GIOChannel *channel = g_io_channel_unix_new(fd);
+	GSource *source = g_io_create_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR);
+	g_source_set_callback(source, (GSourceFunc) function, data, NULL);
+	g_source_attach(source, serverContext);
+	g_source_unref(source);
+	g_io_channel_unref(channel);
+}
+
+static gboolean acceptSession(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	int fd = accept(listenFd, NULL, NULL);
+	if (fd >= 0)
+	{
+		Session *session = g_new0(Session, 1);
+		session->fd = fd;
+		session->input = g_string_new(NULL);
+		addWatch(fd, sessionReadable, session);
+	}
+	return TRUE;
+}
+
+/*
+ * Sends what's due at the current rates to random buddies of random online accounts
+ */
+static gboolean sendTraffic(gpointer data)
+{
+	gint64 now = loadTestClockNowUs();
+	double elapsed = lastTickUs ? (now - lastTickUs) / 1000000.0 : 0;
+	lastTickUs = now;
+
+	pthread_mutex_lock(&statsMutex);
+	presenceCredit += presenceRate * elapsed;
+	messageCredit += messageRate * elapsed;
+	pthread_mutex_unlock(&statsMutex);
+
+	if (onlineSessions->len == 0 || buddyCount == 0)
+	{
+		presenceCredit = messageCredit = 0;
+		return TRUE;
+	}
+	for (; presenceCredit >= 1; presenceCredit--)
+	{
+		sendBuddyPresence(g_ptr_array_index(onlineSessions, g_random_int_range(0, onlineSessions->len)),
+				g_random_int_range(0, buddyCount));
+	}
+	for (; messageCredit >= 1; messageCredit--)
+	{
+		sendBuddyMessage(g_ptr_array_index(onlineSessions, g_random_int_range(0, onlineSessions->len)),
+				g_random_int_range(0, buddyCount));
+	}
+	return TRUE;
+}
+
+static void* runServer(void *data)
+{
+	g_main_loop_run(serverLoop);
+	return NULL;
+}
+
+guint16 loopbackXmppStart(guint buddiesPerAccount, LoopbackXmppReceivedFunction received)
+{
+	struct sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+
+	buddyCount = buddiesPerAccount;
+	receivedFunction = received;
+	onlineSessions = g_ptr_array_new();
+
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr *) &address, sizeof(address)) != 0
+			|| listen(listenFd, 128) != 0
+			|| getsockname(listenFd, (struct sockaddr *) &address, &addressLength) != 0)
+	{
+		perror("loopback XMPP server");
+		return 0;
+	}
+
+	serverContext = g_main_context_new();
+	serverLoop = g_main_loop_new(serverContext, FALSE);
+	addWatch(listenFd, acceptSession, NULL);
+
+	GSource *traffic = g_timeout_source_new(TRAFFIC_TICK_MS);
+	g_source_set_callback(traffic, sendTraffic, NULL, NULL);
+	g_source_attach(traffic, serverContext);
+	g_source_unref(traffic);
+
+	if (pthread_create(&serverThread, NULL, runServer, NULL) != 0)
+	{
+		perror("loopback XMPP server");
+		return 0;
+	}
+	return ntohs(address.sin_port);
+}
+
+void loopbackXmppSetRates(double presencePerSecond, double messagesPerSecond)
+{
+	pthread_mutex_lock(&statsMutex);
+	presenceRate = presencePerSecond;
+	messageRate = messagesPerSecond;
+	pthread_mutex_unlock(&statsMutex);
+}
+
+void loopbackXmppGetStats(LoopbackXmppStats *serverStats)
+{
+	pthread_mutex_lock(&statsMutex);
+	*serverStats = stats;
+	pthread_mutex_unlock(&statsMutex);
+}
+
+void loopbackXmppStop(void)
+{
+	if (serverLoop == NULL)
+	{
+		return;
+	}
+	g_main_loop_quit(serverLoop);
+	g_main_context_wakeup(serverContext);
+	pthread_join(serverThread, NULL);
+	close(listenFd);
+	g_main_loop_unref(serverLoop);
+	serverLoop = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * <LoopbackXmppServer.h: a scriptable XMPP server on 127.0.0.1 for load tests>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Just enough of RFC 3920 for libpurple's jabber prpl: no TLS, SASL PLAIN accepting any password, resource binding,
+ * sessions, and a roster of buddy0@localhost ... buddy<N-1>@localhost for every account. Any other IQ gets an empty
+ * result. Once an account sends its initial presence it gets the presence of all its buddies, then presence changes
+ * and messages from random buddies at the rates set with loopbackXmppSetRates. Every one carries "lt:<seq>" (see
+ * LoadTestClock.h). Runs on a thread of its own so it doesn't compete with the adapter's main loop.
+ */
+
+#ifndef LOOPBACK_XMPP_SERVER_H
+#define LOOPBACK_XMPP_SERVER_H
+
+#include <glib.h>
+
+#define LOOPBACK_XMPP_DOMAIN "localhost"
+
+typedef struct _LoopbackXmppStats
+{
+	/* accounts that have sent their initial presence */
+	guint onlineSessions;
+	guint presenceSent;
+	guint messagesSent;
+	/* messages the accounts sent to their buddies */
+	guint messagesReceived;
+} LoopbackXmppStats;
+
+/**
+ * A message an account sent, with its body. Called on the server's thread.
+ */
+typedef void (*LoopbackXmppReceivedFunction)(const char *body);
+
+/**
+ * Listens on an ephemeral port of 127.0.0.1 and returns it, or 0 if it couldn't
+ */
+guint16 loopbackXmppStart(guint buddiesPerAccount, LoopbackXmppReceivedFunction received);
+
+/**
+ * Presence changes and messages per second, over all online accounts
+ */
+void loopbackXmppSetRates(double presencePerSecond, double messagesPerSecond);
+
+void loopbackXmppGetStats(LoopbackXmppStats *stats);
+
+void loopbackXmppStop(void);
+
+#endif
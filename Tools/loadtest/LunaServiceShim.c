@@ -0,0 +1,382 @@
+/*
+ * <LunaServiceShim.c: the lunaservice calls the adapter makes, in process>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Only what the adapter uses is here. Subscriptions and message reference counts are shared with the event worker
+ * thread and are guarded by one mutex; replies are delivered outside of it.
+ */
+
+#include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cjson/json.h>
+#include <lunaservice.h>
+
+#include "LunaServiceShim.h"
+
+struct LSHandle
+{
+	char *name;
+	LSMethod *methods;
+	void *categoryData;
+};
+
+struct LSMessage
+{
+	int refCount;
+	char *method;
+	char *payload;
+	struct json_object *payloadJson;
+	LSShimReplyFunction reply;
+	gpointer replyData;
+};
+
+struct LSSubscriptionIter
+{
+	GList *messages;
+	GList *next;
+};
+
+typedef struct _ShimCall
+{
+	char *uri;
+	LSFilterFunc callback;
+	void *data;
+} ShimCall;
+
+static pthread_mutex_t shimMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static LSHandle *serviceHandle = NULL;
+static LSShimAttachedFunction attachedFunction = NULL;
+static gpointer attachedData = NULL;
+
+/**
+ * key: subscription key, value: GList of LSMessages (each holding a reference)
+ */
+static GHashTable *subscriptions = NULL;
+
+/**
+ * ShimCalls made with LSCall
+ */
+static GList *calls = NULL;
+
+static guint liveMessages = 0;
+
+static void setError(LSError *lserror, const char *text)
+{
+	if (lserror != NULL)
+	{
+		lserror->error_code = -1;
+		lserror->message = g_strdup(text);
+	}
+}
+
+static LSMessage* newMessage(const char *method, const char *payload, LSShimReplyFunction reply, gpointer data)
+{
+	LSMessage *message = g_new0(LSMessage, 1);
+	message->refCount = 1;
+	message->method = g_strdup(method);
+	message->payload = g_strdup(payload);
+	message->reply = reply;
+	message->replyData = data;
+	pthread_mutex_lock(&shimMutex);
+	liveMessages++;
+	pthread_mutex_unlock(&shimMutex);
+	return message;
+}
+
+void lsShimInit(LSShimAttachedFunction attached, gpointer data)
+{
+	attachedFunction = attached;
+	attachedData = data;
+	subscriptions = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+gboolean lsShimCall(const char *method, const char *payload, LSShimReplyFunction reply, gpointer data)
+{
+	LSMethod *lsMethod;
+
+	if (serviceHandle == NULL || serviceHandle->methods == NULL)
+	{
+		return FALSE;
+	}
+	for (lsMethod = serviceHandle->methods; lsMethod->name != NULL; lsMethod++)
+	{
+		if (strcmp(lsMethod->name, method) == 0)
+		{
+			LSMessage *message = newMessage(method, payload, reply, data);
+			lsMethod->function(serviceHandle, message, serviceHandle->categoryData);
+			LSMessageUnref(message);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void lsShimSignal(const char *uri, const char *payload)
+{
+	GList *iter;
+	for (iter = calls; iter != NULL; iter = iter->next)
+	{
+		ShimCall *call = iter->data;
+		if (strcmp(call->uri, uri) == 0)
+		{
+			LSMessage *message = newMessage(uri, payload, NULL, NULL);
+			call->callback(serviceHandle, message, call->data);
+			LSMessageUnref(message);
+		}
+	}
+}
+
+guint lsShimLiveMessages(void)
+{
+	pthread_mutex_lock(&shimMutex);
+	guint count = liveMessages;
+	pthread_mutex_unlock(&shimMutex);
+	return count;
+}
+
+struct json_object* lsShimMessagePayloadJSON(LSMessage *message)
+{
+	if (message->payloadJson == NULL)
+	{
+		message->payloadJson = json_tokener_parse(message->payload);
+		if (is_error(message->payloadJson))
+		{
+			message->payloadJson = NULL;
+		}
+	}
+	return message->payloadJson;
+}
+
+bool LSErrorInit(LSError *lserror)
+{
+	memset(lserror, 0, sizeof(LSError));
+	return TRUE;
+}
+
+void LSErrorFree(LSError *lserror)
+{
+	g_free(lserror->message);
+	LSErrorInit(lserror);
+}
+
+bool LSErrorIsSet(LSError *lserror)
+{
+	return lserror->error_code != 0;
+}
+
+void LSErrorPrint(LSError *lserror, FILE *out)
+{
+	fprintf(out, "LSError: %s\n", lserror->message != NULL ? lserror->message : "(unknown)");
+}
+
+bool LSRegister(const char *name, LSHandle **handle, LSError *lserror)
+{
+	serviceHandle = g_new0(LSHandle, 1);
+	serviceHandle->name = g_strdup(name);
+	*handle = serviceHandle;
+	return TRUE;
+}
+
+bool LSRegisterCategory(LSHandle *handle, const char *category, LSMethod *methods, LSSignal *signals, void *data,
+		LSError *lserror)
+{
+	if (strcmp(category, "/") != 0)
+	{
+		setError(lserror, "the shim only has the root category");
+		return FALSE;
+	}
+	handle->methods = methods;
+	handle->categoryData = data;
+	return TRUE;
+}
+
+bool LSGmainAttach(LSHandle *handle, GMainLoop *loop, LSError *lserror)
+{
+	if (attachedFunction != NULL)
+	{
+		attachedFunction(loop, attachedData);
+	}
+	return TRUE;
+}
+
+bool LSUnregister(LSHandle *handle, LSError *lserror)
+{
+	g_free(handle->name);
+	g_free(handle);
+	serviceHandle = NULL;
+	return TRUE;
+}
+
+bool LSCall(LSHandle *handle, const char *uri, const char *payload, LSFilterFunc callback, void *data,
+		LSMessageToken *token, LSError *lserror)
+{
+	ShimCall *call = g_new0(ShimCall, 1);
+	call->uri = g_strdup(uri);
+	call->callback = callback;
+	call->data = data;
+	calls = g_list_append(calls, call);
+	if (token != NULL)
+	{
+		*token = g_list_length(calls);
+	}
+	return TRUE;
+}
+
+const char* LSMessageGetPayload(LSMessage *message)
+{
+	return message->payload;
+}
+
+const char* LSMessageGetMethod(LSMessage *message)
+{
+	return message->method;
+}
+
+bool LSMessageIsSubscription(LSMessage *message)
+{
+	struct json_object *payload = lsShimMessagePayloadJSON(message);
+	return payload != NULL && json_object_get_boolean(json_object_object_get(payload, "subscribe"));
+}
+
+void LSMessageRef(LSMessage *message)
+{
+	pthread_mutex_lock(&shimMutex);
+	message->refCount++;
+	pthread_mutex_unlock(&shimMutex);
+}
+
+void LSMessageUnref(LSMessage *message)
+{
+	pthread_mutex_lock(&shimMutex);
+	gboolean last = --message->refCount == 0;
+	if (last)
+	{
+		liveMessages--;
+	}
+	pthread_mutex_unlock(&shimMutex);
+
+	if (last)
+	{
+		if (message->payloadJson != NULL)
+		{
+			json_object_put(message->payloadJson);
+		}
+		g_free(message->method);
+		g_free(message->payload);
+		g_free(message);
+	}
+}
+
+bool LSMessageReply(LSHandle *handle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	if (message->reply != NULL)
+	{
+		message->reply(message->method, payload, message->replyData);
+	}
+	return TRUE;
+}
+
+bool LSMessageReturn(LSHandle *handle, LSMessage *message, const char *payload, LSError *lserror)
+{
+	return LSMessageReply(handle, message, payload, lserror);
+}
+
+bool LSSubscriptionAdd(LSHandle *handle, const char *key, LSMessage *message, LSError *lserror)
+{
+	LSMessageRef(message);
+	pthread_mutex_lock(&shimMutex);
+	GList *messages = g_hash_table_lookup(subscriptions, key);
+	if (messages == NULL)
+	{
+		g_hash_table_insert(subscriptions, g_strdup(key), g_list_append(NULL, message));
+	}
+	else
+	{
+		g_list_append(messages, message);
+	}
+	pthread_mutex_unlock(&shimMutex);
+	return TRUE;
+}
+
+bool LSSubscriptionProcess(LSHandle *handle, LSMessage *message, bool *subscribed, LSError *lserror)
+{
+	*subscribed = LSMessageIsSubscription(message);
+	if (*subscribed)
+	{
+		char *key = g_strconcat("/", message->method, NULL);
+		LSSubscriptionAdd(handle, key, message, lserror);
+		g_free(key);
+	}
+	return TRUE;
+}
+
+/*
+ * Subscriptions are only dropped with the process, so the cancel function is never called
+ */
+bool LSSubscriptionSetCancelFunction(LSHandle *handle, LSFilterFunc cancelFunction, void *ctx, LSError *lserror)
+{
+	return TRUE;
+}
+
+bool LSSubscriptionAcquire(LSHandle *handle, const char *key, LSSubscriptionIter **iterator, LSError *lserror)
+{
+	LSSubscriptionIter *iter = g_new0(LSSubscriptionIter, 1);
+	GList *message;
+
+	pthread_mutex_lock(&shimMutex);
+	iter->messages = g_list_copy(g_hash_table_lookup(subscriptions, key));
+	for (message = iter->messages; message != NULL; message = message->next)
+	{
+		((LSMessage *) message->data)->refCount++;
+	}
+	pthread_mutex_unlock(&shimMutex);
+	iter->next = iter->messages;
+	*iterator = iter;
+	return TRUE;
+}
+
+bool LSSubscriptionHasNext(LSSubscriptionIter *iter)
+{
+	return iter->next != NULL;
+}
+
+LSMessage* LSSubscriptionNext(LSSubscriptionIter *iter)
+{
+	LSMessage *message = iter->next->data;
+	iter->next = iter->next->next;
+	return message;
+}
+
+void LSSubscriptionRelease(LSSubscriptionIter *iter)
+{
+	g_list_foreach(iter->messages, (GFunc) LSMessageUnref, NULL);
+	g_list_free(iter->messages);
+	g_free(iter);
+}
+
+bool LSSubscriptionReply(LSHandle *handle, const char *key, const char *payload, LSError *lserror)
+{
+	LSSubscriptionIter *iter;
+	LSSubscriptionAcquire(handle, key, &iter, lserror);
+	while (LSSubscriptionHasNext(iter))
+	{
+		LSMessageReply(handle, LSSubscriptionNext(iter), payload, lserror);
+	}
+	LSSubscriptionRelease(iter);
+	return TRUE;
+}
@@ -0,0 +1,63 @@
+/*
+ * <LunaServiceShim.h: an in-process stand-in for the Luna bus, for load tests>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * The load test links the adapter against LunaServiceShim.c and JsonUtilsShim.c instead of liblunaservice. The
+ * adapter registers its methods as usual; the driver then calls them directly on the main loop and gets every reply
+ * (to the call itself and, for subscriptions, every later LSSubscriptionReply) through a function of its own.
+ */
+
+#ifndef LUNA_SERVICE_SHIM_H
+#define LUNA_SERVICE_SHIM_H
+
+#include <glib.h>
+
+struct LSHandle;
+struct LSMessage;
+struct json_object;
+
+/**
+ * A reply to a call made with lsShimCall. Called on the main loop, which sends every reply (the event worker thread
+ * only builds presence and incoming messages).
+ */
+typedef void (*LSShimReplyFunction)(const char *method, const char *payload, gpointer data);
+
+/**
+ * Called once the adapter has attached its handle to the main loop: the driver starts from here
+ */
+typedef void (*LSShimAttachedFunction)(GMainLoop *loop, gpointer data);
+
+void lsShimInit(LSShimAttachedFunction attached, gpointer data);
+
+/**
+ * Calls the adapter's method with payload on the calling thread (the main loop). Returns FALSE if there's no such
+ * method.
+ */
+gboolean lsShimCall(const char *method, const char *payload, LSShimReplyFunction reply, gpointer data);
+
+/**
+ * Sends payload to what the adapter subscribed to at uri with LSCall (e.g. the display status)
+ */
+void lsShimSignal(const char *uri, const char *payload);
+
+/**
+ * Messages not yet freed: calls in progress, pending replies and subscriptions
+ */
+guint lsShimLiveMessages(void);
+
+/**
+ * For JsonUtilsShim.c: the message's payload, parsed on first use and freed with the message
+ */
+struct json_object* lsShimMessagePayloadJSON(struct LSMessage *message);
+
+#endif
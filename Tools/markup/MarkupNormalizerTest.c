@@ -0,0 +1,212 @@
+/*
+ * <MarkupNormalizerTest.c: checks the plain text and spans markupNormalize makes of a table of messages>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: MarkupNormalizerTest
+ *
+ * Each case is a message, the plain text it has to come out as and its spans, written as "type start end" (plus the
+ * href of links) and separated by ", ". Span offsets are in characters, as the event worker sends them. The markup is
+ * handed over in a buffer of exactly its length, without a NUL, so that reading past it shows up under valgrind.
+ *
+ * Prints what failed and exits with 1 if anything did.
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MarkupNormalizer.h"
+
+#define MAX_SPANS 8
+
+typedef struct _NormalizeCase
+{
+	const char *name;
+	const char *markup;
+	const char *text;
+	const char *spans;
+} NormalizeCase;
+
+static const NormalizeCase cases[] =
+{
+	{ "plain", "hello", "hello", "" },
+	{ "empty", "", "", "" },
+	{ "long runs", "abcdefghijklmnop<b>q</b>rstuvwxyz&amp;", "abcdefghijklmnopqrstuvwxyz&", "bold 16 17" },
+	{ "aim wrapper", "<HTML><BODY><FONT COLOR=\"#000000\">hi &amp; bye</FONT></BODY></HTML>", "hi & bye", "" },
+
+	/* entities */
+	{ "named entities", "&amp;&lt;&gt;&quot;&apos;&nbsp;&copy;&reg;", "&<>\"' \xc2\xa9\xc2\xae", "" },
+	{ "decimal entities", "&#65;&#233;&#9731;", "A\xc3\xa9\xe2\x98\x83", "" },
+	{ "hex entities", "&#x41;&#X1F600;&#xe9;", "A\xf0\x9f\x98\x80\xc3\xa9", "" },
+	{ "highest code point", "&#x10FFFF;", "\xf4\x8f\xbf\xbf", "" },
+	{ "past the highest code point", "&#x110000;", "&#x110000;", "" },
+	{ "unknown entity", "&foo; &hellip;", "&foo; &hellip;", "" },
+	{ "no semicolon", "fish &chips &amp", "fish &chips &amp", "" },
+	{ "empty entities", "&; &#; &#x;", "&; &#; &#x;", "" },
+	{ "not a number", "&#12a; &#xg1;", "&#12a; &#xg1;", "" },
+	{ "overlong numeric entity", "&#0000000065;", "&#0000000065;", "" },
+	{ "overlong named entity", "&ampersandamp;", "&ampersandamp;", "" },
+	{ "nul", "a&#0;b&#x0;c", "a&#0;b&#x0;c", "" },
+	{ "surrogates", "&#xD800;&#55296;&#xDFFF;&#xdc00;", "&#xD800;&#55296;&#xDFFF;&#xdc00;", "" },
+	{ "lone ampersand", "a & b&", "a & b&", "" },
+
+	/* line breaks */
+	{ "br", "a<br>b<BR>c", "a\nb\nc", "" },
+	{ "self-closing br", "a<br/>b<br />c<BR/>d", "a\nb\nc\nd", "" },
+	{ "closing br", "a</br>b", "ab", "" },
+
+	/* things that look like tags */
+	{ "less than", "a < b", "a < b", "" },
+	{ "heart", "<3 you", "<3 you", "" },
+	{ "unclosed tag", "x <b", "x <b", "" },
+	{ "unclosed tag with attributes", "see <a href=\"x\"", "see <a href=\"x\"", "" },
+	{ "lone less than", "<", "<", "" },
+	{ "closing nothing", "a </> b", "a </> b", "" },
+
+	/* comments */
+	{ "comment", "a<!-- hidden <b>x</b> -->b", "ab", "" },
+	{ "empty comment", "a<!---->b", "ab", "" },
+	{ "unclosed comment", "a<!-- no end", "a<!-- no end", "" },
+
+	/* spans */
+	{ "spans", "<b>bold</b> <i>it</i> <u>u</u>", "bold it u", "bold 0 4, italic 5 7, underline 8 9" },
+	{ "span synonyms", "<STRONG>s</STRONG><em>e</em>", "se", "bold 0 1, italic 1 2" },
+	{ "nested spans", "<b>x<i>y</i>z</b>", "xyz", "bold 0 3, italic 1 2" },
+	{ "same span nested", "<b>a<b>b</b>c</b>", "abc", "bold 0 3, bold 1 2" },
+	{ "overlapping spans", "<b>a<i>b</b>c</i>", "abc", "bold 0 2, italic 1 3" },
+	{ "unclosed span", "<b>to the end", "to the end", "bold 0 10" },
+	{ "unclosed inner span", "<b>a<i>b</b>c", "abc", "bold 0 2, italic 1 3" },
+	{ "empty span", "<b></b>x", "x", "" },
+	{ "close without open", "</i>x", "x", "" },
+
+	/* links */
+	{ "double quoted href", "<a href=\"http://example.com/?a=1&amp;b=2\">link</a>", "link",
+			"link 0 4 http://example.com/?a=1&amp;b=2" },
+	{ "single quoted href", "<A HREF='http://example.org/a b'>x</A>", "x", "link 0 1 http://example.org/a b" },
+	{ "unquoted href", "<a title=\"t\" href=http://example.net>y</a>", "y", "link 0 1 http://example.net" },
+	{ "quotes in quotes", "<a href=\"it's\">a</a><a href='say \"hi\"'>b</a>", "ab",
+			"link 0 1 it's, link 1 2 say \"hi\"" },
+	{ "greater than in href", "<a href=\"a>b\">c</a>", "c", "link 0 1 a>b" },
+	{ "no href", "<a name=top>t</a>", "t", "link 0 1" },
+	{ "href in another attribute", "<a data-href=\"x\" href=\"y\">z</a>", "z", "link 0 1 y" },
+
+	/* character offsets */
+	{ "multibyte text", "h\xc3\xa9llo <b>w\xc3\xb6rld</b> \xe2\x98\x83<i>\xc3\xbc</i>",
+			"h\xc3\xa9llo w\xc3\xb6rld \xe2\x98\x83\xc3\xbc", "bold 6 11, italic 13 14" },
+	{ "multibyte entities", "&copy;<b>&#x1F600;x</b>&eacute;<u>&#233;</u>", "\xc2\xa9\xf0\x9f\x98\x80x&eacute;\xc3\xa9",
+			"bold 1 3, underline 11 12" },
+	{ "multibyte link", "\xe4\xb8\xad\xe6\x96\x87 <a href=\"http://example.cn/\">\xe9\x93\xbe\xe6\x8e\xa5</a>",
+			"\xe4\xb8\xad\xe6\x96\x87 \xe9\x93\xbe\xe6\x8e\xa5", "link 3 5 http://example.cn/" },
+
+	{ NULL, NULL, NULL, NULL }
+};
+
+static int failures = 0;
+
+/*
+ * The spans in the notation of the table
+ */
+static char* describeSpans(const char *text, const FormattingSpan *spans, guint spanCount)
+{
+	GString *description = g_string_new("");
+	guint i;
+
+	for (i = 0; i < spanCount; i++)
+	{
+		g_string_append_printf(description, "%s%s %ld %ld", i > 0 ? ", " : "", markupSpanTypeName(spans[i].type),
+				g_utf8_pointer_to_offset(text, text + spans[i].start),
+				g_utf8_pointer_to_offset(text, text + spans[i].end));
+		if (spans[i].href != NULL)
+		{
+			g_string_append_c(description, ' ');
+			g_string_append_len(description, spans[i].href, spans[i].hrefLength);
+		}
+	}
+	return g_string_free(description, FALSE);
+}
+
+static void checkCase(const NormalizeCase *test)
+{
+	gsize length = strlen(test->markup);
+	/* no NUL after the markup */
+	char *markup = g_malloc(MAX(length, 1));
+	memcpy(markup, test->markup, length);
+	char *out = g_malloc(length + 1);
+	FormattingSpan spans[MAX_SPANS];
+	guint spanCount = 0;
+
+	gsize outLength = markupNormalize(markup, length, out, spans, MAX_SPANS, &spanCount);
+	char *description = describeSpans(out, spans, spanCount);
+
+	if (outLength != strlen(out) || strcmp(out, test->text) != 0 || strcmp(description, test->spans) != 0)
+	{
+		fprintf(stderr, "%s:\n  got      \"%s\" (%lu bytes) [%s]\n  expected \"%s\" [%s]\n", test->name, out,
+				(unsigned long) outLength, description, test->text, test->spans);
+		failures++;
+	}
+
+	/* without spans the text has to be the same */
+	outLength = markupNormalize(markup, length, out, NULL, 0, NULL);
+	if (strcmp(out, test->text) != 0)
+	{
+		fprintf(stderr, "%s: without spans got \"%s\"\n", test->name, out);
+		failures++;
+	}
+
+	g_free(description);
+	g_free(out);
+	g_free(markup);
+}
+
+/*
+ * Spans past maxSpans are dropped, and the ones kept still get closed
+ */
+static void checkSpanLimit(void)
+{
+	const char *markup = "<b>a</b><i>b</i><u>c</u>";
+	char out[32];
+	FormattingSpan spans[2];
+	guint spanCount = 0;
+
+	markupNormalize(markup, strlen(markup), out, spans, G_N_ELEMENTS(spans), &spanCount);
+	char *description = describeSpans(out, spans, spanCount);
+	if (strcmp(description, "bold 0 1, italic 1 2") != 0)
+	{
+		fprintf(stderr, "span limit: got [%s]\n", description);
+		failures++;
+	}
+	g_free(description);
+}
+
+int main(int argc, char *argv[])
+{
+	const NormalizeCase *test;
+	int count = 0;
+
+	for (test = cases; test->name != NULL; test++)
+	{
+		checkCase(test);
+		count++;
+	}
+	checkSpanLimit();
+
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("MarkupNormalizerTest: %d cases ok\n", count);
+	return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * <EventReplay.c: plays a recorded event trace back into the adapter's callbacks>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: EventReplay [--speed X] [--dump] TRACE
+ * TRACE is what the adapter's startEventTrace method recorded (Incs/EventTrace.h). The adapter's own objects run on
+ * the load test's bus shim (Tools/loadtest), with its event worker, avatar store and libpurple set up as usual;
+ * accounts and buddies are created as the trace mentions them and nothing connects. Each record updates libpurple's
+ * state the way the protocol would and then calls the adapter's callback for it:
+ *
+ *   status:          the buddy's presence, then buddy_status_changed_cb
+ *   signed on / off: buddy_signed_on_off_cb (the status record before it has changed the presence)
+ *   icon:            purple_buddy_icons_set_for_user, which goes through the avatar store like a real icon
+ *   IM:              incoming_message_cb, as the conversation UI ops would
+ *
+ * --speed 1 (the default) keeps the recorded timing, 10 plays it ten times as fast and 0 as fast as it goes, which
+ * gives the throughput ceiling. The report is one JSON object on stdout; it includes the time the event worker took
+ * to send everything out, so builds can be compared on the same trace. --dump prints the records instead.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cjson/json.h>
+
+#include "AdapterStats.h"
+#include "EventTrace.h"
+#include "EventWorker.h"
+#include "LibpurpleAdapter.h"
+#include "LoadTestData.h"
+#include "LunaServiceShim.h"
+
+/* records replayed before the main loop gets a turn */
+#define REPLAY_BATCH 64
+
+static gdouble speed = 1;
+static gboolean dump = FALSE;
+static gchar **tracePaths = NULL;
+
+static GOptionEntry options[] =
+{
+{ "speed", 0, 0, G_OPTION_ARG_DOUBLE, &speed, "Times the recorded speed, 0 for as fast as possible", "X" },
+{ "dump", 0, 0, G_OPTION_ARG_NONE, &dump, "Print the records instead of replaying them", NULL },
+{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &tracePaths, NULL, "TRACE" },
+{ NULL } };
+
+static EventTraceReader *reader = NULL;
+static EventTraceRecord record;
+static gboolean haveRecord = FALSE;
+
+static GMainLoop *replayLoop = NULL;
+static gint64 replayStartUs = 0;
+static guint64 lastRecordUs = 0;
+static guint replayed[EVENT_TRACE_IM + 1];
+/* how late each record was replayed, in microseconds (only with a speed) */
+static GArray *lags = NULL;
+static volatile gint messagesDelivered = 0;
+
+/**
+ * key: "protocol id\nusername" (owned), value: PurpleAccount
+ */
+static GHashTable *replayAccounts = NULL;
+static PurpleGroup *replayGroup = NULL;
+
+static gint64 nowMicroseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static const char* typeName(EventTraceType type)
+{
+	static const char *names[] = { "unknown", "status", "signedOn", "signedOff", "icon", "im" };
+	return type <= EVENT_TRACE_IM ? names[type] : names[0];
+}
+
+static PurpleAccount* getAccount(const EventTraceRecord *traceRecord)
+{
+	char *key = g_strconcat(traceRecord->protocolId, "\n", traceRecord->account, NULL);
+	PurpleAccount *account = g_hash_table_lookup(replayAccounts, key);
+
+	if (account == NULL)
+	{
+		account = purple_account_new(traceRecord->account, traceRecord->protocolId);
+		purple_accounts_add(account);
+		g_hash_table_insert(replayAccounts, key, account);
+	}
+	else
+	{
+		g_free(key);
+	}
+	return account;
+}
+
+static PurpleBuddy* getBuddy(PurpleAccount *account, const char *name)
+{
+	PurpleBuddy *buddy = purple_find_buddy(account, name);
+	if (buddy == NULL)
+	{
+		buddy = purple_buddy_new(account, name, NULL);
+		purple_blist_add_buddy(buddy, NULL, replayGroup, NULL);
+	}
+	return buddy;
+}
+
+static void replayRecord(const EventTraceRecord *traceRecord)
+{
+	PurpleAccount *account = getAccount(traceRecord);
+
+	if (traceRecord->type == EVENT_TRACE_IM)
+	{
+		PurpleConversation *conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, traceRecord->buddy,
+				account);
+		if (conv == NULL)
+		{
+			conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, account, traceRecord->buddy);
+		}
+		incoming_message_cb(conv, traceRecord->buddy, NULL, traceRecord->text ? traceRecord->text : "",
+				traceRecord->flags | PURPLE_MESSAGE_RECV, time(NULL));
+		return;
+	}
+
+	PurpleBuddy *buddy = getBuddy(account, traceRecord->buddy);
+	PurplePresence *presence = purple_buddy_get_presence(buddy);
+	PurpleStatus *oldStatus;
+
+	switch (traceRecord->type)
+	{
+		case EVENT_TRACE_STATUS:
+			oldStatus = purple_presence_get_active_status(presence);
+			if (traceRecord->text != NULL)
+			{
+				purple_prpl_got_user_status(account, traceRecord->buddy, traceRecord->statusId, "message",
+						traceRecord->text, NULL);
+			}
+			else
+			{
+				purple_prpl_got_user_status(account, traceRecord->buddy, traceRecord->statusId, NULL);
+			}
+			buddy_status_changed_cb(buddy, oldStatus, purple_presence_get_active_status(presence), NULL);
+			break;
+		case EVENT_TRACE_SIGNED_ON:
+		case EVENT_TRACE_SIGNED_OFF:
+			buddy_signed_on_off_cb(buddy, GINT_TO_POINTER(traceRecord->type == EVENT_TRACE_SIGNED_ON));
+			break;
+		case EVENT_TRACE_ICON:
+			purple_buddy_icons_set_for_user(account, traceRecord->buddy,
+					traceRecord->icon ? g_memdup(traceRecord->icon, traceRecord->iconLength) : NULL,
+					traceRecord->iconLength, traceRecord->text);
+			break;
+		default:
+			break;
+	}
+}
+
+static int compareLags(const void *a, const void *b)
+{
+	guint lagA = *(const guint *) a;
+	guint lagB = *(const guint *) b;
+	return lagA < lagB ? -1 : lagA > lagB;
+}
+
+static void report(gint64 replayedUs, gint64 drainedUs)
+{
+	guint total = 0;
+	int type;
+	struct json_object *byType = json_object_new_object();
+
+	for (type = EVENT_TRACE_STATUS; type <= EVENT_TRACE_IM; type++)
+	{
+		json_object_object_add(byType, typeName(type), json_object_new_int(replayed[type]));
+		total += replayed[type];
+	}
+
+	struct json_object *result = json_object_new_object();
+	json_object_object_add(result, "trace", json_object_new_string((char*) tracePaths[0]));
+	json_object_object_add(result, "speed", json_object_new_double(speed));
+	json_object_object_add(result, "events", json_object_new_int(total));
+	json_object_object_add(result, "byType", byType);
+	json_object_object_add(result, "traceSeconds", json_object_new_double(lastRecordUs / 1000000.0));
+	json_object_object_add(result, "replaySeconds", json_object_new_double(replayedUs / 1000000.0));
+	/* until the event worker had sent everything */
+	json_object_object_add(result, "drainedSeconds", json_object_new_double(drainedUs / 1000000.0));
+	json_object_object_add(result, "eventsPerSecond", json_object_new_double(drainedUs > 0 ? total * 1000000.0 / drainedUs : 0));
+	json_object_object_add(result, "presenceOut", json_object_new_int(adapterStatsGetCounter(STATS_PRESENCE_OUT)));
+	json_object_object_add(result, "messagesIn", json_object_new_int(adapterStatsGetCounter(STATS_MESSAGES_IN)));
+	json_object_object_add(result, "messagesDelivered", json_object_new_int(g_atomic_int_get(&messagesDelivered)));
+	json_object_object_add(result, "rssBytes", json_object_new_double(adapterStatsGetRssBytes()));
+	if (lags->len > 0)
+	{
+		guint *sorted = (guint *) lags->data;
+		qsort(sorted, lags->len, sizeof(guint), compareLags);
+		struct json_object *lag = json_object_new_object();
+		json_object_object_add(lag, "p50Us", json_object_new_int(sorted[(lags->len - 1) * 50 / 100]));
+		json_object_object_add(lag, "p99Us", json_object_new_int(sorted[(lags->len - 1) * 99 / 100]));
+		json_object_object_add(lag, "maxUs", json_object_new_int(sorted[lags->len - 1]));
+		json_object_object_add(result, "lag", lag);
+	}
+	printf("%s\n", json_object_to_json_string(result));
+	json_object_put(result);
+}
+
+static void finishReplay(void)
+{
+	gint64 replayedUs = nowMicroseconds() - replayStartUs;
+
+	/* drains what's queued for the subscribers */
+	eventWorkerStop();
+	report(replayedUs, nowMicroseconds() - replayStartUs);
+	g_main_loop_quit(replayLoop);
+}
+
+static gboolean replayNext(gpointer data)
+{
+	guint batch;
+
+	for (batch = 0; haveRecord && batch < REPLAY_BATCH; batch++)
+	{
+		if (speed > 0)
+		{
+			gint64 now = nowMicroseconds();
+			gint64 dueUs = replayStartUs + (gint64) (record.timeUs / speed);
+			if (dueUs > now)
+			{
+				g_timeout_add(MAX((dueUs - now) / 1000, 1), replayNext, NULL);
+				return FALSE;
+			}
+			guint lag = MIN(now - dueUs, G_MAXUINT);
+			g_array_append_val(lags, lag);
+		}
+		replayRecord(&record);
+		if (record.type <= EVENT_TRACE_IM)
+		{
+			replayed[record.type]++;
+		}
+		lastRecordUs = record.timeUs;
+		haveRecord = eventTraceRead(reader, &record);
+	}
+
+	if (haveRecord)
+	{
+		g_idle_add(replayNext, NULL);
+	}
+	else
+	{
+		finishReplay();
+	}
+	return FALSE;
+}
+
+static void incomingMessageReply(const char *method, const char *payload, gpointer data)
+{
+	if (strstr(payload, "\"returnValue\"") != NULL)
+	{
+		return;
+	}
+	g_atomic_int_inc(&messagesDelivered);
+}
+
+static gboolean startReplay(gpointer data)
+{
+	lsShimCall("registerForIncomingMessages", "{\"subscribe\":true}", incomingMessageReply, NULL);
+
+	initializeLibpurple();
+	replayAccounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	replayGroup = purple_group_new("Buddies");
+	purple_blist_add_group(replayGroup, NULL);
+
+	haveRecord = eventTraceRead(reader, &record);
+	replayStartUs = nowMicroseconds();
+	g_idle_add(replayNext, NULL);
+	return FALSE;
+}
+
+/*
+ * The adapter's main attaches before it starts the event worker, so the replay starts once the main loop runs
+ */
+static void adapterAttached(GMainLoop *loop, gpointer data)
+{
+	replayLoop = loop;
+	g_idle_add(startReplay, NULL);
+}
+
+static void dumpTrace(void)
+{
+	while (eventTraceRead(reader, &record))
+	{
+		printf("%10.6f %-9s %s %s %s", record.timeUs / 1000000.0, typeName(record.type), record.protocolId,
+				record.account, record.buddy);
+		switch (record.type)
+		{
+			case EVENT_TRACE_STATUS:
+				printf(" %s \"%s\"\n", record.statusId, record.text ? record.text : "");
+				break;
+			case EVENT_TRACE_ICON:
+				printf(" %s %lu bytes\n", record.text ? record.text : "-", (unsigned long) record.iconLength);
+				break;
+			case EVENT_TRACE_IM:
+				printf(" flags %u \"%s\"\n", record.flags, record.text ? record.text : "");
+				break;
+			default:
+				printf("\n");
+				break;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("TRACE - replay an event trace into the adapter");
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) || tracePaths == NULL || tracePaths[0] == NULL
+			|| speed < 0)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "Usage: EventReplay [--speed X] [--dump] TRACE");
+		return 1;
+	}
+	g_option_context_free(context);
+
+	reader = eventTraceOpen(tracePaths[0]);
+	if (reader == NULL)
+	{
+		fprintf(stderr, "%s is not an event trace\n", tracePaths[0]);
+		return 1;
+	}
+	if (dump)
+	{
+		dumpTrace();
+		eventTraceClose(reader);
+		return 0;
+	}
+
+	lags = g_array_new(FALSE, FALSE, sizeof(guint));
+	lsShimInit(adapterAttached, NULL);
+	/* the spool and the avatars go to a directory of the run's own, not the device's */
+	adapterSetDataPaths(loadTestDataPath("im-incoming-spool"), loadTestDataPath("im-avatars"));
+	char *adapterArgv[] = { argv[0], NULL };
+	int result = adapterMain(1, adapterArgv);
+
+	eventTraceClose(reader);
+	loadTestDataRemove();
+	return result;
+}
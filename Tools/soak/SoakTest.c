@@ -0,0 +1,435 @@
+/*
+ * <SoakTest.c: millions of events and hundreds of logins through the adapter, failing if memory grows with them>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: SoakTest [--events N] [--logins N] [--buddies N] [--max-bytes-per-event B] [--max-bytes-per-login B]
+ *
+ * The adapter's own objects run on the load test's bus shim, with their event worker, as they do on the device. Two phases:
+ *
+ *   events  a roster of --buddies buddies on an account that doesn't connect gets presence changes, sign-ons and
+ *           sign-offs and IMs, each through libpurple's state and then the adapter's callback (as Tools/replay does),
+ *           with a subscriber for the incoming messages
+ *   logins  one account logs in to the loopback XMPP server (Tools/loadtest) and out again, --logins times
+ *
+ * Through each phase the heap in use (mallinfo) and RSS are sampled SAMPLES times. The growth per event or per login
+ * is the slope of a least-squares line through the samples after the first WARMUP_PERCENT (caches and rings fill up
+ * there); the test fails (exit status 1) if the heap's slope is over the phase's limit. RSS is reported but, being
+ * at the mercy of fragmentation, doesn't decide anything. The report is one JSON object on stdout.
+ */
+
+#include "purple.h"
+
+#include <glib.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cjson/json.h>
+
+#include "AdapterStats.h"
+#include "LibpurpleAdapter.h"
+#include "LoadTestClock.h"
+#include "LoadTestData.h"
+#include "LoopbackXmppServer.h"
+#include "LunaServiceShim.h"
+
+#define SAMPLES 100
+#define WARMUP_PERCENT 20
+/* events driven before the main loop gets a turn */
+#define EVENT_BATCH 256
+#define LOGIN_POLL_MS 10
+#define LOGIN_CYCLE_TIMEOUT_SECONDS 30
+#define SOAK_USERNAME "soak@" LOOPBACK_XMPP_DOMAIN
+#define SOAK_SERVICE "gmail"
+
+typedef struct _Sample
+{
+	guint64 count;
+	guint64 heapBytes;
+	guint64 rssBytes;
+} Sample;
+
+/* options */
+static gint eventCount = 2000000;
+static gint loginCount = 500;
+static gint buddyCount = 200;
+static gdouble maxBytesPerEvent = 0.5;
+static gdouble maxBytesPerLogin = 1024;
+
+static GOptionEntry options[] =
+{
+{ "events", 0, 0, G_OPTION_ARG_INT, &eventCount, "Synthetic events to drive", "N" },
+{ "logins", 0, 0, G_OPTION_ARG_INT, &loginCount, "Login/logout cycles", "N" },
+{ "buddies", 0, 0, G_OPTION_ARG_INT, &buddyCount, "Buddies of the events phase's account", "N" },
+{ "max-bytes-per-event", 0, 0, G_OPTION_ARG_DOUBLE, &maxBytesPerEvent, "Heap growth per event that fails the test", "B" },
+{ "max-bytes-per-login", 0, 0, G_OPTION_ARG_DOUBLE, &maxBytesPerLogin, "Heap growth per login that fails the test", "B" },
+{ NULL } };
+
+static GMainLoop *soakLoop = NULL;
+static guint16 serverPort = 0;
+static gboolean soakFailed = FALSE;
+static struct json_object *soakReport = NULL;
+
+static PurpleAccount *eventAccount = NULL;
+static PurpleBuddy **eventBuddies = NULL;
+static guint eventsDriven = 0;
+static volatile gint messagesDelivered = 0;
+
+static guint loginsDone = 0;
+static gboolean loggingIn = FALSE;
+static gint64 cycleStartUs = 0;
+
+static GArray *samples = NULL;
+static guint64 nextSampleAt = 0;
+static guint64 sampleEvery = 1;
+
+static guint64 heapInUse(void)
+{
+	/* allocated from the heap, plus mmapped blocks */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+	return (guint64) info.uordblks + info.hblkhd;
+#else
+	/* mallinfo's ints wrap past 2 GB; reading them as unsigned gets us to 4 */
+	struct mallinfo info = mallinfo();
+	return (guint64) (guint) info.uordblks + (guint) info.hblkhd;
+#endif
+}
+
+static void sample(guint64 count)
+{
+	Sample taken = { count, heapInUse(), adapterStatsGetRssBytes() };
+	g_array_append_val(samples, taken);
+}
+
+static void startSampling(guint64 total)
+{
+	g_array_set_size(samples, 0);
+	sampleEvery = MAX(total / SAMPLES, 1);
+	nextSampleAt = 0;
+}
+
+static void sampleIfDue(guint64 count)
+{
+	if (count >= nextSampleAt)
+	{
+		sample(count);
+		nextSampleAt = count + sampleEvery;
+	}
+}
+
+/*
+ * Least-squares slope of bytes over count for the samples after the warm-up. heap selects the heap or the RSS.
+ */
+static double growthSlope(gboolean heap)
+{
+	guint first = samples->len * WARMUP_PERCENT / 100;
+	guint n = samples->len - first;
+	double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+	guint i;
+
+	if (n < 2)
+	{
+		return 0;
+	}
+	for (i = first; i < samples->len; i++)
+	{
+		Sample *taken = &g_array_index(samples, Sample, i);
+		double x = taken->count;
+		double y = heap ? taken->heapBytes : taken->rssBytes;
+		sumX += x;
+		sumY += y;
+		sumXX += x * x;
+		sumXY += x * y;
+	}
+	double denominator = n * sumXX - sumX * sumX;
+	return denominator != 0 ? (n * sumXY - sumX * sumY) / denominator : 0;
+}
+
+/*
+ * Adds {"count", "heapBytesPerOp", "rssBytesPerOp", "maxHeapBytesPerOp", "passed", "samples":[[count, heap, rss]...]}
+ */
+static void reportPhase(const char *phase, guint64 count, double maxBytesPerOp)
+{
+	struct json_object *result = json_object_new_object();
+	struct json_object *points = json_object_new_array();
+	double heapSlope = growthSlope(TRUE);
+	gboolean passed = heapSlope <= maxBytesPerOp;
+	guint i;
+
+	for (i = 0; i < samples->len; i++)
+	{
+		Sample *taken = &g_array_index(samples, Sample, i);
+		struct json_object *point = json_object_new_array();
+		json_object_array_add(point, json_object_new_double(taken->count));
+		json_object_array_add(point, json_object_new_double(taken->heapBytes));
+		json_object_array_add(point, json_object_new_double(taken->rssBytes));
+		json_object_array_add(points, point);
+	}
+	json_object_object_add(result, "count", json_object_new_double(count));
+	json_object_object_add(result, "heapBytesPerOp", json_object_new_double(heapSlope));
+	json_object_object_add(result, "rssBytesPerOp", json_object_new_double(growthSlope(FALSE)));
+	json_object_object_add(result, "maxHeapBytesPerOp", json_object_new_double(maxBytesPerOp));
+	json_object_object_add(result, "passed", json_object_new_boolean(passed));
+	json_object_object_add(result, "samples", points);
+	json_object_object_add(soakReport, phase, result);
+
+	fprintf(stderr, "%s: %.3f heap bytes/op (limit %.3f), %.3f RSS bytes/op: %s\n", phase, heapSlope, maxBytesPerOp,
+			growthSlope(FALSE), passed ? "passed" : "FAILED");
+	if (!passed)
+	{
+		soakFailed = TRUE;
+	}
+}
+
+static void finishSoak(void)
+{
+	json_object_object_add(soakReport, "messagesDelivered", json_object_new_int(g_atomic_int_get(&messagesDelivered)));
+	json_object_object_add(soakReport, "passed", json_object_new_boolean(!soakFailed));
+	printf("%s\n", json_object_to_json_string(soakReport));
+	json_object_put(soakReport);
+	g_main_loop_quit(soakLoop);
+}
+
+/*
+ * Called by the adapter's login before the account connects
+ */
+static void loadTestConfigureAccount(PurpleAccount *account)
+{
+	purple_account_set_string(account, "connect_server", "127.0.0.1");
+	purple_account_set_int(account, "port", serverPort);
+	purple_account_set_bool(account, "require_tls", FALSE);
+	purple_account_set_string(account, "connection_security", "opportunistic_tls");
+	purple_account_set_bool(account, "auth_plain_in_clear", TRUE);
+}
+
+static gboolean loginCycle(gpointer data)
+{
+	char *accountKey = getAccountKey(SOAK_USERNAME, SOAK_SERVICE);
+	gboolean online = adapterIsAccountOnline(accountKey);
+	gboolean pending = adapterIsAccountPending(accountKey);
+	free(accountKey);
+
+	if (loggingIn && online)
+	{
+		lsShimCall("logout", "{\"serviceName\":\"" SOAK_SERVICE "\", \"username\":\"" SOAK_USERNAME "\"}", NULL, NULL);
+		loggingIn = FALSE;
+		return TRUE;
+	}
+	if (loggingIn || online || pending)
+	{
+		if (loadTestClockNowUs() - cycleStartUs > (gint64) LOGIN_CYCLE_TIMEOUT_SECONDS * 1000000)
+		{
+			fprintf(stderr, "login %u didn't finish in %d seconds\n", loginsDone, LOGIN_CYCLE_TIMEOUT_SECONDS);
+			soakFailed = TRUE;
+			finishSoak();
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	/* logged out: the cycle is done */
+	if (cycleStartUs != 0)
+	{
+		loginsDone++;
+		sampleIfDue(loginsDone);
+	}
+	if (loginsDone == loginCount)
+	{
+		reportPhase("logins", loginsDone, maxBytesPerLogin);
+		finishSoak();
+		return FALSE;
+	}
+	cycleStartUs = loadTestClockNowUs();
+	loggingIn = TRUE;
+	lsShimCall("login", "{\"serviceName\":\"" SOAK_SERVICE "\", \"username\":\"" SOAK_USERNAME "\", "
+		"\"password\":\"soak\", \"availability\":0, \"localIpAddress\":\"127.0.0.1\", \"connectionType\":\"wifi\"}",
+			NULL, NULL);
+	return TRUE;
+}
+
+static void startLogins(void)
+{
+	if (loginCount <= 0)
+	{
+		finishSoak();
+		return;
+	}
+	startSampling(loginCount);
+	sample(0);
+	nextSampleAt = sampleEvery;
+	g_timeout_add(LOGIN_POLL_MS, loginCycle, NULL);
+}
+
+/*
+ * Event i: mostly presence changes, with sign-offs and sign-ons and IMs mixed in. Messages and status texts come from
+ * small sets so that nothing but a leak keeps growing.
+ */
+static void driveEvent(guint i)
+{
+	static const char *statusIds[] = { "available", "away", "dnd", "xa" };
+	guint buddyIndex = i % buddyCount;
+	PurpleBuddy *buddy = eventBuddies[buddyIndex];
+	const char *name = purple_buddy_get_name(buddy);
+	PurplePresence *presence = purple_buddy_get_presence(buddy);
+	PurpleStatus *oldStatus = purple_presence_get_active_status(presence);
+	char text[64];
+
+	switch (i / buddyCount % 8)
+	{
+		case 5:
+			purple_prpl_got_user_status(eventAccount, name, "offline", NULL);
+			buddy_signed_on_off_cb(buddy, GINT_TO_POINTER(FALSE));
+			break;
+		case 6:
+			purple_prpl_got_user_status(eventAccount, name, "available", NULL);
+			buddy_signed_on_off_cb(buddy, GINT_TO_POINTER(TRUE));
+			break;
+		case 7:
+		{
+			PurpleConversation *conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, name, eventAccount);
+			if (conv == NULL)
+			{
+				conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, eventAccount, name);
+			}
+			g_snprintf(text, sizeof(text), "soak message %u", i % 32);
+			incoming_message_cb(conv, name, NULL, text, PURPLE_MESSAGE_RECV, time(NULL));
+			break;
+		}
+		default:
+			g_snprintf(text, sizeof(text), "soak status %u", i % 16);
+			purple_prpl_got_user_status(eventAccount, name, statusIds[i % G_N_ELEMENTS(statusIds)], "message", text,
+					NULL);
+			buddy_status_changed_cb(buddy, oldStatus, purple_presence_get_active_status(presence), NULL);
+			break;
+	}
+}
+
+static gboolean driveEvents(gpointer data)
+{
+	guint batch;
+
+	for (batch = 0; batch < EVENT_BATCH && eventsDriven < eventCount; batch++)
+	{
+		driveEvent(eventsDriven++);
+		sampleIfDue(eventsDriven);
+	}
+	if (eventsDriven < eventCount)
+	{
+		return TRUE;
+	}
+	reportPhase("events", eventsDriven, maxBytesPerEvent);
+	startLogins();
+	return FALSE;
+}
+
+static void setUpRoster(void)
+{
+	PurpleGroup *group = purple_group_new("Soak");
+	int i;
+
+	purple_blist_add_group(group, NULL);
+	eventAccount = purple_account_new("soakevents@" LOOPBACK_XMPP_DOMAIN, "prpl-jabber");
+	purple_accounts_add(eventAccount);
+	eventBuddies = g_new0(PurpleBuddy *, buddyCount);
+	for (i = 0; i < buddyCount; i++)
+	{
+		char name[32];
+		g_snprintf(name, sizeof(name), "buddy%d@" LOOPBACK_XMPP_DOMAIN, i);
+		eventBuddies[i] = purple_buddy_new(eventAccount, name, NULL);
+		purple_blist_add_buddy(eventBuddies[i], NULL, group, NULL);
+	}
+}
+
+static void incomingMessageReply(const char *method, const char *payload, gpointer data)
+{
+	if (strstr(payload, "\"returnValue\"") == NULL)
+	{
+		g_atomic_int_inc(&messagesDelivered);
+	}
+}
+
+static gboolean startSoak(gpointer data)
+{
+	lsShimCall("registerForIncomingMessages", "{\"subscribe\":true}", incomingMessageReply, NULL);
+	initializeLibpurple();
+	setUpRoster();
+
+	soakReport = json_object_new_object();
+	json_object_object_add(soakReport, "buddies", json_object_new_int(buddyCount));
+	if (eventCount > 0)
+	{
+		startSampling(eventCount);
+		g_idle_add(driveEvents, NULL);
+	}
+	else
+	{
+		startLogins();
+	}
+	return FALSE;
+}
+
+/*
+ * The adapter's main attaches before it starts the event worker, so the soak starts once the main loop runs
+ */
+static void adapterAttached(GMainLoop *loop, gpointer data)
+{
+	soakLoop = loop;
+	g_idle_add(startSoak, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	/* before GLib's first allocation, so that GSlice's magazines don't hide (or fake) growth from mallinfo */
+	setenv("G_SLICE", "always-malloc", 1);
+
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("- soak the adapter and fail on memory growth");
+
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) || buddyCount <= 0)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "--buddies must be at least 1");
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (!g_thread_supported())
+	{
+		g_thread_init(NULL);
+	}
+	samples = g_array_new(FALSE, FALSE, sizeof(Sample));
+	if (loginCount > 0)
+	{
+		serverPort = loopbackXmppStart(0, NULL);
+		if (serverPort == 0)
+		{
+			return 1;
+		}
+	}
+
+	lsShimInit(adapterAttached, NULL);
+	/* the spool and the avatars go to a directory of the run's own, not the device's */
+	adapterSetDataPaths(loadTestDataPath("im-incoming-spool"), loadTestDataPath("im-avatars"));
+	adapterSetConfigureAccountFunction(loadTestConfigureAccount);
+	char *adapterArgv[] = { argv[0], NULL };
+	adapterMain(1, adapterArgv);
+
+	if (loginCount > 0)
+	{
+		loopbackXmppStop();
+	}
+	loadTestDataRemove();
+	return soakFailed ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * <MessageSpoolTest.c: wraps the incoming message spool and reopens it after a torn record>
+ *
+ * Copyright 2009 Palm, Inc. All rights reserved.
+ *
+ * This program is free software and licensed under the terms of the GNU
+ * Lesser General Public License Version 2.1 as published by the Free
+ * Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+
+ * Usage: MessageSpoolTest
+ *
+ * Runs against a small spool in a directory of its own under /tmp:
+ *
+ *   wrap      records of varying length go round the ring several times; what's left has to be the newest records,
+ *             in order and without gaps, and has to survive closing and reopening the spool (and so does the epoch)
+ *   torn      the newest record's payload is damaged in the file (a write cut short by the process dying); reopening
+ *             has to drop just that record, keep the sequence numbers going up, and keep appending where it left off
+ *   header    a spool whose header doesn't add up is started over empty, in a new epoch
+ *   accounts  a replay for one account only gets that account's records
+ *
+ * Prints what failed and exits with 1 if anything did.
+ */
+
+/* memmem */
+#define _GNU_SOURCE
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MessageSpool.h"
+
+#define SPOOL_SIZE 4096
+#define WRAP_RECORDS 500
+/* payloads are 12 to 12 + PAYLOAD_SPREAD - 1 bytes, so records end up at every alignment and the ring wraps */
+#define PAYLOAD_SPREAD 150
+#define ACCOUNT_KEY "soak@localhost_gmail"
+#define OTHER_ACCOUNT_KEY "other@localhost_gmail"
+
+static int failures = 0;
+static guint firstEpoch = 0;
+
+#define CHECK(condition, ...) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: ", __FUNCTION__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+			failures++; \
+		} \
+	} while (0)
+
+/*
+ * "m<seq>:" padded with a letter of the seq; no commas, so that a collected list can be split on them
+ */
+static char* makePayload(guint seq)
+{
+	GString *payload = g_string_new("");
+	g_string_printf(payload, "m%u:", seq);
+	while (payload->len < 12 + seq % PAYLOAD_SPREAD)
+	{
+		g_string_append_c(payload, 'a' + seq % 26);
+	}
+	return g_string_free(payload, FALSE);
+}
+
+static void appendRecords(guint first, guint last)
+{
+	guint seq;
+	for (seq = first; seq <= last; seq++)
+	{
+		char *payload = makePayload(seq);
+		messageSpoolAppend(seq, ACCOUNT_KEY, payload, strlen(payload));
+		g_free(payload);
+	}
+}
+
+/*
+ * Checks that the spool holds exactly the records firstSeq..lastSeq (firstSeq 0: whatever the oldest one is) and
+ * returns how many it holds
+ */
+static guint checkRecords(const char *when, guint firstSeq, guint lastSeq)
+{
+	GString *collected = g_string_new("");
+	guint count = messageSpoolCollectSince(0, NULL, collected);
+	char **payloads = g_strsplit(collected->str, ",", 0);
+	guint i;
+
+	CHECK(count > 0, "%s: the spool is empty", when);
+	CHECK(count == g_strv_length(payloads), "%s: %u records but %u payloads", when, count, g_strv_length(payloads));
+	if (count > 0 && firstSeq == 0)
+	{
+		firstSeq = lastSeq - count + 1;
+	}
+	CHECK(count == lastSeq - firstSeq + 1, "%s: %u records, expected %u..%u", when, count, firstSeq, lastSeq);
+	for (i = 0; payloads[i] != NULL && i < count; i++)
+	{
+		char *expected = makePayload(firstSeq + i);
+		CHECK(strcmp(payloads[i], expected) == 0, "%s: record %u is \"%.20s...\", expected \"%.20s...\"", when, i,
+				payloads[i], expected);
+		g_free(expected);
+	}
+	g_strfreev(payloads);
+	g_string_free(collected, TRUE);
+	return count;
+}
+
+/*
+ * Flips a byte in the payload of record seq, in the file
+ */
+static gboolean damageRecord(const char *path, guint seq)
+{
+	gboolean damaged = FALSE;
+	char *payload = makePayload(seq);
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+	{
+		g_free(payload);
+		return FALSE;
+	}
+	guint8 *mapping = mmap(NULL, SPOOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping != MAP_FAILED)
+	{
+		guint8 *found = memmem(mapping, SPOOL_SIZE, payload, strlen(payload));
+		if (found != NULL)
+		{
+			found[strlen(payload) - 1] ^= 0xff;
+			damaged = TRUE;
+		}
+		munmap(mapping, SPOOL_SIZE);
+	}
+	g_free(payload);
+	return damaged;
+}
+
+static void testWrap(const char *path)
+{
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not open %s", path);
+	CHECK(messageSpoolLastSeq() == 0, "new spool has last seq %u", messageSpoolLastSeq());
+	firstEpoch = messageSpoolEpoch();
+	CHECK(firstEpoch > 0 && firstEpoch <= G_MAXINT32, "new spool has epoch %u", firstEpoch);
+
+	appendRecords(1, WRAP_RECORDS);
+	CHECK(messageSpoolLastSeq() == WRAP_RECORDS, "last seq %u after %u appends", messageSpoolLastSeq(),
+			WRAP_RECORDS);
+	guint count = checkRecords("after wrapping", 0, WRAP_RECORDS);
+	CHECK(count < WRAP_RECORDS, "all %u records fit, the ring never wrapped", count);
+
+	messageSpoolClose();
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not reopen %s", path);
+	CHECK(messageSpoolLastSeq() == WRAP_RECORDS, "last seq %u after reopening", messageSpoolLastSeq());
+	CHECK(messageSpoolEpoch() == firstEpoch, "epoch %u after reopening, was %u", messageSpoolEpoch(), firstEpoch);
+	CHECK(checkRecords("after reopening", 0, WRAP_RECORDS) == count, "reopening lost records");
+	messageSpoolClose();
+}
+
+static void testTornRecord(const char *path)
+{
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not open %s", path);
+	guint before = checkRecords("before tearing", 0, WRAP_RECORDS);
+	messageSpoolClose();
+
+	CHECK(damageRecord(path, WRAP_RECORDS), "record %u is not in the file", WRAP_RECORDS);
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not reopen %s", path);
+	/* the header remembers the last seq handed out, so the next message doesn't reuse it */
+	CHECK(messageSpoolLastSeq() == WRAP_RECORDS, "last seq %u after dropping the torn record", messageSpoolLastSeq());
+	guint firstSeq = WRAP_RECORDS - before + 1;
+	checkRecords("after dropping the torn record", firstSeq, WRAP_RECORDS - 1);
+
+	/* appending goes on where the intact records end, and wraps again */
+	appendRecords(WRAP_RECORDS + 1, WRAP_RECORDS + 1);
+	GString *collected = g_string_new("");
+	messageSpoolCollectSince(WRAP_RECORDS - 1, NULL, collected);
+	char *expected = makePayload(WRAP_RECORDS + 1);
+	CHECK(strcmp(collected->str, expected) == 0, "after the torn record the spool has \"%.20s...\"", collected->str);
+	g_free(expected);
+	g_string_free(collected, TRUE);
+
+	appendRecords(WRAP_RECORDS + 2, 2 * WRAP_RECORDS);
+	checkRecords("after wrapping past the torn record", 0, 2 * WRAP_RECORDS);
+	messageSpoolClose();
+}
+
+static void testBadHeader(const char *path)
+{
+	int fd = open(path, O_WRONLY);
+	CHECK(fd >= 0 && write(fd, "junk", 4) == 4, "could not damage the header of %s", path);
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not reopen %s", path);
+	GString *collected = g_string_new("");
+	CHECK(messageSpoolCollectSince(0, NULL, collected) == 0, "a spool with a bad header kept records");
+	CHECK(messageSpoolLastSeq() == 0, "a spool with a bad header kept last seq %u", messageSpoolLastSeq());
+	CHECK(messageSpoolEpoch() != firstEpoch && messageSpoolEpoch() > 0, "a spool with a bad header has epoch %u",
+			messageSpoolEpoch());
+	g_string_free(collected, TRUE);
+
+	appendRecords(1, 3);
+	checkRecords("after starting over", 1, 3);
+	messageSpoolClose();
+}
+
+static void testAccounts(const char *path)
+{
+	CHECK(messageSpoolOpen(path, SPOOL_SIZE), "could not open %s", path);
+	/* 1..3 are ACCOUNT_KEY's, from testBadHeader */
+	messageSpoolAppend(4, OTHER_ACCOUNT_KEY, "other4", 6);
+	appendRecords(5, 5);
+	messageSpoolAppend(6, OTHER_ACCOUNT_KEY, "other6", 6);
+
+	GString *collected = g_string_new("");
+	char *expected = makePayload(5);
+	char *expectedAll = g_strdup_printf("other4,%s,other6", expected);
+
+	CHECK(messageSpoolCollectSince(3, OTHER_ACCOUNT_KEY, collected) == 2, "other account: \"%s\"", collected->str);
+	CHECK(strcmp(collected->str, "other4,other6") == 0, "other account: \"%s\"", collected->str);
+
+	g_string_truncate(collected, 0);
+	CHECK(messageSpoolCollectSince(3, ACCOUNT_KEY, collected) == 1, "account: \"%.20s...\"", collected->str);
+	CHECK(strcmp(collected->str, expected) == 0, "account: \"%.20s...\"", collected->str);
+
+	g_string_truncate(collected, 0);
+	CHECK(messageSpoolCollectSince(3, NULL, collected) == 3, "all accounts: \"%.20s...\"", collected->str);
+	CHECK(strcmp(collected->str, expectedAll) == 0, "all accounts: \"%.20s...\"", collected->str);
+
+	g_string_truncate(collected, 0);
+	CHECK(messageSpoolCollectSince(0, "soak@localhost", collected) == 0, "a prefix of a key matched");
+
+	g_free(expectedAll);
+	g_free(expected);
+	g_string_free(collected, TRUE);
+	messageSpoolClose();
+}
+
+int main(int argc, char *argv[])
+{
+	char directory[] = "/tmp/MessageSpoolTest-XXXXXX";
+	if (mkdtemp(directory) == NULL)
+	{
+		fprintf(stderr, "Could not create a directory for the spool\n");
+		return 1;
+	}
+	char *path = g_build_filename(directory, "spool", NULL);
+
+	testWrap(path);
+	testTornRecord(path);
+	testBadHeader(path);
+	testAccounts(path);
+
+	unlink(path);
+	rmdir(directory);
+	g_free(path);
+
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("MessageSpoolTest: ok\n");
+	return 0;
+}